@@ -837,10 +837,20 @@ bool RedCharDevice::restore(SpiceMigrateDataCharDevice *mig_data)
 
     client_tokens_window = dev_client->num_client_tokens; /* initial state of tokens */
     dev_client->num_client_tokens = mig_data->num_client_tokens;
-    /* assumption: client_tokens_window stays the same across severs */
-    dev_client->num_client_tokens_free = client_tokens_window -
-                                           mig_data->num_client_tokens -
-                                           mig_data->write_num_client_tokens;
+    /* the window of the source can be smaller, the extra tokens are then
+     * given to the client. A larger window is refused by the migration
+     * protocol version, the source being more recent */
+    if (uint64_t{mig_data->num_client_tokens} + mig_data->write_num_client_tokens >
+        client_tokens_window) {
+        spice_warning("dev %p: client has more tokens (%u + %u) than the window (%u)",
+                      this, mig_data->num_client_tokens, mig_data->write_num_client_tokens,
+                      client_tokens_window);
+        dev_client->num_client_tokens_free = 0;
+    } else {
+        dev_client->num_client_tokens_free = client_tokens_window -
+                                               mig_data->num_client_tokens -
+                                               mig_data->write_num_client_tokens;
+    }
     dev_client->num_send_tokens = mig_data->num_send_tokens;
 
     if (mig_data->write_size > 0) {
@@ -21,6 +21,7 @@
 #include "common-graphics-channel.h"
 #include "dcc.h"
 #include "red-client.h"
+#include "main-channel-client.h"
 
 uint8_t *CommonGraphicsChannelClient::alloc_recv_buf(uint16_t type, uint32_t size)
 {
@@ -50,8 +51,8 @@ bool CommonGraphicsChannelClient::config_socket()
     RedStream *stream = get_stream();
     gboolean is_low_bandwidth;
 
-    // TODO - this should be dynamic, not one time at channel creation
     is_low_bandwidth = mcc->is_low_bandwidth();
+    low_bandwidth = is_low_bandwidth;
     if (!red_stream_set_auto_flush(stream, false)) {
         /* FIXME: Using Nagle's Algorithm can lead to apparent delays, depending
          * on the delayed ack timeout on the other side.
@@ -65,3 +66,25 @@ bool CommonGraphicsChannelClient::config_socket()
     ack_set_client_window(is_low_bandwidth ? WIDE_CLIENT_ACK_WINDOW : NARROW_CLIENT_ACK_WINDOW);
     return true;
 }
+
+void CommonGraphicsChannelClient::on_net_estimate_changed()
+{
+    uint64_t bitrate = get_bitrate_estimate();
+
+    /* avoid switching back and forth around the threshold */
+    bool low = low_bandwidth ?
+        bitrate < LOW_BANDWIDTH_BITRATE * 5 / 4 :
+        bitrate < LOW_BANDWIDTH_BITRATE;
+    if (low != low_bandwidth) {
+        spice_debug("bitrate %.2f Mbps, switching to %s bandwidth",
+                    bitrate / 1024.0 / 1024.0, low ? "low" : "high");
+        set_low_bandwidth(low);
+    }
+}
+
+void CommonGraphicsChannelClient::set_low_bandwidth(bool is_low_bandwidth)
+{
+    low_bandwidth = is_low_bandwidth;
+    ack_set_client_window(is_low_bandwidth ? WIDE_CLIENT_ACK_WINDOW : NARROW_CLIENT_ACK_WINDOW);
+    push_set_ack();
+}
@@ -66,6 +66,12 @@ protected:
     virtual uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
     virtual void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
     virtual bool config_socket() override;
+    virtual void on_net_estimate_changed() override;
+    /* called when the connection switches from/to low bandwidth */
+    virtual void set_low_bandwidth(bool low_bandwidth);
+
+private:
+    bool low_bandwidth = false;
 };
 
 /* pipe item used to release a specific cached item on the client */
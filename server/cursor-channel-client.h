@@ -70,6 +70,16 @@ enum {
     RED_PIPE_ITEM_TYPE_INVAL_CURSOR_CACHE,
 };
 
+struct RedCursorPipeItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_CURSOR> {
+    explicit RedCursorPipeItem(const red::shared_ptr<const RedCursorCmd>& cmd);
+    red::shared_ptr<const RedCursorCmd> red_cursor;
+    /* id of the shape in the client caches, 0 if it can not be cached */
+    uint64_t cache_id = 0;
+};
+
+bool cursor_pipe_coalesce_move(RedChannelClient::Pipe &pipe,
+                               const red::shared_ptr<RedCursorPipeItem> &move);
+
 #include "pop-visibility.h"
 
 #endif /* CURSOR_CHANNEL_CLIENT_H_ */
@@ -25,10 +25,14 @@
 #include "cursor-channel-client.h"
 #include "reds.h"
 
-struct RedCursorPipeItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_CURSOR> {
-    explicit RedCursorPipeItem(const red::shared_ptr<const RedCursorCmd>& cmd);
-    red::shared_ptr<const RedCursorCmd> red_cursor;
-};
+/* bounds of the bytes sent and not acknowledged by cursor clients */
+#define CURSOR_ACK_WINDOW_MIN_BYTES (64 * 1024)
+#define CURSOR_ACK_WINDOW_MAX_BYTES (1024 * 1024)
+
+/* The cache ids synthesised for the shapes without unique id. They are
+ * never reused for a different shape, and the high bits set keep them
+ * apart from the ids of the guest drivers, usually small counters */
+#define CURSOR_SHAPE_ID_BASE 0xfffe000000000000ULL
 
 RedCursorPipeItem::RedCursorPipeItem(const red::shared_ptr<const RedCursorCmd>& cmd):
     red_cursor(cmd)
@@ -45,6 +49,7 @@ static void cursor_fill(CursorChannelClient *ccc, RedCursorPipeItem *cursor,
 
     auto cursor_cmd = cursor->red_cursor.get();
     *red_cursor = cursor_cmd->u.set.shape;
+    red_cursor->header.unique = cursor->cache_id;
 
     if (red_cursor->header.unique) {
         if (ccc->cache_find(red_cursor->header.unique)) {
@@ -175,6 +180,215 @@ cursor_channel_new(RedsState *server, int id,
     return red::make_shared<CursorChannel>(server, id, core, dispatcher);
 }
 
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#define HASH_PRIME64_1 0x9e3779b185ebca87ULL
+#define HASH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME64_3 0x165667b19e3779f9ULL
+#define HASH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define HASH_PRIME64_5 0x27d4eb2f165667c5ULL
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * HASH_PRIME64_2;
+    return rotl64(acc, 31) * HASH_PRIME64_1;
+}
+
+static inline uint64_t hash_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * HASH_PRIME64_1 + HASH_PRIME64_4;
+}
+
+/* The XXH64 hash, the values read depend on the host endianness, which
+ * does not matter as the hashes are not shared */
+uint64_t cursor_hash(const uint8_t *data, size_t len, uint64_t seed)
+{
+    const uint8_t *end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + HASH_PRIME64_1 + HASH_PRIME64_2;
+        uint64_t v2 = seed + HASH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME64_1;
+
+        do {
+            v1 = hash_round(v1, read64(data));
+            v2 = hash_round(v2, read64(data + 8));
+            v3 = hash_round(v3, read64(data + 16));
+            v4 = hash_round(v4, read64(data + 24));
+            data += 32;
+        } while (end - data >= 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge_round(h, v1);
+        h = hash_merge_round(h, v2);
+        h = hash_merge_round(h, v3);
+        h = hash_merge_round(h, v4);
+    } else {
+        h = seed + HASH_PRIME64_5;
+    }
+    h += len;
+
+    for (; end - data >= 8; data += 8) {
+        h ^= hash_round(0, read64(data));
+        h = rotl64(h, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+    }
+    if (end - data >= 4) {
+        h ^= read32(data) * HASH_PRIME64_1;
+        h = rotl64(h, 23) * HASH_PRIME64_2 + HASH_PRIME64_3;
+        data += 4;
+    }
+    for (; data < end; data++) {
+        h ^= *data * HASH_PRIME64_5;
+        h = rotl64(h, 11) * HASH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME64_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static bool cursor_header_equal(const SpiceCursorHeader *a, const SpiceCursorHeader *b)
+{
+    return a->type == b->type && a->width == b->width && a->height == b->height &&
+           a->hot_spot_x == b->hot_spot_x && a->hot_spot_y == b->hot_spot_y;
+}
+
+CursorShapeCache::~CursorShapeCache()
+{
+    clear();
+}
+
+/* Returns the id identifying a shape without unique id in the client
+ * caches, so drivers sending the same shapes again, like animated cursors,
+ * do not resend their data. The shapes are recognised by a hash of their
+ * content, checked against the shape kept in the cache. Returns 0 when
+ * another shape with the same hash is cached, this one is then sent
+ * without caching. */
+uint64_t CursorShapeCache::get_id(const SpiceCursor *shape, CursorShapeLookup *lookup)
+{
+    const SpiceCursorHeader *header = &shape->header;
+    uint64_t seed = ((uint64_t) header->type << 48) ^ ((uint64_t) header->width << 32) ^
+                    ((uint64_t) header->height << 16) ^
+                    ((uint64_t) header->hot_spot_x << 8) ^ header->hot_spot_y;
+    uint64_t hash = cursor_hash(shape->data, shape->data_size, seed);
+    CursorShapeCacheEntry *oldest = &entries[0];
+
+    time++;
+    for (auto &entry : entries) {
+        if (entry.id && entry.hash == hash) {
+            if (cursor_header_equal(&entry.header, header) &&
+                entry.data_size == shape->data_size &&
+                memcmp(entry.data, shape->data, shape->data_size) == 0) {
+                entry.last_used = time;
+                *lookup = CURSOR_SHAPE_HIT;
+                return entry.id;
+            }
+            *lookup = CURSOR_SHAPE_COLLISION;
+            return 0;
+        }
+        if (entry.last_used < oldest->last_used) {
+            oldest = &entry;
+        }
+    }
+
+    g_free(oldest->data);
+    oldest->hash = hash;
+    oldest->id = CURSOR_SHAPE_ID_BASE | ++last_id;
+    oldest->last_used = time;
+    oldest->header = *header;
+    oldest->data_size = shape->data_size;
+    oldest->data = static_cast<uint8_t *>(g_memdup2(shape->data, shape->data_size));
+    *lookup = CURSOR_SHAPE_NEW;
+    return oldest->id;
+}
+
+void CursorShapeCache::clear()
+{
+    for (auto &entry : entries) {
+        g_free(entry.data);
+        entry = CursorShapeCacheEntry();
+    }
+    time = 0;
+}
+
+uint64_t CursorChannel::get_shape_id(const SpiceCursor *shape)
+{
+#ifdef RED_STATISTICS
+    uint64_t start = spice_get_monotonic_time_ns();
+#endif
+    CursorShapeLookup lookup;
+    uint64_t id = shape_cache.get_id(shape, &lookup);
+
+    stat_inc_counter(shapes_hashed_counter, 1);
+    if (lookup == CURSOR_SHAPE_HIT) {
+        stat_inc_counter(shape_hits_counter, 1);
+    } else if (lookup == CURSOR_SHAPE_COLLISION) {
+        stat_inc_counter(shape_collisions_counter, 1);
+    }
+#ifdef RED_STATISTICS
+    stat_inc_counter(shape_hash_time_ns, spice_get_monotonic_time_ns() - start);
+#endif
+    return id;
+}
+
+/* Replaces the move the client did not receive yet with a new one, so stale
+ * positions are not sent when the client is slow. This is only done if the
+ * move is the last message queued, to keep the order with the other cursor
+ * messages, so any other item queued after it, a cursor SET or HIDE but also
+ * an ACK or a PING, stops the coalescing. Returns whether the new move
+ * replaced a previous one. */
+bool cursor_pipe_coalesce_move(RedChannelClient::Pipe &pipe,
+                               const red::shared_ptr<RedCursorPipeItem> &move)
+{
+    // the pipe front is the last item added
+    if (pipe.empty() || pipe.front()->type != RED_PIPE_ITEM_TYPE_CURSOR) {
+        return false;
+    }
+    auto last = static_cast<RedCursorPipeItem*>(pipe.front().get());
+    if (last->red_cursor->type != QXL_CURSOR_MOVE) {
+        return false;
+    }
+    pipe.front() = move;
+    return true;
+}
+
+void CursorChannel::pipes_add_move(const red::shared_ptr<RedCursorPipeItem> &move)
+{
+    RedChannelClient *rcc;
+
+    stat_inc_counter(moves_counter, 1);
+    FOREACH_CLIENT(this, rcc) {
+        if (cursor_pipe_coalesce_move(rcc->get_pipe(), move)) {
+            stat_inc_counter(coalesced_moves_counter, 1);
+        } else {
+            rcc->pipe_add(RedPipeItemPtr(move));
+        }
+    }
+}
+
 void CursorChannel::process_cmd(red::shared_ptr<const RedCursorCmd> &&cursor_cmd)
 {
     bool cursor_show = false;
@@ -184,10 +398,17 @@ void CursorChannel::process_cmd(red::shared_ptr<const RedCursorCmd> &&cursor_cmd
     auto cursor_pipe_item = red::make_shared<RedCursorPipeItem>(cursor_cmd);
 
     switch (cursor_cmd->type) {
-    case QXL_CURSOR_SET:
+    case QXL_CURSOR_SET: {
+        const SpiceCursor *shape = &cursor_cmd->u.set.shape;
+
         cursor_visible = !!cursor_cmd->u.set.visible;
+        cursor_pipe_item->cache_id = shape->header.unique;
+        if (!shape->header.unique && shape->data_size) {
+            cursor_pipe_item->cache_id = get_shape_id(shape);
+        }
         item = cursor_pipe_item;
         break;
+    }
     case QXL_CURSOR_MOVE:
         cursor_show = !cursor_visible;
         cursor_visible = true;
@@ -205,17 +426,20 @@ void CursorChannel::process_cmd(red::shared_ptr<const RedCursorCmd> &&cursor_cmd
         return;
     }
 
-    if (is_connected() &&
-        (mouse_mode == SPICE_MOUSE_MODE_SERVER
-         || cursor_cmd->type != QXL_CURSOR_MOVE
-         || cursor_show)) {
+    if (!is_connected()) {
+        return;
+    }
+    if (cursor_cmd->type != QXL_CURSOR_MOVE) {
         pipes_add(cursor_pipe_item);
+    } else if (mouse_mode == SPICE_MOUSE_MODE_SERVER || cursor_show) {
+        pipes_add_move(cursor_pipe_item);
     }
 }
 
 void CursorChannel::reset()
 {
     item.reset();
+    shape_cache.clear();
     cursor_visible = true;
     cursor_position.x = cursor_position.y = 0;
     cursor_trail_length = cursor_trail_frequency = 0;
@@ -277,11 +501,19 @@ void CursorChannel::on_connect(RedClient *client, RedStream *stream, int migrati
     cursor_channel_init_client(this, ccc);
 }
 
-CursorChannel::~CursorChannel() = default;
-
 CursorChannel::CursorChannel(RedsState *reds, uint32_t id,
                              SpiceCoreInterfaceInternal *core, Dispatcher *dispatcher):
-    CommonGraphicsChannel(reds, SPICE_CHANNEL_CURSOR, id, RedChannel::HandleAcks, core, dispatcher)
+    CommonGraphicsChannel(reds, SPICE_CHANNEL_CURSOR, id,
+                          RedChannel::HandleAcks|RedChannel::CoalesceMessages, core, dispatcher)
 {
+    set_ack_window_bytes(CURSOR_ACK_WINDOW_MIN_BYTES, CURSOR_ACK_WINDOW_MAX_BYTES);
     reds_register_channel(reds, this);
+
+    const RedStatNode *stat = get_stat_node();
+    stat_init_counter(&moves_counter, reds, stat, "moves", TRUE);
+    stat_init_counter(&coalesced_moves_counter, reds, stat, "moves_coalesced", TRUE);
+    stat_init_counter(&shapes_hashed_counter, reds, stat, "shapes_hashed", TRUE);
+    stat_init_counter(&shape_hits_counter, reds, stat, "shape_hash_hits", TRUE);
+    stat_init_counter(&shape_collisions_counter, reds, stat, "shape_hash_collisions", TRUE);
+    stat_init_counter(&shape_hash_time_ns, reds, stat, "shape_hash_time_ns", TRUE);
 }
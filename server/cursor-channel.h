@@ -27,6 +27,42 @@
 
 struct RedCursorPipeItem;
 
+/* Number of cursor shapes without unique id remembered by the cursor
+ * channel, see CursorShapeCache::get_id() */
+#define CURSOR_SHAPE_CACHE_SIZE 32
+
+/* A shape sent with a synthesised cache id, kept to check that a shape with
+ * the same hash is really the same */
+struct CursorShapeCacheEntry {
+    uint64_t hash = 0;
+    uint64_t id = 0;
+    uint64_t last_used = 0;
+    SpiceCursorHeader header;
+    uint32_t data_size = 0;
+    uint8_t *data = nullptr;
+};
+
+enum CursorShapeLookup {
+    CURSOR_SHAPE_NEW,
+    CURSOR_SHAPE_HIT,
+    /* another shape with the same hash is cached */
+    CURSOR_SHAPE_COLLISION,
+};
+
+/* The shapes without unique id sent to the clients, the least recently used
+ * one is replaced */
+struct CursorShapeCache {
+    ~CursorShapeCache();
+    uint64_t get_id(const SpiceCursor *shape, CursorShapeLookup *lookup);
+    void clear();
+
+    CursorShapeCacheEntry entries[CURSOR_SHAPE_CACHE_SIZE];
+    uint64_t time = 0;
+    uint64_t last_id = 0;
+};
+
+uint64_t cursor_hash(const uint8_t *data, size_t len, uint64_t seed);
+
 /**
  * This type it's a RedChannel class which implement cursor (mouse)
  * movements.
@@ -35,7 +71,6 @@ struct CursorChannel final: public CommonGraphicsChannel
 {
     CursorChannel(RedsState *reds, uint32_t id,
                   SpiceCoreInterfaceInternal *core=nullptr, Dispatcher *dispatcher=nullptr);
-    ~CursorChannel();
     void reset();
     void do_init();
     void process_cmd(red::shared_ptr<const RedCursorCmd> &&cursor_cmd);
@@ -49,6 +84,23 @@ struct CursorChannel final: public CommonGraphicsChannel
     uint16_t cursor_trail_length;
     uint16_t cursor_trail_frequency;
     uint32_t mouse_mode = SPICE_MOUSE_MODE_SERVER;
+
+    /* moves queued for the clients, and the moves that replaced one a
+     * client had not received yet */
+    RedStatCounter moves_counter;
+    RedStatCounter coalesced_moves_counter;
+    /* shapes without unique id: hashed, found in shape_cache, with the hash
+     * of a different shape, and the time spent hashing them */
+    RedStatCounter shapes_hashed_counter;
+    RedStatCounter shape_hits_counter;
+    RedStatCounter shape_collisions_counter;
+    RedStatCounter shape_hash_time_ns;
+
+private:
+    void pipes_add_move(const red::shared_ptr<RedCursorPipeItem> &move);
+    uint64_t get_shape_id(const SpiceCursor *shape);
+
+    CursorShapeCache shape_cache;
 };
 
 
@@ -64,9 +64,24 @@ struct DisplayChannelClientPrivate
     std::array<QRegion, NUM_SURFACES> surface_client_lossy_region;
 
     std::array<VideoStreamAgent, NUM_STREAMS> stream_agents;
+    /* frames encoded outside of the worker thread, waiting to be queued */
+    VideoStreamFrameQueue *frame_queue;
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
     bool gl_draw_ongoing;
+
+    uint64_t stall_start;
+    uint64_t last_resync;
+    uint32_t num_resyncs;
+    RedStatCounter stall_time_ms;
+    RedStatCounter resyncs;
+
+    /* surface images sent when the client connects */
+    uint64_t restore_start;
+    uint32_t restore_bands_pending;
+    bool restore_first_sent;
+    RedStatCounter restore_first_pixel_ms;
+    RedStatCounter restore_full_ms;
 };
 
 #include "pop-visibility.h"
@@ -54,19 +54,15 @@ static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id,
     uint64_t serial;
 
     serial = dcc->get_message_serial();
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
-
-    while (item) {
-        if (item->id == id) {
-            ring_remove(&item->lru_link);
-            ring_add(&cache->lru, &item->lru_link);
-            spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
-            item->sync[dcc->priv->id] = serial;
-            cache->sync[dcc->priv->id] = serial;
-            *lossy = item->lossy;
-            break;
-        }
-        item = item->next;
+    item = pixmap_cache_unlocked_find(cache, id);
+
+    if (item) {
+        ring_remove(&item->lru_link);
+        ring_add(&cache->lru, &item->lru_link);
+        spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
+        item->sync[dcc->priv->id] = serial;
+        cache->sync[dcc->priv->id] = serial;
+        *lossy = item->lossy;
     }
 
     return !!item;
@@ -75,11 +71,10 @@ static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id,
 static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
 {
     int hit;
-    PixmapCache *cache = dcc->priv->pixmap_cache;
 
-    pthread_mutex_lock(&cache->lock);
+    dcc_pixmap_cache_lock(dcc);
     hit = dcc_pixmap_cache_unlocked_hit(dcc, id, lossy);
-    pthread_mutex_unlock(&cache->lock);
+    dcc_pixmap_cache_unlock(dcc);
     return hit;
 }
 
@@ -195,6 +190,7 @@ static void red_display_add_image_to_pixmap_cache(DisplayChannelClient *dcc,
     if ((image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
         spice_assert(image->descriptor.width * image->descriptor.height > 0);
         if (!(io_image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) {
+            dcc_pixmap_cache_lock(dcc);
             if (dcc_pixmap_cache_unlocked_add(dcc, image->descriptor.id,
                                               image->descriptor.width * image->descriptor.height,
                                               is_lossy)) {
@@ -203,6 +199,7 @@ static void red_display_add_image_to_pixmap_cache(DisplayChannelClient *dcc,
                                                                                image->descriptor.id;
                 stat_inc_counter(display_channel->priv->add_to_cache_counter, 1);
             }
+            dcc_pixmap_cache_unlock(dcc);
         }
     }
 
@@ -330,17 +327,32 @@ static void marshaller_compress_buf_free(uint8_t *data, void *opaque)
     compress_buf_free(static_cast<RedCompressBuf *>(opaque));
 }
 
+static void marshaller_unref_shared_image(uint8_t *data, void *opaque)
+{
+    red_shared_image_unref(static_cast<RedSharedImage *>(opaque));
+}
+
 static void marshaller_add_compressed(SpiceMarshaller *m,
-                                      RedCompressBuf *comp_buf, size_t size)
+                                      const compress_send_data_t *comp_data)
 {
-    size_t max = size;
+    RedCompressBuf *comp_buf = comp_data->comp_buf;
+    RedSharedImage *shared_image = comp_data->shared_image;
+    size_t max = comp_data->comp_buf_size;
     size_t now;
     do {
         spice_return_if_fail(comp_buf);
         now = MIN(sizeof(comp_buf->buf), max);
         max -= now;
-        spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
-                                         marshaller_compress_buf_free, comp_buf);
+        if (shared_image) {
+            /* buffers are owned by the shared image, keep it alive
+             * until the message is sent */
+            red_shared_image_ref(shared_image);
+            spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
+                                             marshaller_unref_shared_image, shared_image);
+        } else {
+            spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
+                                             marshaller_compress_buf_free, comp_buf);
+        }
         comp_buf = comp_buf->send_next;
     } while (max);
 }
@@ -374,10 +386,11 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
     if (simage->descriptor.flags & SPICE_IMAGE_FLAGS_HIGH_BITS_SET) {
         image.descriptor.flags = SPICE_IMAGE_FLAGS_HIGH_BITS_SET;
     }
-    pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
 
     if ((simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME)) {
         int lossy_cache_item;
+
+        dcc_pixmap_cache_lock(dcc);
         if (dcc_pixmap_cache_unlocked_hit(dcc, image.descriptor.id, &lossy_cache_item)) {
             dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
                 image.descriptor.id;
@@ -395,12 +408,15 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                 spice_assert(bitmap_palette_out == nullptr);
                 spice_assert(lzplt_palette_out == nullptr);
                 stat_inc_counter(display->priv->cache_hits_counter, 1);
-                pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+                dcc_pixmap_cache_unlock(dcc);
                 return FILL_BITS_TYPE_CACHE;
             }
             pixmap_cache_unlocked_set_lossy(dcc->priv->pixmap_cache, simage->descriptor.id, FALSE);
             image.descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME;
         }
+        /* not held while compressing, the other display channels of the
+         * client can use the cache meanwhile */
+        dcc_pixmap_cache_unlock(dcc);
     }
 
     switch (simage->descriptor.type) {
@@ -411,7 +427,6 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         surface = get_dependent_surface(drawable, surface_id);
         if (!surface) {
             spice_warning("Invalid surface in SPICE_IMAGE_TYPE_SURFACE");
-            pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
             return FILL_BITS_TYPE_SURFACE;
         }
 
@@ -425,7 +440,6 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                              &bitmap_palette_out, &lzplt_palette_out);
         spice_assert(bitmap_palette_out == nullptr);
         spice_assert(lzplt_palette_out == nullptr);
-        pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
         return FILL_BITS_TYPE_SURFACE;
     }
     case SPICE_IMAGE_TYPE_BITMAP: {
@@ -433,12 +447,18 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
 #ifdef DUMP_BITMAP
         dump_bitmap(&simage->u.bitmap);
 #endif
+        /* The compressed image can be shared with other clients only if its id
+           identifies its content: images the guest asks to cache, or images
+           generated by the server with a unique id */
+        bool can_share = (simage->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) ||
+                         (simage->descriptor.id >> 32) == QXL_IMAGE_GROUP_RED;
+
         /* Images must be added to the cache only after they are compressed
            in order to prevent starvation in the client between pixmap_cache and
            global dictionary (in cases of multiple monitors) */
         if (red_stream_get_family(dcc->get_stream()) == AF_UNIX ||
             !dcc_compress_image(dcc, &image, &simage->u.bitmap,
-                                drawable, can_lossy, &comp_send_data)) {
+                                drawable, can_lossy, can_share, &comp_send_data)) {
             SpicePalette *palette;
 
             red_display_add_image_to_pixmap_cache(dcc, simage, &image, FALSE);
@@ -464,7 +484,6 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                                  bitmap->data->chunk[i].len,
                                                  marshaller_unref_drawable, drawable);
             }
-            pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
             return FILL_BITS_TYPE_BITMAP;
         }
         red_display_add_image_to_pixmap_cache(dcc, simage, &image, comp_send_data.is_lossy);
@@ -472,15 +491,13 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         spice_marshall_Image(m, &image, &bitmap_palette_out, &lzplt_palette_out);
         spice_assert(bitmap_palette_out == nullptr);
 
-        marshaller_add_compressed(m, comp_send_data.comp_buf,
-                                  comp_send_data.comp_buf_size);
+        marshaller_add_compressed(m, &comp_send_data);
 
         if (lzplt_palette_out && comp_send_data.lzplt_palette) {
             spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
         }
 
         spice_assert(!comp_send_data.is_lossy || can_lossy);
-        pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
         return (comp_send_data.is_lossy ? FILL_BITS_TYPE_COMPRESS_LOSSY :
                                           FILL_BITS_TYPE_COMPRESS_LOSSLESS);
     }
@@ -499,12 +516,10 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                                              image.u.quic.data->chunk[i].len,
                                              marshaller_unref_drawable, drawable);
         }
-        pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
         return FILL_BITS_TYPE_COMPRESS_LOSSLESS;
     default:
         spice_error("invalid image type %u", image.descriptor.type);
     }
-    pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
     return FILL_BITS_TYPE_INVALID;
 }
 
@@ -1637,6 +1652,52 @@ static void red_release_video_encoder_buffer(uint8_t *data, void *opaque)
     buffer->free(buffer);
 }
 
+static void red_marshall_stream_frame(DisplayChannelClient *dcc,
+                                      SpiceMarshaller *base_marshaller,
+                                      VideoStreamAgent *agent,
+                                      uint32_t frame_mm_time,
+                                      bool is_sized,
+                                      uint32_t width, uint32_t height,
+                                      const SpiceRect *dest,
+                                      VideoBuffer *outbuf)
+{
+    int stream_id = display_channel_get_video_stream_id(DCC_TO_DC(dcc), agent->stream);
+
+    if (!is_sized) {
+        SpiceMsgDisplayStreamData stream_data;
+
+        dcc->init_send_data(SPICE_MSG_DISPLAY_STREAM_DATA);
+
+        stream_data.base.id = stream_id;
+        stream_data.base.multi_media_time = frame_mm_time;
+        stream_data.data_size = outbuf->size;
+
+        spice_marshall_msg_display_stream_data(base_marshaller, &stream_data);
+    } else {
+        SpiceMsgDisplayStreamDataSized stream_data;
+
+        dcc->init_send_data(SPICE_MSG_DISPLAY_STREAM_DATA_SIZED);
+
+        stream_data.base.id = stream_id;
+        stream_data.base.multi_media_time = frame_mm_time;
+        stream_data.data_size = outbuf->size;
+        stream_data.width = width;
+        stream_data.height = height;
+        stream_data.dest = *dest;
+
+        spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
+        rect_debug(&stream_data.dest);
+        spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
+    }
+    spice_marshaller_add_by_ref_full(base_marshaller, outbuf->data, outbuf->size,
+                                     &red_release_video_encoder_buffer, outbuf);
+#ifdef STREAM_STATS
+    agent->stats.num_frames_sent++;
+    agent->stats.size_sent += outbuf->size;
+    agent->stats.end = frame_mm_time;
+#endif
+}
+
 static bool red_marshall_stream_data(DisplayChannelClient *dcc,
                                      SpiceMarshaller *base_marshaller,
                                      Drawable *drawable)
@@ -1666,18 +1727,26 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
 
     int stream_id = display_channel_get_video_stream_id(display, stream);
     VideoStreamAgent *agent = &dcc->priv->stream_agents[stream_id];
-    VideoBuffer *outbuf;
+    VideoBuffer *outbuf = nullptr;
     /* workaround for vga streams */
     frame_mm_time =  drawable->red_drawable->mm_time ?
                         drawable->red_drawable->mm_time :
                         reds_get_mm_time();
-    ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
-          agent->video_encoder->encode_frame(agent->video_encoder,
-                                             frame_mm_time,
-                                             &copy->src_bitmap->u.bitmap,
-                                             &copy->src_area, stream->top_down,
-                                             drawable->red_drawable.get(),
-                                             &outbuf);
+    if (!agent->video_encoder) {
+        ret = VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    } else if (video_stream_agent_skip_frame(agent, drawable)) {
+        ret = VIDEO_ENCODER_FRAME_DROP;
+    } else if (agent->video_encoder->encode_frame_async) {
+        /* the frame is sent once encoded, see VideoStreamDataItem */
+        ret = video_stream_agent_encode_frame_async(agent, drawable, frame_mm_time, is_sized);
+    } else {
+        ret = agent->video_encoder->encode_frame(agent->video_encoder,
+                                                 frame_mm_time,
+                                                 &copy->src_bitmap->u.bitmap,
+                                                 &copy->src_area, stream->top_down,
+                                                 drawable->red_drawable.get(),
+                                                 &outbuf);
+    }
     switch (ret) {
     case VIDEO_ENCODER_FRAME_DROP:
 #ifdef STREAM_STATS
@@ -1686,6 +1755,8 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
         return TRUE;
     case VIDEO_ENCODER_FRAME_UNSUPPORTED:
         return FALSE;
+    case VIDEO_ENCODER_FRAME_PENDING:
+        return TRUE;
     case VIDEO_ENCODER_FRAME_ENCODE_DONE:
         break;
     default:
@@ -1693,41 +1764,28 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
         return FALSE;
     }
 
-    if (!is_sized) {
-        SpiceMsgDisplayStreamData stream_data;
-
-        dcc->init_send_data(SPICE_MSG_DISPLAY_STREAM_DATA);
-
-        stream_data.base.id = stream_id;
-        stream_data.base.multi_media_time = frame_mm_time;
-        stream_data.data_size = outbuf->size;
-
-        spice_marshall_msg_display_stream_data(base_marshaller, &stream_data);
-    } else {
-        SpiceMsgDisplayStreamDataSized stream_data;
-
-        dcc->init_send_data(SPICE_MSG_DISPLAY_STREAM_DATA_SIZED);
+    red_marshall_stream_frame(dcc, base_marshaller, agent, frame_mm_time, is_sized,
+                              copy->src_area.right - copy->src_area.left,
+                              copy->src_area.bottom - copy->src_area.top,
+                              &drawable->red_drawable->bbox, outbuf);
+    return TRUE;
+}
 
-        stream_data.base.id = stream_id;
-        stream_data.base.multi_media_time = frame_mm_time;
-        stream_data.data_size = outbuf->size;
-        stream_data.width = copy->src_area.right - copy->src_area.left;
-        stream_data.height = copy->src_area.bottom - copy->src_area.top;
-        stream_data.dest = drawable->red_drawable->bbox;
+static void marshall_stream_data(DisplayChannelClient *dcc,
+                                 SpiceMarshaller *base_marshaller,
+                                 VideoStreamDataItem *item)
+{
+    VideoStreamAgent *agent = item->stream_agent;
 
-        spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
-        rect_debug(&stream_data.dest);
-        spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
+    /* the stream was destroyed while the frame was waiting in the pipe */
+    if (agent->generation != item->generation) {
+        return;
     }
-    spice_marshaller_add_by_ref_full(base_marshaller, outbuf->data, outbuf->size,
-                                     &red_release_video_encoder_buffer, outbuf);
-#ifdef STREAM_STATS
-    agent->stats.num_frames_sent++;
-    agent->stats.size_sent += outbuf->size;
-    agent->stats.end = frame_mm_time;
-#endif
-
-    return TRUE;
+    red_marshall_stream_frame(dcc, base_marshaller, agent, item->frame_mm_time,
+                              item->is_sized, item->width, item->height,
+                              &item->dest, item->outbuf);
+    /* the marshaller releases the buffer once sent */
+    item->outbuf = nullptr;
 }
 
 static inline void marshall_inval_palette(RedChannelClient *rcc,
@@ -1819,7 +1877,7 @@ static void display_channel_marshall_pixmap_sync(DisplayChannelClient *dcc,
     dcc->init_send_data(SPICE_MSG_WAIT_FOR_CHANNELS);
     pixmap_cache = dcc->priv->pixmap_cache;
 
-    pthread_mutex_lock(&pixmap_cache->lock);
+    dcc_pixmap_cache_lock(dcc);
 
     wait.wait_count = 1;
     wait.wait_list[0].channel_type = SPICE_CHANNEL_DISPLAY;
@@ -1828,7 +1886,7 @@ static void display_channel_marshall_pixmap_sync(DisplayChannelClient *dcc,
     dcc->priv->pixmap_cache_generation = pixmap_cache->generation;
     dcc->priv->pending_pixmaps_sync = FALSE;
 
-    pthread_mutex_unlock(&pixmap_cache->lock);
+    dcc_pixmap_cache_unlock(dcc);
 
     spice_marshall_msg_wait_for_channels(base_marshaller, &wait);
 }
@@ -1841,7 +1899,7 @@ static void dcc_pixmap_cache_reset(DisplayChannelClient *dcc, SpiceMsgWaitForCha
     uint32_t i;
 
     serial = dcc->get_message_serial();
-    pthread_mutex_lock(&cache->lock);
+    dcc_pixmap_cache_lock(dcc);
     pixmap_cache_clear(cache);
 
     dcc->priv->pixmap_cache_generation = ++cache->generation;
@@ -1858,7 +1916,7 @@ static void dcc_pixmap_cache_reset(DisplayChannelClient *dcc, SpiceMsgWaitForCha
         }
     }
     sync_data->wait_count = wait_count;
-    pthread_mutex_unlock(&cache->lock);
+    dcc_pixmap_cache_unlock(dcc);
 }
 
 static void display_channel_marshall_reset_cache(DisplayChannelClient *dcc,
@@ -1873,6 +1931,25 @@ static void display_channel_marshall_reset_cache(DisplayChannelClient *dcc,
                                                  &wait);
 }
 
+/* Account the time from the client connection until the first and the last
+ * band of the surface images are sent. The counters hold the times of the
+ * last client restored, a sum over the clients would be meaningless */
+static void dcc_restore_band_sent(DisplayChannelClient *dcc)
+{
+    uint64_t elapsed_ms = (spice_get_monotonic_time_ns() - dcc->priv->restore_start) /
+                          NSEC_PER_MILLISEC;
+
+    if (!dcc->priv->restore_first_sent) {
+        dcc->priv->restore_first_sent = true;
+        stat_set_counter(dcc->priv->restore_first_pixel_ms, elapsed_ms);
+    }
+    if (--dcc->priv->restore_bands_pending == 0) {
+        stat_set_counter(dcc->priv->restore_full_ms, elapsed_ms);
+        spice_debug("display client %u restored in %" G_GUINT64_FORMAT " ms",
+                    dcc->priv->id, elapsed_ms);
+    }
+}
+
 static void red_marshall_image(DisplayChannelClient *dcc,
                                SpiceMarshaller *m,
                                RedImageItem *item)
@@ -1936,15 +2013,15 @@ static void red_marshall_image(DisplayChannelClient *dcc,
 
     compress_send_data_t comp_send_data = {nullptr};
 
-    int comp_succeeded = dcc_compress_image(dcc, &red_image, &bitmap, nullptr, item->can_lossy, &comp_send_data);
+    int comp_succeeded = dcc_compress_image(dcc, &red_image, &bitmap, nullptr, item->can_lossy,
+                                            false, &comp_send_data);
 
     surface_lossy_region = &dcc->priv->surface_client_lossy_region[item->surface_id];
     if (comp_succeeded) {
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
 
-        marshaller_add_compressed(src_bitmap_out,
-                                  comp_send_data.comp_buf, comp_send_data.comp_buf_size);
+        marshaller_add_compressed(src_bitmap_out, &comp_send_data);
 
         if (lzplt_palette_out && comp_send_data.lzplt_palette) {
             spice_marshall_Palette(lzplt_palette_out, comp_send_data.lzplt_palette);
@@ -1966,6 +2043,10 @@ static void red_marshall_image(DisplayChannelClient *dcc,
         region_remove(surface_lossy_region, &copy.base.box);
     }
     spice_chunks_destroy(chunks);
+
+    if (item->restore) {
+        dcc_restore_band_sent(dcc);
+    }
 }
 
 static void marshall_lossy_qxl_drawable(DisplayChannelClient *dcc,
@@ -2343,6 +2424,9 @@ void DisplayChannelClient::send_item(RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_STREAM_CLIP:
         marshall_stream_clip(this, m, static_cast<VideoStreamClipItem*>(pipe_item));
         break;
+    case RED_PIPE_ITEM_TYPE_STREAM_DATA:
+        marshall_stream_data(this, m, static_cast<VideoStreamDataItem*>(pipe_item));
+        break;
     case RED_PIPE_ITEM_TYPE_STREAM_DESTROY: {
         auto item = static_cast<StreamCreateDestroyItem*>(pipe_item);
         marshall_stream_end(this, m, item->agent);
@@ -59,12 +59,28 @@ DisplayChannelClient::DisplayChannelClient(DisplayChannel *display,
     priv->id = id;
 
     image_encoders_init(&priv->encoders, &DCC_TO_DC(this)->priv->encoder_shared_data);
+#ifdef USE_LZ4
+    priv->encoders.lz4_level = reds_get_lz4_level(display->get_server());
+#endif
+
+    RedsState *reds = display->get_server();
+    const RedStatNode *node = get_stat_node();
+    stat_init_counter(&priv->stall_time_ms, reds, node, "stall_time_ms", TRUE);
+    stat_init_counter(&priv->resyncs, reds, node, "resyncs", TRUE);
+    stat_init_counter(&priv->restore_first_pixel_ms, reds, node, "restore_first_pixel_ms", TRUE);
+    stat_init_counter(&priv->restore_full_ms, reds, node, "restore_full_ms", TRUE);
 
     dcc_init_stream_agents(this);
 }
 
 DisplayChannelClient::~DisplayChannelClient()
 {
+    RedsState *reds = get_channel()->get_server();
+    stat_remove_counter(reds, &priv->stall_time_ms);
+    stat_remove_counter(reds, &priv->resyncs);
+    stat_remove_counter(reds, &priv->restore_first_pixel_ms);
+    stat_remove_counter(reds, &priv->restore_full_ms);
+
     g_clear_pointer(&priv->preferred_video_codecs, g_array_unref);
     g_clear_pointer(&priv->client_preferred_video_codecs, g_array_unref);
 }
@@ -178,11 +194,9 @@ void dcc_create_surface(DisplayChannelClient *dcc, RedSurface *surface)
     dcc->pipe_add(create);
 }
 
-// adding the pipe item after pos. If pos == NULL, adding to head.
-void
-dcc_add_surface_area_image(DisplayChannelClient *dcc, RedSurface *surface,
-                           SpiceRect *area, RedChannelClient::Pipe::iterator pipe_item_pos,
-                           int can_lossy)
+static red::shared_ptr<RedImageItem>
+surface_area_image_new(DisplayChannelClient *dcc, RedSurface *surface,
+                       SpiceRect *area, int can_lossy)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
     SpiceCanvas *canvas = surface->context.canvas;
@@ -226,6 +240,16 @@ dcc_add_surface_area_image(DisplayChannelClient *dcc, RedSurface *surface,
             item->image_format = SPICE_BITMAP_FMT_RGBA;
         }
     }
+    return item;
+}
+
+// adding the pipe item after pos. If pos == NULL, adding to head.
+void
+dcc_add_surface_area_image(DisplayChannelClient *dcc, RedSurface *surface,
+                           SpiceRect *area, RedChannelClient::Pipe::iterator pipe_item_pos,
+                           int can_lossy)
+{
+    auto item = surface_area_image_new(dcc, surface, area, can_lossy);
 
     if (pipe_item_pos != dcc->get_pipe().end()) {
         dcc->pipe_add_after_pos(item, pipe_item_pos);
@@ -234,10 +258,100 @@ dcc_add_surface_area_image(DisplayChannelClient *dcc, RedSurface *surface,
     }
 }
 
-void dcc_push_surface_image(DisplayChannelClient *dcc, RedSurface *surface)
+static void add_rect_bands(std::vector<SpiceRect> &bands, const SpiceRect *rect)
+{
+    for (int top = rect->top; top < rect->bottom; top += SURFACE_IMAGE_BAND_HEIGHT) {
+        SpiceRect band = *rect;
+
+        band.top = top;
+        band.bottom = MIN(top + SURFACE_IMAGE_BAND_HEIGHT, rect->bottom);
+        bands.push_back(band);
+    }
+}
+
+static void add_region_bands(std::vector<SpiceRect> &bands, QRegion *region)
+{
+    uint32_t num_rects = pixman_region32_n_rects(region);
+    SpiceRect *rects = g_new(SpiceRect, num_rects);
+
+    region_ret_rects(region, rects, num_rects);
+    for (uint32_t i = 0; i < num_rects; i++) {
+        add_rect_bands(bands, &rects[i]);
+    }
+    g_free(rects);
+}
+
+/* Splits a surface in bands of rows sent as separate images, so the client
+ * can show the first ones while the others are compressed and sent. The
+ * areas of the surface shown by @heads come first, the rest after them */
+std::vector<SpiceRect> surface_image_bands(uint32_t surface_id, uint32_t width, uint32_t height,
+                                           const QXLHead *heads, int num_heads)
 {
+    std::vector<SpiceRect> bands;
     SpiceRect area;
+    QRegion rest;
+
+    area.top = area.left = 0;
+    area.right = width;
+    area.bottom = height;
+    region_init(&rest);
+    region_add(&rest, &area);
+
+    for (int i = 0; i < num_heads; i++) {
+        const QXLHead *head = &heads[i];
+        SpiceRect visible;
+
+        if (head->surface_id != surface_id) {
+            continue;
+        }
+        visible.left = MIN(head->x, width);
+        visible.top = MIN(head->y, height);
+        visible.right = MIN((uint64_t) head->x + head->width, width);
+        visible.bottom = MIN((uint64_t) head->y + head->height, height);
+        if (rect_is_empty(&visible)) {
+            continue;
+        }
+        /* heads can overlap, send what was not sent yet */
+        QRegion head_region;
+        region_init(&head_region);
+        region_add(&head_region, &visible);
+        region_and(&head_region, &rest);
+        region_remove(&rest, &visible);
+
+        add_region_bands(bands, &head_region);
+        region_destroy(&head_region);
+    }
+
+    add_region_bands(bands, &rest);
+    region_destroy(&rest);
+    return bands;
+}
 
+static void push_surface_image_bands(DisplayChannelClient *dcc, RedSurface *surface,
+                                     bool restore)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    MonitorsConfig *monitors_config = display->priv->monitors_config;
+    bool use_heads = is_primary_surface(display, surface) && monitors_config;
+
+    auto bands = surface_image_bands(surface->id, surface->context.width,
+                                     surface->context.height,
+                                     use_heads ? monitors_config->heads : nullptr,
+                                     use_heads ? monitors_config->count : 0);
+    for (auto &band : bands) {
+        /* not allowing lossy compression because probably, especially if it is a primary
+           surface, it combines both "picture-like" areas with areas that are more "artificial"*/
+        auto item = surface_area_image_new(dcc, surface, &band, false);
+        if (restore) {
+            item->restore = true;
+            dcc->priv->restore_bands_pending++;
+        }
+        dcc->pipe_add(item);
+    }
+}
+
+void dcc_push_surface_image(DisplayChannelClient *dcc, RedSurface *surface)
+{
     if (!dcc) {
         return;
     }
@@ -245,13 +359,109 @@ void dcc_push_surface_image(DisplayChannelClient *dcc, RedSurface *surface)
     if (!surface) {
         return;
     }
-    area.top = area.left = 0;
-    area.right = surface->context.width;
-    area.bottom = surface->context.height;
+    push_surface_image_bands(dcc, surface, false);
+}
+
+/* Replace the drawables waiting in the pipe by images of the surfaces they
+ * draw to, the client copies of these surfaces are out of date once the
+ * drawables are dropped. The primary surface is always sent again. The other
+ * surfaces are still in sync, they are sent as usual when a new drawable
+ * depends on a surface the client does not have */
+static void dcc_resync(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    auto &pipe = dcc->get_pipe();
+    std::vector<bool> stale(display->priv->n_surfaces);
+
+    for (auto l = pipe.begin(); l != pipe.end(); ) {
+        RedPipeItem *item = l->get();
+        Drawable *drawable;
+
+        if (item->type == RED_PIPE_ITEM_TYPE_DRAW) {
+            drawable = static_cast<RedDrawablePipeItem*>(item)->drawable;
+        } else if (item->type == RED_PIPE_ITEM_TYPE_UPGRADE) {
+            drawable = static_cast<RedUpgradeItem*>(item)->drawable;
+        } else {
+            ++l;
+            continue;
+        }
+        stale[drawable->surface->id] = true;
+        l = pipe.erase(l);
+    }
+
+    for (uint32_t i = 0; i < display->priv->n_surfaces; i++) {
+        RedSurface *surface = display->priv->surfaces[i];
+        SpiceRect area;
+
+        if (!surface || !dcc->priv->surface_client_created[i]) {
+            continue;
+        }
+        if (!stale[i] && !is_primary_surface(display, surface)) {
+            continue;
+        }
+        display_channel_current_flush(display, surface);
+        area.top = area.left = 0;
+        area.right = surface->context.width;
+        area.bottom = surface->context.height;
+        /* the primary surface can be lossy, it gets upgraded later like any
+         * other lossy image. Other surfaces can be sources of alpha blends */
+        dcc_add_surface_area_image(dcc, surface, &area, dcc->get_pipe().end(),
+                                   is_primary_surface(display, surface));
+    }
+}
+
+/* the id of the client connection, the name of its statistics node */
+static uint32_t dcc_connection_id(DisplayChannelClient *dcc)
+{
+    MainChannelClient *mcc = dcc->get_client()->get_main();
+
+    return mcc ? mcc->get_connection_id() : 0;
+}
 
-    /* not allowing lossy compression because probably, especially if it is a primary surface,
-       it combines both "picture-like" areas with areas that are more "artificial"*/
-    dcc_add_surface_area_image(dcc, surface, &area, dcc->get_pipe().end(), false);
+/* Check whether the client keeps the processing of commands stalled,
+ * resyncing it if it does for too long */
+void dcc_check_stall(DisplayChannelClient *dcc, uint64_t now)
+{
+    uint32_t pipe_size = dcc->get_pipe_size();
+
+    if (pipe_size <= MAX_PIPE_SIZE || dcc->is_waiting_for_migrate_data()) {
+        if (dcc->priv->stall_start) {
+            stat_inc_counter(dcc->priv->stall_time_ms,
+                             (now - dcc->priv->stall_start) / NSEC_PER_MILLISEC);
+            dcc->priv->stall_start = 0;
+        }
+        return;
+    }
+    if (!dcc->priv->stall_start) {
+        dcc->priv->stall_start = now;
+        return;
+    }
+    if (now - dcc->priv->stall_start < DISPLAY_CLIENT_STALL_TIMEOUT) {
+        return;
+    }
+
+    stat_inc_counter(dcc->priv->stall_time_ms,
+                     (now - dcc->priv->stall_start) / NSEC_PER_MILLISEC);
+    dcc->priv->stall_start = 0;
+    if (dcc->priv->last_resync && now - dcc->priv->last_resync < DISPLAY_CLIENT_RESYNC_INTERVAL) {
+        dcc->priv->num_resyncs++;
+    } else {
+        dcc->priv->num_resyncs = 1;
+    }
+    dcc->priv->last_resync = now;
+
+    if (dcc->priv->num_resyncs > DISPLAY_CLIENT_MAX_RESYNCS) {
+        red_channel_warning(dcc->get_channel(),
+                            "display client %u can't keep up, disconnecting",
+                            dcc_connection_id(dcc));
+        dcc->disconnect();
+        return;
+    }
+    red_channel_warning(dcc->get_channel(),
+                        "display client %u stalled with %u items, sending the surfaces",
+                        dcc_connection_id(dcc), pipe_size);
+    stat_inc_counter(dcc->priv->resyncs, 1);
+    dcc_resync(dcc);
 }
 
 static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *drawable)
@@ -411,7 +621,8 @@ void dcc_start(DisplayChannelClient *dcc)
         display_channel_current_flush(display, surface0);
         dcc->pipe_add_type(RED_PIPE_ITEM_TYPE_INVAL_PALETTE_CACHE);
         dcc_create_surface(dcc, surface0);
-        dcc_push_surface_image(dcc, surface0);
+        dcc->priv->restore_start = spice_get_monotonic_time_ns();
+        push_surface_image_bands(dcc, surface0, true);
         dcc_push_monitors_config(dcc);
         dcc->pipe_add_empty_msg(SPICE_MSG_DISPLAY_MARK);
         dcc_create_all_streams(dcc);
@@ -440,11 +651,21 @@ static void dcc_stop(DisplayChannelClient *dcc)
 {
     DisplayChannel *dc = DCC_TO_DC(dcc);
 
-    pixmap_cache_unref(dcc->priv->pixmap_cache);
+    if (dcc->priv->pixmap_cache && reds_get_pixmap_cache_reuse(dc->get_server())) {
+        PixmapCacheDigest *digest =
+            pixmap_cache_unref_to_digest(dcc->priv->pixmap_cache, dcc->priv->id,
+                                         dcc->get_acked_serial());
+        if (digest) {
+            dcc->get_client()->set_pixmap_cache_digest(digest);
+        }
+    } else {
+        pixmap_cache_unref(dcc->priv->pixmap_cache);
+    }
     dcc->priv->pixmap_cache = nullptr;
     dcc_palette_cache_reset(dcc);
     g_free(dcc->priv->send_data.free_list.res);
     dcc_destroy_stream_agents(dcc);
+    dcc_free_video_frames(dcc);
     image_encoders_free(&dcc->priv->encoders);
 
     if (dcc->priv->gl_draw_ongoing) {
@@ -634,9 +855,42 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
+typedef bool (*ImageEncodersCompressFunc)(ImageEncoders *enc, SpiceImage *dest,
+                                          SpiceBitmap *src, compress_send_data_t* o_comp_data);
+
+/* Compress an image reusing, if possible, the result of the compression of
+ * the same image for another client of the display channel.
+ * GLZ is never shared as it depends on the dictionary of each client. */
+static bool dcc_compress_image_shared(DisplayChannelClient *dcc,
+                                      SpiceImage *dest, SpiceBitmap *src, bool can_share,
+                                      uint8_t encoder_type, int32_t param,
+                                      ImageEncodersCompressFunc compress,
+                                      compress_send_data_t* o_comp_data)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    ImageEncoderSharedData *shared_data = &display_channel->priv->encoder_shared_data;
+
+    /* sharing only helps if other clients can send the same image */
+    if (!can_share || display_channel->get_n_clients() < 2) {
+        return compress(&dcc->priv->encoders, dest, src, o_comp_data);
+    }
+
+    const RedSharedImageKey key = { dest->descriptor.id, encoder_type, param };
+    if (image_encoder_shared_lookup(shared_data, &key, src, dest, o_comp_data)) {
+        stat_inc_counter(display_channel->priv->shared_image_hits_counter, 1);
+        return true;
+    }
+    if (!compress(&dcc->priv->encoders, dest, src, o_comp_data)) {
+        return false;
+    }
+    stat_inc_counter(display_channel->priv->shared_image_misses_counter, 1);
+    image_encoder_shared_add(shared_data, &key, src, dest, o_comp_data);
+    return true;
+}
+
 int dcc_compress_image(DisplayChannelClient *dcc,
                        SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                       int can_lossy,
+                       int can_lossy, bool can_share,
                        compress_send_data_t* o_comp_data)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
@@ -653,10 +907,15 @@ int dcc_compress_image(DisplayChannelClient *dcc,
     case SPICE_IMAGE_COMPRESSION_QUIC:
         if (can_lossy && display_channel->priv->enable_jpeg &&
             (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
-            success = image_encoders_compress_jpeg(&dcc->priv->encoders, dest, src, o_comp_data);
+            success = dcc_compress_image_shared(dcc, dest, src, can_share,
+                                                SPICE_IMAGE_TYPE_JPEG,
+                                                dcc->priv->encoders.jpeg_quality,
+                                                image_encoders_compress_jpeg, o_comp_data);
             break;
         }
-        success = image_encoders_compress_quic(&dcc->priv->encoders, dest, src, o_comp_data);
+        success = dcc_compress_image_shared(dcc, dest, src, can_share,
+                                            SPICE_IMAGE_TYPE_QUIC, 0,
+                                            image_encoders_compress_quic, o_comp_data);
         break;
     case SPICE_IMAGE_COMPRESSION_GLZ:
         success = image_encoders_compress_glz(&dcc->priv->encoders, dest, src,
@@ -670,14 +929,21 @@ int dcc_compress_image(DisplayChannelClient *dcc,
 #ifdef USE_LZ4
     case SPICE_IMAGE_COMPRESSION_LZ4:
         if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
-            success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
+            success = dcc_compress_image_shared(dcc, dest, src, can_share,
+                                                SPICE_IMAGE_TYPE_LZ4,
+                                                dcc->priv->encoders.lz4_level,
+                                                image_encoders_compress_lz4, o_comp_data);
             break;
         }
 #endif
         /* fall through */
     case SPICE_IMAGE_COMPRESSION_LZ:
 lz_compress:
-        success = image_encoders_compress_lz(&dcc->priv->encoders, dest, src, o_comp_data);
+        /* palette images are not shared, the palette is cached per client */
+        success = dcc_compress_image_shared(dcc, dest, src,
+                                            can_share && bitmap_fmt_is_rgb(src->format),
+                                            SPICE_IMAGE_TYPE_LZ_RGB, 0,
+                                            image_encoders_compress_lz, o_comp_data);
         if (success && !bitmap_fmt_is_rgb(src->format)) {
             dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
         }
@@ -740,17 +1006,39 @@ static void dcc_push_release(DisplayChannelClient *dcc, uint8_t type, uint64_t i
     free_list->res->resources[free_list->res->count++].id = id;
 }
 
+/* The pixmap cache is shared by the display channels of the client, each
+ * one running in the worker thread of its QXL device. Accounts the time
+ * spent waiting for another worker */
+void dcc_pixmap_cache_lock(DisplayChannelClient *dcc)
+{
+    PixmapCache *cache = dcc->priv->pixmap_cache;
+
+    if (pthread_mutex_trylock(&cache->lock) == 0) {
+        return;
+    }
+
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    uint64_t start = spice_get_monotonic_time_ns();
+    pthread_mutex_lock(&cache->lock);
+    stat_inc_counter(display->priv->pixmap_cache_lock_waits_counter, 1);
+    stat_inc_counter(display->priv->pixmap_cache_lock_wait_us_counter,
+                     (spice_get_monotonic_time_ns() - start) / NSEC_PER_MICROSEC);
+}
+
+void dcc_pixmap_cache_unlock(DisplayChannelClient *dcc)
+{
+    pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+}
+
 bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
                                    uint32_t size, int lossy)
 {
     PixmapCache *cache = dcc->priv->pixmap_cache;
     NewCacheItem *item;
     uint64_t serial;
-    int key;
 
     spice_assert(size > 0);
 
-    item = g_new(NewCacheItem, 1);
     serial = dcc->get_message_serial();
 
     if (cache->generation != dcc->priv->pixmap_cache_generation) {
@@ -758,14 +1046,20 @@ bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
             dcc->pipe_add_type(RED_PIPE_ITEM_TYPE_PIXMAP_SYNC);
             dcc->priv->pending_pixmaps_sync = TRUE;
         }
-        g_free(item);
         return FALSE;
     }
 
+    /* another display channel of the client added it while the image was
+     * compressed, this one is sent without being cached */
+    if (pixmap_cache_unlocked_find(cache, id)) {
+        return FALSE;
+    }
+
+    item = g_new(NewCacheItem, 1);
+
     cache->available -= size;
     while (cache->available < 0) {
         NewCacheItem *tail;
-        NewCacheItem **now;
 
         SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
         if (!(tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), NewCacheItem, lru_link)) ||
@@ -775,26 +1069,17 @@ bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
             return FALSE;
         }
 
-        now = &cache->hash_table[BITS_CACHE_HASH_KEY(tail->id)];
-        for (;;) {
-            spice_assert(*now);
-            if (*now == tail) {
-                *now = tail->next;
-                break;
-            }
-            now = &(*now)->next;
-        }
+        pixmap_cache_unlocked_unhash(cache, tail);
         ring_remove(&tail->lru_link);
         cache->available += tail->size;
         cache->sync[dcc->priv->id] = serial;
         dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, tail->id, tail->sync);
         g_free(tail);
     }
-    item->next = cache->hash_table[(key = BITS_CACHE_HASH_KEY(id))];
-    cache->hash_table[key] = item;
+    item->id = id;
+    pixmap_cache_unlocked_insert(cache, item);
     ring_item_init(&item->lru_link);
     ring_add(&cache->lru, &item->lru_link);
-    item->id = id;
     item->size = size;
     item->lossy = lossy;
     memset(item->sync, 0, sizeof(item->sync));
@@ -803,6 +1088,23 @@ bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
     return TRUE;
 }
 
+/* account whether the GLZ dictionary ended up in hugepages when asked to */
+static void dcc_glz_dictionary_stat(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+
+    if (!reds_get_glz_hugepages(display->get_server())) {
+        return;
+    }
+    size_t hugepage_bytes = image_encoders_get_glz_hugepage_bytes(&dcc->priv->encoders);
+    spice_debug("GLZ dictionary hugepage bytes %zu", hugepage_bytes);
+    if (hugepage_bytes) {
+        stat_inc_counter(display->priv->glz_dict_hugepages_counter, 1);
+    } else {
+        stat_inc_counter(display->priv->glz_dict_hugepage_fallbacks_counter, 1);
+    }
+}
+
 static bool dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *init)
 {
     gboolean success;
@@ -817,11 +1119,27 @@ static bool dcc_handle_init(DisplayChannelClient *dcc, SpiceMsgcDisplayInit *ini
                                                init->pixmap_cache_size);
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
+    PixmapCacheDigest *digest = client->take_pixmap_cache_digest();
+    if (digest) {
+        if (reds_get_pixmap_cache_reuse(dcc->get_channel()->get_server())) {
+            uint32_t dropped = pixmap_cache_adopt_digest(dcc->priv->pixmap_cache, digest);
+            uint64_t sync[MAX_CACHE_CLIENTS] = {};
+
+            // the client still holds them, as if they were evicted
+            for (uint32_t i = 0; i < dropped; i++) {
+                dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, digest->items[i].id, sync);
+            }
+        }
+        g_free(digest);
+    }
+
     success = image_encoders_get_glz_dictionary(&dcc->priv->encoders,
                                                 client,
                                                 init->glz_dictionary_id,
-                                                init->glz_dictionary_window_size);
+                                                init->glz_dictionary_window_size,
+                                                reds_get_glz_hugepages(dcc->get_channel()->get_server()));
     spice_return_val_if_fail(success, FALSE);
+    dcc_glz_dictionary_stat(dcc);
 
     return TRUE;
 }
@@ -1013,10 +1331,15 @@ static int dcc_handle_migrate_glz_dictionary(DisplayChannelClient *dcc,
                                              SpiceMigrateDataDisplay *migrate)
 {
     GlzEncDictRestoreData glz_dict_data = migrate->glz_dict_data;
-    return image_encoders_restore_glz_dictionary(&dcc->priv->encoders,
-                                                 dcc->get_client(),
-                                                 migrate->glz_dict_id,
-                                                 &glz_dict_data);
+    if (!image_encoders_restore_glz_dictionary(&dcc->priv->encoders,
+                                               dcc->get_client(),
+                                               migrate->glz_dict_id,
+                                               &glz_dict_data,
+                                               reds_get_glz_hugepages(dcc->get_channel()->get_server()))) {
+        return FALSE;
+    }
+    dcc_glz_dictionary_stat(dcc);
+    return TRUE;
 }
 
 static bool restore_surface(DisplayChannelClient *dcc, uint32_t surface_id)
@@ -1095,12 +1418,12 @@ bool DisplayChannelClient::handle_migrate_data(uint32_t size, void *message)
                                                migrate_data->pixmap_cache_id, -1);
     spice_return_val_if_fail(dcc->priv->pixmap_cache, FALSE);
 
-    pthread_mutex_lock(&dcc->priv->pixmap_cache->lock);
+    dcc_pixmap_cache_lock(dcc);
     for (i = 0; i < MAX_CACHE_CLIENTS; i++) {
         dcc->priv->pixmap_cache->sync[i] = MAX(dcc->priv->pixmap_cache->sync[i],
                                                migrate_data->pixmap_cache_clients[i]);
     }
-    pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
+    dcc_pixmap_cache_unlock(dcc);
 
     if (migrate_data->pixmap_cache_freezer) {
         /* activating the cache. The cache will start to be active after
@@ -1172,6 +1495,16 @@ void dcc_set_max_stream_latency(DisplayChannelClient *dcc, uint32_t latency)
     dcc->priv->streams_max_latency = latency;
 }
 
+VideoStreamFrameQueue *dcc_get_video_frame_queue(DisplayChannelClient *dcc)
+{
+    return dcc->priv->frame_queue;
+}
+
+void dcc_set_video_frame_queue(DisplayChannelClient *dcc, VideoStreamFrameQueue *queue)
+{
+    dcc->priv->frame_queue = queue;
+}
+
 uint64_t dcc_get_max_stream_bit_rate(DisplayChannelClient *dcc)
 {
     return dcc->priv->streams_max_bit_rate;
@@ -1192,6 +1525,14 @@ bool DisplayChannelClient::config_socket()
     return CommonGraphicsChannelClient::config_socket();
 }
 
+void DisplayChannelClient::set_low_bandwidth(bool low_bandwidth)
+{
+    CommonGraphicsChannelClient::set_low_bandwidth(low_bandwidth);
+
+    is_low_bandwidth = low_bandwidth;
+    display_channel_update_compression(DCC_TO_DC(this), this);
+}
+
 void DisplayChannelClient::on_disconnect()
 {
     DisplayChannel *display;
@@ -19,6 +19,9 @@
 #ifndef DCC_H_
 #define DCC_H_
 
+#include <vector>
+#include <spice/qxl_dev.h>
+
 #include "image-encoders.h"
 #include "image-cache.h"
 #include "pixmap-cache.h"
@@ -48,6 +51,7 @@ public:
 protected:
     virtual bool handle_message(uint16_t type, uint32_t size, void *msg) override;
     virtual bool config_socket() override;
+    virtual void set_low_bandwidth(bool low_bandwidth) override;
     virtual void on_disconnect() override;
     virtual void send_item(RedPipeItem *item) override;
     virtual bool handle_migrate_data(uint32_t size, void *message) override;
@@ -76,11 +80,25 @@ public:
 #define WIDE_CLIENT_ACK_WINDOW 40
 #define NARROW_CLIENT_ACK_WINDOW 20
 
+/* bounds of the bytes sent and not acknowledged by display clients */
+#define DISPLAY_ACK_WINDOW_MIN_BYTES (256 * 1024)
+#define DISPLAY_ACK_WINDOW_MAX_BYTES (16 * 1024 * 1024)
+
 #define MAX_PIPE_SIZE 50
 
+/* A display client keeping more than MAX_PIPE_SIZE items for
+ * DISPLAY_CLIENT_STALL_TIMEOUT stops the processing of commands for all the
+ * clients. Its drawables are replaced by images of the surfaces, it is
+ * disconnected after DISPLAY_CLIENT_MAX_RESYNCS of them, each less than
+ * DISPLAY_CLIENT_RESYNC_INTERVAL after the previous one */
+#define DISPLAY_CLIENT_STALL_TIMEOUT (NSEC_PER_SEC / 2)
+#define DISPLAY_CLIENT_RESYNC_INTERVAL (NSEC_PER_SEC * 10)
+#define DISPLAY_CLIENT_MAX_RESYNCS 3
+
 struct DisplayChannel;
 struct VideoStream;
 struct VideoStreamAgent;
+struct VideoStreamFrameQueue;
 struct RedSurface;
 
 struct WaitForChannels {
@@ -119,6 +137,8 @@ void                       dcc_palette_cache_reset                   (DisplayCha
 void                       dcc_palette_cache_palette                 (DisplayChannelClient *dcc,
                                                                       SpicePalette *palette,
                                                                       uint8_t *flags);
+void                       dcc_pixmap_cache_lock                     (DisplayChannelClient *dcc);
+void                       dcc_pixmap_cache_unlock                   (DisplayChannelClient *dcc);
 bool                       dcc_pixmap_cache_unlocked_add             (DisplayChannelClient *dcc,
                                                                       uint64_t id, uint32_t size, int lossy);
 void                       dcc_prepend_drawable                      (DisplayChannelClient *dcc,
@@ -133,16 +153,19 @@ bool                       dcc_drawable_is_in_pipe                   (DisplayCha
 
 int                        dcc_compress_image                        (DisplayChannelClient *dcc,
                                                                       SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                                                                      int can_lossy,
+                                                                      int can_lossy, bool can_share,
                                                                       compress_send_data_t* o_comp_data);
 
 void dcc_create_surface(DisplayChannelClient *dcc, struct RedSurface *surface);
 void dcc_push_surface_image(DisplayChannelClient *dcc, struct RedSurface *surface);
+std::vector<SpiceRect> surface_image_bands(uint32_t surface_id, uint32_t width, uint32_t height,
+                                           const QXLHead *heads, int num_heads);
 bool dcc_clear_surface_drawables_from_pipe(DisplayChannelClient *dcc,
                                            RedSurface *surface, bool wait_if_used);
 void dcc_add_surface_area_image(DisplayChannelClient *dcc, RedSurface *surface,
                                 SpiceRect *area, RedChannelClient::Pipe::iterator pipe_item_pos,
                                 int can_lossy);
+void dcc_check_stall(DisplayChannelClient *dcc, uint64_t now);
 RedPipeItemPtr dcc_gl_scanout_item_new(RedChannelClient *rcc, void *data, int num);
 RedPipeItemPtr dcc_gl_draw_item_new(RedChannelClient *rcc, void *data, int num);
 VideoStreamAgent *dcc_get_video_stream_agent(DisplayChannelClient *dcc, int stream_id);
@@ -151,6 +174,8 @@ spice_wan_compression_t    dcc_get_jpeg_state                        (DisplayCha
 spice_wan_compression_t    dcc_get_zlib_glz_state                    (DisplayChannelClient *dcc);
 uint32_t dcc_get_max_stream_latency(DisplayChannelClient *dcc);
 void dcc_set_max_stream_latency(DisplayChannelClient *dcc, uint32_t latency);
+VideoStreamFrameQueue *dcc_get_video_frame_queue(DisplayChannelClient *dcc);
+void dcc_set_video_frame_queue(DisplayChannelClient *dcc, VideoStreamFrameQueue *queue);
 uint64_t dcc_get_max_stream_bit_rate(DisplayChannelClient *dcc);
 void dcc_set_max_stream_bit_rate(DisplayChannelClient *dcc, uint64_t rate);
 gboolean dcc_is_low_bandwidth(DisplayChannelClient *dcc);
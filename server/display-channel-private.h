@@ -45,6 +45,9 @@ struct RedSurface {
      * which drawables overlap, and to exclude regions of drawables that are
      * obscured by other drawables */
     Ring current;
+    /* Spatial index of the top level items of 'current', used to visit only
+     * the items intersecting a given area */
+    TreeIndex tree_index;
     /* A ring of pending Drawables associated with this surface. This ring is
      * actually used for drawing. The ring is maintained in order of age, the
      * tail being the oldest drawable. */
@@ -70,7 +73,8 @@ struct MonitorsConfig {
     QXLHead heads[0];
 };
 
-#define NUM_DRAWABLES 1000
+/* Drawables are allocated in chunks of this size, the pool grows on demand */
+#define DRAWABLES_CHUNK_SIZE 256
 struct _Drawable {
     union {
         alignas(Drawable) char raw_drawable[sizeof(Drawable)];
@@ -78,6 +82,35 @@ struct _Drawable {
     } u;
 };
 
+struct DrawablesChunk {
+    DrawablesChunk *next;
+    std::array<_Drawable, DRAWABLES_CHUNK_SIZE> drawables;
+};
+
+/* Memory of the drawables of a display channel, allocated upfront up to
+ * the soft limit then grown on demand up to the hard limit */
+struct DrawablesPool {
+    /* number of drawables allocated in chunks, never more than max_drawables */
+    uint32_t allocated;
+    uint32_t max_drawables;
+    DrawablesChunk *chunks;
+    _Drawable *free_list;
+    RedStatCounter grow_counter;
+    RedStatCounter forced_free_counter;
+};
+
+/* called when the pool reached its maximum size, should release a drawable
+ * to the pool; returns false if there is nothing to release */
+typedef bool (*drawables_pool_release_proc)(void *opaque);
+
+void drawables_pool_init(DrawablesPool *pool, uint32_t soft_limit, uint32_t hard_limit);
+void drawables_pool_destroy(DrawablesPool *pool);
+/* returns uninitialized memory for a Drawable or NULL if the pool is
+ * exhausted and release failed */
+void *drawables_pool_alloc(DrawablesPool *pool,
+                           drawables_pool_release_proc release, void *opaque);
+void drawables_pool_free(DrawablesPool *pool, void *drawable);
+
 struct DisplayChannelPrivate
 {
     SPICE_CXX_GLIB_ALLOCATOR
@@ -102,8 +135,7 @@ struct DisplayChannelPrivate
     Ring current_list;
 
     uint32_t drawable_count;
-    std::array<_Drawable, NUM_DRAWABLES> drawables;
-    _Drawable *free_drawables;
+    DrawablesPool drawables;
 
     int stream_video;
     GArray *video_codecs;
@@ -114,6 +146,13 @@ struct DisplayChannelPrivate
     std::array<ItemTrace, NUM_TRACE_ITEMS> items_trace;
     uint32_t next_item_trace;
     uint64_t streams_size_total;
+    /* frame rate limits of the streams for regular and low bandwidth
+     * clients, 0 if not set */
+    uint32_t stream_max_fps;
+    uint32_t stream_low_bandwidth_max_fps;
+    /* threads encoding each frame of a stream */
+    uint32_t stream_encoder_threads;
+    FullSurfaceStreaming full_surface;
 
     std::array<RedSurface *, NUM_SURFACES> surfaces;
     uint32_t n_surfaces;
@@ -134,6 +173,12 @@ struct DisplayChannelPrivate
     RedStatCounter cache_hits_counter;
     RedStatCounter add_to_cache_counter;
     RedStatCounter non_cache_counter;
+    RedStatCounter shared_image_hits_counter;
+    RedStatCounter shared_image_misses_counter;
+    RedStatCounter glz_dict_hugepages_counter;
+    RedStatCounter glz_dict_hugepage_fallbacks_counter;
+    RedStatCounter pixmap_cache_lock_waits_counter;
+    RedStatCounter pixmap_cache_lock_wait_us_counter;
     ImageEncoderSharedData encoder_shared_data;
 };
 
@@ -158,6 +203,7 @@ enum {
     RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT,
     RED_PIPE_ITEM_TYPE_GL_SCANOUT,
     RED_PIPE_ITEM_TYPE_GL_DRAW,
+    RED_PIPE_ITEM_TYPE_STREAM_DATA,
 };
 
 struct RedMonitorsConfigItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_MONITORS_CONFIG> {
@@ -177,6 +223,7 @@ void display_channel_draw_until(DisplayChannel *display,
                                 Drawable *last);
 GArray* display_channel_get_video_codecs(DisplayChannel *display);
 int display_channel_get_stream_video(DisplayChannel *display);
+void display_channel_add_full_surface_frame(DisplayChannel *display);
 void display_channel_current_flush(DisplayChannel *display,
                                    RedSurface *surface);
 uint32_t display_channel_generate_uid(DisplayChannel *display);
@@ -215,6 +262,7 @@ struct RedImageItem final: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_IMAGE> {
     int image_format;
     uint32_t image_flags;
     int can_lossy;
+    bool restore = false; // part of the surface images sent when the client connects
     uint8_t data[0];
 };
 
@@ -24,7 +24,8 @@
 DisplayChannel::~DisplayChannel()
 {
     display_channel_destroy_surfaces(this);
-    image_cache_reset(&priv->image_cache);
+    image_cache_destroy(&priv->image_cache);
+    image_encoder_shared_destroy(&priv->encoder_shared_data);
 
     if (spice_extra_checks) {
         unsigned int count;
@@ -32,10 +33,10 @@ DisplayChannel::~DisplayChannel()
         VideoStream *stream;
 
         count = 0;
-        for (drawable = priv->free_drawables; drawable; drawable = drawable->u.next) {
+        for (drawable = priv->drawables.free_list; drawable; drawable = drawable->u.next) {
             ++count;
         }
-        spice_assert(count == priv->drawables.size());
+        spice_assert(count == priv->drawables.allocated);
 
         count = 0;
         for (stream = priv->free_streams; stream; stream = stream->next) {
@@ -49,6 +50,8 @@ DisplayChannel::~DisplayChannel()
         }
     }
 
+    drawables_pool_destroy(&priv->drawables);
+
     monitors_config_unref(priv->monitors_config);
     g_array_unref(priv->video_codecs);
 }
@@ -138,7 +141,7 @@ static MonitorsConfig* monitors_config_new(const QXLHead *heads, ssize_t nheads,
 
 int display_channel_get_streams_timeout(DisplayChannel *display)
 {
-    int timeout = INT_MAX;
+    int timeout = video_stream_full_surface_get_timeout(display);
     Ring *ring = &display->priv->streams;
     RingItem *item = ring;
 
@@ -275,6 +278,11 @@ static void streams_update_visible_region(DisplayChannel *display, Drawable *dra
         return;
     }
 
+    /* the area is sent by the next frame of the full surface stream */
+    if (drawable->held_back) {
+        return;
+    }
+
     ring = &display->priv->streams;
     item = ring_get_head(ring);
 
@@ -301,10 +309,15 @@ static void streams_update_visible_region(DisplayChannel *display, Drawable *dra
     }
 }
 
+/* The drawables held back by the full surface video mode are not sent,
+ * the next frame of the surface is */
 static void pipes_add_drawable(DisplayChannel *display, Drawable *drawable)
 {
     DisplayChannelClient *dcc;
 
+    if (drawable->held_back) {
+        return;
+    }
     spice_warn_if_fail(drawable->pipes == nullptr);
     FOREACH_DCC(display, dcc) {
         dcc_prepend_drawable(dcc, drawable);
@@ -318,6 +331,9 @@ static void pipes_add_drawable_after(DisplayChannel *display,
     DisplayChannelClient *dcc;
     int num_other_linked = 0;
 
+    if (drawable->held_back) {
+        return;
+    }
     for (GList *l = pos_after->pipes; l != nullptr; l = l->next) {
         dpi_pos_after = static_cast<RedDrawablePipeItem *>(l->data);
 
@@ -355,6 +371,12 @@ static void current_add_drawable(DisplayChannel *display,
 
     surface = drawable->surface;
     ring_add_after(&drawable->tree_item.base.siblings_link, pos);
+    if (!drawable->tree_item.base.container) {
+        /* added to the top level ring, keep the spatial index in sync */
+        tree_index_add(&surface->tree_index, &drawable->tree_item.base,
+                       pos == &surface->current ? nullptr :
+                           SPICE_CONTAINEROF(pos, TreeItem, siblings_link));
+    }
     ring_add(&display->priv->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
     drawable->refs++;
@@ -367,12 +389,33 @@ static void current_remove_drawable(DisplayChannel *display, Drawable *item)
     /* todo: move all to unref? */
     video_stream_trace_add_drawable(display, item);
     draw_item_remove_shadow(&item->tree_item);
+    tree_index_remove(&item->tree_item.base);
     ring_remove(&item->tree_item.base.siblings_link);
     ring_remove(&item->list_link);
     ring_remove(&item->surface_list_link);
     drawable_unref(item);
 }
 
+/* Returns the item following @now in @ring, skipping the items that can't
+ * intersect @box. For the top level ring of @surface the spatial index finds
+ * the next candidate directly, otherwise this is the same as ring_next().
+ * The items are visited in ring order in both cases. @last, if not NULL, is
+ * the last item of the top level ring the caller is interested in */
+static RingItem *current_next_intersecting(RedSurface *surface, Ring *ring, RingItem *now,
+                                           const pixman_box32_t *box, TreeItem *last)
+{
+    TreeIndex *index = &surface->tree_index;
+
+    if (ring != &surface->current || !tree_index_usable(index, box)) {
+        return ring_next(ring, now);
+    }
+
+    SPICE_VERIFY(SPICE_OFFSETOF(TreeItem, siblings_link) == 0);
+    TreeItem *from = now == ring ? nullptr : reinterpret_cast<TreeItem *>(now);
+    TreeItem *next = tree_index_next(index, from, box, last);
+    return next ? &next->siblings_link : nullptr;
+}
+
 static void drawable_remove_from_pipes(Drawable *drawable)
 {
     RedDrawablePipeItem *dpi;
@@ -514,6 +557,10 @@ static bool current_add_equal(DisplayChannel *display, DrawItem *item, TreeItem
             dpi_item = g_list_first(other_drawable->pipes);
             /* dpi contains a sublist of dcc's, ordered the same */
             FOREACH_DCC(display, dcc) {
+                if (drawable->held_back) {
+                    /* sent by the next frame of the full surface video mode */
+                    break;
+                }
                 if (dpi_item && dcc == (static_cast<RedDrawablePipeItem *>(dpi_item->data))->dcc) {
                     dpi_item = dpi_item->next;
                 } else {
@@ -711,8 +758,9 @@ static void __exclude_region(DisplayChannel *display, Ring *ring, TreeItem *item
  * @frame_candidate: usually callers pass NULL, sometimes it's the drawable
  *      that's being added to the 'current' ring. TODO: What is its purpose?
  */
-static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_item,
-                           QRegion *rgn, TreeItem **last, Drawable *frame_candidate)
+static void exclude_region(DisplayChannel *display, RedSurface *surface, Ring *ring,
+                           RingItem *ring_item, QRegion *rgn, TreeItem **last,
+                           Drawable *frame_candidate)
 {
     Ring *top_ring;
     stat_start(&display->priv->exclude_stat, start_time);
@@ -773,9 +821,11 @@ static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_i
 
         SPICE_VERIFY(SPICE_OFFSETOF(TreeItem, siblings_link) == 0);
         /* if this is the last item to check, or if the current ring is
-         * completed, don't go any further */
+         * completed, don't go any further. Items not intersecting @rgn are
+         * not affected, they can be skipped */
         while ((last && *last == reinterpret_cast<TreeItem *>(ring_item)) ||
-               !(ring_item = ring_next(ring, ring_item))) {
+               !(ring_item = current_next_intersecting(surface, ring, ring_item, &rgn->extents,
+                                                       last ? *last : nullptr))) {
             /* we're currently iterating the top ring, so we're done */
             if (ring == top_ring) {
                 stat_add(&display->priv->exclude_stat, start_time);
@@ -820,6 +870,7 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
 
     /* Prepend the shadow to the beginning of the current ring */
     ring_add(ring, &shadow->base.siblings_link);
+    tree_index_add(&item->surface->tree_index, &shadow->base, nullptr);
     /* Prepend the draw item to the beginning of the current ring. NOTE: this
      * means that the drawable is placed *before* its associated shadow in the
      * tree. Changing this order will violate several unstated assumptions */
@@ -831,7 +882,8 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
          * items already in the tree.  Start iterating through the tree
          * starting with the shadow item to avoid excluding the new item
          * itself */
-        exclude_region(display, ring, &shadow->base.siblings_link, &exclude_rgn, nullptr, nullptr);
+        exclude_region(display, item->surface, ring, &shadow->base.siblings_link, &exclude_rgn,
+                       nullptr, nullptr);
         region_destroy(&exclude_rgn);
         streams_update_visible_region(display, item);
     } else {
@@ -855,7 +907,8 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
 
     spice_assert(!region_is_empty(&item->base.rgn));
     region_init(&exclude_rgn);
-    now = ring_next(ring, ring);
+    now = current_next_intersecting(drawable->surface, ring, ring, &item->base.rgn.extents,
+                                    nullptr);
 
     /* check whether the new drawable region intersects any of the items
      * already in the 'current' ring */
@@ -866,7 +919,8 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
         if (!region_bounds_intersects(&item->base.rgn, &sibling->rgn)) {
             /* the bounds of the two items are totally disjoint, so no need to
              * check further. check the next item */
-            now = ring_next(ring, now);
+            now = current_next_intersecting(drawable->surface, ring, now,
+                                            &item->base.rgn.extents, nullptr);
             continue;
         }
         /* bounds overlap, but check whether the regions actually overlap */
@@ -874,7 +928,8 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
         if (!(test_res & REGION_TEST_SHARED)) {
             /* there's no overlap of the regions between these two items. Move
              * on to the next one. */
-            now = ring_next(ring, now);
+            now = current_next_intersecting(drawable->surface, ring, now,
+                                            &item->base.rgn.extents, nullptr);
             continue;
         }
         if (sibling->type != TREE_ITEM_TYPE_SHADOW) {
@@ -918,7 +973,8 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
                          * item is obscured and has a shadow. -jjongsma
                          */
                         TreeItem *next = sibling;
-                        exclude_region(display, ring, exclude_base, &exclude_rgn, &next, nullptr);
+                        exclude_region(display, drawable->surface, ring, exclude_base,
+                                       &exclude_rgn, &next, nullptr);
                         if (next != sibling) {
                             /* the @next param is only changed if the given item
                              * was removed as a side-effect of calling
@@ -965,7 +1021,8 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
                  * this loop may have added various Shadow::on_hold regions to
                  * it. */
                 if (exclude_base) {
-                    exclude_region(display, ring, exclude_base, &exclude_rgn, nullptr, nullptr);
+                    exclude_region(display, drawable->surface, ring, exclude_base,
+                                   &exclude_rgn, nullptr, nullptr);
                     region_clear(&exclude_rgn);
                     exclude_base = nullptr;
                 }
@@ -1015,7 +1072,8 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
          * Shadows that were associated with DrawItems that were removed from
          * the tree.  Add the new item's region to that */
         region_or(&exclude_rgn, &item->base.rgn);
-        exclude_region(display, ring, exclude_base, &exclude_rgn, nullptr, drawable);
+        exclude_region(display, drawable->surface, ring, exclude_base, &exclude_rgn, nullptr,
+                       drawable);
         video_stream_trace_update(display, drawable);
         streams_update_visible_region(display, drawable);
         /*
@@ -1130,23 +1188,22 @@ static void surface_read_bits(DisplayChannel *display, RedSurface *surface,
     canvas->ops->read_bits(canvas, dest, dest_stride, area);
 }
 
-static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
+/* Returns a bitmap with the content of the area of the surface, which must
+ * have been drawn already */
+static SpiceImage *surface_image_new(DisplayChannel *display, RedSurface *surface,
+                                     const SpiceRect *area)
 {
-    RedDrawable *red_drawable = drawable->red_drawable.get();
     SpiceImage *image;
     int32_t width;
     int32_t height;
     uint8_t *dest;
     int dest_stride;
-    RedSurface *surface;
     int bpp;
     int all_set;
 
-    surface = drawable->surface;
-
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
-    width = red_drawable->self_bitmap_area.right - red_drawable->self_bitmap_area.left;
-    height = red_drawable->self_bitmap_area.bottom - red_drawable->self_bitmap_area.top;
+    width = area->right - area->left;
+    height = area->bottom - area->top;
     dest_stride = SPICE_ALIGN(width * bpp, 4);
 
     image = g_new0(SpiceImage, 1);
@@ -1165,14 +1222,11 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     image->u.bitmap.data = spice_chunks_new_linear(dest, height * dest_stride);
     image->u.bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
 
-    display_channel_surface_draw(display, drawable->surface,
-                                 &red_drawable->self_bitmap_area);
-    surface_read_bits(display, drawable->surface,
-        &red_drawable->self_bitmap_area, dest, dest_stride);
+    surface_read_bits(display, surface, area, dest, dest_stride);
 
     /* For 32bit non-primary surfaces we need to keep any non-zero
        high bytes as the surface may be used as source to an alpha_blend */
-    if (!is_primary_surface(display, drawable->surface) &&
+    if (!is_primary_surface(display, surface) &&
         image->u.bitmap.format == SPICE_BITMAP_FMT_32BIT &&
         rgb32_data_has_alpha(width, height, dest_stride, dest, &all_set)) {
         if (all_set) {
@@ -1181,8 +1235,17 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
             image->u.bitmap.format = SPICE_BITMAP_FMT_RGBA;
         }
     }
+    return image;
+}
 
-    red_drawable->self_bitmap_image = image;
+static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable.get();
+
+    display_channel_surface_draw(display, drawable->surface,
+                                 &red_drawable->self_bitmap_area);
+    red_drawable->self_bitmap_image =
+        surface_image_new(display, drawable->surface, &red_drawable->self_bitmap_area);
 }
 
 static void surface_add_reverse_dependency(DisplayChannel *display, RedSurface *surface,
@@ -1313,8 +1376,11 @@ static Drawable *display_channel_get_drawable(DisplayChannel *display, uint8_t e
 /**
  * Add a Drawable to the items to draw.
  * On failure the Drawable is not added.
+ * @full_surface_frame tells whether the Drawable is a frame of the full
+ * surface video mode, see display_channel_add_full_surface_frame()
  */
-static void display_channel_add_drawable(DisplayChannel *display, Drawable *drawable)
+static void display_channel_add_drawable(DisplayChannel *display, Drawable *drawable,
+                                         bool full_surface_frame)
 {
     RedDrawable *red_drawable = drawable->red_drawable.get();
 
@@ -1341,19 +1407,37 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
 
     draw_depend_on_me(display, drawable->surface);
 
+    /* the clients must have the drawables held back by the full surface
+     * video mode before reading the primary surface. This adds a drawable
+     * so has to be done before depending on the surface */
+    for (const auto dep : drawable->surface_deps) {
+        if (dep && dep->id == 0 && dep != drawable->surface) {
+            video_stream_full_surface_flush(display);
+            break;
+        }
+    }
+
     if (!handle_surface_deps(display, drawable)) {
         return;
     }
 
+    drawable->held_back = !full_surface_frame &&
+                          is_primary_surface(display, drawable->surface) &&
+                          video_stream_full_surface_add_damage(display, drawable);
+
     Ring *ring = &drawable->surface->current;
     int add_to_pipe;
     if (has_shadow(red_drawable)) {
         add_to_pipe = current_add_with_shadow(display, ring, drawable);
     } else {
-        drawable->streamable = drawable_can_stream(display, drawable);
+        drawable->streamable = !drawable->held_back && drawable_can_stream(display, drawable);
         add_to_pipe = current_add(display, ring, drawable);
     }
 
+    if (full_surface_frame) {
+        video_stream_full_surface_frame_added(display, drawable);
+    }
+
     if (add_to_pipe)
         pipes_add_drawable(display, drawable);
 
@@ -1375,7 +1459,50 @@ void display_channel_process_draw(DisplayChannel *display,
         return;
     }
 
-    display_channel_add_drawable(display, drawable);
+    display_channel_add_drawable(display, drawable, false);
+
+    drawable_unref(drawable);
+}
+
+/* Renders the primary surface and adds its content as a single drawable, a
+ * frame of the full surface video mode */
+void display_channel_add_full_surface_frame(DisplayChannel *display)
+{
+    RedSurface *surface = display->priv->surfaces[0];
+
+    if (!surface) {
+        return;
+    }
+
+    SpiceRect area;
+    area.left = 0;
+    area.top = 0;
+    area.right = surface->context.width;
+    area.bottom = surface->context.height;
+    display_channel_surface_draw(display, surface, &area);
+
+    auto red_drawable = red::make_shared<RedDrawable>();
+    red_drawable->surface_id = 0;
+    red_drawable->effect = QXL_EFFECT_OPAQUE;
+    red_drawable->type = QXL_DRAW_COPY;
+    red_drawable->bbox = area;
+    red_drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    for (auto &surface_id : red_drawable->surface_deps) {
+        surface_id = -1;
+    }
+    red_drawable->u.copy.src_bitmap = surface_image_new(display, surface, &area);
+    red_drawable->u.copy.src_area = area;
+    red_drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    red_drawable->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+
+    Drawable *drawable =
+        display_channel_get_drawable(display, QXL_EFFECT_OPAQUE, std::move(red_drawable),
+                                     ++display->priv->full_surface.frame_count);
+    if (!drawable) {
+        return;
+    }
+
+    display_channel_add_drawable(display, drawable, true);
 
     drawable_unref(drawable);
 }
@@ -1437,6 +1564,16 @@ void display_channel_free_glz_drawables_to_free(DisplayChannel *display)
     }
 }
 
+void display_channel_check_stalled_clients(DisplayChannel *display)
+{
+    DisplayChannelClient *dcc;
+    uint64_t now = spice_get_monotonic_time_ns();
+
+    FOREACH_DCC(display, dcc) {
+        dcc_check_stall(dcc, now);
+    }
+}
+
 void display_channel_free_glz_drawables(DisplayChannel *display)
 {
     DisplayChannelClient *dcc;
@@ -1506,37 +1643,90 @@ void display_channel_free_some(DisplayChannel *display)
     }
 }
 
-static Drawable* drawable_try_new(DisplayChannel *display)
-{
-    if (!display->priv->free_drawables)
-        return nullptr;
-
-    void *buf = display->priv->free_drawables->u.raw_drawable;
-    display->priv->free_drawables = display->priv->free_drawables->u.next;
-    display->priv->drawable_count++;
-
-    memset(buf, 0, sizeof(display->priv->free_drawables->u.raw_drawable));
-    return new(buf) Drawable();
-}
-
 static void drawable_free(DisplayChannel *display, Drawable *drawable)
 {
     drawable->~Drawable();
-    reinterpret_cast<_Drawable *>(drawable)->u.next = display->priv->free_drawables;
-    display->priv->free_drawables = reinterpret_cast<_Drawable *>(drawable);
+    drawables_pool_free(&display->priv->drawables, drawable);
     display->priv->drawable_count--;
 }
 
-// initialize Drawable memory pool
-static void drawables_init(DisplayChannel *display)
+// add a chunk of drawables to the pool
+static bool drawables_pool_grow(DrawablesPool *pool)
 {
-    _Drawable *curr = nullptr;
+    if (pool->allocated + DRAWABLES_CHUNK_SIZE > pool->max_drawables) {
+        return false;
+    }
 
-    for (auto& drawable : display->priv->drawables) {
+    auto chunk = g_new(DrawablesChunk, 1);
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    _Drawable *curr = pool->free_list;
+    for (auto& drawable : chunk->drawables) {
         drawable.u.next = curr;
         curr = &drawable;
     }
-    display->priv->free_drawables = curr;
+    pool->free_list = curr;
+    pool->allocated += DRAWABLES_CHUNK_SIZE;
+    return true;
+}
+
+void drawables_pool_init(DrawablesPool *pool, uint32_t soft_limit, uint32_t hard_limit)
+{
+    /* the pool grows in chunks, round the limits up */
+    hard_limit = CLAMP(hard_limit, 1, DRAWABLES_LIMIT_MAX);
+    soft_limit = CLAMP(soft_limit, 1, hard_limit);
+    pool->max_drawables = SPICE_ALIGN(hard_limit, DRAWABLES_CHUNK_SIZE);
+
+    while (pool->allocated < soft_limit) {
+        if (!drawables_pool_grow(pool)) {
+            break;
+        }
+    }
+}
+
+void drawables_pool_destroy(DrawablesPool *pool)
+{
+    while (pool->chunks) {
+        DrawablesChunk *chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        g_free(chunk);
+    }
+    pool->free_list = nullptr;
+    pool->allocated = 0;
+}
+
+void *drawables_pool_alloc(DrawablesPool *pool,
+                           drawables_pool_release_proc release, void *opaque)
+{
+    while (!pool->free_list) {
+        if (drawables_pool_grow(pool)) {
+            stat_inc_counter(pool->grow_counter, 1);
+            continue;
+        }
+        /* the pool reached its maximum size, release a drawable to make room */
+        if (!release(opaque)) {
+            return nullptr;
+        }
+        stat_inc_counter(pool->forced_free_counter, 1);
+    }
+
+    _Drawable *drawable = pool->free_list;
+    pool->free_list = drawable->u.next;
+    return drawable->u.raw_drawable;
+}
+
+void drawables_pool_free(DrawablesPool *pool, void *drawable)
+{
+    auto free_drawable = static_cast<_Drawable *>(drawable);
+    free_drawable->u.next = pool->free_list;
+    pool->free_list = free_drawable;
+}
+
+/* renders the oldest drawable to release it */
+static bool drawables_pool_release_oldest(void *opaque)
+{
+    return free_one_drawable(static_cast<DisplayChannel *>(opaque), FALSE);
 }
 
 /**
@@ -1547,12 +1737,15 @@ static void drawables_init(DisplayChannel *display)
 static Drawable *display_channel_drawable_try_new(DisplayChannel *display,
                                                   uint32_t process_commands_generation)
 {
-    Drawable *drawable;
-
-    while (!(drawable = drawable_try_new(display))) {
-        if (!free_one_drawable(display, FALSE))
-            return nullptr;
+    void *buf = drawables_pool_alloc(&display->priv->drawables,
+                                     drawables_pool_release_oldest, display);
+    if (!buf) {
+        return nullptr;
     }
+    display->priv->drawable_count++;
+
+    memset(buf, 0, sizeof(_Drawable));
+    Drawable *drawable = new(buf) Drawable();
 
     /* Pointer to the display from which the drawable is allocated.  This
      * pointer is safe to be retained as DisplayChannel lifespan is bigger than
@@ -2114,6 +2307,7 @@ display_channel_create_surface(DisplayChannel *display, uint32_t surface_id, uin
 
     // finish initialization
     ring_init(&surface->current);
+    tree_index_init(&surface->tree_index, width, height);
     ring_init(&surface->current_list);
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
@@ -2184,7 +2378,9 @@ DisplayChannel::DisplayChannel(RedsState *reds,
                                GArray *video_codecs,
                                uint32_t n_surfaces):
     CommonGraphicsChannel(reds, SPICE_CHANNEL_DISPLAY, qxl->id,
-                          RedChannel::MigrateAll|RedChannel::HandleAcks, core, dispatcher)
+                          RedChannel::MigrateAll|RedChannel::HandleAcks|
+                          RedChannel::CoalesceMessages|RedChannel::SendThread,
+                          core, dispatcher)
 {
     static const SpiceImageSurfacesOps image_surfaces_ops = {
         image_surfaces_get,
@@ -2203,10 +2399,15 @@ DisplayChannel::DisplayChannel(RedsState *reds,
     image_encoder_shared_init(&priv->encoder_shared_data);
 
     ring_init(&priv->current_list);
-    drawables_init(this);
+    drawables_pool_init(&priv->drawables, reds_get_drawables_soft_limit(reds),
+                        reds_get_drawables_hard_limit(reds));
     priv->image_surfaces.ops = &image_surfaces_ops;
 
-    image_cache_init(&priv->image_cache);
+    image_cache_init(&priv->image_cache, reds_get_image_cache_size(reds));
+    priv->stream_max_fps = reds_get_video_max_fps(reds, false);
+    priv->stream_low_bandwidth_max_fps = reds_get_video_max_fps(reds, true);
+    priv->full_surface.enabled = reds_get_full_surface_streaming(reds);
+    priv->stream_encoder_threads = reds_get_video_encoder_threads(reds);
     display_channel_init_video_streams(this);
 
     display_channel_set_video_codecs(this, video_codecs);
@@ -2223,12 +2424,36 @@ DisplayChannel::DisplayChannel(RedsState *reds,
                       "add_to_cache", TRUE);
     stat_init_counter(&priv->non_cache_counter, reds, stat,
                       "non_cache", TRUE);
+    stat_init_counter(&priv->shared_image_hits_counter, reds, stat,
+                      "shared_image_hits", TRUE);
+    stat_init_counter(&priv->shared_image_misses_counter, reds, stat,
+                      "shared_image_misses", TRUE);
+    stat_init_counter(&priv->drawables.grow_counter, reds, stat,
+                      "drawables_grow", TRUE);
+    stat_init_counter(&priv->drawables.forced_free_counter, reds, stat,
+                      "drawables_forced_free", TRUE);
+    stat_init_counter(&priv->image_cache.hits_counter, reds, stat,
+                      "image_cache_hits", TRUE);
+    stat_init_counter(&priv->image_cache.misses_counter, reds, stat,
+                      "image_cache_misses", TRUE);
+    stat_init_counter(&priv->image_cache.evictions_counter, reds, stat,
+                      "image_cache_evictions", TRUE);
+    stat_init_counter(&priv->glz_dict_hugepages_counter, reds, stat,
+                      "glz_dict_hugepages", TRUE);
+    stat_init_counter(&priv->glz_dict_hugepage_fallbacks_counter, reds, stat,
+                      "glz_dict_hugepage_fallbacks", TRUE);
+    stat_init_counter(&priv->pixmap_cache_lock_waits_counter, reds, stat,
+                      "pixmap_cache_lock_waits", TRUE);
+    stat_init_counter(&priv->pixmap_cache_lock_wait_us_counter, reds, stat,
+                      "pixmap_cache_lock_wait_us", TRUE);
 
     set_cap(SPICE_DISPLAY_CAP_MONITORS_CONFIG);
     set_cap(SPICE_DISPLAY_CAP_PREF_COMPRESSION);
     set_cap(SPICE_DISPLAY_CAP_PREF_VIDEO_CODEC_TYPE);
     set_cap(SPICE_DISPLAY_CAP_STREAM_REPORT);
 
+    set_ack_window_bytes(DISPLAY_ACK_WINDOW_MIN_BYTES, DISPLAY_ACK_WINDOW_MAX_BYTES);
+
     reds_register_channel(reds, this);
 }
 
@@ -2288,7 +2513,7 @@ void display_channel_process_surface_cmd(DisplayChannel *display,
     };
 }
 
-static void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc)
+void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc)
 {
     if (dcc_get_jpeg_state(dcc) == SPICE_WAN_COMPRESSION_AUTO) {
         display->priv->enable_jpeg = dcc_is_low_bandwidth(dcc);
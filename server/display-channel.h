@@ -76,6 +76,8 @@ struct Drawable {
     int last_gradual_frame;
     VideoStream *stream;
     int streamable;
+    /* not sent to the clients, see video_stream_full_surface_add_damage() */
+    bool held_back;
     BitmapGradualType copy_bitmap_graduality;
     std::array<DependItem, 3> depend_items;
 
@@ -116,9 +118,12 @@ void                       display_channel_set_video_codecs          (DisplayCha
 int                        display_channel_get_streams_timeout       (DisplayChannel *display);
 void                       display_channel_compress_stats_print      (DisplayChannel *display);
 void                       display_channel_compress_stats_reset      (DisplayChannel *display);
+void                       display_channel_update_compression        (DisplayChannel *display,
+                                                                      DisplayChannelClient *dcc);
 bool                       display_channel_wait_for_migrate_data     (DisplayChannel *display);
 void                       display_channel_flush_all_surfaces        (DisplayChannel *display);
 void                       display_channel_free_glz_drawables_to_free(DisplayChannel *display);
+void                       display_channel_check_stalled_clients     (DisplayChannel *display);
 void                       display_channel_free_glz_drawables        (DisplayChannel *display);
 void                       display_channel_destroy_surface_wait      (DisplayChannel *display,
                                                                       uint32_t surface_id);
@@ -22,6 +22,22 @@
 /** Maximum number of surfaces a guest can create */
 #define NUM_SURFACES 1024
 
+/** Default number of drawables allocated upfront by each display channel */
+#define NUM_DRAWABLES 1000
+
+/** Default maximum number of drawables of each display channel; when
+ * reached the oldest drawables are rendered to make room for new ones */
+#define MAX_DRAWABLES (NUM_DRAWABLES * 4)
+
+/** Highest drawables limit accepted by spice_server_set_drawables_limits */
+#define DRAWABLES_LIMIT_MAX (1024 * 1024)
+
+/** Default memory each display channel uses to keep decoded images */
+#define IMAGE_CACHE_DEFAULT_SIZE (16 * 1024 * 1024)
+
+/** Rows of the bands surface images are split in when sent to a client */
+#define SURFACE_IMAGE_BAND_HEIGHT 128
+
 /** Maximum number of streams created by spice-server */
 #define NUM_STREAMS 50
 
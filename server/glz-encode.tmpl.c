@@ -94,6 +94,29 @@
 #endif
 
 
+/*
+    Vectorized match extension, comparing GLZ_SIMD_BYTES bytes at a time:
+    SIMD_PIXELS        : number of whole pixels compared
+    SIMD_READ_PIXELS   : number of pixels (partially) read
+    SIMD_IGNORE_MASK   : bits of bytes not taken into account by SAME_PIXEL
+    SIMD_PREPARE(v)    : clear the bits not taken into account by SAME_PIXEL
+*/
+#if defined(GLZ_SIMD_BYTES) && (defined(LZ_RGB16) || defined(LZ_RGB24) || defined(LZ_RGB32))
+#define SIMD_MATCH
+#define SIMD_PIXELS (GLZ_SIMD_BYTES / sizeof(PIXEL))
+#define SIMD_READ_PIXELS ((GLZ_SIMD_BYTES + sizeof(PIXEL) - 1) / sizeof(PIXEL))
+#if defined(LZ_RGB16)
+#define SIMD_IGNORE_MASK 0u
+#define SIMD_PREPARE(v) GLZ_SIMD_AND_EPI16(v, 0x7fff)
+#elif defined(LZ_RGB24)
+#define SIMD_IGNORE_MASK (GLZ_SIMD_FULL_MASK & ~((1u << (SIMD_PIXELS * 3)) - 1))
+#define SIMD_PREPARE(v) (v)
+#else
+#define SIMD_IGNORE_MASK (GLZ_SIMD_FULL_MASK & 0x88888888u)
+#define SIMD_PREPARE(v) (v)
+#endif
+#endif
+
 #if  defined(LZ_RGB24) || defined(LZ_RGB32)
 #define ENCODE_PIXEL(e, pix) {encode(e, (pix).b); encode(e, (pix).g); encode(e, (pix).r);}
 #define MIN_REF_ENCODE_SIZE 2
@@ -121,6 +144,34 @@
     ((PIXEL_ID(src_pix_ptr,src_seg_ptr, pix_per_byte) - \
     PIXEL_ID(ref_pix_ptr, ref_seg_ptr, pix_per_byte)) / pix_per_byte)
 
+/* returns the end of the identical pixels starting at ip and ref */
+static inline const PIXEL *FNAME(match_extend)(const PIXEL *ip, const PIXEL *ip_limit,
+                                               const PIXEL *ref, const PIXEL *ref_limit)
+{
+#ifdef SIMD_MATCH
+    while ((ip + SIMD_READ_PIXELS <= ip_limit) && (ref + SIMD_READ_PIXELS <= ref_limit)) {
+        glz_simd_t ip_pixels = SIMD_PREPARE(GLZ_SIMD_LOAD(ip));
+        glz_simd_t ref_pixels = SIMD_PREPARE(GLZ_SIMD_LOAD(ref));
+        uint32_t mask = GLZ_SIMD_EQ_MASK(ip_pixels, ref_pixels) | SIMD_IGNORE_MASK;
+
+        if (mask != GLZ_SIMD_FULL_MASK) {
+            return ip + __builtin_ctz(~mask) / sizeof(PIXEL);
+        }
+        ip += SIMD_PIXELS;
+        ref += SIMD_PIXELS;
+    }
+#endif
+
+    while ((ip < ip_limit) && (ref < ref_limit)) {
+        if (!SAME_PIXEL(*ref, *ip)) {
+            break;
+        }
+        ref++;
+        ip++;
+    }
+    return ip;
+}
+
 /* returns the length of the match. 0 if no match.
   if image_distance = 0, pixel_distance is the distance between the matching pixels.
   Otherwise, it is the offset from the beginning of the referred image */
@@ -195,14 +246,7 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
 
 
     /* continue the match*/
-    while ((tmp_ip < ip_limit) && (tmp_ref < ref_limit)) {
-        if (!SAME_PIXEL(*tmp_ref, *tmp_ip)) {
-            break;
-        } else {
-            tmp_ref++;
-            tmp_ip++;
-        }
-    }
+    tmp_ip = FNAME(match_extend)(tmp_ip, ip_limit, tmp_ref, ref_limit);
 
 
     if ((tmp_ip - ip) > MAX_REF_ENCODE_SIZE) {
@@ -237,6 +281,9 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
     const PIXEL *ip_bound = (PIXEL *)(seg->lines_end) - BOUND_OFFSET;
     const PIXEL *ip_limit = (PIXEL *)(seg->lines_end) - LIMIT_OFFSET;
     int hval;
+    /* hash of the pixel following the last looked up one */
+    const PIXEL *next_ip = NULL;
+    int next_hval = 0;
     int copy = copied;
 #ifdef  LZ_PLT
     int pix_per_byte = PLT_PIXELS_PER_BYTE[encoder->cur_image.type];
@@ -299,7 +346,17 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
         }
 
         /* find potential match */
-        HASH_FUNC(hval, ip);
+        if (ip == next_ip) {
+            hval = next_hval;
+        } else {
+            HASH_FUNC(hval, ip);
+        }
+
+        /* the next pixel is looked up if this one ends up as a literal,
+           fetch its hash entry in advance (ip < ip_limit so it can be hashed) */
+        next_ip = ip + 1;
+        HASH_FUNC(next_hval, next_ip);
+        GLZ_PREFETCH(&encoder->dict->htab[next_hval]);
 
 #ifdef CHAINED_HASH
         for (hash_id = 0; hash_id < HASH_CHAIN_SIZE; hash_id++) {
@@ -525,3 +582,8 @@ static void FNAME(compress)(Encoder *encoder)
 #undef LZ_RGB32
 #undef MIN_REF_ENCODE_SIZE
 #undef MAX_REF_ENCODE_SIZE
+#undef SIMD_MATCH
+#undef SIMD_PIXELS
+#undef SIMD_READ_PIXELS
+#undef SIMD_IGNORE_MASK
+#undef SIMD_PREPARE
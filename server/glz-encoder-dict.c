@@ -19,6 +19,11 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "glz-encoder.h"
 #include "glz-encoder-dict.h"
@@ -26,6 +31,115 @@
 
 static void glz_enc_dictionary_reset(GlzEncDictContext *opaque_dict, GlzEncoderUsrContext *usr);
 
+#define GLZ_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define GLZ_MPOL_PREFERRED 1
+
+#ifdef __linux__
+/* Prefer the NUMA node the calling thread is running on. The dictionary is
+   created by the display worker thread, which is also the one encoding. */
+static void glz_dictionary_mem_bind_local(void *ptr, size_t size)
+{
+#if defined(SYS_mbind) && defined(SYS_getcpu)
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < sizeof(unsigned long) * 8) {
+        unsigned long nodemask = 1UL << node;
+        // best effort, the pages are first touched by this thread anyway
+        syscall(SYS_mbind, ptr, size, GLZ_MPOL_PREFERRED, &nodemask,
+                sizeof(nodemask) * 8 + 1, 0);
+    }
+#endif
+}
+
+/* Whether the areas advised with MADV_HUGEPAGE can get transparent hugepages.
+   The advice is accepted even when they are disabled with "never". */
+static bool glz_dictionary_thp_enabled(void)
+{
+    char buf[64];
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    bool enabled;
+
+    if (!f) {
+        return FALSE;
+    }
+    enabled = fgets(buf, sizeof(buf), f) != NULL && strstr(buf, "[never]") == NULL;
+    fclose(f);
+    return enabled;
+}
+
+/* Map the area with reserved hugepages if there are any, otherwise ask for
+   transparent hugepages. Returns NULL if the mapping failed. */
+static void *glz_dictionary_mem_map_huge(size_t size, bool *huge)
+{
+    void *ptr;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    // explicitly 2MB pages, GLZ_HUGEPAGE_SIZE is used for the mapping size
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (ptr != MAP_FAILED) {
+        *huge = TRUE;
+        return ptr;
+    }
+#endif
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    *huge = madvise(ptr, size, MADV_HUGEPAGE) == 0 && glz_dictionary_thp_enabled();
+#else
+    *huge = FALSE;
+#endif
+    return ptr;
+}
+#endif
+
+/* Allocate an area of the dictionary. Areas of at least a hugepage are mapped
+   with hugepages if the dictionary was created with GLZ_DICT_ALLOC_HUGEPAGES,
+   falling back to the usr allocator. */
+static bool glz_dictionary_mem_alloc(SharedDictionary *dict, GlzDictMem *mem, size_t size)
+{
+    mem->size = 0;
+    mem->huge = FALSE;
+
+#ifdef __linux__
+    if ((dict->alloc_flags & GLZ_DICT_ALLOC_HUGEPAGES) && size >= GLZ_HUGEPAGE_SIZE) {
+        size_t map_size = (size + GLZ_HUGEPAGE_SIZE - 1) & ~((size_t)GLZ_HUGEPAGE_SIZE - 1);
+
+        mem->ptr = glz_dictionary_mem_map_huge(map_size, &mem->huge);
+        if (mem->ptr) {
+            mem->size = map_size;
+            glz_dictionary_mem_bind_local(mem->ptr, map_size);
+            return TRUE;
+        }
+        dict->cur_usr->warn(dict->cur_usr, "failed mapping dictionary memory, "
+                            "not using hugepages\n");
+    }
+#endif
+
+    mem->ptr = dict->cur_usr->malloc(dict->cur_usr, size);
+    return mem->ptr != NULL;
+}
+
+static void glz_dictionary_mem_free(SharedDictionary *dict, GlzDictMem *mem)
+{
+    if (!mem->ptr) {
+        return;
+    }
+#ifdef __linux__
+    if (mem->size) {
+        munmap(mem->ptr, mem->size);
+    } else
+#endif
+    {
+        dict->cur_usr->free(dict->cur_usr, mem->ptr);
+    }
+    mem->ptr = NULL;
+    mem->size = 0;
+    mem->huge = FALSE;
+}
+
 /* turning all used images to free ones. If they are alive, calling the free_image callback for
    each one */
 static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
@@ -53,12 +167,11 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     }
 
     dict->window.size_limit = size;
-    dict->window.segs = (WindowImageSegment *)(
-            dict->cur_usr->malloc(dict->cur_usr, sizeof(WindowImageSegment) * INIT_IMAGE_SEGS_NUM));
-
-    if (!dict->window.segs) {
+    if (!glz_dictionary_mem_alloc(dict, &dict->window.segs_mem,
+                                  sizeof(WindowImageSegment) * INIT_IMAGE_SEGS_NUM)) {
         return FALSE;
     }
+    dict->window.segs = (WindowImageSegment *)dict->window.segs_mem.ptr;
 
     dict->window.segs_quota = INIT_IMAGE_SEGS_NUM;
 
@@ -66,7 +179,8 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
                                                             sizeof(uint32_t) * dict->max_encoders);
 
     if (!dict->window.encoders_heads) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
+        glz_dictionary_mem_free(dict, &dict->window.segs_mem);
+        dict->window.segs = NULL;
         return FALSE;
     }
 
@@ -121,10 +235,8 @@ static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
 {
     __glz_dictionary_window_reset_images(dict);
 
-    if (dict->window.segs) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-        dict->window.segs = NULL;
-    }
+    glz_dictionary_mem_free(dict, &dict->window.segs_mem);
+    dict->window.segs = NULL;
 
     while (dict->window.free_images) {
         WindowImage *tmp = dict->window.free_images;
@@ -146,7 +258,7 @@ static inline void glz_dictionary_window_kill_image(SharedDictionary *dict, Wind
 }
 
 GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoders,
-                                             GlzEncoderUsrContext *usr)
+                                             uint32_t alloc_flags, GlzEncoderUsrContext *usr)
 {
     SharedDictionary *dict;
 
@@ -158,18 +270,27 @@ GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoder
     dict->cur_usr = usr;
     dict->last_image_id = 0;
     dict->max_encoders = max_encoders;
-
-    pthread_mutex_init(&dict->lock, NULL);
-    pthread_rwlock_init(&dict->rw_alloc_lock, NULL);
+    dict->alloc_flags = alloc_flags;
 
     dict->window.encoders_heads = NULL;
 
+    if (!glz_dictionary_mem_alloc(dict, &dict->htab_mem,
+                                  sizeof(HashEntry) * HASH_SIZE * HASH_CHAIN_SIZE)) {
+        dict->cur_usr->free(usr, dict);
+        return NULL;
+    }
+    dict->htab = dict->htab_mem.ptr;
+
     // alloc window fields and reset
     if (!glz_dictionary_window_create(dict, size)) {
+        glz_dictionary_mem_free(dict, &dict->htab_mem);
         dict->cur_usr->free(usr, dict);
         return NULL;
     }
 
+    pthread_mutex_init(&dict->lock, NULL);
+    pthread_rwlock_init(&dict->rw_alloc_lock, NULL);
+
     // reset window and hash
     glz_enc_dictionary_reset((GlzEncDictContext *)dict, usr);
 
@@ -190,13 +311,13 @@ void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
 }
 
 GlzEncDictContext *glz_enc_dictionary_restore(GlzEncDictRestoreData *restore_data,
-                                              GlzEncoderUsrContext *usr)
+                                              uint32_t alloc_flags, GlzEncoderUsrContext *usr)
 {
     if (!restore_data) {
         return NULL;
     }
     SharedDictionary *ret = (SharedDictionary *)glz_enc_dictionary_create(
-            restore_data->size, restore_data->max_encoders, usr);
+            restore_data->size, restore_data->max_encoders, alloc_flags, usr);
     if (!ret) {
         return NULL;
     }
@@ -227,6 +348,9 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
     dict->cur_usr = usr;
     glz_dictionary_window_destroy(dict);
 
+    glz_dictionary_mem_free(dict, &dict->htab_mem);
+    dict->htab = NULL;
+
     pthread_mutex_destroy(&dict->lock);
     pthread_rwlock_destroy(&dict->rw_alloc_lock);
 
@@ -243,6 +367,26 @@ uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *opaque_dict)
     return dict->window.size_limit;
 }
 
+size_t glz_enc_dictionary_get_hugepage_bytes(GlzEncDictContext *opaque_dict)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    size_t bytes = 0;
+
+    if (!opaque_dict) {
+        return 0;
+    }
+    if (dict->htab_mem.huge) {
+        bytes += dict->htab_mem.size;
+    }
+    // segs may be reallocated concurrently by an encoder
+    pthread_rwlock_rdlock(&dict->rw_alloc_lock);
+    if (dict->window.segs_mem.huge) {
+        bytes += dict->window.segs_mem.size;
+    }
+    pthread_rwlock_unlock(&dict->rw_alloc_lock);
+    return bytes;
+}
+
 /* doesn't call the remove image callback */
 void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
                                      GlzEncDictImageContext *opaque_image,
@@ -272,6 +416,7 @@ static inline int __get_pixels_num(LzImageType image_type, unsigned int num_line
 static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
 {
     WindowImageSegment *new_segs;
+    GlzDictMem new_segs_mem;
     uint32_t new_quota = (MAX_IMAGE_SEGS_NUM < (dict->window.segs_quota * 2)) ?
         MAX_IMAGE_SEGS_NUM : (dict->window.segs_quota * 2);
     WindowImageSegment *seg;
@@ -283,13 +428,11 @@ static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
         dict->cur_usr->error(dict->cur_usr, "overflow in image segments window\n");
     }
 
-    new_segs = (WindowImageSegment*)dict->cur_usr->malloc(
-            dict->cur_usr, sizeof(WindowImageSegment) * new_quota);
-
-    if (!new_segs) {
+    if (!glz_dictionary_mem_alloc(dict, &new_segs_mem, sizeof(WindowImageSegment) * new_quota)) {
         dict->cur_usr->error(dict->cur_usr,
                              "realloc of dictionary window failed\n");
     }
+    new_segs = (WindowImageSegment*)new_segs_mem.ptr;
 
     memcpy(new_segs, dict->window.segs,
            sizeof(WindowImageSegment) * dict->window.segs_quota);
@@ -306,7 +449,8 @@ static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
     new_segs[new_quota - 1].next = dict->window.free_segs_head;
     dict->window.free_segs_head = dict->window.segs_quota;
 
-    dict->cur_usr->free(dict->cur_usr, dict->window.segs);
+    glz_dictionary_mem_free(dict, &dict->window.segs_mem);
+    dict->window.segs_mem = new_segs_mem;
     dict->window.segs = new_segs;
     dict->window.segs_quota = new_quota;
 
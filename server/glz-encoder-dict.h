@@ -18,6 +18,7 @@
 #ifndef GLZ_ENCODER_DICT_H_
 #define GLZ_ENCODER_DICT_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <spice/macros.h>
 
@@ -42,17 +43,26 @@ typedef struct GlzEncDictRestoreData {
     uint64_t last_image_id;
 } GlzEncDictRestoreData;
 
+/* Back the hash table and the segments with hugepages, placed on the NUMA node
+   of the creating thread. Falls back to regular memory if it's not possible. */
+#define GLZ_DICT_ALLOC_HUGEPAGES (1 << 0)
+
 /* size        : maximal number of pixels occupying the window
    max_encoders: maximal number of encoders that use the dictionary
+   alloc_flags : GLZ_DICT_ALLOC_* flags
    usr         : callbacks */
 GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoders,
-                                             GlzEncoderUsrContext *usr);
+                                             uint32_t alloc_flags, GlzEncoderUsrContext *usr);
 
 void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrContext *usr);
 
 /* returns the window capacity in pixels */
 uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *);
 
+/* returns the number of bytes of the dictionary mapped with reserved hugepages or
+   with transparent hugepages while the kernel has them enabled */
+size_t glz_enc_dictionary_get_hugepage_bytes(GlzEncDictContext *);
+
 /* returns the current state of the dictionary.
    NOTE - you should use it only when no encoder uses the dictionary. */
 void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
@@ -61,7 +71,7 @@ void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
 
 /* creates a dictionary and initialized it by use the given info */
 GlzEncDictContext *glz_enc_dictionary_restore(GlzEncDictRestoreData *restore_data,
-                                              GlzEncoderUsrContext *usr);
+                                              uint32_t alloc_flags, GlzEncoderUsrContext *usr);
 
 /* image: the context returned by the encoder when the image was encoded.
    NOTE - you should use this routine only when no encoder uses the dictionary.*/
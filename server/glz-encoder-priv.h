@@ -19,6 +19,8 @@
 #define GLZ_ENCODER_PRIV_H_
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <common/lz_common.h>
 
 #include "glz-encoder-dict.h"
@@ -47,6 +49,13 @@ typedef struct HashEntry HashEntry;
 
 typedef struct SharedDictionary SharedDictionary;
 
+/* Memory area of the dictionary, possibly mapped with hugepages */
+typedef struct GlzDictMem {
+    void *ptr;
+    size_t size;            // mapped size, 0 if allocated with the usr allocator
+    bool huge;
+} GlzDictMem;
+
 struct WindowImage {
     uint64_t id;
     LzImageType type;
@@ -89,6 +98,7 @@ struct SharedDictionary {
            we save space in the hash entries (32bit instead of 64bit) */
         WindowImageSegment  *segs;
         uint32_t segs_quota;
+        GlzDictMem segs_mem;
 
         /* The window is manged as a linked list rather than as a cyclic
            array in order to keep the indices of the segments consistent
@@ -115,16 +125,19 @@ struct SharedDictionary {
 
     /* Concurrency issues: the reading/writing of each entry field should be atomic.
        It is allowed that the reading/writing of the whole entry won't be atomic,
-       since before we access a reference we check its validity*/
+       since before we access a reference we check its validity.
+       The table is allocated separately so it can be placed in hugepages */
 #ifdef CHAINED_HASH
-    HashEntry htab[HASH_SIZE][HASH_CHAIN_SIZE];
+    HashEntry (*htab)[HASH_CHAIN_SIZE];
     uint8_t htab_counter[HASH_SIZE];  //cyclic counter for the next entry in a chain to be assigned
 #else
-    HashEntry htab[HASH_SIZE];
+    HashEntry *htab;
 #endif
+    GlzDictMem htab_mem;
 
     uint64_t last_image_id;
     uint32_t max_encoders;
+    uint32_t alloc_flags;                // GLZ_DICT_ALLOC_* flags
     pthread_mutex_t lock;
     pthread_rwlock_t rw_alloc_lock;
     GlzEncoderUsrContext       *cur_usr; // each encoder has other context.
@@ -165,6 +165,36 @@ void glz_encoder_destroy(GlzEncoderContext *opaque_encoder)
 #define LZ_UNEXPECT_CONDITIONAL(c) (c)
 #endif
 
+#if defined(__GNUC__)
+#define GLZ_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define GLZ_PREFETCH(addr)
+#endif
+
+/*
+ * Vector helpers used to extend matches several pixels at a time.
+ * GLZ_SIMD_EQ_MASK returns a bit per byte, set if the bytes are equal.
+ * GLZ_ENCODER_NO_SIMD keeps the scalar loop, the tests compare both.
+ */
+#if defined(GLZ_ENCODER_NO_SIMD)
+#elif defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define GLZ_SIMD_BYTES 32
+#define GLZ_SIMD_FULL_MASK 0xffffffffu
+typedef __m256i glz_simd_t;
+#define GLZ_SIMD_LOAD(ptr) _mm256_loadu_si256((const __m256i *)(ptr))
+#define GLZ_SIMD_AND_EPI16(v, mask) _mm256_and_si256(v, _mm256_set1_epi16(mask))
+#define GLZ_SIMD_EQ_MASK(a, b) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define GLZ_SIMD_BYTES 16
+#define GLZ_SIMD_FULL_MASK 0xffffu
+typedef __m128i glz_simd_t;
+#define GLZ_SIMD_LOAD(ptr) _mm_loadu_si128((const __m128i *)(ptr))
+#define GLZ_SIMD_AND_EPI16(v, mask) _mm_and_si128(v, _mm_set1_epi16(mask))
+#define GLZ_SIMD_EQ_MASK(a, b) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)))
+#endif
+
 
 typedef uint8_t BYTE;
 
@@ -78,6 +78,26 @@ typedef struct {
     uint64_t duration;
 } SpiceGstFrameInformation;
 
+/* A frame submitted with encode_frame_async() */
+typedef struct {
+    video_encoder_done_t done;
+    gpointer done_opaque;
+    uint32_t mm_time;
+    /* When the frame was pushed, to compute the encoding time */
+    uint64_t start;
+
+    /* The virtual buffer space reserved for the frame until its size
+     * is known.
+     */
+    uint32_t reserved;
+
+    /* Set when the pipeline is done with the frame. The size is 0 if the
+     * encoding failed.
+     */
+    uint64_t duration;
+    uint32_t size;
+} SpiceGstAsyncFrame;
+
 typedef enum SpiceGstBitRateStatus {
     SPICE_GST_BITRATE_DECREASING,
     SPICE_GST_BITRATE_INCREASING,
@@ -137,6 +157,22 @@ typedef struct SpiceGstEncoder {
     pthread_cond_t outbuf_cond;
     VideoBuffer *outbuf;
 
+    /* The frames submitted with encode_frame_async() in the pipeline order,
+     * and the ones the pipeline is done with that the main context still has
+     * to account for. Both are protected by outbuf_mutex.
+     */
+    GQueue async_frames;
+    GQueue done_frames;
+
+    /* The number of frames in both queues. Only used by the main context. */
+    uint32_t frames_in_flight;
+
+    /* How many frames may be in the pipeline at any given time. The frame
+     * statistics are only updated once a frame is out of the pipeline, so
+     * keep this small.
+     */
+#   define SPICE_GST_MAX_FRAMES_IN_FLIGHT 2
+
     /* The video bit rate. */
     uint64_t video_bit_rate;
 
@@ -826,6 +862,37 @@ static void set_appsrc_caps(SpiceGstEncoder *encoder)
     gst_app_src_set_caps(encoder->appsrc, encoder->src_caps);
 }
 
+/* Hands the pipeline output over to the oldest frame submitted with
+ * encode_frame_async(), returns FALSE if there is none.
+ */
+static gboolean complete_async_frame(SpiceGstEncoder *encoder,
+                                     SpiceGstVideoBuffer *outbuf)
+{
+    pthread_mutex_lock(&encoder->outbuf_mutex);
+    SpiceGstAsyncFrame *frame = g_queue_pop_head(&encoder->async_frames);
+    if (!frame) {
+        pthread_mutex_unlock(&encoder->outbuf_mutex);
+        return FALSE;
+    }
+    gboolean encoded = outbuf->base.data && outbuf->base.size;
+    frame->duration = spice_get_monotonic_time_ns() - frame->start;
+    frame->size = encoded ? outbuf->base.size : 0;
+
+    /* The main context owns the frame once it is in done_frames */
+    video_encoder_done_t done = frame->done;
+    gpointer done_opaque = frame->done_opaque;
+    g_queue_push_tail(&encoder->done_frames, frame);
+    pthread_mutex_unlock(&encoder->outbuf_mutex);
+
+    if (encoded) {
+        done(done_opaque, VIDEO_ENCODER_FRAME_ENCODE_DONE, &outbuf->base);
+    } else {
+        outbuf->base.free(&outbuf->base);
+        done(done_opaque, VIDEO_ENCODER_FRAME_UNSUPPORTED, NULL);
+    }
+    return TRUE;
+}
+
 static GstBusSyncReply handle_pipeline_message(GstBus *bus, GstMessage *msg, gpointer video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*) video_encoder;
@@ -842,6 +909,10 @@ static GstBusSyncReply handle_pipeline_message(GstBus *bus, GstMessage *msg, gpo
         }
         g_clear_error(&err);
 
+        if (complete_async_frame(encoder, create_gst_video_buffer())) {
+            return GST_BUS_PASS;
+        }
+
         /* Unblock the main thread */
         pthread_mutex_lock(&encoder->outbuf_mutex);
         encoder->outbuf = (VideoBuffer*)create_gst_video_buffer();
@@ -875,6 +946,10 @@ static GstFlowReturn new_sample(GstAppSink *gstappsink, gpointer video_encoder)
     }
 #endif
 
+    if (complete_async_frame(encoder, outbuf)) {
+        return GST_FLOW_OK;
+    }
+
     /* Notify the main thread that the output buffer is ready */
     pthread_mutex_lock(&encoder->outbuf_mutex);
     encoder->outbuf = (VideoBuffer*)outbuf;
@@ -1450,37 +1525,14 @@ pull_compressed_buffer(SpiceGstEncoder *encoder, VideoBuffer **outbuf)
 }
 
 
-/* ---------- VideoEncoder's public API ---------- */
-
-static void spice_gst_encoder_destroy(VideoEncoder *video_encoder)
-{
-    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-
-    free_pipeline(encoder);
-    pthread_mutex_destroy(&encoder->outbuf_mutex);
-    pthread_cond_destroy(&encoder->outbuf_cond);
-
-    /* Unref any lingering bitmap opaque structures from past frames */
-    clear_zero_copy_queue(encoder, TRUE);
-
-    g_free(encoder);
-}
-
-static VideoEncodeResults
-spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
-                               uint32_t frame_mm_time,
-                               const SpiceBitmap *bitmap,
-                               const SpiceRect *src, int top_down,
-                               gpointer bitmap_opaque,
-                               VideoBuffer **outbuf)
+/* A helper for the encode_frame methods, checks whether the frame can and
+ * should be encoded.
+ */
+static VideoEncodeResults check_frame(SpiceGstEncoder *encoder,
+                                      uint32_t frame_mm_time,
+                                      const SpiceBitmap *bitmap,
+                                      const SpiceRect *src)
 {
-    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    g_return_val_if_fail(outbuf != NULL, VIDEO_ENCODER_FRAME_UNSUPPORTED);
-    *outbuf = NULL;
-
-    /* Unref the last frame's bitmap_opaque structures if any */
-    clear_zero_copy_queue(encoder, FALSE);
-
     uint32_t width = src->right - src->left;
     uint32_t height = src->bottom - src->top;
     if (width != encoder->width || height != encoder->height ||
@@ -1522,11 +1574,121 @@ spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    if (handle_server_drops(encoder, frame_mm_time) ||
+    /* The server drops are accounted for as a 0 byte frame which must come
+     * after the frames still in the pipeline.
+     */
+    if ((encoder->frames_in_flight == 0 && handle_server_drops(encoder, frame_mm_time)) ||
         frame_mm_time < encoder->next_frame_mm_time) {
         /* Drop the frame to limit the outgoing bit rate. */
         return VIDEO_ENCODER_FRAME_DROP;
     }
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+/* A helper for the encode_frame methods, updates the statistics and the
+ * rate control once a frame has been encoded.
+ */
+static void add_encoded_frame(SpiceGstEncoder *encoder, uint32_t frame_mm_time,
+                              uint64_t duration, uint32_t size)
+{
+    uint32_t last_mm_time = get_last_frame_mm_time(encoder);
+    add_frame(encoder, frame_mm_time, duration, size);
+
+    int32_t refill = encoder->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
+    encoder->vbuffer_free = MIN(encoder->vbuffer_free + refill,
+                                encoder->vbuffer_size) - size;
+
+    server_increase_bit_rate(encoder, frame_mm_time);
+    update_next_frame_mm_time(encoder);
+}
+
+/* Moves the frames that will never come out of the pipeline to done_frames,
+ * notifying the caller that they could not be encoded.
+ */
+static void flush_async_frames(SpiceGstEncoder *encoder)
+{
+    SpiceGstAsyncFrame *frame;
+
+    pthread_mutex_lock(&encoder->outbuf_mutex);
+    while ((frame = g_queue_pop_head(&encoder->async_frames))) {
+        g_queue_push_tail(&encoder->done_frames, frame);
+        frame->done(frame->done_opaque, VIDEO_ENCODER_FRAME_UNSUPPORTED, NULL);
+    }
+    pthread_mutex_unlock(&encoder->outbuf_mutex);
+}
+
+/* Accounts for the frames the pipeline is done with. This must be called
+ * from the main context.
+ */
+static void process_done_frames(SpiceGstEncoder *encoder)
+{
+    while (TRUE) {
+        pthread_mutex_lock(&encoder->outbuf_mutex);
+        SpiceGstAsyncFrame *frame = g_queue_pop_head(&encoder->done_frames);
+        pthread_mutex_unlock(&encoder->outbuf_mutex);
+        if (!frame) {
+            break;
+        }
+
+        encoder->frames_in_flight--;
+        encoder->vbuffer_free += frame->reserved;
+        if (frame->size) {
+            add_encoded_frame(encoder, frame->mm_time, frame->duration, frame->size);
+        } else if (encoder->pipeline) {
+            /* Same as in spice_gst_encoder_encode_frame(), the other frames
+             * are stuck in the pipeline too.
+             */
+            free_pipeline(encoder);
+            flush_async_frames(encoder);
+            encoder->errors++;
+        }
+        g_free(frame);
+    }
+}
+
+
+/* ---------- VideoEncoder's public API ---------- */
+
+static void spice_gst_encoder_destroy(VideoEncoder *video_encoder)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
+
+    free_pipeline(encoder);
+
+    /* Drop the frames still being encoded */
+    flush_async_frames(encoder);
+    while (!g_queue_is_empty(&encoder->done_frames)) {
+        g_free(g_queue_pop_head(&encoder->done_frames));
+    }
+
+    pthread_mutex_destroy(&encoder->outbuf_mutex);
+    pthread_cond_destroy(&encoder->outbuf_cond);
+
+    /* Unref any lingering bitmap opaque structures from past frames */
+    clear_zero_copy_queue(encoder, TRUE);
+
+    g_free(encoder);
+}
+
+static VideoEncodeResults
+spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
+                               uint32_t frame_mm_time,
+                               const SpiceBitmap *bitmap,
+                               const SpiceRect *src, int top_down,
+                               gpointer bitmap_opaque,
+                               VideoBuffer **outbuf)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
+    g_return_val_if_fail(outbuf != NULL, VIDEO_ENCODER_FRAME_UNSUPPORTED);
+    *outbuf = NULL;
+
+    /* Unref the last frame's bitmap_opaque structures if any */
+    clear_zero_copy_queue(encoder, FALSE);
+
+    VideoEncodeResults rc = check_frame(encoder, frame_mm_time, bitmap, src);
+    if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        return rc;
+    }
 
     if (!configure_pipeline(encoder)) {
         encoder->errors++;
@@ -1534,7 +1696,7 @@ spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
     }
 
     uint64_t start = spice_get_monotonic_time_ns();
-    VideoEncodeResults rc = push_raw_frame(encoder, bitmap, src, top_down, bitmap_opaque);
+    rc = push_raw_frame(encoder, bitmap, src, top_down, bitmap_opaque);
     if (rc == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
         rc = pull_compressed_buffer(encoder, outbuf);
         if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
@@ -1554,18 +1716,75 @@ spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
     if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
         return rc;
     }
-    uint32_t last_mm_time = get_last_frame_mm_time(encoder);
-    add_frame(encoder, frame_mm_time, spice_get_monotonic_time_ns() - start,
-              (*outbuf)->size);
+    add_encoded_frame(encoder, frame_mm_time, spice_get_monotonic_time_ns() - start,
+                      (*outbuf)->size);
 
-    int32_t refill = encoder->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
-    encoder->vbuffer_free = MIN(encoder->vbuffer_free + refill,
-                                encoder->vbuffer_size) - (*outbuf)->size;
+    return rc;
+}
 
-    server_increase_bit_rate(encoder, frame_mm_time);
-    update_next_frame_mm_time(encoder);
+static VideoEncodeResults
+spice_gst_encoder_encode_frame_async(VideoEncoder *video_encoder,
+                                     uint32_t frame_mm_time,
+                                     const SpiceBitmap *bitmap,
+                                     const SpiceRect *src, int top_down,
+                                     gpointer bitmap_opaque,
+                                     video_encoder_done_t done,
+                                     gpointer done_opaque)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
 
-    return rc;
+    /* Unref the past frames' bitmap_opaque structures if any */
+    clear_zero_copy_queue(encoder, FALSE);
+    process_done_frames(encoder);
+
+    VideoEncodeResults rc = check_frame(encoder, frame_mm_time, bitmap, src);
+    if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        return rc;
+    }
+
+    /* Reconfiguring the pipeline requires stopping it which would lose the
+     * frames it contains. Also the frames in flight have only been
+     * accounted for with the average frame size so don't go over the
+     * virtual buffer based on that estimate.
+     */
+    if (encoder->frames_in_flight &&
+        (encoder->frames_in_flight >= SPICE_GST_MAX_FRAMES_IN_FLIGHT ||
+         encoder->set_pipeline || encoder->vbuffer_free < 0)) {
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
+    if (!configure_pipeline(encoder)) {
+        encoder->errors++;
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    SpiceGstAsyncFrame *frame = g_new0(SpiceGstAsyncFrame, 1);
+    frame->done = done;
+    frame->done_opaque = done_opaque;
+    frame->mm_time = frame_mm_time;
+    frame->reserved = get_average_frame_size(encoder);
+    frame->start = spice_get_monotonic_time_ns();
+
+    /* The pipeline may be done with the frame before push_raw_frame()
+     * returns so queue it first.
+     */
+    pthread_mutex_lock(&encoder->outbuf_mutex);
+    g_queue_push_tail(&encoder->async_frames, frame);
+    pthread_mutex_unlock(&encoder->outbuf_mutex);
+
+    rc = push_raw_frame(encoder, bitmap, src, top_down, bitmap_opaque);
+    if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        pthread_mutex_lock(&encoder->outbuf_mutex);
+        g_queue_remove(&encoder->async_frames, frame);
+        pthread_mutex_unlock(&encoder->outbuf_mutex);
+        g_free(frame);
+        clear_zero_copy_queue(encoder, FALSE);
+        return rc;
+    }
+
+    encoder->frames_in_flight++;
+    encoder->vbuffer_free -= frame->reserved;
+    return VIDEO_ENCODER_FRAME_PENDING;
 }
 
 static void spice_gst_encoder_client_stream_report(VideoEncoder *video_encoder,
@@ -1577,6 +1796,7 @@ static void spice_gst_encoder_client_stream_report(VideoEncoder *video_encoder,
                                              uint32_t audio_margin)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
+    process_done_frames(encoder);
     encoder->has_client_reports = TRUE;
 
     encoder->max_video_margin = MAX(encoder->max_video_margin, video_margin);
@@ -1678,6 +1898,7 @@ static void spice_gst_encoder_client_stream_report(VideoEncoder *video_encoder,
 static void spice_gst_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
+    process_done_frames(encoder);
     if (encoder->server_drops == 0) {
         spice_debug("server report: getting frame drops...");
     }
@@ -1697,6 +1918,7 @@ static void spice_gst_encoder_get_stats(VideoEncoder *video_encoder,
     uint64_t raw_bit_rate = encoder->width * encoder->height * encoder->format->bpp * get_source_fps(encoder);
 
     spice_return_if_fail(stats != NULL);
+    process_done_frames(encoder);
     stats->starting_bit_rate = encoder->starting_bit_rate;
     stats->cur_bit_rate = get_effective_bit_rate(encoder);
 
@@ -1758,6 +1980,7 @@ VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
     SpiceGstEncoder *encoder = g_new0(SpiceGstEncoder, 1);
     encoder->base.destroy = spice_gst_encoder_destroy;
     encoder->base.encode_frame = spice_gst_encoder_encode_frame;
+    encoder->base.encode_frame_async = spice_gst_encoder_encode_frame_async;
     encoder->base.client_stream_report = spice_gst_encoder_client_stream_report;
     encoder->base.notify_server_frame_drop = spice_gst_encoder_notify_server_frame_drop;
     encoder->base.get_bit_rate = spice_gst_encoder_get_bit_rate;
@@ -0,0 +1,134 @@
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file id-hash-table.hpp
+ * Hash of items by their 64 bit id, shared by the image and pixmap caches.
+ *
+ * Open addressing with linear probing, kept at most half full. Removal
+ * moves back the following items of the probe sequence so no tombstone
+ * is needed. The hash is embedded in the cache structure which must
+ * provide these fields:
+ *
+ * @code{.cpp}
+ * T **hash_table;      // allocated with g_new0()
+ * uint32_t hash_size;  // power of 2
+ * uint32_t num_items;
+ * @endcode
+ *
+ * and T must have an "uint64_t id" field.
+ */
+#pragma once
+
+#include <type_traits>
+#include <glib.h>
+#include <common/log.h>
+
+#include "push-visibility.h"
+
+namespace red {
+
+/* pointer to an item of the hash of Cache */
+template <typename Cache>
+using id_hash_item_t = typename std::remove_pointer<decltype(Cache::hash_table)>::type;
+
+template <typename Cache>
+inline uint32_t id_hash_home(const Cache *cache, uint64_t id)
+{
+    // ids are often sequential, spread them over the table
+    return ((id * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (cache->hash_size - 1);
+}
+
+/* returns the slot holding the item with the given id, or the empty slot
+   where it would be inserted */
+template <typename Cache>
+inline id_hash_item_t<Cache> *id_hash_find_slot(Cache *cache, uint64_t id)
+{
+    const uint32_t mask = cache->hash_size - 1;
+    uint32_t pos = id_hash_home(cache, id);
+
+    while (cache->hash_table[pos] && cache->hash_table[pos]->id != id) {
+        pos = (pos + 1) & mask;
+    }
+    return &cache->hash_table[pos];
+}
+
+template <typename Cache>
+inline id_hash_item_t<Cache> id_hash_find(Cache *cache, uint64_t id)
+{
+    return *id_hash_find_slot(cache, id);
+}
+
+template <typename Cache>
+void id_hash_grow(Cache *cache)
+{
+    id_hash_item_t<Cache> *old_table = cache->hash_table;
+    uint32_t old_size = cache->hash_size;
+
+    cache->hash_size = old_size * 2;
+    cache->hash_table = g_new0(id_hash_item_t<Cache>, cache->hash_size);
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old_table[i]) {
+            *id_hash_find_slot(cache, old_table[i]->id) = old_table[i];
+        }
+    }
+    g_free(old_table);
+}
+
+/* the item must not be in the hash already */
+template <typename Cache, typename T>
+void id_hash_insert(Cache *cache, T *item)
+{
+    if ((cache->num_items + 1) * 2 > cache->hash_size) {
+        id_hash_grow(cache);
+    }
+    T **slot = id_hash_find_slot(cache, item->id);
+    spice_assert(*slot == nullptr);
+    *slot = item;
+    cache->num_items++;
+}
+
+template <typename Cache, typename T>
+void id_hash_remove(Cache *cache, T *item)
+{
+    const uint32_t mask = cache->hash_size - 1;
+    T **slot = id_hash_find_slot(cache, item->id);
+    uint32_t pos = slot - cache->hash_table;
+    uint32_t next = pos;
+
+    spice_assert(*slot == item);
+    cache->hash_table[pos] = nullptr;
+    cache->num_items--;
+    for (;;) {
+        next = (next + 1) & mask;
+        T *other = cache->hash_table[next];
+        if (!other) {
+            break;
+        }
+        // can move to the hole only if the hole is not before its home slot
+        uint32_t home = id_hash_home(cache, other->id);
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            cache->hash_table[pos] = other;
+            cache->hash_table[next] = nullptr;
+            pos = next;
+        }
+    }
+}
+
+} // namespace red
+
+#include "pop-visibility.h"
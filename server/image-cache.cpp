@@ -19,18 +19,14 @@
 #include "image-cache.h"
 #include "red-parse-qxl.h"
 #include "display-channel.h"
+#include "id-hash-table.hpp"
+
+/* images used in the last IMAGE_CACHE_MAX_AGE generations are kept */
+#define IMAGE_CACHE_MAX_AGE 4096
 
 static ImageCacheItem *image_cache_find(ImageCache *cache, uint64_t id)
 {
-    ImageCacheItem *item = cache->hash_table[id % IMAGE_CACHE_HASH_SIZE];
-
-    while (item) {
-        if (item->id == id) {
-            return item;
-        }
-        item = item->next;
-    }
-    return nullptr;
+    return red::id_hash_find(cache, id);
 }
 
 static bool image_cache_hit(ImageCache *cache, uint64_t id)
@@ -39,9 +35,7 @@ static bool image_cache_hit(ImageCache *cache, uint64_t id)
     if (!(item = image_cache_find(cache, id))) {
         return FALSE;
     }
-#ifdef IMAGE_CACHE_AGE
     item->age = cache->age;
-#endif
     ring_remove(&item->lru_link);
     ring_add(&cache->lru, &item->lru_link);
     return TRUE;
@@ -49,54 +43,57 @@ static bool image_cache_hit(ImageCache *cache, uint64_t id)
 
 static void image_cache_remove(ImageCache *cache, ImageCacheItem *item)
 {
-    ImageCacheItem **now;
-
-    now = &cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE];
-    for (;;) {
-        spice_assert(*now);
-        if (*now == item) {
-            *now = item->next;
-            break;
-        }
-        now = &(*now)->next;
-    }
+    red::id_hash_remove(cache, item);
     ring_remove(&item->lru_link);
     pixman_image_unref(item->image);
+    cache->size -= item->size;
     g_free(item);
-#ifndef IMAGE_CACHE_AGE
-    cache->num_items--;
-#endif
 }
 
-#define IMAGE_CACHE_MAX_ITEMS 2
+static ImageCacheItem *image_cache_get_lru_tail(ImageCache *cache)
+{
+    SPICE_VERIFY(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
+    return SPICE_CONTAINEROF(ring_get_tail(&cache->lru), ImageCacheItem, lru_link);
+}
+
+/* evict least recently used images until size bytes fit in the budget */
+static bool image_cache_make_room(ImageCache *cache, size_t size)
+{
+    ImageCacheItem *tail;
+
+    while (cache->size + size > cache->size_limit) {
+        tail = image_cache_get_lru_tail(cache);
+        // images localized for the current drawing will be requested by the canvas
+        if (!tail || tail->age == cache->age) {
+            return FALSE;
+        }
+        image_cache_remove(cache, tail);
+        stat_inc_counter(cache->evictions_counter, 1);
+    }
+    return TRUE;
+}
 
 static void image_cache_put(SpiceImageCache *spice_cache, uint64_t id, pixman_image_t *image)
 {
     ImageCache *cache = SPICE_UPCAST(ImageCache, spice_cache);
     ImageCacheItem *item;
+    size_t size = (size_t) pixman_image_get_stride(image) * pixman_image_get_height(image);
 
-#ifndef IMAGE_CACHE_AGE
-    if (cache->num_items == IMAGE_CACHE_MAX_ITEMS) {
-        SPICE_VERIFY(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
-        ImageCacheItem *tail =
-            SPICE_CONTAINEROF(ring_get_tail(&cache->lru), ImageCacheItem, lru_link);
-        spice_assert(tail);
-        image_cache_remove(cache, tail);
+    if ((item = image_cache_find(cache, id))) {
+        image_cache_remove(cache, item);
+    }
+    if (size > cache->size_limit || !image_cache_make_room(cache, size)) {
+        return;
     }
-#endif
-
     item = g_new(ImageCacheItem, 1);
     item->id = id;
-#ifdef IMAGE_CACHE_AGE
     item->age = cache->age;
-#else
-    cache->num_items++;
-#endif
+    item->size = size;
     item->image = pixman_image_ref(image);
     ring_item_init(&item->lru_link);
 
-    item->next = cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE];
-    cache->hash_table[item->id % IMAGE_CACHE_HASH_SIZE] = item;
+    red::id_hash_insert(cache, item);
+    cache->size += size;
 
     ring_add(&cache->lru, &item->lru_link);
 }
@@ -112,7 +109,7 @@ static pixman_image_t *image_cache_get(SpiceImageCache *spice_cache, uint64_t id
     return pixman_image_ref(item->image);
 }
 
-void image_cache_init(ImageCache *cache)
+void image_cache_init(ImageCache *cache, size_t size_limit)
 {
     static const SpiceImageCacheOps image_cache_ops = {
         image_cache_put,
@@ -120,42 +117,41 @@ void image_cache_init(ImageCache *cache)
     };
 
     cache->base.ops = &image_cache_ops;
-    memset(cache->hash_table, 0, sizeof(cache->hash_table));
+    cache->hash_size = IMAGE_CACHE_INIT_HASH_SIZE;
+    cache->hash_table = g_new0(ImageCacheItem *, cache->hash_size);
+    cache->num_items = 0;
     ring_init(&cache->lru);
-#ifdef IMAGE_CACHE_AGE
     cache->age = 0;
-#else
-    cache->num_items = 0;
-#endif
+    cache->size = 0;
+    cache->size_limit = size_limit;
+}
+
+void image_cache_destroy(ImageCache *cache)
+{
+    image_cache_reset(cache);
+    g_clear_pointer(&cache->hash_table, g_free);
 }
 
 void image_cache_reset(ImageCache *cache)
 {
     ImageCacheItem *item;
 
-    SPICE_VERIFY(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
-    while ((item = SPICE_CONTAINEROF(ring_get_head(&cache->lru), ImageCacheItem, lru_link))) {
+    while ((item = image_cache_get_lru_tail(cache))) {
         image_cache_remove(cache, item);
     }
-#ifdef IMAGE_CACHE_AGE
     cache->age = 0;
-#endif
 }
 
-#define IMAGE_CACHE_DEPTH 4
-
 void image_cache_aging(ImageCache *cache)
 {
-    SPICE_VERIFY(SPICE_OFFSETOF(ImageCacheItem, lru_link) == 0);
-#ifdef IMAGE_CACHE_AGE
     ImageCacheItem *item;
 
     cache->age++;
-    while ((item = (ImageCacheItem *)ring_get_tail(&cache->lru)) &&
-           cache->age - item->age > IMAGE_CACHE_DEPTH) {
+    while ((item = image_cache_get_lru_tail(cache)) &&
+           cache->age - item->age > IMAGE_CACHE_MAX_AGE) {
         image_cache_remove(cache, item);
+        stat_inc_counter(cache->evictions_counter, 1);
     }
-#endif
 }
 
 void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
@@ -171,6 +167,7 @@ void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
     }
 
     if (image_cache_hit(cache, image->descriptor.id)) {
+        stat_inc_counter(cache->hits_counter, 1);
         image_store->descriptor = image->descriptor;
         image_store->descriptor.type = SPICE_IMAGE_TYPE_FROM_CACHE;
         image_store->descriptor.flags = 0;
@@ -183,13 +180,13 @@ void image_cache_localize(ImageCache *cache, SpiceImage **image_ptr,
         image_store->descriptor = image->descriptor;
         image_store->u.quic = image->u.quic;
         *image_ptr = image_store;
-#ifdef IMAGE_CACHE_AGE
-        image_store->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
-#else
-        if (image_store->descriptor.width * image->descriptor.height >= 640 * 480) {
+        stat_inc_counter(cache->misses_counter, 1);
+        /* any image fitting in the budget, full screen images (a desktop
+         * background, a window brought back) are worth keeping too */
+        if ((size_t) image->descriptor.width * image->descriptor.height * 4 <=
+            cache->size_limit) {
             image_store->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
         }
-#endif
         break;
     }
     case SPICE_IMAGE_TYPE_BITMAP:
@@ -24,6 +24,8 @@
 #include <common/canvas_base.h>
 #include <common/ring.h>
 
+#include "stat.h"
+
 #include "push-visibility.h"
 
 /* FIXME: move back to display-channel.h (once structs are private) */
@@ -32,27 +34,33 @@ struct Drawable;
 struct ImageCacheItem {
     RingItem lru_link;
     uint64_t id;
-#ifdef IMAGE_CACHE_AGE
-    uint32_t age;
-#endif
-    struct ImageCacheItem *next;
+    uint32_t age;                   // generation the image was last used in
+    size_t size;                    // bytes of decoded pixels
     pixman_image_t *image;
 };
 
-#define IMAGE_CACHE_HASH_SIZE 1024
+#define IMAGE_CACHE_INIT_HASH_SIZE 1024
 
+/* Decoded images kept for rendering on the server, limited in bytes.
+   Least recently used images are evicted, but never the ones used by the
+   drawing in progress (current generation, see image_cache_aging). */
 struct ImageCache {
     SpiceImageCache base;
-    ImageCacheItem *hash_table[IMAGE_CACHE_HASH_SIZE];
+    /* hash of the items by id, see id-hash-table.hpp */
+    ImageCacheItem **hash_table;
+    uint32_t hash_size;             // power of 2
+    uint32_t num_items;
     Ring lru;
-#ifdef IMAGE_CACHE_AGE
     uint32_t age;
-#else
-    uint32_t num_items;
-#endif
+    size_t size;
+    size_t size_limit;
+    RedStatCounter hits_counter;
+    RedStatCounter misses_counter;
+    RedStatCounter evictions_counter;
 };
 
-void         image_cache_init              (ImageCache *cache);
+void         image_cache_init              (ImageCache *cache, size_t size_limit);
+void         image_cache_destroy           (ImageCache *cache);
 void         image_cache_reset             (ImageCache *cache);
 void         image_cache_aging             (ImageCache *cache);
 void         image_cache_localize          (ImageCache *cache, SpiceImage **image_ptr,
@@ -30,6 +30,8 @@
 
 #define MAX_GLZ_DRAWABLE_INSTANCES 2
 
+#define SHARED_IMAGES_DEFAULT_MAX_SIZE (32 * 1024 * 1024)
+
 #if 0
 #define COMPRESS_DEBUG(...) g_debug(__VA_ARGS__)
 #else
@@ -472,6 +474,9 @@ void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data
 
     // todo: tune level according to bandwidth
     enc->zlib_level = ZLIB_DEFAULT_COMPRESSION_LEVEL;
+#ifdef USE_LZ4
+    enc->lz4_level = LZ4_DEFAULT_COMPRESSION_LEVEL;
+#endif
 }
 
 void image_encoders_free(ImageEncoders *enc)
@@ -724,19 +729,23 @@ static GlzSharedDictionary *find_glz_dictionary(RedClient *client, uint8_t dict_
 
 static GlzSharedDictionary *create_glz_dictionary(ImageEncoders *enc,
                                                   RedClient *client,
-                                                  uint8_t id, int window_size)
+                                                  uint8_t id, int window_size,
+                                                  bool hugepages)
 {
     spice_debug("Lz Window %d Size=%d", id, window_size);
 
     GlzEncDictContext *glz_dict =
-        glz_enc_dictionary_create(window_size, MAX_LZ_ENCODERS, &enc->glz_data.usr);
+        glz_enc_dictionary_create(window_size, MAX_LZ_ENCODERS,
+                                  hugepages ? GLZ_DICT_ALLOC_HUGEPAGES : 0,
+                                  &enc->glz_data.usr);
 
     return glz_shared_dictionary_new(client, id, glz_dict);
 }
 
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
                                            RedClient *client,
-                                           uint8_t id, int window_size)
+                                           uint8_t id, int window_size,
+                                           bool hugepages)
 {
     GlzSharedDictionary *shared_dict;
 
@@ -748,7 +757,7 @@ gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
     if (shared_dict) {
         shared_dict->refs++;
     } else {
-        shared_dict = create_glz_dictionary(enc, client, id, window_size);
+        shared_dict = create_glz_dictionary(enc, client, id, window_size, hugepages);
         if (shared_dict != nullptr) {
             glz_dictionary_list = g_list_prepend(glz_dictionary_list, shared_dict);
         }
@@ -762,10 +771,12 @@ gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
 static GlzSharedDictionary *restore_glz_dictionary(ImageEncoders *enc,
                                                    RedClient *client,
                                                    uint8_t id,
-                                                   GlzEncDictRestoreData *restore_data)
+                                                   GlzEncDictRestoreData *restore_data,
+                                                   bool hugepages)
 {
     GlzEncDictContext *glz_dict =
-        glz_enc_dictionary_restore(restore_data, &enc->glz_data.usr);
+        glz_enc_dictionary_restore(restore_data, hugepages ? GLZ_DICT_ALLOC_HUGEPAGES : 0,
+                                   &enc->glz_data.usr);
 
     return glz_shared_dictionary_new(client, id, glz_dict);
 }
@@ -773,7 +784,8 @@ static GlzSharedDictionary *restore_glz_dictionary(ImageEncoders *enc,
 gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
                                                RedClient *client,
                                                uint8_t id,
-                                               GlzEncDictRestoreData *restore_data)
+                                               GlzEncDictRestoreData *restore_data,
+                                               bool hugepages)
 {
     GlzSharedDictionary *shared_dict = nullptr;
 
@@ -786,7 +798,7 @@ gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
     if (shared_dict) {
         shared_dict->refs++;
     } else {
-        shared_dict = restore_glz_dictionary(enc, client, id, restore_data);
+        shared_dict = restore_glz_dictionary(enc, client, id, restore_data, hugepages);
         if(shared_dict != nullptr) {
             glz_dictionary_list = g_list_prepend(glz_dictionary_list, shared_dict);
         }
@@ -797,6 +809,11 @@ gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
     return shared_dict != nullptr;
 }
 
+size_t image_encoders_get_glz_hugepage_bytes(ImageEncoders *enc)
+{
+    return enc->glz_dict ? glz_enc_dictionary_get_hugepage_bytes(enc->glz_dict->dict) : 0;
+}
+
 gboolean image_encoders_glz_create(ImageEncoders *enc, uint8_t id)
 {
     enc->glz = glz_encoder_create(id, enc->glz_dict->dict, &enc->glz_data.usr);
@@ -1129,7 +1146,8 @@ bool image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
     lz4_data->data.u.lines_data.next = 0;
     lz4_data->data.u.lines_data.reverse = 0;
 
-    lz4_size = lz4_encode(lz4, src->y, src->stride, lz4_data->data.bufs_head->buf.bytes,
+    lz4_size = lz4_encode(lz4, enc->lz4_level, src->y, src->stride,
+                          lz4_data->data.bufs_head->buf.bytes,
                           sizeof(lz4_data->data.bufs_head->buf),
                           src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format);
 
@@ -1306,10 +1324,167 @@ glz:
     return TRUE;
 }
 
+struct RedSharedImage {
+    RingItem lru_link;
+    RedSharedImage *hash_next;
+    /* nullptr once removed from the shared images */
+    ImageEncoderSharedData *shared_data;
+    int refs;
+
+    RedSharedImageKey key;
+    /* source bitmap, used to double check a match */
+    uint8_t src_format;
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t src_stride;
+
+    /* image descriptor type and data produced by the encoder */
+    SpiceImage image;
+    RedCompressBuf *comp_buf;
+    uint32_t comp_buf_size;
+    gboolean is_lossy;
+    size_t mem_size;
+};
+
+static inline RedSharedImage **shared_image_bucket(ImageEncoderSharedData *shared_data,
+                                                   uint64_t id)
+{
+    return &shared_data->shared_images[(id ^ (id >> 32)) % SHARED_IMAGES_HASH_SIZE];
+}
+
+void red_shared_image_ref(RedSharedImage *image)
+{
+    image->refs++;
+}
+
+void red_shared_image_unref(RedSharedImage *image)
+{
+    if (--image->refs > 0) {
+        return;
+    }
+
+    spice_assert(image->shared_data == nullptr);
+    RedCompressBuf *buf = image->comp_buf;
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    g_free(image);
+}
+
+static void shared_image_remove(RedSharedImage *image)
+{
+    ImageEncoderSharedData *shared_data = image->shared_data;
+    RedSharedImage **now = shared_image_bucket(shared_data, image->key.id);
+
+    while (*now != image) {
+        now = &(*now)->hash_next;
+    }
+    *now = image->hash_next;
+    ring_remove(&image->lru_link);
+    shared_data->shared_images_size -= image->mem_size;
+    image->shared_data = nullptr;
+    red_shared_image_unref(image);
+}
+
+static bool shared_image_match(const RedSharedImage *image, const RedSharedImageKey *key,
+                               const SpiceBitmap *src)
+{
+    return image->key.id == key->id &&
+           image->key.encoder_type == key->encoder_type &&
+           image->key.param == key->param &&
+           image->src_format == src->format &&
+           image->src_x == src->x &&
+           image->src_y == src->y &&
+           image->src_stride == src->stride;
+}
+
+bool image_encoder_shared_lookup(ImageEncoderSharedData *shared_data,
+                                 const RedSharedImageKey *key, const SpiceBitmap *src,
+                                 SpiceImage *dest, compress_send_data_t *o_comp_data)
+{
+    RedSharedImage *image = *shared_image_bucket(shared_data, key->id);
+
+    for (; image; image = image->hash_next) {
+        if (!shared_image_match(image, key, src)) {
+            continue;
+        }
+        ring_remove(&image->lru_link);
+        ring_add(&shared_data->shared_images_lru, &image->lru_link);
+
+        dest->descriptor.type = image->image.descriptor.type;
+        dest->u = image->image.u;
+        o_comp_data->comp_buf = image->comp_buf;
+        o_comp_data->comp_buf_size = image->comp_buf_size;
+        o_comp_data->lzplt_palette = nullptr;
+        o_comp_data->is_lossy = image->is_lossy;
+        /* the image is referenced by the marshaller so it cannot be
+         * evicted before being sent */
+        o_comp_data->shared_image = image;
+        return true;
+    }
+    return false;
+}
+
+void image_encoder_shared_add(ImageEncoderSharedData *shared_data,
+                              const RedSharedImageKey *key, const SpiceBitmap *src,
+                              const SpiceImage *dest, compress_send_data_t *comp_data)
+{
+    size_t mem_size = 0;
+
+    for (RedCompressBuf *buf = comp_data->comp_buf; buf; buf = buf->send_next) {
+        mem_size += sizeof(*buf);
+    }
+    if (mem_size > shared_data->shared_images_max_size / 4) {
+        return;
+    }
+
+    while (shared_data->shared_images_size + mem_size > shared_data->shared_images_max_size) {
+        RingItem *tail = ring_get_tail(&shared_data->shared_images_lru);
+        spice_assert(tail);
+        shared_image_remove(SPICE_CONTAINEROF(tail, RedSharedImage, lru_link));
+    }
+
+    RedSharedImage *image = g_new0(RedSharedImage, 1);
+    image->shared_data = shared_data;
+    image->refs = 1;
+    image->key = *key;
+    image->src_format = src->format;
+    image->src_x = src->x;
+    image->src_y = src->y;
+    image->src_stride = src->stride;
+    image->image = *dest;
+    image->comp_buf = comp_data->comp_buf;
+    image->comp_buf_size = comp_data->comp_buf_size;
+    image->is_lossy = comp_data->is_lossy;
+    image->mem_size = mem_size;
+
+    RedSharedImage **bucket = shared_image_bucket(shared_data, key->id);
+    image->hash_next = *bucket;
+    *bucket = image;
+    ring_add(&shared_data->shared_images_lru, &image->lru_link);
+    shared_data->shared_images_size += mem_size;
+
+    comp_data->shared_image = image;
+}
+
+void image_encoder_shared_destroy(ImageEncoderSharedData *shared_data)
+{
+    RingItem *tail;
+
+    while ((tail = ring_get_tail(&shared_data->shared_images_lru))) {
+        shared_image_remove(SPICE_CONTAINEROF(tail, RedSharedImage, lru_link));
+    }
+}
+
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data)
 {
     clockid_t stat_clock = CLOCK_THREAD_CPUTIME_ID;
 
+    ring_init(&shared_data->shared_images_lru);
+    shared_data->shared_images_max_size = SHARED_IMAGES_DEFAULT_MAX_SIZE;
+
     stat_compress_init(&shared_data->off_stat, "off", stat_clock);
     stat_compress_init(&shared_data->lz_stat, "lz", stat_clock);
     stat_compress_init(&shared_data->glz_stat, "glz", stat_clock);
@@ -43,8 +43,11 @@ typedef struct ImageEncoders ImageEncoders;
 typedef struct ImageEncoderSharedData ImageEncoderSharedData;
 typedef struct GlzSharedDictionary GlzSharedDictionary;
 typedef struct GlzImageRetention GlzImageRetention;
+typedef struct RedSharedImage RedSharedImage;
+typedef struct compress_send_data_t compress_send_data_t;
 
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data);
+void image_encoder_shared_destroy(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data);
 
@@ -82,11 +85,14 @@ static inline void compress_buf_free(RedCompressBuf *buf)
 
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
                                            struct RedClient *client,
-                                           uint8_t id, int window_size);
+                                           uint8_t id, int window_size,
+                                           bool hugepages);
 gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
                                                struct RedClient *client,
                                                uint8_t id,
-                                               GlzEncDictRestoreData *restore_data);
+                                               GlzEncDictRestoreData *restore_data,
+                                               bool hugepages);
+size_t image_encoders_get_glz_hugepage_bytes(ImageEncoders *enc);
 
 typedef struct  {
     RedCompressBuf *bufs_head;
@@ -147,9 +153,27 @@ static inline void glz_retention_init(GlzImageRetention *ret)
     ring_init(&ret->ring);
 }
 
+/* Identify an encoding of an image shared between clients */
+typedef struct RedSharedImageKey {
+    uint64_t id;          // image descriptor id
+    uint8_t encoder_type; // SpiceImageType generated by the encoder
+    int32_t param;        // encoder parameter (jpeg quality, lz4 level), 0 if none
+} RedSharedImageKey;
+
+#define SHARED_IMAGES_HASH_SIZE 256
+
 struct ImageEncoderSharedData {
     uint32_t glz_drawable_count;
 
+    /* Compressed images recently sent to a client of the display, they are
+     * reused for the other clients sending the same image with the same
+     * encoding parameters. Ordered by last use in an LRU ring and bounded by
+     * shared_images_max_size bytes of compressed buffers. */
+    RedSharedImage *shared_images[SHARED_IMAGES_HASH_SIZE];
+    Ring shared_images_lru;
+    uint64_t shared_images_size;
+    uint64_t shared_images_max_size;
+
     stat_info_t off_stat;
     stat_info_t lz_stat;
     stat_info_t glz_stat;
@@ -175,6 +199,8 @@ struct ImageEncoders {
     JpegEncoderContext *jpeg;
 
 #ifdef USE_LZ4
+    int lz4_level;
+
     Lz4Data lz4_data;
     Lz4EncoderContext *lz4;
 #endif
@@ -194,12 +220,27 @@ struct ImageEncoders {
     pthread_mutex_t glz_drawables_inst_to_free_lock;
 };
 
-typedef struct compress_send_data_t {
+struct compress_send_data_t {
     RedCompressBuf *comp_buf;
     uint32_t comp_buf_size;
     SpicePalette *lzplt_palette;
     gboolean is_lossy;
-} compress_send_data_t;
+    /* if not NULL comp_buf belongs to this shared image and must not be freed */
+    RedSharedImage *shared_image;
+};
+
+/* Look for an image already compressed for another client with the same key,
+ * on success dest and o_comp_data are filled as the encoder would have done. */
+bool image_encoder_shared_lookup(ImageEncoderSharedData *shared_data,
+                                 const RedSharedImageKey *key, const SpiceBitmap *src,
+                                 SpiceImage *dest, compress_send_data_t *o_comp_data);
+/* Add an image just compressed to the shared images, on success the
+ * ownership of the compressed buffers is moved to the shared image */
+void image_encoder_shared_add(ImageEncoderSharedData *shared_data,
+                              const RedSharedImageKey *key, const SpiceBitmap *src,
+                              const SpiceImage *dest, compress_send_data_t *comp_data);
+void red_shared_image_ref(RedSharedImage *image);
+void red_shared_image_unref(RedSharedImage *image);
 
 bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
                                   SpiceBitmap *src, compress_send_data_t* o_comp_data);
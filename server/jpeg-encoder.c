@@ -27,6 +27,9 @@
 #include "red-common.h"
 #include "jpeg-encoder.h"
 
+/* maximum number of lines passed to each jpeg_write_scanlines call */
+#define JPEG_ENCODER_BATCH_LINES 16
+
 struct JpegEncoderContext {
     JpegEncoderUsrContext *usr;
 
@@ -40,8 +43,20 @@ struct JpegEncoderContext {
         int height;
         int stride;
         unsigned int out_size;
+        /* NULL if the lines can be passed as is to libjpeg */
         void (*convert_line_to_RGB24) (void *line, int width, uint8_t **out_line);
     } cur_image;
+
+    /* parameters of the previous image, the tables computed by
+     * jpeg_set_defaults/jpeg_set_quality are reused while they don't change */
+    struct {
+        int quality;
+        J_COLOR_SPACE in_color_space;
+    } last_params;
+
+    /* destination of converted lines, JPEG_ENCODER_BATCH_LINES lines */
+    uint8_t *RGB24_lines;
+    size_t RGB24_lines_size;
 };
 
 typedef struct JpegEncoderContext JpegEncoder;
@@ -102,12 +117,14 @@ JpegEncoderContext* jpeg_encoder_create(JpegEncoderUsrContext *usr)
     jpeg_create_compress(&enc->cinfo);
     enc->cinfo.client_data = enc;
     enc->cinfo.dest = &enc->dest_mgr;
+    enc->last_params.quality = -1;
     return enc;
 }
 
 void jpeg_encoder_destroy(JpegEncoderContext* encoder)
 {
     jpeg_destroy_compress(&encoder->cinfo);
+    g_free(encoder->RGB24_lines);
     g_free(encoder);
 }
 
@@ -130,6 +147,7 @@ static void convert_RGB16_to_RGB24(void *line, int width, uint8_t **out_line)
    }
 }
 
+#ifndef JCS_EXTENSIONS
 static void convert_BGR24_to_RGB24(void *in_line, int width, uint8_t **out_line)
 {
     int x;
@@ -165,6 +183,7 @@ static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
         *out_pix++ = pixel & 0xff;
     }
 }
+#endif
 
 
 #define FILL_LINES() {                                                  \
@@ -180,24 +199,31 @@ static void convert_BGRX32_to_RGB24(void *line, int width, uint8_t **out_line)
 static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_lines)
 {
     uint8_t *lines_end;
-    uint8_t *RGB24_line;
     int stride, width;
-    JSAMPROW row_pointer[1];
+    JSAMPROW row_pointers[JPEG_ENCODER_BATCH_LINES];
     width = jpeg->cur_image.width;
     stride = jpeg->cur_image.stride;
 
-    RGB24_line = g_new(uint8_t, width*3);
-
     lines_end = lines + (stride * num_lines);
 
-    for (;jpeg->cinfo.next_scanline < jpeg->cinfo.image_height; lines += stride) {
+    while (jpeg->cinfo.next_scanline < jpeg->cinfo.image_height) {
+        unsigned int batch, i;
+
         FILL_LINES();
-        jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
-        row_pointer[0] = RGB24_line;
-        jpeg_write_scanlines(&jpeg->cinfo, row_pointer, 1);
+        /* only lines of the same chunk are contiguous */
+        batch = MIN((lines_end - lines) / stride,
+                    jpeg->cinfo.image_height - jpeg->cinfo.next_scanline);
+        batch = MIN(batch, JPEG_ENCODER_BATCH_LINES);
+        for (i = 0; i < batch; i++, lines += stride) {
+            if (jpeg->cur_image.convert_line_to_RGB24) {
+                row_pointers[i] = jpeg->RGB24_lines + i * width * 3;
+                jpeg->cur_image.convert_line_to_RGB24(lines, width, &row_pointers[i]);
+            } else {
+                row_pointers[i] = lines;
+            }
+        }
+        jpeg_write_scanlines(&jpeg->cinfo, row_pointers, batch);
     }
-
-    g_free(RGB24_line);
 }
 
 int jpeg_encode(JpegEncoderContext *enc, int quality, JpegEncoderImageType type,
@@ -210,26 +236,53 @@ int jpeg_encode(JpegEncoderContext *enc, int quality, JpegEncoderImageType type,
     enc->cur_image.stride = stride;
     enc->cur_image.out_size = 0;
 
+    enc->cur_image.convert_line_to_RGB24 = NULL;
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_RGB;
+
+    /* libjpeg-turbo can read the guest pixels directly, the memory order of
+     * the components does not depend on the host endianness */
     switch (type) {
     case JPEG_IMAGE_TYPE_RGB16:
         enc->cur_image.convert_line_to_RGB24 = convert_RGB16_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_BGR24:
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_BGR;
+#else
         enc->cur_image.convert_line_to_RGB24 = convert_BGR24_to_RGB24;
+#endif
         break;
     case JPEG_IMAGE_TYPE_BGRX32:
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.input_components = 4;
+        enc->cinfo.in_color_space = JCS_EXT_BGRX;
+#else
         enc->cur_image.convert_line_to_RGB24 = convert_BGRX32_to_RGB24;
+#endif
         break;
     default:
         spice_error("bad image type");
     }
 
+    if (enc->cur_image.convert_line_to_RGB24) {
+        size_t lines_size = (size_t) width * 3 * JPEG_ENCODER_BATCH_LINES;
+        if (enc->RGB24_lines_size < lines_size) {
+            g_free(enc->RGB24_lines);
+            enc->RGB24_lines = g_new(uint8_t, lines_size);
+            enc->RGB24_lines_size = lines_size;
+        }
+    }
+
     enc->cinfo.image_width = width;
     enc->cinfo.image_height = height;
-    enc->cinfo.input_components = 3;
-    enc->cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults(&enc->cinfo);
-    jpeg_set_quality(&enc->cinfo, quality, TRUE);
+    if (enc->last_params.quality != quality ||
+        enc->last_params.in_color_space != enc->cinfo.in_color_space) {
+        jpeg_set_defaults(&enc->cinfo);
+        jpeg_set_quality(&enc->cinfo, quality, TRUE);
+        enc->last_params.quality = quality;
+        enc->last_params.in_color_space = enc->cinfo.in_color_space;
+    }
 
     enc->dest_mgr.next_output_byte = io_ptr;
     enc->dest_mgr.free_in_buffer = num_io_bytes;
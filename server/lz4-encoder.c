@@ -17,11 +17,25 @@
 #include <config.h>
 
 #include <lz4.h>
+#ifdef HAVE_LZ4_COMPRESS_HC_CONTINUE
+#include <lz4hc.h>
+#endif
 #include "red-common.h"
 #include "lz4-encoder.h"
 
 typedef struct Lz4Encoder {
     Lz4EncoderUsrContext *usr;
+    /* streams are kept between images and only reset before each
+     * encoding, allocating them is costly (16KB for the fast one,
+     * 256KB for the HC one) */
+    LZ4_stream_t *stream;
+#ifdef HAVE_LZ4_COMPRESS_HC_CONTINUE
+    LZ4_streamHC_t *stream_hc;
+#endif
+    /* used only when a compressed block does not fit in the remaining
+     * output space and has to be split between several buffers */
+    uint8_t *bounce_buf;
+    int bounce_buf_size;
 } Lz4Encoder;
 
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
@@ -33,16 +47,85 @@ Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
 
     enc = g_new0(Lz4Encoder, 1);
     enc->usr = usr;
+    enc->stream = LZ4_createStream();
+    if (!enc->stream) {
+        g_free(enc);
+        return NULL;
+    }
 
     return (Lz4EncoderContext*)enc;
 }
 
 void lz4_encoder_destroy(Lz4EncoderContext* encoder)
 {
-    g_free(encoder);
+    Lz4Encoder *enc = (Lz4Encoder *)encoder;
+
+    if (!enc) {
+        return;
+    }
+    LZ4_freeStream(enc->stream);
+#ifdef HAVE_LZ4_COMPRESS_HC_CONTINUE
+    if (enc->stream_hc) {
+        LZ4_freeStreamHC(enc->stream_hc);
+    }
+#endif
+    g_free(enc->bounce_buf);
+    g_free(enc);
+}
+
+static inline void lz4_put_block_size(uint8_t *ptr, uint32_t size)
+{
+    // output can be at any offset inside the buffer, do not assume alignment
+    uint32_t be_size = GUINT32_TO_BE(size);
+    memcpy(ptr, &be_size, sizeof(be_size));
 }
 
-int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
+static bool lz4_encoder_reset_stream(Lz4Encoder *enc, int level)
+{
+#ifdef HAVE_LZ4_COMPRESS_HC_CONTINUE
+    if (level > 0) {
+        if (!enc->stream_hc) {
+            enc->stream_hc = LZ4_createStreamHC();
+            if (!enc->stream_hc) {
+                return false;
+            }
+        }
+#ifdef HAVE_LZ4_RESETSTREAMHC_FAST
+        LZ4_resetStreamHC_fast(enc->stream_hc, MIN(level, LZ4HC_CLEVEL_MAX));
+#else
+        LZ4_resetStreamHC(enc->stream_hc, MIN(level, LZ4HC_CLEVEL_MAX));
+#endif
+        return true;
+    }
+#endif
+#ifdef HAVE_LZ4_RESETSTREAM_FAST
+    LZ4_resetStream_fast(enc->stream);
+#else
+    LZ4_resetStream(enc->stream);
+#endif
+    return true;
+}
+
+static int lz4_encoder_compress(Lz4Encoder *enc, int level, const uint8_t *in_buf, int in_size,
+                                uint8_t *out_buf, int out_size)
+{
+#ifdef HAVE_LZ4_COMPRESS_HC_CONTINUE
+    if (level > 0) {
+        return LZ4_compress_HC_continue(enc->stream_hc, (const char *) in_buf,
+                                        (char *) out_buf, in_size, out_size);
+    }
+#endif
+#ifdef HAVE_LZ4_COMPRESS_FAST_CONTINUE
+    return LZ4_compress_fast_continue(enc->stream, (const char *) in_buf,
+                                      (char *) out_buf, in_size, out_size,
+                                      level < 0 ? -level : 1);
+#else
+    return LZ4_compress_limitedOutput_continue(enc->stream, (const char *) in_buf,
+                                               (char *) out_buf, in_size, out_size);
+#endif
+}
+
+int lz4_encode(Lz4EncoderContext *lz4, int level, int height, int stride, uint8_t *io_ptr,
                unsigned int num_io_bytes, int top_down, uint8_t format)
 {
     Lz4Encoder *enc = (Lz4Encoder *)lz4;
@@ -50,9 +133,13 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
     int num_lines = 0;
     int total_lines = 0;
     int in_size, enc_size, out_size, already_copied;
-    uint8_t *in_buf, *compressed_lines;
+    uint8_t *in_buf;
     uint8_t *out_buf = io_ptr;
-    LZ4_stream_t *stream = LZ4_createStream();
+
+    if (!lz4_encoder_reset_stream(enc, level)) {
+        spice_error("create stream failed");
+        return 0;
+    }
 
     // Encode direction and format
     *(out_buf++) = top_down ? 1 : 0;
@@ -64,55 +151,72 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         num_lines = enc->usr->more_lines(enc->usr, &lines);
         if (num_lines <= 0) {
             spice_error("more lines failed");
-            LZ4_freeStream(stream);
             return 0;
         }
         in_buf = lines;
         in_size = stride * num_lines;
         lines += in_size;
         int bound_size = LZ4_compressBound(in_size);
-        compressed_lines = g_new(uint8_t, bound_size + 4);
-#ifdef HAVE_LZ4_COMPRESS_FAST_CONTINUE
-        enc_size = LZ4_compress_fast_continue(stream, (const char *) in_buf,
-                                              (char *) compressed_lines + 4, in_size,
-                                              bound_size, 1);
-#else
-        enc_size = LZ4_compress_continue(stream, (const char *) in_buf,
-                                         (char *) compressed_lines + 4, in_size);
-#endif
+
+        if (num_io_bytes == 0) {
+            num_io_bytes = enc->usr->more_space(enc->usr, &io_ptr);
+            if (num_io_bytes <= 0) {
+                spice_error("more space failed");
+                return 0;
+            }
+            out_buf = io_ptr;
+        }
+
+        if (num_io_bytes >= (unsigned int) bound_size + 4) {
+            // common case, compress directly in the output buffer
+            enc_size = lz4_encoder_compress(enc, level, in_buf, in_size,
+                                            out_buf + 4, bound_size);
+            if (enc_size <= 0) {
+                spice_error("compress failed!");
+                return 0;
+            }
+            lz4_put_block_size(out_buf, enc_size);
+            out_size += enc_size += 4;
+            out_buf += enc_size;
+            num_io_bytes -= enc_size;
+            total_lines += num_lines;
+            continue;
+        }
+
+        // block could cross buffer boundaries, compress in the bounce buffer
+        if (enc->bounce_buf_size < bound_size + 4) {
+            enc->bounce_buf_size = bound_size + 4;
+            g_free(enc->bounce_buf);
+            enc->bounce_buf = g_new(uint8_t, enc->bounce_buf_size);
+        }
+        enc_size = lz4_encoder_compress(enc, level, in_buf, in_size,
+                                        enc->bounce_buf + 4, bound_size);
         if (enc_size <= 0) {
             spice_error("compress failed!");
-            g_free(compressed_lines);
-            LZ4_freeStream(stream);
             return 0;
         }
-        // compressed_lines is returned by malloc so is surely aligned
-        *SPICE_ALIGNED_CAST(uint32_t *, compressed_lines) = GUINT32_TO_BE(enc_size);
+        lz4_put_block_size(enc->bounce_buf, enc_size);
 
         out_size += enc_size += 4;
         already_copied = 0;
         while (num_io_bytes < enc_size) {
-            memcpy(out_buf, compressed_lines + already_copied, num_io_bytes);
+            memcpy(out_buf, enc->bounce_buf + already_copied, num_io_bytes);
             already_copied += num_io_bytes;
             enc_size -= num_io_bytes;
             num_io_bytes = enc->usr->more_space(enc->usr, &io_ptr);
             if (num_io_bytes <= 0) {
                 spice_error("more space failed");
-                g_free(compressed_lines);
-                LZ4_freeStream(stream);
                 return 0;
             }
             out_buf = io_ptr;
         }
-        memcpy(out_buf, compressed_lines + already_copied, enc_size);
+        memcpy(out_buf, enc->bounce_buf + already_copied, enc_size);
         out_buf += enc_size;
         num_io_bytes -= enc_size;
 
-        g_free(compressed_lines);
         total_lines += num_lines;
     } while (total_lines < height);
 
-    LZ4_freeStream(stream);
     if (total_lines != height) {
         spice_error("too many lines");
         out_size = 0;
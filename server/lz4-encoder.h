@@ -47,8 +47,15 @@ struct Lz4EncoderUsrContext {
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr);
 void lz4_encoder_destroy(Lz4EncoderContext *encoder);
 
-/* returns the total size of the encoded data. */
-int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
+/* Compression level used when none is configured: LZ4 fast mode,
+ * acceleration 1 */
+#define LZ4_DEFAULT_COMPRESSION_LEVEL 0
+
+/* returns the total size of the encoded data.
+ * level > 0 selects LZ4 HC with that level (clamped to the maximum HC level),
+ * level < 0 selects the fast mode with an acceleration of -level,
+ * if HC is not available positive levels behave like level 0 */
+int lz4_encode(Lz4EncoderContext *lz4, int level, int height, int stride, uint8_t *io_ptr,
                unsigned int num_io_bytes, int top_down, uint8_t format);
 
 SPICE_END_DECLS
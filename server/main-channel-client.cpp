@@ -37,8 +37,11 @@ enum NetTestStage {
 
 #define CLIENT_CONNECTIVITY_TIMEOUT (MSEC_PER_SEC * 30)
 
-// approximate max receive message size for main channel
-#define MAIN_CHANNEL_RECEIVE_BUF_SIZE \
+// approximate max receive message size for main channel. The agent data
+// has its own buffers, the migration data is allocated when received
+#define MAIN_CHANNEL_RECEIVE_BUF_SIZE 4096
+// the migration data carries the agent messages in flight
+#define MAIN_CHANNEL_MIGRATE_DATA_MAX_SIZE \
     (4096 + (REDS_AGENT_WINDOW_SIZE + REDS_NUM_INTERNAL_AGENT_MESSAGES) * SPICE_AGENT_MAX_DATA_SIZE)
 
 struct MainChannelClientPrivate {
@@ -116,6 +119,10 @@ uint8_t *MainChannelClient::alloc_recv_buf(uint16_t type, uint32_t size)
         return reds_get_agent_data_buffer(channel->get_server(), this, size);
     }
 
+    if (type == SPICE_MSGC_MIGRATE_DATA && size <= MAIN_CHANNEL_MIGRATE_DATA_MAX_SIZE) {
+        return static_cast<uint8_t *>(g_malloc(size));
+    }
+
     if (size > sizeof(priv->recv_buf)) {
         /* message too large, caller will log a message and close the connection */
         return nullptr;
@@ -129,6 +136,8 @@ void MainChannelClient::release_recv_buf(uint16_t type, uint32_t size, uint8_t *
     if (type == SPICE_MSGC_MAIN_AGENT_DATA) {
         RedChannel *channel = get_channel();
         reds_release_agent_data_buffer(channel->get_server(), msg);
+    } else if (type == SPICE_MSGC_MIGRATE_DATA) {
+        g_free(msg);
     }
 }
 
@@ -484,7 +493,20 @@ bool MainChannelClient::is_network_info_initialized() const
 bool MainChannelClient::is_low_bandwidth() const
 {
     // TODO: configurable?
-    return priv->bitrate_per_sec < 10 * 1024 * 1024;
+    return priv->bitrate_per_sec < LOW_BANDWIDTH_BITRATE;
+}
+
+/* keep the network info used by new channels up to date after the
+ * initial network test */
+void MainChannelClient::on_net_estimate_changed()
+{
+    if (priv->net_test_stage != NET_TEST_STAGE_COMPLETE) {
+        return;
+    }
+    priv->bitrate_per_sec = get_bitrate_estimate();
+    if (get_roundtrip_estimate_ms()) {
+        priv->latency = uint64_t{get_roundtrip_estimate_ms()} * 1000;
+    }
 }
 
 uint64_t MainChannelClient::get_bitrate_per_sec() const
@@ -26,6 +26,9 @@
 
 #include "push-visibility.h"
 
+/* connections slower than this use more aggressive compression */
+#define LOW_BANDWIDTH_BITRATE (10 * 1024 * 1024)
+
 struct MainChannelClientPrivate;
 
 MainChannelClient *main_channel_client_create(MainChannel *main_chan, RedClient *client,
@@ -90,6 +93,7 @@ protected:
     virtual bool handle_migrate_data(uint32_t size, void *message) override;
     virtual void migrate() override;
     virtual void handle_migrate_flush_mark() override;
+    virtual void on_net_estimate_changed() override;
 
 public:
     red::unique_link<MainChannelClientPrivate> priv;
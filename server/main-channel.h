@@ -28,7 +28,9 @@
 
 // TODO: Defines used to calculate receive buffer size, and also by reds.c
 // other options: is to make a reds_main_consts.h, to duplicate defines.
-#define REDS_AGENT_WINDOW_SIZE 10
+// Agent chunks the client can send before waiting for tokens; with 2KB
+// chunks this bounds client to guest transfers to window * 2KB per round trip
+#define REDS_AGENT_WINDOW_SIZE 64
 #define REDS_NUM_INTERNAL_AGENT_MESSAGES 1
 
 struct RedsMigSpice {
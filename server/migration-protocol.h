@@ -31,8 +31,11 @@
 #include <spice/start-packed.h>
 
 /* increase the version when the version of any
- * of the migration data messages is increased */
-#define SPICE_MIGRATION_PROTOCOL_VERSION 1
+ * of the migration data messages is increased.
+ * 2: the agent token window grew from 10 to 64 chunks, older destinations
+ *    cannot restore the tokens of the client and fall back to semi-seamless
+ *    migration */
+#define SPICE_MIGRATION_PROTOCOL_VERSION 2
 
 typedef struct SPICE_ATTR_PACKED SpiceMigrateDataHeader {
     uint32_t magic;
@@ -87,8 +90,9 @@ typedef struct SPICE_ATTR_PACKED SpiceMigrateDataSmartcard {
 /* *********************************
  * main channel (mainly guest agent)
  * *********************************/
-#define SPICE_MIGRATE_DATA_MAIN_VERSION 1 /* NOTE: increase version when CHAR_DEVICE_VERSION
-                                             is increased */
+#define SPICE_MIGRATE_DATA_MAIN_VERSION 2 /* NOTE: increase version when CHAR_DEVICE_VERSION
+                                             is increased.
+                                             2: agent window of 64 tokens */
 #define SPICE_MIGRATE_DATA_MAIN_MAGIC SPICE_MAGIC_CONST("MNMD")
 
 typedef struct SPICE_ATTR_PACKED SpiceMigrateDataMain {
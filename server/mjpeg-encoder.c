@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <jerror.h>
 #include <jpeglib.h>
 
@@ -75,6 +76,31 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
 /* The compressed buffer initial size. */
 #define MJPEG_INITIAL_BUFFER_SIZE (32 * 1024)
 
+/* Maximum number of scanlines passed to each jpeg_write_scanlines call. */
+#define MJPEG_BATCH_LINES 16
+
+/* Maximum number of frames submitted with encode_frame_async() that may be
+ * waiting for the encoding thread. More frames are dropped as if the pipe
+ * was congested, since the encoder cannot keep up with the stream.
+ */
+#define MJPEG_MAX_FRAMES_IN_FLIGHT 2
+
+/* jpeg_set_defaults() subsamples the chroma 2x2, so the MCUs cover 16x16
+ * pixels. The slices of a frame encoded in parallel are made of whole MCU
+ * rows. */
+#define MJPEG_MCU_SIZE 16
+
+/* Frames are only split when each slice gets at least that many pixels,
+ * smaller frames are not worth waking up the slice threads. */
+#define MJPEG_SLICE_MIN_PIXELS (128 * 1024)
+
+/* JPEG markers used to stitch the slices together */
+#define JPEG_MARKER_SOF0 0xc0
+#define JPEG_MARKER_SOF1 0xc1
+#define JPEG_MARKER_RST0 0xd0
+#define JPEG_MARKER_EOI 0xd9
+#define JPEG_MARKER_SOS 0xda
+
 #ifdef JCS_EXTENSIONS
 #  ifndef WORDS_BIGENDIAN
 #    define JCS_EXT_LE_BGRX JCS_EXT_BGRX
@@ -174,21 +200,103 @@ typedef struct MJpegVideoBuffer {
     size_t maxsize;
 } MJpegVideoBuffer;
 
-typedef struct MJpegEncoder {
-    VideoEncoder base;
+/* A frame submitted with encode_frame_async() */
+typedef struct MJpegEncoderJob {
+    const SpiceBitmap *bitmap;
+    SpiceRect src;
+    int top_down;
+    int quality;
+    gpointer bitmap_opaque;
+    video_encoder_done_t done;
+    gpointer done_opaque;
+
+    /* the compressed size, 0 if the encoding failed */
+    size_t size;
+} MJpegEncoderJob;
+
+/* A libjpeg instance and the buffers it needs */
+typedef struct MJpegCompressor {
     uint8_t *row;
     uint32_t row_size;
-    int first_frame;
+
+    /* parameters of the previous frame, the tables computed by
+     * jpeg_set_defaults/jpeg_set_quality are reused while they don't change */
+    int last_quality;
+    J_COLOR_SPACE last_in_color_space;
 
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
 
     unsigned int bytes_per_pixel; /* bytes per pixel of the input buffer */
     void (*pixel_converter)(void *src, uint8_t *dest);
+} MJpegCompressor;
+
+/* A horizontal slice of a frame, encoded as a JPEG image of its own */
+typedef struct MJpegEncoderSlice {
+    MJpegCompressor compressor;
+    /* the compressed slice, the buffer is kept from one frame to the next */
+    uint8_t *data;
+    size_t maxsize;
+    size_t size; /* 0 if the encoding failed */
+    size_t scan_offset; /* where the entropy-coded data starts */
+    SpiceRect src;
+} MJpegEncoderSlice;
+
+typedef struct MJpegEncoder {
+    VideoEncoder base;
+    MJpegCompressor compressor;
+    int first_frame;
 
     MJpegEncoderRateControl rate_control;
     VideoEncoderRateControlCbs cbs;
 
+    /* Callbacks to adjust the refcount of the bitmaps being encoded. */
+    bitmap_ref_t bitmap_ref;
+    bitmap_unref_t bitmap_unref;
+
+    /* ---------- Asynchronous encoding ----------
+     *
+     * Once encode_frame_async() is used the compression state (compressor,
+     * first_frame and the slices below) belongs to the encoding thread,
+     * while the rate control stays in the main context. Frames are accounted
+     * for in the rate control when the main context collects them from
+     * done_jobs.
+     */
+    pthread_t thread;
+    bool thread_started;
+    pthread_mutex_t jobs_mutex;
+    pthread_cond_t jobs_cond;
+    GQueue jobs;      /* waiting for the encoding thread, protected by jobs_mutex */
+    GQueue done_jobs; /* encoded, protected by jobs_mutex */
+    bool stop_thread;
+    /* frames submitted but not collected yet, only used in the main context */
+    uint32_t frames_in_flight;
+
+    /* ---------- Slice-parallel encoding ----------
+     *
+     * Large frames are split in up to num_threads slices of whole MCU rows,
+     * encoded in parallel by the thread compressing the frame and the slice
+     * threads. The slices are then stitched into a single JPEG image, a
+     * restart marker separating each of them.
+     */
+    uint32_t num_threads;
+    MJpegEncoderSlice *slices; /* num_threads entries */
+    pthread_t *slice_threads;  /* num_threads - 1 entries */
+    uint32_t num_slice_threads; /* the slice threads actually running */
+    bool slice_threads_started;
+    pthread_mutex_t slices_mutex;
+    pthread_cond_t slices_cond;
+    pthread_cond_t slices_done_cond;
+    /* the frame being split, protected by slices_mutex */
+    const SpiceBitmap *slice_bitmap;
+    int slice_top_down;
+    int slice_quality;
+    unsigned int slice_restart_interval;
+    uint32_t num_slices;
+    uint32_t next_slice;
+    uint32_t slices_pending;
+    bool stop_slice_threads;
+
     /* stats */
     uint64_t starting_bit_rate;
     uint64_t avg_quality;
@@ -219,18 +327,43 @@ static MJpegVideoBuffer* create_mjpeg_video_buffer(void)
     return buffer;
 }
 
-static void mjpeg_encoder_destroy(VideoEncoder *video_encoder)
+static void mjpeg_compressor_init(MJpegCompressor *compressor)
 {
-    MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
-    g_free(encoder->cinfo.dest);
-    jpeg_destroy_compress(&encoder->cinfo);
-    g_free(encoder->row);
-    g_free(encoder);
+    compressor->cinfo.err = jpeg_std_error(&compressor->jerr);
+    jpeg_create_compress(&compressor->cinfo);
+    compressor->last_quality = -1;
 }
 
-static uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder)
+static void mjpeg_compressor_destroy(MJpegCompressor *compressor)
 {
-    return encoder->bytes_per_pixel;
+    g_free(compressor->cinfo.dest);
+    jpeg_destroy_compress(&compressor->cinfo);
+    g_free(compressor->row);
+}
+
+static void mjpeg_encoder_stop_thread(MJpegEncoder *encoder);
+static void mjpeg_encoder_stop_slice_threads(MJpegEncoder *encoder);
+
+static void mjpeg_encoder_destroy(VideoEncoder *video_encoder)
+{
+    MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+    mjpeg_encoder_stop_thread(encoder);
+    mjpeg_encoder_stop_slice_threads(encoder);
+    pthread_mutex_destroy(&encoder->jobs_mutex);
+    pthread_cond_destroy(&encoder->jobs_cond);
+    pthread_mutex_destroy(&encoder->slices_mutex);
+    pthread_cond_destroy(&encoder->slices_cond);
+    pthread_cond_destroy(&encoder->slices_done_cond);
+    if (encoder->slices) {
+        for (uint32_t i = 0; i < encoder->num_threads; i++) {
+            mjpeg_compressor_destroy(&encoder->slices[i].compressor);
+            g_free(encoder->slices[i].data);
+        }
+        g_free(encoder->slices);
+    }
+    g_free(encoder->slice_threads);
+    mjpeg_compressor_destroy(&encoder->compressor);
+    g_free(encoder);
 }
 
 #ifndef JCS_EXTENSIONS
@@ -351,10 +484,20 @@ spice_jpeg_mem_dest(j_compress_ptr cinfo,
 }
 /* end of code from libjpeg */
 
+/* MJPEG keeps its historical 25 fps limit unless a frame rate higher than
+ * the default one was configured */
+static inline uint32_t mjpeg_encoder_get_fps_limit(const MJpegEncoder *encoder)
+{
+    uint32_t max_fps = encoder->cbs.get_max_fps ?
+        encoder->cbs.get_max_fps(encoder->cbs.opaque) : VIDEO_ENCODER_DEFAULT_MAX_FPS;
+
+    return max_fps > VIDEO_ENCODER_DEFAULT_MAX_FPS ? max_fps : MIN(max_fps, MJPEG_MAX_FPS);
+}
+
 static inline uint32_t mjpeg_encoder_get_source_fps(const MJpegEncoder *encoder)
 {
     return encoder->cbs.get_source_fps ?
-        encoder->cbs.get_source_fps(encoder->cbs.opaque) : MJPEG_MAX_FPS;
+        encoder->cbs.get_source_fps(encoder->cbs.opaque) : mjpeg_encoder_get_fps_limit(encoder);
 }
 
 static inline uint32_t mjpeg_encoder_get_latency(const MJpegEncoder *encoder)
@@ -388,7 +531,7 @@ static void mjpeg_encoder_reset_quality(MJpegEncoder *encoder,
     rate_control->quality_id = quality_id;
     memset(&rate_control->quality_eval_data, 0, sizeof(MJpegEncoderQualityEval));
     rate_control->quality_eval_data.max_quality_id = MJPEG_QUALITY_SAMPLE_NUM - 1;
-    rate_control->quality_eval_data.max_quality_fps = MJPEG_MAX_FPS;
+    rate_control->quality_eval_data.max_quality_fps = mjpeg_encoder_get_fps_limit(encoder);
 
     if (rate_control->adjusted_fps) {
         fps_ratio = rate_control->adjusted_fps / rate_control->fps;
@@ -396,7 +539,7 @@ static void mjpeg_encoder_reset_quality(MJpegEncoder *encoder,
         fps_ratio = 1.5;
     }
     rate_control->fps = MAX(MJPEG_MIN_FPS, fps);
-    rate_control->fps = MIN(MJPEG_MAX_FPS, rate_control->fps);
+    rate_control->fps = MIN(mjpeg_encoder_get_fps_limit(encoder), rate_control->fps);
     rate_control->adjusted_fps = rate_control->fps*fps_ratio;
     spice_debug("adjusted-fps-ratio=%.2f adjusted-fps=%.2f", fps_ratio, rate_control->adjusted_fps);
     rate_control->adjusted_fps_start_time = 0;
@@ -720,17 +863,13 @@ static void mjpeg_encoder_adjust_fps(MJpegEncoder *encoder, uint64_t now)
  *  MJPEG_ENCODER_FRAME_DROP        : frame should be dropped. This value can only be returned
  *                                    if mjpeg rate control is active.
  *  MJPEG_ENCODER_FRAME_ENCODE_DONE : frame encoding started. Continue with
- *                                    mjpeg_encoder_encode_scanline.
+ *                                    mjpeg_encoder_encode_scanlines.
  */
+/* Decides whether to encode the next frame and adjusts the stream
+ * parameters, this runs in the main context. */
 static VideoEncodeResults
-mjpeg_encoder_start_frame(MJpegEncoder *encoder,
-                          SpiceBitmapFmt format,
-                          const SpiceRect *src,
-                          MJpegVideoBuffer *buffer,
-                          uint32_t frame_mm_time)
+mjpeg_encoder_rate_control_frame(MJpegEncoder *encoder, uint32_t frame_mm_time)
 {
-    uint32_t quality;
-
     MJpegEncoderRateControl *rate_control = &encoder->rate_control;
     uint64_t now;
     uint64_t interval;
@@ -761,32 +900,57 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         }
         bit_rate_info->last_frame_time = now;
     }
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
 
-    encoder->cinfo.in_color_space   = JCS_RGB;
-    encoder->cinfo.input_components = 3;
-    encoder->pixel_converter = NULL;
+static bool mjpeg_encoder_format_is_supported(SpiceBitmapFmt format)
+{
+    switch (format) {
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+    case SPICE_BITMAP_FMT_16BIT:
+    case SPICE_BITMAP_FMT_24BIT:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Prepares the compressor for a new image, this runs in the thread doing
+ * the encoding. */
+static VideoEncodeResults
+mjpeg_compressor_start(MJpegCompressor *compressor,
+                       SpiceBitmapFmt format,
+                       JDIMENSION width, JDIMENSION height,
+                       uint8_t **outbuffer, size_t *outsize,
+                       int quality, unsigned int restart_interval,
+                       int write_all_tables)
+{
+    compressor->cinfo.in_color_space   = JCS_RGB;
+    compressor->cinfo.input_components = 3;
+    compressor->pixel_converter = NULL;
 
     switch (format) {
     case SPICE_BITMAP_FMT_32BIT:
     case SPICE_BITMAP_FMT_RGBA:
-        encoder->bytes_per_pixel = 4;
+        compressor->bytes_per_pixel = 4;
 #ifdef JCS_EXTENSIONS
-        encoder->cinfo.in_color_space   = JCS_EXT_LE_BGRX;
-        encoder->cinfo.input_components = 4;
+        compressor->cinfo.in_color_space   = JCS_EXT_LE_BGRX;
+        compressor->cinfo.input_components = 4;
 #else
-        encoder->pixel_converter = pixel_rgb32bpp_to_24;
+        compressor->pixel_converter = pixel_rgb32bpp_to_24;
 #endif
         break;
     case SPICE_BITMAP_FMT_16BIT:
-        encoder->bytes_per_pixel = 2;
-        encoder->pixel_converter = pixel_rgb16bpp_to_24;
+        compressor->bytes_per_pixel = 2;
+        compressor->pixel_converter = pixel_rgb16bpp_to_24;
         break;
     case SPICE_BITMAP_FMT_24BIT:
-        encoder->bytes_per_pixel = 3;
+        compressor->bytes_per_pixel = 3;
 #ifdef JCS_EXTENSIONS
-        encoder->cinfo.in_color_space = JCS_EXT_LE_BGR;
+        compressor->cinfo.in_color_space = JCS_EXT_LE_BGR;
 #else
-        encoder->pixel_converter = pixel_rgb24bpp_to_24;
+        compressor->pixel_converter = pixel_rgb24bpp_to_24;
 #endif
         break;
     default:
@@ -794,71 +958,86 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    encoder->cinfo.image_width = src->right - src->left;
-    encoder->cinfo.image_height = src->bottom - src->top;
-    if (encoder->pixel_converter != NULL) {
-        JDIMENSION stride = encoder->cinfo.image_width * 3;
+    compressor->cinfo.image_width = width;
+    compressor->cinfo.image_height = height;
+    if (compressor->pixel_converter != NULL) {
+        JDIMENSION stride = compressor->cinfo.image_width * 3;
+        uint64_t rows_size = (uint64_t) stride * MJPEG_BATCH_LINES;
         /* check for integer overflow */
-        if (stride < encoder->cinfo.image_width) {
+        if (stride < compressor->cinfo.image_width || rows_size > UINT32_MAX) {
             return VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
-        if (encoder->row_size < stride) {
-            encoder->row = (uint8_t*) g_realloc(encoder->row, stride);
-            encoder->row_size = stride;
+        if (compressor->row_size < rows_size) {
+            compressor->row = (uint8_t*) g_realloc(compressor->row, rows_size);
+            compressor->row_size = rows_size;
         }
     }
 
-    spice_jpeg_mem_dest(&encoder->cinfo, &buffer->base.data, &buffer->maxsize);
-
-    jpeg_set_defaults(&encoder->cinfo);
-    encoder->cinfo.dct_method       = JDCT_IFAST;
-    quality = mjpeg_quality_samples[encoder->rate_control.quality_id];
-    jpeg_set_quality(&encoder->cinfo, quality, TRUE);
-    jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+    spice_jpeg_mem_dest(&compressor->cinfo, outbuffer, outsize);
 
-    encoder->num_frames++;
-    encoder->avg_quality += quality;
+    if (quality != compressor->last_quality ||
+        compressor->cinfo.in_color_space != compressor->last_in_color_space) {
+        jpeg_set_defaults(&compressor->cinfo);
+        compressor->cinfo.dct_method       = JDCT_IFAST;
+        jpeg_set_quality(&compressor->cinfo, quality, TRUE);
+        compressor->last_quality = quality;
+        compressor->last_in_color_space = compressor->cinfo.in_color_space;
+    } else {
+        /* the tables are reused, but every frame must still carry them */
+        jpeg_suppress_tables(&compressor->cinfo, FALSE);
+    }
+    compressor->cinfo.restart_interval = restart_interval;
+    jpeg_start_compress(&compressor->cinfo, write_all_tables);
     return VIDEO_ENCODER_FRAME_ENCODE_DONE;
 }
 
-static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
-                                         uint8_t *src_pixels,
-                                         size_t image_width)
+static int mjpeg_compressor_encode_scanlines(MJpegCompressor *compressor,
+                                             uint8_t **src_lines,
+                                             unsigned int num_lines,
+                                             size_t image_width)
 {
     unsigned int scanlines_written;
-    uint8_t *row;
 
-    row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            /* src_pixels is expected to be 4 bytes aligned */
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
+    if (compressor->pixel_converter) {
+        unsigned int i, x;
+        for (i = 0; i < num_lines; i++) {
+            uint8_t *src_pixels = src_lines[i];
+            uint8_t *row = compressor->row + i * image_width * 3;
+            for (x = 0; x < image_width; x++) {
+                /* src_pixels is expected to be 4 bytes aligned */
+                compressor->pixel_converter(src_pixels, row);
+                row += 3;
+                src_pixels += compressor->bytes_per_pixel;
+            }
+            src_lines[i] = compressor->row + i * image_width * 3;
         }
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
-    } else {
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
     }
+    scanlines_written = jpeg_write_scanlines(&compressor->cinfo, src_lines, num_lines);
     if (scanlines_written == 0) { /* Not enough space */
-        jpeg_abort_compress(&encoder->cinfo);
-        encoder->rate_control.last_enc_size = 0;
+        jpeg_abort_compress(&compressor->cinfo);
         return 0;
     }
 
     return scanlines_written;
 }
 
-static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
+/* Completes the compression, this runs in the thread doing the encoding. */
+static size_t mjpeg_compressor_finish(MJpegCompressor *compressor)
 {
-    mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
-    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+    mem_destination_mgr *dest = (mem_destination_mgr *) compressor->cinfo.dest;
+
+    jpeg_finish_compress(&compressor->cinfo);
 
-    jpeg_finish_compress(&encoder->cinfo);
+    return dest->pub.next_output_byte - dest->buffer;
+}
+
+/* Accounts for an encoded frame in the rate control, this runs in the main
+ * context. */
+static void mjpeg_encoder_add_frame(MJpegEncoder *encoder, size_t size)
+{
+    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
 
-    encoder->first_frame = FALSE;
-    rate_control->last_enc_size = dest->pub.next_output_byte - dest->buffer;
+    rate_control->last_enc_size = size;
     rate_control->server_state.num_frames_encoded++;
 
     if (!rate_control->during_quality_eval ||
@@ -876,7 +1055,6 @@ static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
         rate_control->bit_rate_info.sum_enc_size += encoder->rate_control.last_enc_size;
         rate_control->bit_rate_info.num_enc_frames++;
     }
-    return encoder->rate_control.last_enc_size;
 }
 
 static inline uint8_t *get_image_line(SpiceChunks *chunks, size_t *offset,
@@ -905,7 +1083,7 @@ static inline uint8_t *get_image_line(SpiceChunks *chunks, size_t *offset,
     return ret;
 }
 
-static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
+static bool encode_frame(MJpegCompressor *compressor, const SpiceRect *src,
                          const SpiceBitmap *image, int top_down)
 {
     SpiceChunks *chunks;
@@ -925,6 +1103,8 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
 
     const unsigned int stream_height = src->bottom - src->top;
     const unsigned int stream_width = src->right - src->left;
+    uint8_t *src_lines[MJPEG_BATCH_LINES];
+    unsigned int num_lines = 0;
 
     for (i = 0; i < stream_height; i++) {
         uint8_t *src_line = get_image_line(chunks, &offset, &chunk, image_stride);
@@ -933,15 +1113,307 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
             return FALSE;
         }
 
-        src_line += src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
-        if (mjpeg_encoder_encode_scanline(encoder, src_line, stream_width) == 0) {
+        src_lines[num_lines++] = src_line + src->left * compressor->bytes_per_pixel;
+        if (num_lines < MJPEG_BATCH_LINES && i + 1 < stream_height) {
+            continue;
+        }
+        if (mjpeg_compressor_encode_scanlines(compressor, src_lines, num_lines, stream_width) == 0) {
             return FALSE;
         }
+        num_lines = 0;
     }
 
     return TRUE;
 }
 
+/* Compresses the src area of the bitmap as a JPEG image of its own, returns
+ * its size or 0 if the encoding failed. */
+static size_t mjpeg_compressor_compress(MJpegCompressor *compressor,
+                                        const SpiceBitmap *bitmap,
+                                        const SpiceRect *src, int top_down,
+                                        uint8_t **outbuffer, size_t *outsize,
+                                        int quality, unsigned int restart_interval,
+                                        int write_all_tables)
+{
+    if (mjpeg_compressor_start(compressor, (SpiceBitmapFmt) bitmap->format,
+                               src->right - src->left, src->bottom - src->top,
+                               outbuffer, outsize, quality, restart_interval,
+                               write_all_tables) != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        return 0;
+    }
+    if (!encode_frame(compressor, src, bitmap, top_down)) {
+        /* leave the compressor ready for the next frame */
+        jpeg_abort_compress(&compressor->cinfo);
+        return 0;
+    }
+    return mjpeg_compressor_finish(compressor);
+}
+
+/* Encodes the slices of the current frame until there is none left, this
+ * runs in the thread compressing the frame and in the slice threads. */
+static void mjpeg_encoder_encode_slices(MJpegEncoder *encoder)
+{
+    pthread_mutex_lock(&encoder->slices_mutex);
+    while (encoder->next_slice < encoder->num_slices) {
+        uint32_t index = encoder->next_slice++;
+        MJpegEncoderSlice *slice = &encoder->slices[index];
+        const SpiceBitmap *bitmap = encoder->slice_bitmap;
+        int top_down = encoder->slice_top_down;
+        int quality = encoder->slice_quality;
+        /* the restart interval is declared in the headers of the first slice,
+         * which are the ones kept */
+        unsigned int restart_interval = index == 0 ? encoder->slice_restart_interval : 0;
+        pthread_mutex_unlock(&encoder->slices_mutex);
+
+        slice->size = mjpeg_compressor_compress(&slice->compressor, bitmap, &slice->src,
+                                                top_down, &slice->data, &slice->maxsize,
+                                                quality, restart_interval, TRUE);
+
+        pthread_mutex_lock(&encoder->slices_mutex);
+        if (--encoder->slices_pending == 0) {
+            pthread_cond_signal(&encoder->slices_done_cond);
+        }
+    }
+    pthread_mutex_unlock(&encoder->slices_mutex);
+}
+
+static void *mjpeg_encoder_slice_thread_main(void *opaque)
+{
+    MJpegEncoder *encoder = (MJpegEncoder *) opaque;
+
+    pthread_mutex_lock(&encoder->slices_mutex);
+    while (!encoder->stop_slice_threads) {
+        if (encoder->next_slice >= encoder->num_slices) {
+            pthread_cond_wait(&encoder->slices_cond, &encoder->slices_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&encoder->slices_mutex);
+        mjpeg_encoder_encode_slices(encoder);
+        pthread_mutex_lock(&encoder->slices_mutex);
+    }
+    pthread_mutex_unlock(&encoder->slices_mutex);
+    return NULL;
+}
+
+/* The slices are also encoded by the thread compressing the frame, so
+ * failing to start some of the threads only makes the encoding slower. */
+static void mjpeg_encoder_start_slice_threads(MJpegEncoder *encoder)
+{
+    if (encoder->slice_threads_started) {
+        return;
+    }
+    encoder->slice_threads_started = TRUE;
+    encoder->slice_threads = g_new0(pthread_t, encoder->num_threads - 1);
+    for (uint32_t i = 0; i < encoder->num_threads - 1; i++) {
+        if (pthread_create(&encoder->slice_threads[i], NULL,
+                           mjpeg_encoder_slice_thread_main, encoder) != 0) {
+            spice_warning("failed to create the mjpeg slice threads");
+            break;
+        }
+        encoder->num_slice_threads++;
+    }
+}
+
+static void mjpeg_encoder_stop_slice_threads(MJpegEncoder *encoder)
+{
+    if (!encoder->slice_threads_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&encoder->slices_mutex);
+    encoder->stop_slice_threads = TRUE;
+    pthread_cond_broadcast(&encoder->slices_cond);
+    pthread_mutex_unlock(&encoder->slices_mutex);
+    for (uint32_t i = 0; i < encoder->num_slice_threads; i++) {
+        pthread_join(encoder->slice_threads[i], NULL);
+    }
+    encoder->num_slice_threads = 0;
+    encoder->slice_threads_started = FALSE;
+}
+
+/* Returns the offset of the segment with the given marker in the headers of
+ * a JPEG image, or 0 if it does not come before the scan. */
+static size_t jpeg_find_segment(const uint8_t *data, size_t size, uint8_t marker)
+{
+    size_t pos = 2; /* SOI */
+
+    while (pos + 4 <= size && data[pos] == 0xff) {
+        if (data[pos + 1] == marker) {
+            return pos;
+        }
+        if (data[pos + 1] == JPEG_MARKER_SOS) {
+            break;
+        }
+        pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+    }
+    return 0;
+}
+
+/* Returns the offset of the entropy-coded data of a slice, that is the end
+ * of the headers, or 0 if the slice is not a valid JPEG image. */
+static size_t mjpeg_encoder_slice_get_scan_offset(const MJpegEncoderSlice *slice)
+{
+    size_t sos;
+    size_t offset;
+
+    if (slice->size < 4 ||
+        slice->data[slice->size - 2] != 0xff || slice->data[slice->size - 1] != JPEG_MARKER_EOI) {
+        return 0;
+    }
+    sos = jpeg_find_segment(slice->data, slice->size, JPEG_MARKER_SOS);
+    if (!sos) {
+        return 0;
+    }
+    offset = sos + 2 + ((slice->data[sos + 2] << 8) | slice->data[sos + 3]);
+    return offset <= slice->size - 2 ? offset : 0;
+}
+
+/* Concatenates the slices into a single JPEG image: the headers of the first
+ * slice, with the height of the whole frame, then the entropy-coded data of
+ * each slice separated by restart markers. Returns the size of the image or
+ * 0 if the encoding failed. */
+static size_t mjpeg_encoder_stitch_slices(MJpegEncoder *encoder, uint32_t num_slices,
+                                          uint32_t height, MJpegVideoBuffer *buffer)
+{
+    size_t size = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_slices; i++) {
+        MJpegEncoderSlice *slice = &encoder->slices[i];
+
+        slice->scan_offset = mjpeg_encoder_slice_get_scan_offset(slice);
+        if (!slice->scan_offset) {
+            return 0;
+        }
+        /* the first slice also brings the headers */
+        if (i == 0) {
+            slice->scan_offset = 0;
+        }
+        /* the slice data without EOI, followed by a restart marker or EOI
+         * for the last one */
+        size += slice->size - 2 - slice->scan_offset + 2;
+    }
+
+    if (buffer->maxsize < size) {
+        uint8_t *data = (uint8_t*) g_try_realloc(buffer->base.data, size);
+        if (!data) {
+            return 0;
+        }
+        buffer->base.data = data;
+        buffer->maxsize = size;
+    }
+
+    uint8_t *out = buffer->base.data;
+    for (i = 0; i < num_slices; i++) {
+        const MJpegEncoderSlice *slice = &encoder->slices[i];
+        size_t start = slice->scan_offset;
+
+        if (i) {
+            /* restart markers cycle through RST0-RST7 */
+            *out++ = 0xff;
+            *out++ = JPEG_MARKER_RST0 + ((i - 1) & 7);
+        }
+        memcpy(out, slice->data + start, slice->size - 2 - start);
+        out += slice->size - 2 - start;
+    }
+    *out++ = 0xff;
+    *out++ = JPEG_MARKER_EOI;
+
+    size_t sof = jpeg_find_segment(buffer->base.data, size, JPEG_MARKER_SOF0);
+    if (!sof) {
+        sof = jpeg_find_segment(buffer->base.data, size, JPEG_MARKER_SOF1);
+    }
+    if (!sof) {
+        return 0;
+    }
+    /* marker, length and sample precision come before the image height */
+    buffer->base.data[sof + 5] = height >> 8;
+    buffer->base.data[sof + 6] = height & 0xff;
+    return size;
+}
+
+/* Compresses a frame into buffer, splitting it in slices encoded in parallel
+ * if it is large enough. Returns the compressed size or 0 if the encoding
+ * failed. This runs in the thread doing the encoding. */
+static size_t mjpeg_encoder_compress_frame(MJpegEncoder *encoder,
+                                           const SpiceBitmap *bitmap,
+                                           const SpiceRect *src, int top_down,
+                                           int quality, MJpegVideoBuffer *buffer)
+{
+    const uint32_t width = src->right - src->left;
+    const uint32_t height = src->bottom - src->top;
+    const uint32_t mcu_rows = (height + MJPEG_MCU_SIZE - 1) / MJPEG_MCU_SIZE;
+    const uint32_t mcus_per_row = (width + MJPEG_MCU_SIZE - 1) / MJPEG_MCU_SIZE;
+    uint64_t num_slices;
+    uint32_t slice_mcu_rows = 0;
+    size_t size;
+
+    num_slices = (uint64_t) width * height / MJPEG_SLICE_MIN_PIXELS;
+    num_slices = MIN(num_slices, MIN(encoder->num_threads, mcu_rows));
+    if (num_slices > 1) {
+        slice_mcu_rows = (mcu_rows + num_slices - 1) / num_slices;
+        num_slices = (mcu_rows + slice_mcu_rows - 1) / slice_mcu_rows;
+        /* the restart interval, in MCUs, is stored on 16 bits */
+        if ((uint64_t) slice_mcu_rows * mcus_per_row > UINT16_MAX) {
+            num_slices = 1;
+        }
+    }
+
+    if (num_slices <= 1) {
+        size = mjpeg_compressor_compress(&encoder->compressor, bitmap, src, top_down,
+                                         &buffer->base.data, &buffer->maxsize,
+                                         quality, 0, encoder->first_frame);
+        if (size) {
+            encoder->first_frame = FALSE;
+        }
+        return size;
+    }
+
+    const uint32_t slice_height = slice_mcu_rows * MJPEG_MCU_SIZE;
+    for (uint32_t i = 0; i < num_slices; i++) {
+        SpiceRect *slice_src = &encoder->slices[i].src;
+        uint32_t start = i * slice_height;
+        uint32_t end = MIN(start + slice_height, height);
+
+        slice_src->left = src->left;
+        slice_src->right = src->right;
+        /* the image rows of a bottom-up bitmap are encoded from the bottom */
+        if (top_down) {
+            slice_src->top = src->top + start;
+            slice_src->bottom = src->top + end;
+        } else {
+            slice_src->top = src->bottom - end;
+            slice_src->bottom = src->bottom - start;
+        }
+    }
+
+    mjpeg_encoder_start_slice_threads(encoder);
+
+    pthread_mutex_lock(&encoder->slices_mutex);
+    encoder->slice_bitmap = bitmap;
+    encoder->slice_top_down = top_down;
+    encoder->slice_quality = quality;
+    encoder->slice_restart_interval = slice_mcu_rows * mcus_per_row;
+    encoder->num_slices = num_slices;
+    encoder->next_slice = 0;
+    encoder->slices_pending = num_slices;
+    pthread_cond_broadcast(&encoder->slices_cond);
+    pthread_mutex_unlock(&encoder->slices_mutex);
+
+    mjpeg_encoder_encode_slices(encoder);
+
+    pthread_mutex_lock(&encoder->slices_mutex);
+    while (encoder->slices_pending) {
+        pthread_cond_wait(&encoder->slices_done_cond, &encoder->slices_mutex);
+    }
+    encoder->num_slices = 0;
+    encoder->next_slice = 0;
+    encoder->slice_bitmap = NULL;
+    pthread_mutex_unlock(&encoder->slices_mutex);
+
+    return mjpeg_encoder_stitch_slices(encoder, num_slices, height, buffer);
+}
+
 static VideoEncodeResults
 mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
                            uint32_t frame_mm_time,
@@ -951,18 +1423,30 @@ mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
                            VideoBuffer **outbuf)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+
+    if (!mjpeg_encoder_format_is_supported((SpiceBitmapFmt) bitmap->format)) {
+        spice_debug("unsupported format %d", bitmap->format);
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
     MJpegVideoBuffer *buffer = create_mjpeg_video_buffer();
     if (!buffer) {
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    VideoEncodeResults ret = mjpeg_encoder_start_frame(encoder, (SpiceBitmapFmt) bitmap->format,
-                                                       src, buffer, frame_mm_time);
+    VideoEncodeResults ret = mjpeg_encoder_rate_control_frame(encoder, frame_mm_time);
     if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
-        if (encode_frame(encoder, src, bitmap, top_down)) {
-            buffer->base.size = mjpeg_encoder_end_frame(encoder);
+        int quality = mjpeg_quality_samples[encoder->rate_control.quality_id];
+
+        encoder->num_frames++;
+        encoder->avg_quality += quality;
+        buffer->base.size = mjpeg_encoder_compress_frame(encoder, bitmap, src, top_down,
+                                                         quality, buffer);
+        if (buffer->base.size) {
+            mjpeg_encoder_add_frame(encoder, buffer->base.size);
             *outbuf = (VideoBuffer*)buffer;
         } else {
+            encoder->rate_control.last_enc_size = 0;
             ret = VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
     }
@@ -973,6 +1457,170 @@ mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
     return ret;
 }
 
+static void *mjpeg_encoder_thread_main(void *opaque)
+{
+    MJpegEncoder *encoder = (MJpegEncoder *) opaque;
+
+    pthread_mutex_lock(&encoder->jobs_mutex);
+    while (!encoder->stop_thread) {
+        MJpegEncoderJob *job = (MJpegEncoderJob *) g_queue_pop_head(&encoder->jobs);
+        if (!job) {
+            pthread_cond_wait(&encoder->jobs_cond, &encoder->jobs_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&encoder->jobs_mutex);
+
+        MJpegVideoBuffer *buffer = create_mjpeg_video_buffer();
+        VideoEncodeResults ret = VIDEO_ENCODER_FRAME_UNSUPPORTED;
+        if (buffer &&
+            (job->size = mjpeg_encoder_compress_frame(encoder, job->bitmap, &job->src,
+                                                      job->top_down, job->quality,
+                                                      buffer))) {
+            buffer->base.size = job->size;
+            ret = VIDEO_ENCODER_FRAME_ENCODE_DONE;
+        } else if (buffer) {
+            buffer->base.free(&buffer->base);
+            buffer = NULL;
+        }
+
+        /* the job belongs to the main context once in done_jobs */
+        video_encoder_done_t done = job->done;
+        gpointer done_opaque = job->done_opaque;
+        pthread_mutex_lock(&encoder->jobs_mutex);
+        g_queue_push_tail(&encoder->done_jobs, job);
+        pthread_mutex_unlock(&encoder->jobs_mutex);
+
+        done(done_opaque, ret, (VideoBuffer *) buffer);
+
+        pthread_mutex_lock(&encoder->jobs_mutex);
+    }
+    pthread_mutex_unlock(&encoder->jobs_mutex);
+    return NULL;
+}
+
+static void mjpeg_encoder_free_job(MJpegEncoder *encoder, MJpegEncoderJob *job)
+{
+    encoder->bitmap_unref(job->bitmap_opaque);
+    encoder->frames_in_flight--;
+    g_free(job);
+}
+
+/* Collects the frames the encoding thread is done with, and accounts for
+ * them in the rate control. */
+static void mjpeg_encoder_process_done_jobs(MJpegEncoder *encoder)
+{
+    GQueue done_jobs;
+    MJpegEncoderJob *job;
+
+    if (!encoder->thread_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&encoder->jobs_mutex);
+    done_jobs = encoder->done_jobs;
+    g_queue_init(&encoder->done_jobs);
+    pthread_mutex_unlock(&encoder->jobs_mutex);
+
+    while ((job = (MJpegEncoderJob *) g_queue_pop_head(&done_jobs))) {
+        if (job->size) {
+            mjpeg_encoder_add_frame(encoder, job->size);
+        } else {
+            encoder->rate_control.last_enc_size = 0;
+        }
+        mjpeg_encoder_free_job(encoder, job);
+    }
+}
+
+static void mjpeg_encoder_stop_thread(MJpegEncoder *encoder)
+{
+    MJpegEncoderJob *job;
+
+    if (!encoder->thread_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&encoder->jobs_mutex);
+    encoder->stop_thread = TRUE;
+    pthread_cond_signal(&encoder->jobs_cond);
+    pthread_mutex_unlock(&encoder->jobs_mutex);
+    pthread_join(encoder->thread, NULL);
+
+    /* the frames that were not encoded yet are dropped */
+    while ((job = (MJpegEncoderJob *) g_queue_pop_head(&encoder->jobs))) {
+        job->done(job->done_opaque, VIDEO_ENCODER_FRAME_UNSUPPORTED, NULL);
+        mjpeg_encoder_free_job(encoder, job);
+    }
+    while ((job = (MJpegEncoderJob *) g_queue_pop_head(&encoder->done_jobs))) {
+        mjpeg_encoder_free_job(encoder, job);
+    }
+    encoder->thread_started = FALSE;
+}
+
+static VideoEncodeResults
+mjpeg_encoder_encode_frame_async(VideoEncoder *video_encoder,
+                                 uint32_t frame_mm_time,
+                                 const SpiceBitmap *bitmap,
+                                 const SpiceRect *src, int top_down,
+                                 gpointer bitmap_opaque,
+                                 video_encoder_done_t done,
+                                 gpointer done_opaque)
+{
+    MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+
+    if (!mjpeg_encoder_format_is_supported((SpiceBitmapFmt) bitmap->format)) {
+        spice_debug("unsupported format %d", bitmap->format);
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    if (!encoder->thread_started) {
+        if (pthread_create(&encoder->thread, NULL, mjpeg_encoder_thread_main, encoder) != 0) {
+            spice_warning("failed to create the mjpeg encoding thread");
+            return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+        }
+        encoder->thread_started = TRUE;
+    }
+    mjpeg_encoder_process_done_jobs(encoder);
+
+    /* The quality evaluation relies on the size of the previous frame being
+     * known, so only one frame may be in flight while it is going on.
+     */
+    if (rate_control->during_quality_eval && encoder->frames_in_flight) {
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+    if (encoder->frames_in_flight >= MJPEG_MAX_FRAMES_IN_FLIGHT) {
+        rate_control->server_state.num_frames_dropped++;
+        mjpeg_encoder_process_server_drops(encoder);
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
+    VideoEncodeResults ret = mjpeg_encoder_rate_control_frame(encoder, frame_mm_time);
+    if (ret != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        return ret;
+    }
+
+    MJpegEncoderJob *job = g_new0(MJpegEncoderJob, 1);
+    job->bitmap = bitmap;
+    job->src = *src;
+    job->top_down = top_down;
+    job->quality = mjpeg_quality_samples[rate_control->quality_id];
+    job->bitmap_opaque = bitmap_opaque;
+    job->done = done;
+    job->done_opaque = done_opaque;
+
+    encoder->bitmap_ref(bitmap_opaque);
+    encoder->frames_in_flight++;
+    encoder->num_frames++;
+    encoder->avg_quality += job->quality;
+
+    pthread_mutex_lock(&encoder->jobs_mutex);
+    g_queue_push_tail(&encoder->jobs, job);
+    pthread_cond_signal(&encoder->jobs_cond);
+    pthread_mutex_unlock(&encoder->jobs_mutex);
+
+    return VIDEO_ENCODER_FRAME_PENDING;
+}
+
 
 static void mjpeg_encoder_quality_eval_stop(MJpegEncoder *encoder)
 {
@@ -994,7 +1642,7 @@ static void mjpeg_encoder_quality_eval_stop(MJpegEncoder *encoder)
         break;
     case MJPEG_QUALITY_EVAL_TYPE_SET:
         quality_id = MJPEG_QUALITY_SAMPLE_NUM / 2;
-        fps = MJPEG_MAX_FPS / 2;
+        fps = mjpeg_encoder_get_fps_limit(encoder) / 2;
         break;
     default:
         spice_warning("unexpected");
@@ -1216,6 +1864,8 @@ static void mjpeg_encoder_client_stream_report(VideoEncoder *video_encoder,
     uint32_t min_playback_delay;
     int is_video_delay_small = FALSE;
 
+    mjpeg_encoder_process_done_jobs(encoder);
+
     spice_debug("client report: #frames %u, #drops %d, duration %u video-delay %d audio-delay %u",
                 num_frames, num_drops,
                 end_frame_mm_time - start_frame_mm_time,
@@ -1244,7 +1894,8 @@ static void mjpeg_encoder_client_stream_report(VideoEncoder *video_encoder,
         * network bit rate and the min_playback_delay
         */
         if (rate_control->quality_id != MJPEG_QUALITY_SAMPLE_NUM - 1 ||
-            rate_control->fps < MIN(src_fps, MJPEG_MAX_FPS) || end_frame_delay < 0) {
+            rate_control->fps < MIN(src_fps, mjpeg_encoder_get_fps_limit(encoder)) ||
+            end_frame_delay < 0) {
             is_video_delay_small = TRUE;
             if (encoder->cbs.update_client_playback_delay) {
                 encoder->cbs.update_client_playback_delay(encoder->cbs.opaque,
@@ -1308,6 +1959,7 @@ static void mjpeg_encoder_client_stream_report(VideoEncoder *video_encoder,
 static void mjpeg_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+    mjpeg_encoder_process_done_jobs(encoder);
     encoder->rate_control.server_state.num_frames_dropped++;
     mjpeg_encoder_process_server_drops(encoder);
 }
@@ -1355,6 +2007,7 @@ static void mjpeg_encoder_get_stats(VideoEncoder *video_encoder,
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
     spice_assert(encoder != NULL && stats != NULL);
+    mjpeg_encoder_process_done_jobs(encoder);
     stats->starting_bit_rate = encoder->starting_bit_rate;
     stats->cur_bit_rate = mjpeg_encoder_get_bit_rate(video_encoder);
     stats->avg_quality = (double)encoder->avg_quality / encoder->num_frames;
@@ -1373,6 +2026,7 @@ VideoEncoder *mjpeg_encoder_new(SpiceVideoCodecType codec_type,
     encoder = g_new0(MJpegEncoder, 1);
     encoder->base.destroy = mjpeg_encoder_destroy;
     encoder->base.encode_frame = mjpeg_encoder_encode_frame;
+    encoder->base.encode_frame_async = mjpeg_encoder_encode_frame_async;
     encoder->base.client_stream_report = mjpeg_encoder_client_stream_report;
     encoder->base.notify_server_frame_drop = mjpeg_encoder_notify_server_frame_drop;
     encoder->base.get_bit_rate = mjpeg_encoder_get_bit_rate;
@@ -1383,14 +2037,31 @@ VideoEncoder *mjpeg_encoder_new(SpiceVideoCodecType codec_type,
     encoder->starting_bit_rate = starting_bit_rate;
 
     encoder->cbs = *cbs;
+    encoder->bitmap_ref = bitmap_ref;
+    encoder->bitmap_unref = bitmap_unref;
+    pthread_mutex_init(&encoder->jobs_mutex, NULL);
+    pthread_cond_init(&encoder->jobs_cond, NULL);
     mjpeg_encoder_reset_quality(encoder, MJPEG_QUALITY_SAMPLE_NUM / 2, 5, 0);
     encoder->rate_control.during_quality_eval = TRUE;
     encoder->rate_control.quality_eval_data.type = MJPEG_QUALITY_EVAL_TYPE_SET;
     encoder->rate_control.quality_eval_data.reason = MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE;
     encoder->rate_control.warmup_start_time = spice_get_monotonic_time_ns();
 
-    encoder->cinfo.err = jpeg_std_error(&encoder->jerr);
-    jpeg_create_compress(&encoder->cinfo);
+    mjpeg_compressor_init(&encoder->compressor);
+
+    encoder->num_threads = cbs->get_encoder_threads ?
+        CLAMP(cbs->get_encoder_threads(cbs->opaque), 1, VIDEO_ENCODER_MAX_THREADS) : 1;
+    if (encoder->num_threads > 1) {
+        encoder->slices = g_new0(MJpegEncoderSlice, encoder->num_threads);
+        for (uint32_t i = 0; i < encoder->num_threads; i++) {
+            mjpeg_compressor_init(&encoder->slices[i].compressor);
+            encoder->slices[i].maxsize = MJPEG_INITIAL_BUFFER_SIZE;
+            encoder->slices[i].data = (uint8_t*) g_malloc(encoder->slices[i].maxsize);
+        }
+    }
+    pthread_mutex_init(&encoder->slices_mutex, NULL);
+    pthread_cond_init(&encoder->slices_cond, NULL);
+    pthread_cond_init(&encoder->slices_done_cond, NULL);
 
     return (VideoEncoder*)encoder;
 }
@@ -17,19 +17,30 @@
 #include <config.h>
 
 #include "pixmap-cache.h"
+#include "id-hash-table.hpp"
 
-int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+NewCacheItem *pixmap_cache_unlocked_find(PixmapCache *cache, uint64_t id)
 {
-    NewCacheItem *item;
+    return red::id_hash_find(cache, id);
+}
 
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
+/* the item must not be in the cache already */
+void pixmap_cache_unlocked_insert(PixmapCache *cache, NewCacheItem *item)
+{
+    red::id_hash_insert(cache, item);
+}
 
-    while (item) {
-        if (item->id == id) {
-            item->lossy = lossy;
-            break;
-        }
-        item = item->next;
+void pixmap_cache_unlocked_unhash(PixmapCache *cache, NewCacheItem *item)
+{
+    red::id_hash_remove(cache, item);
+}
+
+int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+{
+    NewCacheItem *item = pixmap_cache_unlocked_find(cache, id);
+
+    if (item) {
+        item->lossy = lossy;
     }
     return !!item;
 }
@@ -49,7 +60,8 @@ void pixmap_cache_clear(PixmapCache *cache)
         ring_remove(&item->lru_link);
         g_free(item);
     }
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * cache->hash_size);
+    cache->num_items = 0;
 
     cache->available = cache->size;
 }
@@ -66,7 +78,8 @@ bool pixmap_cache_freeze(PixmapCache *cache)
     cache->frozen_head = cache->lru.next;
     cache->frozen_tail = cache->lru.prev;
     ring_init(&cache->lru);
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * cache->hash_size);
+    cache->num_items = 0;
     cache->available = -1;
     cache->frozen = TRUE;
 
@@ -80,6 +93,7 @@ static void pixmap_cache_destroy(PixmapCache *cache)
 
     pthread_mutex_lock(&cache->lock);
     pixmap_cache_clear(cache);
+    g_clear_pointer(&cache->hash_table, g_free);
     pthread_mutex_unlock(&cache->lock);
 }
 
@@ -95,6 +109,8 @@ static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size
     pthread_mutex_init(&cache->lock, nullptr);
     cache->id = id;
     cache->refs = 1;
+    cache->hash_size = PIXMAP_CACHE_INIT_HASH_SIZE;
+    cache->hash_table = g_new0(NewCacheItem *, cache->hash_size);
     ring_init(&cache->lru);
     cache->available = size;
     cache->size = size;
@@ -142,3 +158,113 @@ void pixmap_cache_unref(PixmapCache *cache)
     pixmap_cache_destroy(cache);
     g_free(cache);
 }
+
+/* whether the client received the item through the channel client client_id,
+ * and only through it */
+static bool pixmap_cache_item_received(const NewCacheItem *item, uint8_t client_id,
+                                       uint64_t acked_serial)
+{
+    for (int i = 0; i < MAX_CACHE_CLIENTS; i++) {
+        if (item->sync[i] && (i != client_id || item->sync[i] > acked_serial)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static PixmapCacheDigest *pixmap_cache_unlocked_digest(PixmapCache *cache, uint8_t client_id,
+                                                       uint64_t acked_serial)
+{
+    PixmapCacheDigest *digest;
+    RingItem *link;
+    uint32_t num_items = 0;
+
+    RING_FOREACH(link, &cache->lru) {
+        num_items++;
+    }
+    digest = static_cast<PixmapCacheDigest *>(
+        g_malloc(sizeof(PixmapCacheDigest) + num_items * sizeof(PixmapCacheDigestItem)));
+    digest->id = cache->id;
+    digest->num_items = 0;
+
+    SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
+    for (link = ring_get_tail(&cache->lru); link; link = ring_prev(&cache->lru, link)) {
+        auto item = SPICE_CONTAINEROF(link, NewCacheItem, lru_link);
+
+        if (!pixmap_cache_item_received(item, client_id, acked_serial)) {
+            continue;
+        }
+        PixmapCacheDigestItem *digest_item = &digest->items[digest->num_items++];
+        digest_item->id = item->id;
+        digest_item->size = item->size;
+        digest_item->lossy = item->lossy;
+    }
+    return digest;
+}
+
+/* Like pixmap_cache_unref(). When the last reference is dropped, returns the
+ * images the client is known to hold: the ones only the channel client
+ * client_id sent or referenced, in messages the client acknowledged */
+PixmapCacheDigest *pixmap_cache_unref_to_digest(PixmapCache *cache, uint8_t client_id,
+                                                uint64_t acked_serial)
+{
+    PixmapCacheDigest *digest = nullptr;
+
+    if (!cache)
+        return nullptr;
+
+    pthread_mutex_lock(&cache_lock);
+    if (--cache->refs) {
+        pthread_mutex_unlock(&cache_lock);
+        return nullptr;
+    }
+    ring_remove(&cache->base);
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_mutex_lock(&cache->lock);
+    // a frozen cache is being migrated, the client state is not known
+    if (!cache->frozen) {
+        digest = pixmap_cache_unlocked_digest(cache, client_id, acked_serial);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    pixmap_cache_destroy(cache);
+    g_free(cache);
+    return digest;
+}
+
+/* Fill a new cache with the images of the digest, so they are referenced
+ * instead of sent again. The most recently used ones are kept if the cache
+ * is now smaller. Returns the number of items dropped, the first ones of the
+ * digest, which the client must be told to release */
+uint32_t pixmap_cache_adopt_digest(PixmapCache *cache, const PixmapCacheDigest *digest)
+{
+    uint32_t first = digest->num_items;
+    int64_t available;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->frozen || !ring_is_empty(&cache->lru) || digest->id != cache->id) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    available = cache->available;
+    while (first > 0 && available >= digest->items[first - 1].size) {
+        first--;
+        available -= digest->items[first].size;
+    }
+
+    for (uint32_t i = first; i < digest->num_items; i++) {
+        auto item = g_new0(NewCacheItem, 1);
+
+        item->id = digest->items[i].id;
+        item->size = digest->items[i].size;
+        item->lossy = digest->items[i].lossy;
+        pixmap_cache_unlocked_insert(cache, item);
+        ring_item_init(&item->lru_link);
+        ring_add(&cache->lru, &item->lru_link);
+    }
+    cache->available = available;
+    pthread_mutex_unlock(&cache->lock);
+    return first;
+}
@@ -27,14 +27,10 @@
 
 #define MAX_CACHE_CLIENTS 4
 
-#define BITS_CACHE_HASH_SHIFT 10
-#define BITS_CACHE_HASH_SIZE (1 << BITS_CACHE_HASH_SHIFT)
-#define BITS_CACHE_HASH_MASK (BITS_CACHE_HASH_SIZE - 1)
-#define BITS_CACHE_HASH_KEY(id) ((id) & BITS_CACHE_HASH_MASK)
+#define PIXMAP_CACHE_INIT_HASH_SIZE 1024
 
 struct NewCacheItem {
     RingItem lru_link;
-    NewCacheItem *next;
     uint64_t id;
     uint64_t sync[MAX_CACHE_CLIENTS];
     size_t size;
@@ -46,7 +42,10 @@ struct PixmapCache {
     pthread_mutex_t lock;
     uint8_t id;
     uint32_t refs;
-    NewCacheItem *hash_table[BITS_CACHE_HASH_SIZE];
+    /* hash of the items by id, see id-hash-table.hpp */
+    NewCacheItem **hash_table;
+    uint32_t hash_size;             // power of 2
+    uint32_t num_items;
     Ring lru;
     int64_t available;
     int64_t size;
@@ -65,9 +64,29 @@ struct PixmapCache {
     RedClient *client;
 };
 
+/* Images a client holds in one of its caches, kept while its display
+ * channels reconnect. Items are ordered from the least recently used */
+struct PixmapCacheDigestItem {
+    uint64_t id;
+    uint32_t size;
+    uint8_t lossy;
+};
+
+struct PixmapCacheDigest {
+    uint8_t id;
+    uint32_t num_items;
+    PixmapCacheDigestItem items[0];
+};
+
 PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size);
 void         pixmap_cache_unref(PixmapCache *cache);
+PixmapCacheDigest *pixmap_cache_unref_to_digest(PixmapCache *cache, uint8_t client_id,
+                                                uint64_t acked_serial);
+uint32_t     pixmap_cache_adopt_digest(PixmapCache *cache, const PixmapCacheDigest *digest);
 void         pixmap_cache_clear(PixmapCache *cache);
+NewCacheItem *pixmap_cache_unlocked_find(PixmapCache *cache, uint64_t id);
+void         pixmap_cache_unlocked_insert(PixmapCache *cache, NewCacheItem *item);
+void         pixmap_cache_unlocked_unhash(PixmapCache *cache, NewCacheItem *item);
 int          pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy);
 bool         pixmap_cache_freeze(PixmapCache *cache);
 
@@ -23,11 +23,14 @@
 
 #include <fcntl.h>
 #include <glib.h>
+#include <pthread.h>
 #include <unistd.h>
 #ifndef _WIN32
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #endif
 #ifdef HAVE_LINUX_SOCKIOS_H
 #include <linux/sockios.h> /* SIOCOUTQ */
@@ -36,11 +39,31 @@
 
 #include "red-channel-client.h"
 #include "red-client.h"
+#include "reds.h"
+#include "main-channel-client.h"
+#include "net-utils.h"
 
 #define CLIENT_ACK_WINDOW 20
 
+/* interval between updates of the bandwidth estimation and the relative
+ * change reported to the channel client */
+#define NET_ESTIMATE_INTERVAL (NSEC_PER_SEC / 2)
+#define NET_ESTIMATE_REPORT_PERCENT 25
+
 #define MAX_HEADER_SIZE sizeof(SpiceDataHeader)
 
+/* Messages up to COALESCE_MAX_MSG_SIZE bytes are copied into a buffer and
+ * sent together, with at most COALESCE_MAX_MSGS messages per write */
+#define COALESCE_BUF_SIZE (64 * 1024)
+#define COALESCE_MAX_MSG_SIZE (4 * 1024)
+#define COALESCE_MAX_MSGS 64
+
+/* Data queued to the send thread above which the channel client is blocked,
+ * like it would be by a full socket */
+#define SEND_THREAD_MAX_PENDING (4 * 1024 * 1024)
+/* marshallers written by the send thread kept for the next messages */
+#define SEND_THREAD_MAX_SPARE_MARSHALLERS 8
+
 #ifndef IOV_MAX
 #define IOV_MAX 1024
 #endif
@@ -106,6 +129,45 @@ struct OutgoingMessageBuffer {
     int size;
 };
 
+/* Already marshalled messages waiting to be written together */
+struct CoalesceBuffer {
+    uint8_t *data; // nullptr if coalescing is disabled
+    uint32_t pos;
+    uint32_t size;
+    uint32_t num_msgs;
+};
+
+/* A message handed to the send thread. Its marshaller keeps the data it
+ * references alive until the channel client releases it, once written */
+struct RedSendJob {
+    SpiceMarshaller *marshaller;
+    uint32_t size;
+};
+
+/* Writes the messages of a channel client from a dedicated thread.
+ * The channel client still marshalls them, then hands their marshaller to
+ * the thread and goes on with a new one */
+struct RedSendThread {
+    RedStream *stream;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* serializes the accesses to the stream, TLS and SASL are not thread safe */
+    pthread_mutex_t stream_lock;
+    /* [0] is watched by the channel client, [1] polled by the thread */
+    int wakeup_fds[2];
+    SpiceWatch *wakeup_watch;
+
+    /* protected by lock */
+    GQueue pending; // RedSendJob to write
+    uint32_t pending_size; // bytes to write, including the ones being written
+    GQueue written; // RedSendJob written, to release by the channel client
+    bool stop;
+    int error; // errno of the failed write, 0 if none
+
+    GQueue spare; // SpiceMarshaller to reuse, owned by the channel client
+};
+
 struct IncomingMessageBuffer {
     uint8_t header_buf[MAX_HEADER_SIZE];
     SpiceDataHeaderOpaque header;
@@ -135,6 +197,11 @@ struct RedChannelClientPrivate
         uint32_t client_generation;
         uint32_t messages_window;
         uint32_t client_window;
+
+        RedAckBytes bytes;
+        /* 0 if the window is counted in messages */
+        uint64_t bytes_window;
+        uint64_t stall_start;
     } ack_data;
 
     struct {
@@ -167,12 +234,21 @@ struct RedChannelClientPrivate
 
     RedChannelClientLatencyMonitor latency_monitor;
     RedChannelClientConnectivityMonitor connectivity_monitor;
+    RedNetEstimate net_estimate;
 
     IncomingMessageBuffer incoming;
     OutgoingMessageBuffer outgoing;
+    CoalesceBuffer coalesce;
+    RedSendThread *send_thread; // nullptr if messages are written directly
 
     RedStatCounter out_messages;
     RedStatCounter out_bytes;
+    RedStatCounter out_coalesced_messages;
+    RedStatCounter ack_bytes_in_flight;
+    RedStatCounter ack_stall_time_ms;
+    RedStatCounter send_time_ns;
+    RedStatNode stat;
+    bool own_stat_node;
 
     inline RedPipeItemPtr pipe_item_get();
     inline void pipe_remove(RedPipeItem *item);
@@ -184,6 +260,8 @@ struct RedChannelClientPrivate
     inline int get_out_msg_size();
     inline int prepare_out_msg(struct iovec *vec, int vec_size, int pos);
     inline void set_blocked();
+    inline bool coalesce_pending() const;
+    bool coalesce_msg();
     void reset_send_data();
     void seamless_migration_done();
     void clear_sent_item();
@@ -192,8 +270,16 @@ struct RedChannelClientPrivate
     void cancel_ping_timer();
     inline int urgent_marshaller_is_active();
     inline int waiting_for_ack();
+    void ack_reset_bytes();
+    void ack_add_msg(uint32_t size);
+    void ack_received();
+    void update_ack_bytes_window();
     inline void restore_main_sender();
     void watch_update_mask(int event_mask);
+    bool send_thread_start();
+    void send_thread_stop();
+    bool send_thread_queue(int *error);
+    void send_thread_collect();
 };
 
 static void full_header_set_msg_type(SpiceDataHeaderOpaque *header, uint16_t type);
@@ -314,6 +400,11 @@ RedChannelClientPrivate::RedChannelClientPrivate(RedChannel *init_channel,
     outgoing.pos = 0;
     outgoing.size = 0;
 
+    RedsState* reds = channel->get_server();
+    if (channel->coalesce_messages() && reds_get_send_coalescing(reds)) {
+        coalesce.data = static_cast<uint8_t *>(g_malloc(COALESCE_BUF_SIZE));
+    }
+
     if (test_capability(remote_caps.common_caps, remote_caps.num_common_caps,
                         SPICE_COMMON_CAP_MINI_HEADER)) {
         incoming.header = mini_header_wrapper;
@@ -326,14 +417,36 @@ RedChannelClientPrivate::RedChannelClientPrivate(RedChannel *init_channel,
     }
     incoming.header.data = incoming.header_buf;
 
-    RedsState* reds = channel->get_server();
     const RedStatNode *node = channel->get_stat_node();
     stat_init_counter(&out_messages, reds, node, "out_messages", TRUE);
     stat_init_counter(&out_bytes, reds, node, "out_bytes", TRUE);
+    stat_init_counter(&out_coalesced_messages, reds, node, "out_coalesced_messages", TRUE);
+    stat_init_counter(&ack_stall_time_ms, reds, node, "ack_stall_time_ms", TRUE);
+    stat_init_counter(&send_time_ns, reds, node, "send_time_ns", TRUE);
+
+    /* named after the connection, the main channel client comes first */
+    MainChannelClient *mcc = client->get_main();
+    if (mcc) {
+        char name[32];
+        snprintf(name, sizeof(name), "client_%u", mcc->get_connection_id());
+        stat_init_node(&stat, reds, node, name, TRUE);
+        own_stat_node = true;
+        /* a value for each client, not a sum */
+        stat_init_counter(&ack_bytes_in_flight, reds, &stat, "ack_bytes_in_flight", TRUE);
+    } else {
+        stat = *node;
+    }
 }
 
 RedChannelClientPrivate::~RedChannelClientPrivate()
 {
+    send_thread_stop();
+
+    if (own_stat_node) {
+        stat_remove_counter(channel->get_server(), &ack_bytes_in_flight);
+        stat_remove_node(channel->get_server(), &stat);
+    }
+
     red_timer_remove(latency_monitor.timer);
     latency_monitor.timer = nullptr;
 
@@ -351,6 +464,7 @@ RedChannelClientPrivate::~RedChannelClientPrivate()
     }
 
     red_channel_capabilities_reset(&remote_caps);
+    g_free(coalesce.data);
 }
 
 /* This even empty is better to by declared here to make sure
@@ -403,6 +517,342 @@ inline void RedChannelClientPrivate::set_blocked()
     send_data.blocked = true;
 }
 
+inline bool RedChannelClientPrivate::coalesce_pending() const
+{
+    return coalesce.pos < coalesce.size;
+}
+
+/* Copy the current message into the coalesce buffer.
+ * Returns false if the message has to be sent directly */
+bool RedChannelClientPrivate::coalesce_msg()
+{
+    if (!coalesce.data || send_data.size > COALESCE_MAX_MSG_SIZE) {
+        return false;
+    }
+
+    /* file descriptors are sent after the data of their message */
+    int fd;
+    if (spice_marshaller_get_fd(send_data.marshaller, &fd)) {
+        spice_marshaller_add_fd(send_data.marshaller, fd);
+        return false;
+    }
+
+    /* the buffer is only reused when fully written, messages queued
+     * behind a partial write keep their order */
+    if (coalesce.pos == coalesce.size) {
+        coalesce.pos = 0;
+        coalesce.size = 0;
+    }
+    if (coalesce.size + send_data.size > COALESCE_BUF_SIZE) {
+        return false;
+    }
+
+    struct iovec vec[IOV_MAX];
+    int vec_size = prepare_out_msg(vec, G_N_ELEMENTS(vec), 0);
+    for (int i = 0; i < vec_size; i++) {
+        memcpy(coalesce.data + coalesce.size, vec[i].iov_base, vec[i].iov_len);
+        coalesce.size += vec[i].iov_len;
+    }
+    coalesce.num_msgs++;
+    stat_inc_counter(out_coalesced_messages, 1);
+    return true;
+}
+
+static void send_job_free(RedSendJob *job)
+{
+    spice_marshaller_destroy(job->marshaller);
+    g_free(job);
+}
+
+static void send_jobs_free(GQueue *jobs)
+{
+    while (auto job = static_cast<RedSendJob *>(g_queue_pop_head(jobs))) {
+        send_job_free(job);
+    }
+}
+
+#ifndef _WIN32
+static void send_thread_notify(int fd)
+{
+    char c = 0;
+
+    while (write(fd, &c, 1) == -1 && errno == EINTR) {
+        continue;
+    }
+}
+
+static void send_thread_drain(int fd)
+{
+    char buf[16];
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0 && !(n == -1 && errno == EINTR)) {
+            break;
+        }
+    }
+}
+
+/* Called from the channel client thread, once the send thread is stopped:
+ * the marshallers release the data they reference */
+static void send_thread_free(RedSendThread *st)
+{
+    red_watch_remove(st->wakeup_watch);
+    close(st->wakeup_fds[0]);
+    close(st->wakeup_fds[1]);
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->stream_lock);
+    pthread_mutex_destroy(&st->lock);
+    send_jobs_free(&st->pending);
+    send_jobs_free(&st->written);
+    while (auto m = static_cast<SpiceMarshaller *>(g_queue_pop_head(&st->spare))) {
+        spice_marshaller_destroy(m);
+    }
+    g_free(st);
+}
+
+/* Write the messages of @batch, as few writes as possible.
+ * Returns 0 or the errno of the failure */
+static int send_thread_write(RedSendThread *st, GQueue *batch)
+{
+    GList *link = batch->head;
+    uint32_t pos = 0; // in the message of link
+
+    while (link) {
+        struct iovec vec[IOV_MAX];
+        int vec_size = 0;
+        uint32_t skip = pos;
+
+        for (GList *l = link; l && vec_size < IOV_MAX; l = l->next) {
+            auto job = static_cast<RedSendJob *>(l->data);
+            vec_size += spice_marshaller_fill_iovec(job->marshaller, vec + vec_size,
+                                                    IOV_MAX - vec_size, skip);
+            skip = 0;
+        }
+
+        pthread_mutex_lock(&st->stream_lock);
+        ssize_t n = red_stream_writev(st->stream, vec, vec_size);
+        int error = n == 0 ? EPIPE : errno;
+        pthread_mutex_unlock(&st->stream_lock);
+
+        if (n > 0) {
+            size_t written = n;
+            while (written) {
+                auto job = static_cast<RedSendJob *>(link->data);
+                size_t left = job->size - pos;
+                if (written < left) {
+                    pos += written;
+                    break;
+                }
+                written -= left;
+                pos = 0;
+                link = link->next;
+            }
+            continue;
+        }
+        if (error == EINTR) {
+            continue;
+        }
+        if (error != EAGAIN) {
+            return error;
+        }
+
+        struct pollfd fds[2] = {
+            { st->stream->socket, POLLOUT, 0 },
+            { st->wakeup_fds[1], POLLIN, 0 },
+        };
+        if (poll(fds, G_N_ELEMENTS(fds), -1) == -1 && errno != EINTR) {
+            return errno;
+        }
+        if (fds[1].revents) {
+            send_thread_drain(st->wakeup_fds[1]);
+            pthread_mutex_lock(&st->lock);
+            bool stop = st->stop;
+            pthread_mutex_unlock(&st->lock);
+            if (stop) {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static void *send_thread_main(void *opaque)
+{
+    auto st = static_cast<RedSendThread *>(opaque);
+
+    pthread_mutex_lock(&st->lock);
+    while (!st->stop) {
+        if (g_queue_is_empty(&st->pending)) {
+            pthread_cond_wait(&st->cond, &st->lock);
+            continue;
+        }
+
+        GQueue batch = st->pending;
+        g_queue_init(&st->pending);
+        pthread_mutex_unlock(&st->lock);
+
+        int error = send_thread_write(st, &batch);
+
+        pthread_mutex_lock(&st->lock);
+        if (error) {
+            /* not sent, released with the thread */
+            while (auto job = g_queue_pop_tail(&batch)) {
+                g_queue_push_head(&st->pending, job);
+            }
+            st->error = error;
+            send_thread_notify(st->wakeup_fds[1]);
+            break;
+        }
+        /* the channel client collects all the messages written at once */
+        bool notify = g_queue_is_empty(&st->written);
+        while (auto job = static_cast<RedSendJob *>(g_queue_pop_head(&batch))) {
+            st->pending_size -= job->size;
+            g_queue_push_tail(&st->written, job);
+        }
+        if (g_queue_is_empty(&st->pending)) {
+            /* idle, don't let the last messages wait in the socket */
+            pthread_mutex_lock(&st->stream_lock);
+            red_stream_flush(st->stream);
+            pthread_mutex_unlock(&st->stream_lock);
+        }
+        if (notify) {
+            send_thread_notify(st->wakeup_fds[1]);
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    return nullptr;
+}
+#endif
+
+bool RedChannelClientPrivate::send_thread_start()
+{
+#ifndef _WIN32
+    auto st = g_new0(RedSendThread, 1);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, st->wakeup_fds) == -1) {
+        red_channel_warning(channel, "socketpair failed %s", strerror(errno));
+        g_free(st);
+        return false;
+    }
+    red_socket_set_non_blocking(st->wakeup_fds[0], TRUE);
+    red_socket_set_non_blocking(st->wakeup_fds[1], TRUE);
+
+    st->stream = stream;
+    pthread_mutex_init(&st->lock, nullptr);
+    pthread_mutex_init(&st->stream_lock, nullptr);
+    pthread_cond_init(&st->cond, nullptr);
+
+    if (pthread_create(&st->thread, nullptr, send_thread_main, st) != 0) {
+        red_channel_warning(channel, "failed to create the send thread");
+        send_thread_free(st);
+        return false;
+    }
+    send_thread = st;
+
+    /* the send thread writes the messages queued together */
+    g_free(coalesce.data);
+    coalesce.data = nullptr;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void RedChannelClientPrivate::send_thread_stop()
+{
+#ifndef _WIN32
+    RedSendThread *st = send_thread;
+
+    if (!st) {
+        return;
+    }
+    send_thread = nullptr;
+
+    /* data not written yet is dropped */
+    pthread_mutex_lock(&st->lock);
+    st->stop = true;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    send_thread_notify(st->wakeup_fds[0]);
+    pthread_join(st->thread, nullptr);
+
+    send_thread_free(st);
+#endif
+}
+
+/* Hand the current message to the send thread, its marshaller is replaced
+ * by a new one until the thread wrote it.
+ * Returns false if it was not queued, either because the thread is already
+ * late or because it failed, in which case error is set */
+bool RedChannelClientPrivate::send_thread_queue(int *error)
+{
+    RedSendThread *st = send_thread;
+    bool queued = false;
+
+    pthread_mutex_lock(&st->lock);
+    *error = st->error;
+    if (*error) {
+        // don't queue more
+    } else if (send_data.size == 0) {
+        queued = true;
+    } else if (st->pending_size == 0 ||
+               st->pending_size + send_data.size <= SEND_THREAD_MAX_PENDING) {
+        auto job = g_new(RedSendJob, 1);
+        job->marshaller = send_data.marshaller;
+        job->size = send_data.size;
+        g_queue_push_tail(&st->pending, job);
+        st->pending_size += job->size;
+        pthread_cond_signal(&st->cond);
+        queued = true;
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    if (queued && send_data.size) {
+        auto m = static_cast<SpiceMarshaller *>(g_queue_pop_head(&st->spare));
+        if (!m) {
+            m = spice_marshaller_new();
+        }
+        if (urgent_marshaller_is_active()) {
+            send_data.urgent.marshaller = m;
+        } else {
+            send_data.main.marshaller = m;
+        }
+        send_data.marshaller = m;
+    }
+    return queued;
+}
+
+/* Release the messages written by the send thread, they are sent now */
+void RedChannelClientPrivate::send_thread_collect()
+{
+    RedSendThread *st = send_thread;
+
+    pthread_mutex_lock(&st->lock);
+    GQueue written = st->written;
+    g_queue_init(&st->written);
+    bool idle = st->pending_size == 0;
+    pthread_mutex_unlock(&st->lock);
+
+    if (g_queue_is_empty(&written)) {
+        return;
+    }
+    while (auto job = static_cast<RedSendJob *>(g_queue_pop_head(&written))) {
+        data_sent(job->size);
+        if (g_queue_get_length(&st->spare) < SEND_THREAD_MAX_SPARE_MARSHALLERS) {
+            spice_marshaller_reset(job->marshaller);
+            g_queue_push_head(&st->spare, job->marshaller);
+            g_free(job);
+        } else {
+            send_job_free(job);
+        }
+    }
+    if (idle && pipe.empty() && send_data.size == 0) {
+        /* the socket may become idle, so we may be able to test latency */
+        restart_ping_timer();
+    }
+}
+
 inline int RedChannelClientPrivate::urgent_marshaller_is_active()
 {
     return send_data.marshaller == send_data.urgent.marshaller;
@@ -431,6 +881,8 @@ void RedChannelClient::send_set_ack()
     ack.generation = ++priv->ack_data.generation;
     ack.window = priv->ack_data.client_window;
     priv->ack_data.messages_window = 0;
+    priv->ack_reset_bytes();
+    priv->update_ack_bytes_window();
 
     spice_marshall_msg_set_ack(priv->send_data.marshaller, &ack);
 
@@ -546,7 +998,8 @@ void RedChannelClient::msg_sent()
         spice_assert(priv->send_data.header.data != nullptr);
         begin_send_message();
     } else {
-        if (priv->pipe.empty()) {
+        /* the send thread tells once it wrote the messages */
+        if (priv->pipe.empty() && !priv->send_thread) {
             /* It is possible that the socket will become idle, so we may be able to test latency */
             priv->restart_ping_timer();
         }
@@ -628,12 +1081,186 @@ void RedChannelClient::ping_timer(RedChannelClient *rcc)
     rcc->push_ping();
 }
 
+bool red_ack_window_is_full(uint32_t messages_window, uint32_t client_window,
+                            uint64_t bytes_in_flight, uint64_t bytes_window)
+{
+    if (bytes_window == 0) {
+        return messages_window > client_window * 2;
+    }
+    /* the client acknowledges every client_window messages, stopping
+     * before that would never get an ack */
+    if (messages_window <= client_window) {
+        return false;
+    }
+    return bytes_in_flight >= bytes_window || messages_window >= ACK_MAX_MESSAGES;
+}
+
 inline int RedChannelClientPrivate::waiting_for_ack()
 {
-    gboolean handle_acks = channel->handle_acks();
+    if (!channel->handle_acks()) {
+        return FALSE;
+    }
+    return red_ack_window_is_full(ack_data.messages_window, ack_data.client_window,
+                                  ack_data.bytes.in_flight, ack_data.bytes_window);
+}
+
+void RedAckBytes::reset()
+{
+    head = 0;
+    count = 0;
+    in_flight = 0;
+}
+
+void RedAckBytes::add_msg(uint32_t size)
+{
+    if (count == ACK_MAX_MESSAGES) {
+        return;
+    }
+    msg_sizes[(head + count) % ACK_MAX_MESSAGES] = size;
+    count++;
+    in_flight += size;
+}
+
+uint64_t RedAckBytes::remove_msgs(uint32_t num_msgs)
+{
+    uint64_t removed = 0;
+
+    for (num_msgs = MIN(num_msgs, count); num_msgs > 0; num_msgs--) {
+        removed += msg_sizes[head];
+        head = (head + 1) % ACK_MAX_MESSAGES;
+        count--;
+    }
+    in_flight -= removed;
+    return removed;
+}
 
-    return (handle_acks && (ack_data.messages_window >
-                            ack_data.client_window * 2));
+void RedChannelClientPrivate::ack_reset_bytes()
+{
+    ack_data.bytes.reset();
+    ack_data.stall_start = 0;
+    stat_set_counter(ack_bytes_in_flight, 0);
+}
+
+void RedChannelClientPrivate::ack_add_msg(uint32_t size)
+{
+    ack_data.bytes.add_msg(size);
+    stat_set_counter(ack_bytes_in_flight, ack_data.bytes.in_flight);
+}
+
+/* the client received client_window more messages */
+void RedChannelClientPrivate::ack_received()
+{
+    uint64_t acked_bytes = ack_data.bytes.remove_msgs(ack_data.client_window);
+    uint64_t now = spice_get_monotonic_time_ns();
+
+    stat_set_counter(ack_bytes_in_flight, ack_data.bytes.in_flight);
+
+    bool stalled = ack_data.stall_start != 0;
+    if (stalled) {
+        stat_inc_counter(ack_stall_time_ms, (now - ack_data.stall_start) / NSEC_PER_MILLISEC);
+        ack_data.stall_start = 0;
+    }
+    net_estimate.add_ack(acked_bytes, now, stalled);
+    update_ack_bytes_window();
+}
+
+void RedNetEstimate::add_roundtrip(int64_t sample)
+{
+    if (roundtrip == 0) {
+        roundtrip = sample;
+    } else {
+        roundtrip = (roundtrip * 7 + sample) / 8;
+    }
+}
+
+void RedNetEstimate::add_bitrate(uint64_t sample)
+{
+    if (bitrate_per_sec == 0) {
+        bitrate_per_sec = sample;
+    } else {
+        bitrate_per_sec = (bitrate_per_sec * 3 + sample) / 4;
+    }
+}
+
+void RedNetEstimate::add_ack(uint64_t acked_bytes, uint64_t time, bool stalled)
+{
+    if (stalled && last_ack_time && time > last_ack_time) {
+        add_bitrate(acked_bytes * 8 * NSEC_PER_SEC / (time - last_ack_time));
+    }
+    last_ack_time = time;
+}
+
+void RedNetEstimate::add_tcp_info(uint32_t rtt_us, uint64_t cwnd_bytes, bool network_limited)
+{
+    if (rtt_us == 0) {
+        return;
+    }
+    add_roundtrip(int64_t{rtt_us} * NSEC_PER_MICROSEC);
+    if (network_limited) {
+        /* the congestion window is what the connection can send per roundtrip */
+        add_bitrate(cwnd_bytes * 8 * 1000000 / rtt_us);
+    }
+}
+
+bool RedNetEstimate::report_bitrate()
+{
+    if (bitrate_per_sec == 0) {
+        return false;
+    }
+    if (reported_bitrate != 0 &&
+        bitrate_per_sec * 100 <= reported_bitrate * (100 + NET_ESTIMATE_REPORT_PERCENT) &&
+        bitrate_per_sec * 100 >= reported_bitrate * (100 - NET_ESTIMATE_REPORT_PERCENT)) {
+        return false;
+    }
+    reported_bitrate = bitrate_per_sec;
+    return true;
+}
+
+uint64_t red_ack_bytes_window(uint64_t bitrate_per_sec, int64_t roundtrip_us,
+                              uint64_t min_bytes, uint64_t max_bytes)
+{
+    uint64_t bytes_per_sec = bitrate_per_sec / 8;
+    uint64_t window = max_bytes;
+
+    // beyond that rate the window is the maximum, don't overflow computing it
+    if (bytes_per_sec < max_bytes * 500000 / roundtrip_us) {
+        window = bytes_per_sec * roundtrip_us / 1000000 * 2;
+    }
+    return CLAMP(window, min_bytes, max_bytes);
+}
+
+/* Size the window from the bandwidth and roundtrip of the connection.
+ * Messages are counted instead until both are known */
+void RedChannelClientPrivate::update_ack_bytes_window()
+{
+    uint64_t min_bytes = channel->get_ack_window_min_bytes();
+    uint64_t max_bytes = channel->get_ack_window_max_bytes();
+    MainChannelClient *mcc = client->get_main();
+
+    ack_data.bytes_window = 0;
+    if (max_bytes == 0) {
+        return;
+    }
+
+    uint64_t bitrate = net_estimate.bitrate_per_sec;
+    int64_t roundtrip_us = net_estimate.roundtrip / NSEC_PER_MICROSEC;
+    if (bitrate == 0) {
+        if (!mcc || !mcc->is_network_info_initialized()) {
+            return;
+        }
+        bitrate = mcc->get_bitrate_per_sec();
+    }
+    if (roundtrip_us <= 0) {
+        roundtrip_us = latency_monitor.roundtrip / NSEC_PER_MICROSEC;
+    }
+    if (roundtrip_us <= 0 && mcc) {
+        roundtrip_us = mcc->get_roundtrip_ms() * 1000;
+    }
+    if (roundtrip_us <= 0) {
+        return;
+    }
+
+    ack_data.bytes_window = red_ack_bytes_window(bitrate, roundtrip_us, min_bytes, max_bytes);
 }
 
 /*
@@ -828,6 +1455,20 @@ bool RedChannelClient::init()
                         red_channel_client_event,
                         this);
 
+#ifndef _WIN32
+    /* local clients are cheap to write to and can receive file descriptors */
+    if (priv->channel->send_thread() &&
+        reds_get_display_send_threads(priv->channel->get_server()) &&
+        red_stream_get_family(priv->stream) != AF_UNIX &&
+        priv->send_thread_start()) {
+        priv->send_thread->wakeup_watch =
+            core->watch_new(priv->send_thread->wakeup_fds[0],
+                            SPICE_WATCH_EVENT_READ,
+                            send_thread_wakeup,
+                            this);
+    }
+#endif
+
     if (red_stream_get_family(priv->stream) != AF_UNIX) {
         priv->latency_monitor.timer =
             core->timer_new(ping_timer, this);
@@ -864,6 +1505,10 @@ void RedChannelClientPrivate::watch_update_mask(int event_mask)
     if (block_read) {
         event_mask &= ~SPICE_WATCH_EVENT_READ;
     }
+    /* the socket being writable doesn't help, the send thread wakes us up */
+    if (send_thread && send_data.blocked) {
+        event_mask &= ~SPICE_WATCH_EVENT_WRITE;
+    }
 
     red_watch_update_mask(stream->watch, event_mask);
 }
@@ -940,6 +1585,16 @@ void RedChannelClient::handle_outgoing()
         return;
     }
 
+    if (priv->send_thread) {
+        send_to_thread();
+        return;
+    }
+
+    /* coalesced messages were marshalled before the current one */
+    if (!send_coalesced()) {
+        return;
+    }
+
     if (buffer->size == 0) {
         buffer->size = priv->get_out_msg_size();
         if (!buffer->size) {  // nothing to be sent
@@ -983,8 +1638,103 @@ void RedChannelClient::handle_outgoing()
     }
 }
 
+/* The bytes are counted as sent once the thread wrote them, see
+ * RedChannelClientPrivate::send_thread_collect() */
+void RedChannelClient::send_to_thread()
+{
+    uint32_t size = priv->get_out_msg_size();
+    int error;
+
+    if (!priv->send_thread_queue(&error)) {
+        if (error) {
+            if (error != EPIPE) {
+                red_channel_warning(get_channel(), "%s", strerror(error));
+            }
+            disconnect();
+            return;
+        }
+        priv->set_blocked();
+        priv->watch_update_mask(SPICE_WATCH_EVENT_READ);
+        return;
+    }
+    if (size) {
+        msg_sent();
+    }
+}
+
+#ifndef _WIN32
+/* The send thread wrote messages, making room for more, or failed */
+void RedChannelClient::send_thread_wakeup(int fd, int event, RedChannelClient *rcc)
+{
+    red::shared_ptr<RedChannelClient> hold_rcc(rcc);
+
+    send_thread_drain(fd);
+    if (rcc->priv->send_thread) {
+        rcc->priv->send_thread_collect();
+    }
+    rcc->send();
+    if (rcc->is_connected()) {
+        rcc->push();
+    }
+}
+#endif
+
+/* Write the coalesced messages.
+ * Returns true if everything was written */
+bool RedChannelClient::send_coalesced()
+{
+    CoalesceBuffer *coalesce = &priv->coalesce;
+
+    while (priv->coalesce_pending()) {
+        ssize_t n = red_stream_write(priv->stream, coalesce->data + coalesce->pos,
+                                     coalesce->size - coalesce->pos);
+        if (n == -1) {
+            switch (errno) {
+            case EAGAIN:
+                priv->set_blocked();
+                break;
+            case EINTR:
+                continue;
+            case EPIPE:
+                disconnect();
+                break;
+            default:
+                red_channel_warning(get_channel(), "%s", strerror(errno));
+                disconnect();
+                break;
+            }
+            return false;
+        }
+        coalesce->pos += n;
+        priv->data_sent(n);
+    }
+    coalesce->pos = 0;
+    coalesce->size = 0;
+    coalesce->num_msgs = 0;
+    if (no_item_being_sent()) {
+        priv->send_data.blocked = false;
+    }
+    return true;
+}
+
+static ssize_t stream_read(RedStream *stream, RedSendThread *send_thread,
+                           uint8_t *buf, size_t size)
+{
+    if (!send_thread) {
+        return red_stream_read(stream, buf, size);
+    }
+
+    pthread_mutex_lock(&send_thread->stream_lock);
+    ssize_t ret = red_stream_read(stream, buf, size);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&send_thread->stream_lock);
+    errno = saved_errno;
+    return ret;
+}
+
 /* return the number of bytes read. -1 in case of error */
-static int red_peer_receive(RedStream *stream, uint8_t *buf, uint32_t size)
+static int red_peer_receive(RedStream *stream, RedSendThread *send_thread,
+                            uint8_t *buf, uint32_t size)
 {
     uint8_t *pos = buf;
     while (size) {
@@ -996,7 +1746,7 @@ static int red_peer_receive(RedStream *stream, uint8_t *buf, uint32_t size)
         if (!stream->watch) {
             return -1;
         }
-        now = red_stream_read(stream, pos, size);
+        now = stream_read(stream, send_thread, pos, size);
         if (now <= 0) {
             if (now == 0) {
                 return -1;
@@ -1045,7 +1795,7 @@ void RedChannelClient::handle_incoming()
         RedChannel *channel = get_channel();
 
         if (buffer->header_pos < buffer->header.header_size) {
-            bytes_read = red_peer_receive(stream,
+            bytes_read = red_peer_receive(stream, priv->send_thread,
                                           buffer->header.data + buffer->header_pos,
                                           buffer->header.header_size - buffer->header_pos);
             if (bytes_read == -1) {
@@ -1077,7 +1827,7 @@ void RedChannelClient::handle_incoming()
                 }
             }
 
-            bytes_read = red_peer_receive(stream,
+            bytes_read = red_peer_receive(stream, priv->send_thread,
                                           buffer->msg + buffer->msg_pos,
                                           msg_size - buffer->msg_pos);
             if (bytes_read == -1) {
@@ -1150,6 +1900,9 @@ void RedChannelClient::push()
 
     priv->during_send = TRUE;
     red::shared_ptr<RedChannelClient> hold_rcc(this);
+#ifdef RED_STATISTICS
+    uint64_t start = spice_get_monotonic_time_ns();
+#endif
     if (is_blocked()) {
         send();
     }
@@ -1163,6 +1916,12 @@ void RedChannelClient::push()
     while (auto pipe_item = priv->pipe_item_get()) {
         send_any_item(pipe_item.get());
     }
+    if (priv->waiting_for_ack() && !priv->pipe.empty() && !priv->ack_data.stall_start) {
+        priv->ack_data.stall_start = spice_get_monotonic_time_ns();
+    }
+    if (priv->stream) {
+        send_coalesced();
+    }
     /* prepare_pipe_add() will reenable WRITE events when the priv->pipe is empty
      * ack_zero_messages_window() will reenable WRITE events
      * if we were waiting for acks to be received
@@ -1170,7 +1929,7 @@ void RedChannelClient::push()
      * notified that we can write and we then exit (see pipe_item_get) as we
      * are waiting for the ack consuming CPU in a tight loop
      */
-    if ((no_item_being_sent() && priv->pipe.empty()) ||
+    if ((no_item_being_sent() && !priv->coalesce_pending() && priv->pipe.empty()) ||
         priv->waiting_for_ack()) {
         priv->watch_update_mask(SPICE_WATCH_EVENT_READ);
 
@@ -1180,10 +1939,21 @@ void RedChannelClient::push()
          * We need to flush also in case of ack as it is possible
          * that for a long train of small messages the message that would
          * cause the client to send the ack is still in the queue
+         * The send thread flushes by itself once it wrote everything
          */
-        red_stream_flush(priv->stream);
+        if (!priv->send_thread) {
+            red_stream_flush(priv->stream);
+        }
     }
     priv->during_send = FALSE;
+#ifdef RED_STATISTICS
+    /* marshalling, compressing and writing the messages */
+    stat_inc_counter(priv->send_time_ns, spice_get_monotonic_time_ns() - start);
+#endif
+
+    if (priv->stream && is_connected()) {
+        update_net_estimate();
+    }
 }
 
 int RedChannelClient::get_roundtrip_ms() const
@@ -1197,9 +1967,51 @@ int RedChannelClient::get_roundtrip_ms() const
 void RedChannelClient::init_outgoing_messages_window()
 {
     priv->ack_data.messages_window = 0;
+    priv->ack_reset_bytes();
     push();
 }
 
+uint64_t RedChannelClient::get_bitrate_estimate() const
+{
+    return priv->net_estimate.bitrate_per_sec;
+}
+
+uint32_t RedChannelClient::get_roundtrip_estimate_ms() const
+{
+    return priv->net_estimate.roundtrip / NSEC_PER_MILLISEC;
+}
+
+/* Update the estimation of the connection bandwidth and roundtrip, using
+ * what the TCP stack knows about the connection when available */
+void RedChannelClient::update_net_estimate()
+{
+    RedNetEstimate *estimate = &priv->net_estimate;
+    uint64_t now = spice_get_monotonic_time_ns();
+
+    if (now - estimate->last_update < NET_ESTIMATE_INTERVAL) {
+        return;
+    }
+    estimate->last_update = now;
+
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (priv->stream &&
+        getsockopt(priv->stream->socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        /* waiting for the socket, the send thread or the client acks */
+        bool network_limited = priv->send_data.blocked || priv->ack_data.stall_start ||
+                               send_thread_pending();
+        estimate->add_tcp_info(info.tcpi_rtt, uint64_t{info.tcpi_snd_cwnd} * info.tcpi_snd_mss,
+                               network_limited);
+    }
+#endif
+
+    if (estimate->report_bitrate()) {
+        on_net_estimate_changed();
+    }
+}
+
 void RedChannelClientPrivate::handle_pong(SpiceMsgPing *ping)
 {
     uint64_t now;
@@ -1234,6 +2046,7 @@ void RedChannelClientPrivate::handle_pong(SpiceMsgPing *ping)
      *  threads or processes that are utilizing the network. We update the roundtrip
      *  measurement with the minimal value we encountered till now.
      */
+    net_estimate.add_roundtrip(now - ping->timestamp);
     if (latency_monitor.roundtrip < 0 ||
         now - ping->timestamp < latency_monitor.roundtrip) {
         latency_monitor.roundtrip = now - ping->timestamp;
@@ -1288,6 +2101,8 @@ bool RedChannelClient::handle_message(uint16_t type, uint32_t size, void *messag
     case SPICE_MSGC_ACK:
         if (priv->ack_data.client_generation == priv->ack_data.generation) {
             priv->ack_data.messages_window -= priv->ack_data.client_window;
+            priv->ack_received();
+            update_net_estimate();
             priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
             push();
         }
@@ -1307,6 +2122,7 @@ bool RedChannelClient::handle_message(uint16_t type, uint32_t size, void *messag
         break;
     case SPICE_MSGC_PONG:
         priv->handle_pong(static_cast<SpiceMsgPing *>(message));
+        update_net_estimate();
         break;
     default:
         red_channel_warning(get_channel(), "invalid message type %u",
@@ -1346,7 +2162,17 @@ void RedChannelClient::begin_send_message()
     priv->send_data.header.set_msg_serial(&priv->send_data.header,
                                                ++priv->send_data.last_sent_serial);
     priv->ack_data.messages_window++;
+    priv->ack_add_msg(priv->send_data.size);
     priv->send_data.header.data = nullptr; /* avoid writing to this until we have a new message */
+
+    /* only coalesce while pushing, push() writes the messages at the end */
+    if (priv->during_send && priv->coalesce_msg()) {
+        msg_sent();
+        if (priv->coalesce.num_msgs >= COALESCE_MAX_MSGS) {
+            send_coalesced();
+        }
+        return;
+    }
     send();
 }
 
@@ -1366,6 +2192,15 @@ uint64_t RedChannelClient::get_message_serial() const
     return priv->send_data.last_sent_serial + 1;
 }
 
+uint64_t RedChannelClient::get_acked_serial() const
+{
+    if (!priv->channel->handle_acks() ||
+        priv->ack_data.messages_window > priv->send_data.last_sent_serial) {
+        return 0;
+    }
+    return priv->send_data.last_sent_serial - priv->ack_data.messages_window;
+}
+
 inline void RedChannelClientPrivate::set_message_serial(uint64_t serial)
 {
     send_data.last_sent_serial = serial - 1;
@@ -1501,6 +2336,9 @@ void RedChannelClientPrivate::clear_sent_item()
 void RedChannelClientPrivate::pipe_clear()
 {
     clear_sent_item();
+    coalesce.pos = 0;
+    coalesce.size = 0;
+    coalesce.num_msgs = 0;
     pipe.clear();
 }
 
@@ -1508,6 +2346,7 @@ void RedChannelClient::ack_zero_messages_window()
 {
     priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
     priv->ack_data.messages_window = 0;
+    priv->ack_reset_bytes();
 }
 
 void RedChannelClient::ack_set_client_window(int client_window)
@@ -1530,6 +2369,7 @@ void RedChannelClient::disconnect()
     priv->pipe_clear();
 
     shutdown();
+    priv->send_thread_stop();
 
     red_timer_remove(priv->latency_monitor.timer);
     priv->latency_monitor.timer = nullptr;
@@ -1550,6 +2390,19 @@ bool RedChannelClient::is_blocked() const
     return priv->send_data.blocked;
 }
 
+bool RedChannelClient::send_thread_pending() const
+{
+    RedSendThread *st = priv->send_thread;
+
+    if (!st) {
+        return false;
+    }
+    pthread_mutex_lock(&st->lock);
+    bool pending = !st->error && st->pending_size != 0;
+    pthread_mutex_unlock(&st->lock);
+    return pending;
+}
+
 int RedChannelClient::send_message_pending()
 {
     return priv->send_data.header.get_msg_type(&priv->send_data.header) != 0;
@@ -1570,6 +2423,11 @@ RedClient *RedChannelClient::get_client()
     return priv->client;
 }
 
+const RedStatNode *RedChannelClient::get_stat_node()
+{
+    return &priv->stat;
+}
+
 void RedChannelClient::set_header_sub_list(uint32_t sub_list)
 {
     priv->send_data.header.set_msg_sub_list(&priv->send_data.header, sub_list);
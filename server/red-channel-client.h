@@ -29,6 +29,53 @@
 
 #include "push-visibility.h"
 
+/* maximum number of messages not acknowledged when the window is counted in
+ * bytes, the size of each of them is kept until acknowledged */
+#define ACK_MAX_MESSAGES 512
+
+/* Size of the messages sent and not acknowledged yet, oldest first */
+struct RedAckBytes {
+    void reset();
+    void add_msg(uint32_t size);
+    /* the client received @num_msgs more messages, returns their size */
+    uint64_t remove_msgs(uint32_t num_msgs);
+
+    uint32_t msg_sizes[ACK_MAX_MESSAGES];
+    uint32_t head = 0;
+    uint32_t count = 0;
+    uint64_t in_flight = 0;
+};
+
+/* Whether sending must wait for the client to acknowledge messages.
+ * @bytes_window is 0 if the window is counted in messages */
+bool red_ack_window_is_full(uint32_t messages_window, uint32_t client_window,
+                            uint64_t bytes_in_flight, uint64_t bytes_window);
+/* Twice the bandwidth-delay product of the connection, within the bounds */
+uint64_t red_ack_bytes_window(uint64_t bitrate_per_sec, int64_t roundtrip_us,
+                              uint64_t min_bytes, uint64_t max_bytes);
+
+/* Estimation of the bandwidth and roundtrip of a connection, the samples are
+ * smoothed so a single slow or fast one does not change it much */
+struct RedNetEstimate {
+    void add_roundtrip(int64_t roundtrip);
+    void add_bitrate(uint64_t bitrate);
+    /* the client acknowledged @acked_bytes at @time, sending was waiting for
+     * it if @stalled so the rate of the acks is the one of the connection */
+    void add_ack(uint64_t acked_bytes, uint64_t time, bool stalled);
+    /* what the TCP stack knows of the connection. The congestion window
+     * stays small while the application sends little, it only tells the
+     * bandwidth if sending is @network_limited */
+    void add_tcp_info(uint32_t rtt_us, uint64_t cwnd_bytes, bool network_limited);
+    /* whether the bitrate changed enough since the last time it was reported */
+    bool report_bitrate();
+
+    uint64_t bitrate_per_sec = 0; // smoothed, 0 if unknown
+    int64_t roundtrip = 0;        // smoothed, ns, 0 if unknown
+    uint64_t last_update = 0;
+    uint64_t last_ack_time = 0;
+    uint64_t reported_bitrate = 0;
+};
+
 struct RedChannelClientPrivate;
 
 class RedChannelClient: public red::shared_ptr_counted
@@ -57,6 +104,8 @@ public:
     void init_send_data(uint16_t msg_type);
 
     uint64_t get_message_serial() const;
+    /* serial of the last message the client acknowledged, 0 if unknown */
+    uint64_t get_acked_serial() const;
 
     /* When sending a msg. Should first call begin_send_message.
      * It will first send the pending urgent data, if there is any, and then
@@ -78,6 +127,11 @@ public:
     /* returns -1 if we don't have an estimation */
     int get_roundtrip_ms() const;
 
+    /* Smoothed estimations of the connection updated while sending,
+     * return 0 if we don't have an estimation */
+    uint64_t get_bitrate_estimate() const;
+    uint32_t get_roundtrip_estimate_ms() const;
+
 protected:
     /* Checks periodically if the connection is still alive */
     void start_connectivity_monitoring(uint32_t timeout_ms);
@@ -107,6 +161,8 @@ public:
     void push_set_ack();
 
     bool is_blocked() const;
+    /* messages were handed to the send thread but not written yet */
+    bool send_thread_pending() const;
 
     /* helper for channels that have complex logic that can possibly ready a send */
     int send_message_pending();
@@ -121,6 +177,8 @@ public:
     SpiceMarshaller *get_marshaller();
     RedStream *get_stream();
     RedClient *get_client();
+    /* statistics of this client, a child of the ones of its channel */
+    const RedStatNode *get_stat_node();
 
     /* Note that the header is valid only between reset_send_data and
      * begin_send_message.*/
@@ -164,6 +222,9 @@ protected:
 
     virtual void on_disconnect() {};
 
+    /* called when the bitrate estimation changed significantly */
+    virtual void on_net_estimate_changed() {};
+
     // TODO: add ASSERTS for thread_id  in client and channel calls
     /*
      * callbacks that are triggered from channel client stream events.
@@ -181,6 +242,9 @@ protected:
 private:
     void send_any_item(RedPipeItem *item);
     void handle_outgoing();
+    void update_net_estimate();
+    bool send_coalesced();
+    void send_to_thread();
     void handle_incoming();
     virtual void handle_migrate_flush_mark();
     void handle_migrate_data_early(uint32_t size, void *message);
@@ -192,6 +256,7 @@ private:
     void msg_sent();
     static void ping_timer(RedChannelClient *rcc);
     static void connectivity_timer(RedChannelClient *rcc);
+    static void send_thread_wakeup(int fd, int event, RedChannelClient *rcc);
     void send_ping();
     void push_ping();
 
@@ -69,6 +69,8 @@ struct RedChannelPrivate
         type(init_type), id(init_id),
         core(init_core ? init_core : reds_get_core_interface(init_reds)),
         handle_acks(!!(flags & RedChannel::HandleAcks)),
+        coalesce_messages(!!(flags & RedChannel::CoalesceMessages)),
+        send_thread(!!(flags & RedChannel::SendThread)),
         parser(spice_get_client_channel_parser(init_type, nullptr)),
         migration_flags(flags & RedChannel::MigrateAll),
         dispatcher(init_dispatcher),
@@ -90,6 +92,10 @@ struct RedChannelPrivate
      */
     SpiceCoreInterfaceInternal *const core;
     const bool handle_acks;
+    const bool coalesce_messages;
+    const bool send_thread;
+    uint32_t ack_window_min_bytes;
+    uint32_t ack_window_max_bytes;
 
     const spice_parse_channel_func_t parser;
 
@@ -151,6 +157,33 @@ bool RedChannel::handle_acks() const
     return priv->handle_acks;
 }
 
+bool RedChannel::coalesce_messages() const
+{
+    return priv->coalesce_messages;
+}
+
+bool RedChannel::send_thread() const
+{
+    return priv->send_thread;
+}
+
+void RedChannel::set_ack_window_bytes(uint32_t min_bytes, uint32_t max_bytes)
+{
+    spice_return_if_fail(min_bytes <= max_bytes);
+    priv->ack_window_min_bytes = min_bytes;
+    priv->ack_window_max_bytes = max_bytes;
+}
+
+uint32_t RedChannel::get_ack_window_min_bytes() const
+{
+    return priv->ack_window_min_bytes;
+}
+
+uint32_t RedChannel::get_ack_window_max_bytes() const
+{
+    return priv->ack_window_max_bytes;
+}
+
 uint8_t *RedChannel::parse(uint8_t *message, size_t message_size,
                            uint16_t message_type,
                            size_t *size_out, message_destructor_t *free_message) const
@@ -391,7 +424,7 @@ static bool red_channel_any_blocked(RedChannel *channel)
     RedChannelClient *rcc;
 
     FOREACH_CLIENT(channel, rcc) {
-        if (rcc->is_blocked()) {
+        if (rcc->is_blocked() || rcc->send_thread_pending()) {
             return TRUE;
         }
     }
@@ -60,6 +60,12 @@ struct RedChannel: public red::shared_ptr_counted
         MigrateNeedFlush = SPICE_MIGRATE_NEED_FLUSH,
         MigrateNeedDataTransfer = SPICE_MIGRATE_NEED_DATA_TRANSFER,
         HandleAcks = 8,
+        /* small messages can be coalesced in a single write, if enabled
+         * with spice_server_set_send_coalescing() */
+        CoalesceMessages = 16,
+        /* messages are written by a thread of each client, if enabled with
+         * spice_server_set_display_send_threads() */
+        SendThread = 32,
         MigrateAll = MigrateNeedFlush|MigrateNeedDataTransfer,
     } CreationFlags;
 
@@ -71,6 +77,8 @@ struct RedChannel: public red::shared_ptr_counted
     uint32_t type() const;
     uint32_t migration_flags() const;
     bool handle_acks() const;
+    bool coalesce_messages() const;
+    bool send_thread() const;
 
     virtual void on_connect(RedClient *client, RedStream *stream, int migration,
                             RedChannelCapabilities *caps) = 0;
@@ -90,6 +98,14 @@ struct RedChannel: public red::shared_ptr_counted
     void set_common_cap(uint32_t cap);
     void set_cap(uint32_t cap);
 
+    /* Bounds of the number of bytes sent and not yet acknowledged by the
+     * client. If set, the window of clients is sized from their measured
+     * bandwidth and roundtrip, otherwise only the number of messages is
+     * limited. Only used for channels handling acks */
+    void set_ack_window_bytes(uint32_t min_bytes, uint32_t max_bytes);
+    uint32_t get_ack_window_min_bytes() const;
+    uint32_t get_ack_window_max_bytes() const;
+
     int is_connected();
 
     /* seamless migration is supported for only one client. This routine
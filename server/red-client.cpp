@@ -24,6 +24,7 @@
 RedClient::~RedClient()
 {
     spice_debug("release client=%p", this);
+    g_free(pixmap_cache_digest);
     pthread_mutex_destroy(&lock);
 }
 
@@ -262,3 +263,22 @@ RedsState *RedClient::get_server()
 {
     return reds;
 }
+
+void RedClient::set_pixmap_cache_digest(PixmapCacheDigest *digest)
+{
+    pthread_mutex_lock(&lock);
+    g_free(pixmap_cache_digest);
+    pixmap_cache_digest = digest;
+    pthread_mutex_unlock(&lock);
+}
+
+PixmapCacheDigest *RedClient::take_pixmap_cache_digest()
+{
+    PixmapCacheDigest *digest;
+
+    pthread_mutex_lock(&lock);
+    digest = pixmap_cache_digest;
+    pixmap_cache_digest = nullptr;
+    pthread_mutex_unlock(&lock);
+    return digest;
+}
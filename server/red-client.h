@@ -24,6 +24,8 @@
 
 #include "push-visibility.h"
 
+struct PixmapCacheDigest;
+
 RedClient *red_client_new(RedsState *reds, int migrated);
 
 class RedClient final
@@ -66,6 +68,11 @@ public:
     void set_disconnecting();
     RedsState* get_server();
 
+    /* images the client keeps in its pixmap cache while its display
+     * channels reconnect, see spice_server_set_pixmap_cache_reuse() */
+    void set_pixmap_cache_digest(PixmapCacheDigest *digest);
+    PixmapCacheDigest *take_pixmap_cache_digest();
+
 private:
     RedChannelClient *get_channel(int type, int id);
 
@@ -88,6 +95,8 @@ private:
     int seamless_migrate;
     int num_migrated_channels; /* for seamless - number of channels that wait for migrate data*/
 
+    PixmapCacheDigest *pixmap_cache_digest = nullptr;
+
     gint _ref = 1;
 };
 
@@ -319,26 +319,17 @@ StreamDevice::handle_msg_data()
     spice_extra_assert(hdr_pos >= sizeof(StreamDevHeader));
     spice_extra_assert(hdr.type == STREAM_TYPE_DATA);
 
-    /* make sure we have a large enough buffer for the whole frame */
-    /* ---
-     * TODO: Now that we copy partial data into the buffer, for each frame
-     * the buffer is allocated and freed (look for g_realloc in
-     * partial_read).
-     * Probably better to just keep the larger buffer.
-     */
+    /* the frame is read directly into a buffer of the channel which is
+     * then passed to the clients without copies */
     if (msg_pos == 0) {
         frame_mmtime = reds_get_mm_time();
         record(stream_device_data, "Stream data packet size %u mm_time %u",
                hdr.size, frame_mmtime);
-        if (msg_len < hdr.size) {
-            g_free(msg);
-            msg = static_cast<StreamDevice::AllMessages *>(g_malloc(hdr.size));
-            msg_len = hdr.size;
-        }
+        frame_data = stream_channel->get_data_buffer(hdr.size);
     }
 
     /* read from device */
-    n = read(msg->buf + msg_pos, hdr.size - msg_pos);
+    n = read(frame_data + msg_pos, hdr.size - msg_pos);
     if (n <= 0) {
         return msg_pos == hdr.size;
     }
@@ -349,7 +340,8 @@ StreamDevice::handle_msg_data()
     }
 
     /* The whole frame was read from the device, send it */
-    stream_channel->send_data(msg->buf, hdr.size, frame_mmtime);
+    stream_channel->send_data(frame_mmtime);
+    frame_data = nullptr;
 
     return true;
 }
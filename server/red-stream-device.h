@@ -87,6 +87,8 @@ private:
     red::shared_ptr<CursorChannel> cursor_channel;
     SpiceTimer *close_timer;
     uint32_t frame_mmtime;
+    /* buffer of the frame being read, owned by stream_channel */
+    uint8_t *frame_data;
     StreamDeviceDisplayInfo device_display_info;
 
 private:
@@ -57,6 +57,21 @@
 #define CMD_RING_POLL_TIMEOUT 10 //milli
 #define CMD_RING_POLL_RETRIES 1
 
+/* When the display ring gets empty it is polled again after the usual
+ * interval between commands, at least CMD_RING_POLL_MIN. Guests sending
+ * commands less often than CMD_RING_POLL_TIMEOUT are not polled, they
+ * notify us */
+#define CMD_RING_POLL_MIN 1 //milli
+
+/* Longest time processing display commands before going back to the
+ * clients. Shortened while they don't keep up with the guest */
+#define PROCESS_SLICE_MAX (NSEC_PER_SEC / 100)
+#define PROCESS_SLICE_MIN (NSEC_PER_SEC / 500)
+
+/* interval between checks of the stalled display clients while they
+ * block the processing of commands */
+#define STALLED_CLIENTS_CHECK_TIMEOUT 100 //milli
+
 #define INF_EVENT_WAIT ~0
 
 struct RedWorker {
@@ -77,11 +92,25 @@ struct RedWorker {
     RedMemSlotInfo mem_slots;
 
     uint32_t process_display_generation;
+    uint64_t process_slice;
+    uint64_t last_command_time;
+    uint64_t command_interval; // smoothed, ns
+    uint64_t busy_poll;        // ns, 0 if disabled
+    uint64_t poll_start;
+
     RedStatNode stat;
     RedStatCounter wakeup_counter;
     RedStatCounter command_counter;
     RedStatCounter full_loop_counter;
     RedStatCounter total_loop_counter;
+    RedStatCounter busy_poll_hits;
+    /* time spent reading the commands from the guest, processing them
+     * (drawing tree, surfaces) and waiting for events, in ns. The time
+     * spent sending to the clients is counted by each channel, see
+     * RedChannelClient::push() */
+    RedStatCounter ingest_time_ns;
+    RedStatCounter process_time_ns;
+    RedStatCounter idle_time_ns;
 
     bool driver_cap_monitors_config;
 
@@ -156,11 +185,50 @@ static gboolean red_process_surface_cmd(RedWorker *worker, QXLCommandExt *ext, g
     return true;
 }
 
+/* Keep checking the ring a little once empty, the next command may be
+ * about to come and waiting for a notification or a timer costs more */
+static bool red_busy_poll_display(RedWorker *worker, QXLCommandExt *ext_cmd)
+{
+    if (!worker->busy_poll || worker->display_poll_tries > 0) {
+        return false;
+    }
+
+    uint64_t end = spice_get_monotonic_time_ns() + worker->busy_poll;
+    do {
+        if (red_qxl_get_command(worker->qxl, ext_cmd)) {
+            stat_inc_counter(worker->busy_poll_hits, 1);
+            return true;
+        }
+    } while (spice_get_monotonic_time_ns() < end);
+    return false;
+}
+
+/* Returns the time to wait before polling the empty ring again,
+ * 0 if the guest should rather notify us */
+static unsigned int red_display_poll_timeout(RedWorker *worker)
+{
+    uint64_t interval = worker->command_interval / NSEC_PER_MILLISEC;
+
+    if (interval > CMD_RING_POLL_TIMEOUT) {
+        return 0;
+    }
+    return MAX(interval, CMD_RING_POLL_MIN);
+}
+
+static void red_display_update_interval(RedWorker *worker, uint64_t now)
+{
+    uint64_t interval = MIN(now - worker->last_command_time, NSEC_PER_SEC);
+
+    worker->last_command_time = now;
+    worker->command_interval = (worker->command_interval * 7 + interval) / 8;
+}
+
 static int red_process_display(RedWorker *worker, int *ring_is_empty)
 {
     QXLCommandExt ext_cmd;
     int n = 0;
     uint64_t start = spice_get_monotonic_time_ns();
+    uint64_t now = start;
 
     if (!red_qxl_is_running(worker->qxl)) {
         *ring_is_empty = TRUE;
@@ -169,15 +237,29 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
     stat_inc_counter(worker->total_loop_counter, 1);
 
+    display_channel_check_stalled_clients(worker->display_channel);
+
     worker->process_display_generation++;
     *ring_is_empty = FALSE;
     while (worker->display_channel->max_pipe_size() <= MAX_PIPE_SIZE) {
-        if (!red_qxl_get_command(worker->qxl, &ext_cmd)) {
+        if (!red_qxl_get_command(worker->qxl, &ext_cmd) &&
+            !red_busy_poll_display(worker, &ext_cmd)) {
             *ring_is_empty = TRUE;
+            /* caught up with the guest, the clients can have longer slices */
+            if (worker->display_channel->max_pipe_size() <= MAX_PIPE_SIZE / 2) {
+                worker->process_slice = MIN(worker->process_slice * 2, PROCESS_SLICE_MAX);
+            }
             if (worker->display_poll_tries < CMD_RING_POLL_RETRIES) {
-                worker->event_timeout = MIN(worker->event_timeout, CMD_RING_POLL_TIMEOUT);
-            } else if (worker->display_poll_tries == CMD_RING_POLL_RETRIES &&
-                       !red_qxl_req_cmd_notification(worker->qxl)) {
+                unsigned int timeout = red_display_poll_timeout(worker);
+                if (timeout) {
+                    worker->event_timeout = MIN(worker->event_timeout, timeout);
+                    worker->display_poll_tries++;
+                    return n;
+                }
+                worker->display_poll_tries = CMD_RING_POLL_RETRIES;
+            }
+            if (worker->display_poll_tries == CMD_RING_POLL_RETRIES &&
+                !red_qxl_req_cmd_notification(worker->qxl)) {
                 continue;
             }
             worker->display_poll_tries++;
@@ -190,12 +272,18 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
 
         stat_inc_counter(worker->command_counter, 1);
         worker->display_poll_tries = 0;
+        uint64_t cmd_start = spice_get_monotonic_time_ns();
+        red_display_update_interval(worker, cmd_start);
+        stat_inc_counter(worker->ingest_time_ns, cmd_start - now);
+        now = cmd_start;
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_DRAW: {
             auto red_drawable = red_drawable_new(worker->qxl, &worker->mem_slots,
                                                  ext_cmd.group_id, ext_cmd.cmd.data,
                                                  ext_cmd.flags); // returns with 1 ref
 
+            now = spice_get_monotonic_time_ns();
+            stat_inc_counter(worker->ingest_time_ns, now - cmd_start);
             if (red_drawable) {
                 display_channel_process_draw(worker->display_channel, std::move(red_drawable),
                                              worker->process_display_generation);
@@ -235,13 +323,21 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             spice_error("bad command type");
         }
         n++;
-        if (worker->display_channel->all_blocked()
-            || spice_get_monotonic_time_ns() - start > NSEC_PER_SEC / 100) {
+        uint64_t cmd_end = spice_get_monotonic_time_ns();
+        stat_inc_counter(worker->process_time_ns, cmd_end - now);
+        now = cmd_end;
+        if (worker->display_channel->all_blocked() || now - start > worker->process_slice) {
+            /* the clients didn't drain what the last slice produced */
+            if (worker->display_channel->max_pipe_size() > MAX_PIPE_SIZE / 2) {
+                worker->process_slice = MAX(worker->process_slice / 2, PROCESS_SLICE_MIN);
+            }
             worker->event_timeout = 0;
             return n;
         }
     }
     worker->was_blocked = TRUE;
+    worker->process_slice = PROCESS_SLICE_MIN;
+    worker->event_timeout = MIN(worker->event_timeout, STALLED_CLIENTS_CHECK_TIMEOUT);
     stat_inc_counter(worker->full_loop_counter, 1);
     return n;
 }
@@ -280,14 +376,18 @@ static void flush_commands(RedWorker *worker, RedChannel *red_channel,
             }
             red_channel->receive();
             red_channel->send();
-            // TODO: MC: the whole timeout will break since it takes lowest timeout, should
-            // do it client by client.
+            if (red_channel == worker->display_channel) {
+                display_channel_check_stalled_clients(worker->display_channel);
+            }
             if (spice_get_monotonic_time_ns() >= end_time) {
-                // TODO: we need to record the client that actually causes the timeout.
-                // So we need to check the locations of the various pipe heads when counting,
-                // and disconnect only those/that.
-                spice_warning("flush timeout");
-                red_channel->disconnect();
+                // only the clients still holding the commands back
+                RedChannelClient *rcc;
+                FOREACH_CLIENT(red_channel, rcc) {
+                    if (rcc->get_pipe_size() > MAX_PIPE_SIZE) {
+                        red_channel_warning(red_channel, "flush timeout");
+                        rcc->disconnect();
+                    }
+                }
             } else {
                 usleep(DISPLAY_CLIENT_RETRY_INTERVAL);
             }
@@ -307,9 +407,6 @@ static void flush_cursor_commands(RedWorker *worker)
                    red_process_cursor);
 }
 
-// TODO: on timeout, don't disconnect all channels immediately - try to disconnect the slowest ones
-// first and maybe turn timeouts to several timeouts in order to disconnect channels gradually.
-// Should use disconnect or shutdown?
 static void flush_all_qxl_commands(RedWorker *worker)
 {
     flush_display_commands(worker);
@@ -890,6 +987,7 @@ static gboolean worker_source_prepare(GSource *source, gint *p_timeout)
         return TRUE;
     }
 
+    worker->poll_start = spice_get_monotonic_time_ns();
     return FALSE;
 }
 
@@ -898,6 +996,12 @@ static gboolean worker_source_check(GSource *source)
     RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
     RedWorker *worker = wsource->worker;
 
+    if (worker->poll_start) {
+        stat_inc_counter(worker->idle_time_ns,
+                         spice_get_monotonic_time_ns() - worker->poll_start);
+        worker->poll_start = 0;
+    }
+
     return red_qxl_is_running(worker->qxl) /* TODO && worker->pending_process */;
 }
 
@@ -965,6 +1069,12 @@ RedWorker* red_worker_new(QXLInstance *qxl)
     stat_init_counter(&worker->command_counter, reds, &worker->stat, "commands", TRUE);
     stat_init_counter(&worker->full_loop_counter, reds, &worker->stat, "full_loops", TRUE);
     stat_init_counter(&worker->total_loop_counter, reds, &worker->stat, "total_loops", TRUE);
+    stat_init_counter(&worker->busy_poll_hits, reds, &worker->stat, "busy_poll_hits", TRUE);
+    stat_init_counter(&worker->ingest_time_ns, reds, &worker->stat, "ingest_time_ns", TRUE);
+    stat_init_counter(&worker->process_time_ns, reds, &worker->stat, "process_time_ns", TRUE);
+    stat_init_counter(&worker->idle_time_ns, reds, &worker->stat, "idle_time_ns", TRUE);
+    worker->process_slice = PROCESS_SLICE_MAX;
+    worker->busy_poll = (uint64_t) reds_get_worker_busy_poll(reds) * NSEC_PER_MICROSEC;
 
     worker->dispatch_watch = dispatcher->create_watch(&worker->core);
     spice_assert(worker->dispatch_watch != nullptr);
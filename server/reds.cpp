@@ -63,6 +63,7 @@
 #include "inputs-channel.h"
 #include "main-channel.h"
 #include "red-qxl.h"
+#include "display-limits.h"
 #include "main-dispatcher.h"
 #include "sound.h"
 #include "stat.h"
@@ -93,8 +94,15 @@ static void reds_set_video_codecs(RedsState *reds, GArray *video_codecs);
  * server */
 #define SPICE_DEBUG_ALLOW_MC_ENV "SPICE_DEBUG_ALLOW_MC"
 
-#define REDS_TOKENS_TO_SEND 5
+/* return agent tokens to the client once a quarter of its window is free */
+#define REDS_TOKENS_TO_SEND (REDS_AGENT_WINDOW_SIZE / 4)
+/* buffers read from the agent and not yet sent to the client. The ring
+ * follows the window of tokens the client gives us, within these bounds */
 #define REDS_VDI_PORT_NUM_RECEIVE_BUFFS 5
+#define REDS_VDI_PORT_MAX_RECEIVE_BUFFS 64
+
+/* longest busy poll of the display worker, microseconds */
+#define WORKER_BUSY_POLL_MAX 1000
 
 /* TODO while we can technically create more than one server in a process,
  * the intended use is to support a single server per process */
@@ -134,6 +142,19 @@ struct RedServerConfig {
     bool playback_compression;
     spice_wan_compression_t jpeg_state;
     spice_wan_compression_t zlib_glz_state;
+    int lz4_level;
+    uint32_t drawables_soft_limit;
+    uint32_t drawables_hard_limit;
+    bool send_coalescing;
+    bool glz_hugepages;
+    size_t image_cache_size;
+    bool display_send_threads;
+    uint32_t worker_busy_poll;
+    uint32_t video_max_fps;
+    uint32_t video_low_bandwidth_max_fps;
+    bool full_surface_streaming;
+    uint32_t video_encoder_threads;
+    bool pixmap_cache_reuse;
 
     gboolean agent_mouse;
     gboolean agent_copypaste;
@@ -184,6 +205,7 @@ struct RedCharDeviceVDIPortPrivate {
 
     /* read from agent */
     uint32_t num_read_buf;
+    uint32_t max_read_buf;
     VDIPortReadStates read_state;
     uint32_t message_receive_len;
     uint8_t *receive_pos;
@@ -692,7 +714,7 @@ static red::shared_ptr<RedVDIReadBuf> vdi_read_buf_new(RedCharDeviceVDIPort *dev
 
 static red::shared_ptr<RedVDIReadBuf> vdi_port_get_read_buf(RedCharDeviceVDIPort *dev)
 {
-    if (dev->priv->num_read_buf >= REDS_VDI_PORT_NUM_RECEIVE_BUFFS) {
+    if (dev->priv->num_read_buf >= dev->priv->max_read_buf) {
         return red::shared_ptr<RedVDIReadBuf>();
     }
 
@@ -1003,6 +1025,13 @@ SpiceMsgChannels *reds_msg_channels_new(RedsState *reds)
     return channels_info;
 }
 
+/* as many chunks in flight as the client accepts, so reading from the agent
+ * does not stall while a large transfer waits for the network */
+static uint32_t vdi_port_num_receive_buffs(uint32_t client_tokens)
+{
+    return CLAMP(client_tokens, REDS_VDI_PORT_NUM_RECEIVE_BUFFS, REDS_VDI_PORT_MAX_RECEIVE_BUFFS);
+}
+
 void reds_on_main_agent_start(RedsState *reds, MainChannelClient *mcc, uint32_t num_tokens)
 {
     RedCharDevice *dev_state = reds->agent_dev.get();
@@ -1025,8 +1054,9 @@ void reds_on_main_agent_start(RedsState *reds, MainChannelClient *mcc, uint32_t
     if (!dev_state->client_exists(client_opaque)) {
         int client_added;
 
+        reds->agent_dev->priv->max_read_buf = vdi_port_num_receive_buffs(num_tokens);
         client_added = dev_state->client_add(client_opaque, TRUE,
-                                             REDS_VDI_PORT_NUM_RECEIVE_BUFFS,
+                                             reds->agent_dev->priv->max_read_buf,
                                              REDS_AGENT_WINDOW_SIZE,
                                              num_tokens,
                                              mcc->is_waiting_for_migrate_data());
@@ -3198,6 +3228,8 @@ attach_to_red_agent(RedsState *reds, SpiceCharDeviceInstance *sin)
         if (!dev->client_exists(client_opaque)) {
             int client_added;
 
+            /* the client window is not known, it comes with the migration data */
+            dev->priv->max_read_buf = REDS_VDI_PORT_NUM_RECEIVE_BUFFS;
             client_added = dev->client_add(client_opaque, TRUE,
                                            REDS_VDI_PORT_NUM_RECEIVE_BUFFS,
                                            REDS_AGENT_WINDOW_SIZE, ~0, TRUE);
@@ -3608,6 +3640,19 @@ SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
     reds->config->playback_compression = TRUE;
     reds->config->jpeg_state = SPICE_WAN_COMPRESSION_AUTO;
     reds->config->zlib_glz_state = SPICE_WAN_COMPRESSION_AUTO;
+    reds->config->lz4_level = 0;
+    reds->config->drawables_soft_limit = NUM_DRAWABLES;
+    reds->config->drawables_hard_limit = MAX_DRAWABLES;
+    reds->config->send_coalescing = FALSE;
+    reds->config->glz_hugepages = FALSE;
+    reds->config->image_cache_size = IMAGE_CACHE_DEFAULT_SIZE;
+    reds->config->display_send_threads = FALSE;
+    reds->config->worker_busy_poll = 0;
+    reds->config->video_max_fps = 0;
+    reds->config->video_low_bandwidth_max_fps = 0;
+    reds->config->full_surface_streaming = FALSE;
+    reds->config->video_encoder_threads = 1;
+    reds->config->pixmap_cache_reuse = FALSE;
     reds->config->agent_mouse = TRUE;
     reds->config->agent_copypaste = TRUE;
     reds->config->agent_file_xfer = TRUE;
@@ -4127,6 +4172,117 @@ SPICE_GNUC_VISIBLE int spice_server_set_zlib_glz_compression(SpiceServer *s, spi
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_lz4_level(SpiceServer *s, int level)
+{
+#ifndef USE_LZ4
+    spice_warning("LZ4 compression not supported, ignoring level");
+    return -1;
+#else
+    // only affects display channel clients connecting after the change
+    s->config->lz4_level = level;
+    return 0;
+#endif
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_drawables_limits(SpiceServer *s,
+                                                         unsigned int soft_limit,
+                                                         unsigned int hard_limit)
+{
+    if (soft_limit == 0 || hard_limit < soft_limit || hard_limit > DRAWABLES_LIMIT_MAX) {
+        return -1;
+    }
+    // only affects display channels created after the change
+    s->config->drawables_soft_limit = soft_limit;
+    s->config->drawables_hard_limit = hard_limit;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_send_coalescing(SpiceServer *s, int enable)
+{
+    // only affects channel clients connecting after the change
+    s->config->send_coalescing = !!enable;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_image_cache_size(SpiceServer *s, unsigned int size_mb)
+{
+    // only affects display channels created after the change
+    s->config->image_cache_size = (size_t) size_mb * 1024 * 1024;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_glz_hugepages(SpiceServer *s, int enable)
+{
+#ifndef __linux__
+    spice_warning("hugepages not supported, ignoring");
+    return -1;
+#else
+    // only affects GLZ dictionaries created after the change
+    s->config->glz_hugepages = !!enable;
+    return 0;
+#endif
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_display_send_threads(SpiceServer *s, int enable)
+{
+#ifdef _WIN32
+    spice_warning("send threads not supported, ignoring");
+    return -1;
+#else
+    // only affects display channel clients connecting after the change
+    s->config->display_send_threads = !!enable;
+    return 0;
+#endif
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_worker_busy_poll(SpiceServer *s, unsigned int usec)
+{
+    if (usec > WORKER_BUSY_POLL_MAX) {
+        return -1;
+    }
+    // only affects QXL instances added after the change
+    s->config->worker_busy_poll = usec;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_video_max_fps(SpiceServer *s, unsigned int max_fps,
+                                                      unsigned int low_bandwidth_max_fps)
+{
+    if (max_fps == 0 || max_fps > VIDEO_ENCODER_MAX_FPS_LIMIT ||
+        low_bandwidth_max_fps == 0 || low_bandwidth_max_fps > VIDEO_ENCODER_MAX_FPS_LIMIT) {
+        return -1;
+    }
+    // only affects display channels created after the change
+    s->config->video_max_fps = max_fps;
+    s->config->video_low_bandwidth_max_fps = low_bandwidth_max_fps;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_full_surface_streaming(SpiceServer *s, int enable)
+{
+    // only affects display channels created after the change
+    s->config->full_surface_streaming = !!enable;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_video_encoder_threads(SpiceServer *s,
+                                                              unsigned int threads)
+{
+    if (threads == 0 || threads > VIDEO_ENCODER_MAX_THREADS) {
+        return -1;
+    }
+    // only affects display channels created after the change
+    s->config->video_encoder_threads = threads;
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_pixmap_cache_reuse(SpiceServer *s, int enable)
+{
+    // only affects display channel clients disconnecting after the change
+    s->config->pixmap_cache_reuse = !!enable;
+    return 0;
+}
+
 SPICE_GNUC_VISIBLE int spice_server_set_channel_security(SpiceServer *s, const char *channel, int security)
 {
     int type;
@@ -4441,6 +4597,68 @@ spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds)
     return reds->config->zlib_glz_state;
 }
 
+int reds_get_lz4_level(const RedsState *reds)
+{
+    return reds->config->lz4_level;
+}
+
+uint32_t reds_get_drawables_soft_limit(const RedsState *reds)
+{
+    return reds->config->drawables_soft_limit;
+}
+
+uint32_t reds_get_drawables_hard_limit(const RedsState *reds)
+{
+    return reds->config->drawables_hard_limit;
+}
+
+bool reds_get_send_coalescing(const RedsState *reds)
+{
+    return reds->config->send_coalescing;
+}
+
+bool reds_get_glz_hugepages(const RedsState *reds)
+{
+    return reds->config->glz_hugepages;
+}
+
+size_t reds_get_image_cache_size(const RedsState *reds)
+{
+    return reds->config->image_cache_size;
+}
+
+bool reds_get_display_send_threads(const RedsState *reds)
+{
+    return reds->config->display_send_threads;
+}
+
+uint32_t reds_get_worker_busy_poll(const RedsState *reds)
+{
+    return reds->config->worker_busy_poll;
+}
+
+/* 0 if no limit was set, only the encoders limit the frame rate then */
+uint32_t reds_get_video_max_fps(const RedsState *reds, bool low_bandwidth)
+{
+    return low_bandwidth ? reds->config->video_low_bandwidth_max_fps :
+                           reds->config->video_max_fps;
+}
+
+bool reds_get_full_surface_streaming(const RedsState *reds)
+{
+    return reds->config->full_surface_streaming;
+}
+
+uint32_t reds_get_video_encoder_threads(const RedsState *reds)
+{
+    return reds->config->video_encoder_threads;
+}
+
+bool reds_get_pixmap_cache_reuse(const RedsState *reds)
+{
+    return reds->config->pixmap_cache_reuse;
+}
+
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds)
 {
     return &reds->core;
@@ -4587,6 +4805,7 @@ MainDispatcher* reds_get_main_dispatcher(RedsState *reds)
 RedCharDeviceVDIPort::RedCharDeviceVDIPort(RedsState *reds):
     RedCharDevice(reds, nullptr, REDS_TOKENS_TO_SEND, REDS_NUM_INTERNAL_AGENT_MESSAGES)
 {
+    priv->max_read_buf = REDS_VDI_PORT_NUM_RECEIVE_BUFFS;
     priv->read_state = VDI_PORT_READ_STATE_READ_HEADER;
     priv->receive_pos = reinterpret_cast<uint8_t *>(&priv->vdi_chunk_header);
     priv->receive_len = sizeof(priv->vdi_chunk_header);
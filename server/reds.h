@@ -100,6 +100,18 @@ uint32_t reds_get_streaming_video(const RedsState *reds);
 GArray* reds_get_video_codecs(const RedsState *reds);
 spice_wan_compression_t reds_get_jpeg_state(const RedsState *reds);
 spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds);
+int reds_get_lz4_level(const RedsState *reds);
+uint32_t reds_get_drawables_soft_limit(const RedsState *reds);
+uint32_t reds_get_drawables_hard_limit(const RedsState *reds);
+bool reds_get_send_coalescing(const RedsState *reds);
+bool reds_get_glz_hugepages(const RedsState *reds);
+bool reds_get_display_send_threads(const RedsState *reds);
+uint32_t reds_get_worker_busy_poll(const RedsState *reds);
+size_t reds_get_image_cache_size(const RedsState *reds);
+uint32_t reds_get_video_max_fps(const RedsState *reds, bool low_bandwidth);
+bool reds_get_full_surface_streaming(const RedsState *reds);
+uint32_t reds_get_video_encoder_threads(const RedsState *reds);
+bool reds_get_pixmap_cache_reuse(const RedsState *reds);
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds);
 void reds_update_client_mouse_allowed(RedsState *reds);
 MainDispatcher* reds_get_main_dispatcher(RedsState *reds);
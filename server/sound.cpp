@@ -112,6 +112,7 @@ public:
     uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
     void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
     void migrate() override;
+    void on_net_estimate_changed() override;
 
 private:
     /* we don't expect very big messages so don't allocate too much
@@ -760,6 +761,11 @@ bool SndChannelClient::config_socket()
     return true;
 }
 
+void SndChannelClient::on_net_estimate_changed()
+{
+    red_stream_set_no_delay(get_stream(), get_bitrate_estimate() >= LOW_BANDWIDTH_BITRATE);
+}
+
 uint8_t*
 SndChannelClient::alloc_recv_buf(uint16_t type, uint32_t size)
 {
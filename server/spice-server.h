@@ -116,6 +116,72 @@ typedef enum {
 int spice_server_set_jpeg_compression(SpiceServer *s, spice_wan_compression_t comp);
 int spice_server_set_zlib_glz_compression(SpiceServer *s, spice_wan_compression_t comp);
 
+/* level 0 is the default LZ4 fast mode, negative values increase the
+ * acceleration (faster, worse ratio), positive values select LZ4 HC with
+ * the given level (slower, better ratio) */
+int spice_server_set_lz4_level(SpiceServer *s, int level);
+
+/* number of drawables each display channel allocates upfront (soft limit)
+ * and the maximum it can grow to (hard limit, at most 1048576) before
+ * rendering the oldest drawables to release them. Must be set before adding
+ * QXL instances */
+int spice_server_set_drawables_limits(SpiceServer *s,
+                                      unsigned int soft_limit, unsigned int hard_limit);
+
+/* write small display and cursor messages ready at the same time with a
+ * single system call (and a single TLS record), disabled by default */
+int spice_server_set_send_coalescing(SpiceServer *s, int enable);
+
+/* memory used by each display channel to keep images decoded for rendering
+ * on the server, 0 disables the cache. Must be set before adding QXL
+ * instances */
+int spice_server_set_image_cache_size(SpiceServer *s, unsigned int size_mb);
+
+/* back the GLZ dictionaries with hugepages, allocated on the NUMA node of
+ * the display worker. Reserved hugepages are used if available, otherwise
+ * transparent hugepages. Disabled by default, Linux only */
+int spice_server_set_glz_hugepages(SpiceServer *s, int enable);
+
+/* write the messages of each display channel client to its socket from a
+ * dedicated thread, so the display worker can go on processing commands and
+ * encoding images meanwhile. The messages are still produced by the worker.
+ * Disabled by default, not supported on Windows */
+int spice_server_set_display_send_threads(SpiceServer *s, int enable);
+
+/* time in microseconds the display worker keeps checking the command ring
+ * of the guest once empty, instead of waiting for a notification. Lowers
+ * the latency of commands following closely each other at the cost of CPU
+ * time, 0 (the default) disables it. Must be set before adding QXL
+ * instances */
+int spice_server_set_worker_busy_poll(SpiceServer *s, unsigned int usec);
+
+/* highest frame rate video streams are sent at, for clients with a fast
+ * connection and for low bandwidth ones, between 1 and 240. Stream detection
+ * adapts to sources up to the highest of the two values. By default only
+ * the video encoders limit the frame rate, MJPEG to 25 fps. Must be set
+ * before adding QXL instances */
+int spice_server_set_video_max_fps(SpiceServer *s, unsigned int max_fps,
+                                   unsigned int low_bandwidth_max_fps);
+
+/* when the primary surface is redrawn at a high rate by many drawing
+ * commands, render it on the server and send it as a single video stream
+ * until the activity drops. Requires streaming video to be enabled,
+ * disabled by default. Must be set before adding QXL instances */
+int spice_server_set_full_surface_streaming(SpiceServer *s, int enable);
+
+/* number of threads encoding each frame of the large MJPEG video streams,
+ * the frames are split in horizontal slices compressed in parallel. Between
+ * 1 (the default, no splitting) and 16. Must be set before adding QXL
+ * instances */
+int spice_server_set_video_encoder_threads(SpiceServer *s, unsigned int threads);
+
+/* when the display channels of a client disconnect while the client stays
+ * connected, remember the images it received in its pixmap cache and
+ * reference them once the channels reconnect instead of sending them again.
+ * Only for clients keeping their image cache across channel reconnections.
+ * Disabled by default */
+int spice_server_set_pixmap_cache_reuse(SpiceServer *s, int enable);
+
 #define SPICE_CHANNEL_SECURITY_NONE (1 << 0)
 #define SPICE_CHANNEL_SECURITY_SSL (1 << 1)
 
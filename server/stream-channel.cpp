@@ -71,10 +71,39 @@ struct StreamCreateItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_STREAM_CREATE>
     SpiceMsgDisplayStreamCreate stream_create;
 };
 
+/* Frame buffers are allocated in power of 2 size classes starting from
+ * 1 << STREAM_DATA_MIN_SIZE_SHIFT bytes. Released buffers are kept by the
+ * channel, up to STREAM_DATA_MAX_FREE_BLOCKS per class, so consecutive
+ * frames of similar size don't need a new allocation.
+ * The kept buffers are limited to STREAM_DATA_MIN_FREE_SIZE bytes or to
+ * STREAM_DATA_FREE_FRAMES times the buffer of the last frame if bigger.
+ */
+#define STREAM_DATA_MIN_SIZE_SHIFT 12
+#define STREAM_DATA_MAX_FREE_BLOCKS 4
+#define STREAM_DATA_MIN_FREE_SIZE (4 * 1024 * 1024)
+#define STREAM_DATA_FREE_FRAMES 2
+
+static inline size_t stream_data_class_size(int size_class)
+{
+    return (size_t) 1 << (STREAM_DATA_MIN_SIZE_SHIFT + size_class);
+}
+
+/* Header preceding each StreamDataItem, allows to return the memory
+ * to the channel pool when the item is freed.
+ * The alignment keeps the following StreamDataItem properly aligned. */
+struct alignas(std::max_align_t) StreamDataBlock {
+    StreamChannel *channel;
+    StreamDataBlock *next_free;
+    int size_class; // -1 if not from the pool
+};
+
 struct StreamDataItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_STREAM_DATA> {
     ~StreamDataItem() override;
+    static void operator delete(void *p);
 
     StreamChannel *channel;
+    // whether the item was counted in the channel queue statistics
+    bool queued = false;
     // NOTE: this must be the last field in the structure
     SpiceMsgDisplayStreamData data;
 };
@@ -109,6 +138,7 @@ StreamChannelClient::on_disconnect()
     channel->stream_id = -1;
     channel->width = 0;
     channel->height = 0;
+    channel->free_data_blocks();
 
     // send stream stop to device
     StreamMsgStartStop stop = { 0, };
@@ -401,6 +431,12 @@ StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
     reds_register_channel(reds, this);
 }
 
+StreamChannel::~StreamChannel()
+{
+    discard_pending_data();
+    free_data_blocks();
+}
+
 void
 StreamChannel::change_format(const StreamMsgFormat *fmt)
 {
@@ -452,28 +488,131 @@ StreamChannel::update_queue_stat(int32_t num_diff, int32_t size_diff)
 
 StreamDataItem::~StreamDataItem()
 {
-    channel->update_queue_stat(-1, -data.data_size);
+    if (queued) {
+        channel->update_queue_stat(-1, -data.data_size);
+    }
+}
+
+void StreamDataItem::operator delete(void *p)
+{
+    auto block = reinterpret_cast<StreamDataBlock *>(p) - 1;
+    block->channel->release_data_block(block);
+}
+
+void
+StreamChannel::release_data_block(StreamDataBlock *block)
+{
+    const int size_class = block->size_class;
+
+    if (size_class < 0 || num_free_blocks[size_class] >= STREAM_DATA_MAX_FREE_BLOCKS ||
+        free_blocks_size + stream_data_class_size(size_class) > free_blocks_limit()) {
+        g_free(block);
+        return;
+    }
+    block->next_free = free_blocks[size_class];
+    free_blocks[size_class] = block;
+    num_free_blocks[size_class]++;
+    free_blocks_size += stream_data_class_size(size_class);
+}
+
+size_t
+StreamChannel::free_blocks_limit() const
+{
+    return MAX(STREAM_DATA_MIN_FREE_SIZE, STREAM_DATA_FREE_FRAMES * frame_block_size);
 }
 
+/* frees the kept buffers, from the biggest, until they fit in the limit */
 void
-StreamChannel::send_data(const void *data, size_t size, uint32_t mm_time)
+StreamChannel::trim_data_blocks(size_t limit)
 {
+    for (int size_class = STREAM_DATA_NUM_SIZE_CLASSES - 1;
+         size_class >= 0 && free_blocks_size > limit; size_class--) {
+        while (free_blocks[size_class] && free_blocks_size > limit) {
+            StreamDataBlock *block = free_blocks[size_class];
+            free_blocks[size_class] = block->next_free;
+            num_free_blocks[size_class]--;
+            free_blocks_size -= stream_data_class_size(size_class);
+            g_free(block);
+        }
+    }
+}
+
+void
+StreamChannel::free_data_blocks()
+{
+    trim_data_blocks(0);
+    frame_block_size = 0;
+}
+
+void
+StreamChannel::discard_pending_data()
+{
+    if (pending_data) {
+        delete pending_data;
+        pending_data = nullptr;
+    }
+}
+
+uint8_t *
+StreamChannel::get_data_buffer(size_t size)
+{
+    discard_pending_data();
+
+    const size_t needed = sizeof(StreamDataBlock) + sizeof(StreamDataItem) + size;
+    int size_class = 0;
+    while (size_class < STREAM_DATA_NUM_SIZE_CLASSES &&
+           needed > stream_data_class_size(size_class)) {
+        size_class++;
+    }
+
+    StreamDataBlock *block;
+    if (size_class >= STREAM_DATA_NUM_SIZE_CLASSES) {
+        block = static_cast<StreamDataBlock *>(g_malloc(needed));
+        size_class = -1;
+    } else {
+        // buffers of frames much bigger than the current ones are not needed anymore
+        frame_block_size = stream_data_class_size(size_class);
+        trim_data_blocks(free_blocks_limit());
+        if (free_blocks[size_class]) {
+            block = free_blocks[size_class];
+            free_blocks[size_class] = block->next_free;
+            num_free_blocks[size_class]--;
+            free_blocks_size -= frame_block_size;
+        } else {
+            block = static_cast<StreamDataBlock *>(g_malloc(frame_block_size));
+        }
+    }
+    block->channel = this;
+    block->next_free = nullptr;
+    block->size_class = size_class;
+
+    pending_data = new (block + 1) StreamDataItem();
+    pending_data->channel = this;
+    pending_data->data.data_size = size;
+    return pending_data->data.data;
+}
+
+void
+StreamChannel::send_data(uint32_t mm_time)
+{
+    spice_return_if_fail(pending_data != nullptr);
+
     if (stream_id < 0) {
         // this condition can happen if the guest didn't handle
         // the format stop that we send so think the stream is still
         // started
+        discard_pending_data();
         return;
     }
 
-    auto item = new (size) StreamDataItem();
+    auto item = red::shared_ptr<StreamDataItem>(pending_data);
+    pending_data = nullptr;
     item->data.base.id = stream_id;
     item->data.base.multi_media_time = mm_time;
-    item->data.data_size = size;
-    item->channel = this;
-    update_queue_stat(1, size);
-    // TODO try to optimize avoiding the copy
-    memcpy(item->data.data, data, size);
-    pipes_add(red::shared_ptr<StreamDataItem>(item));
+    item->queued = true;
+    update_queue_stat(1, item->data.data_size);
+    // the same item is shared by all the clients pipes
+    pipes_add(std::move(item));
 }
 
 void
@@ -510,6 +649,7 @@ StreamChannel::reset()
     stream_id = -1;
     width = 0;
     height = 0;
+    free_data_blocks();
 
     if (!is_connected()) {
         return;
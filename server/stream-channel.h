@@ -50,13 +50,19 @@ struct StreamQueueStat {
 typedef void (*stream_channel_queue_stat_proc)(void *opaque, const StreamQueueStat *stats,
                                                StreamChannel *channel);
 
+/* Number of power of 2 size classes of the frame buffer pool,
+ * from 4KB to 64MB */
+#define STREAM_DATA_NUM_SIZE_CLASSES 15
+
 struct StreamDataItem;
+struct StreamDataBlock;
 class StreamChannelClient;
 struct StreamChannel final: public RedChannel
 {
     friend struct StreamChannelClient;
     friend struct StreamDataItem;
     StreamChannel(RedsState *reds, uint32_t id);
+    ~StreamChannel() override;
 
     /**
      * Reset channel at initial state
@@ -64,7 +70,18 @@ struct StreamChannel final: public RedChannel
     void reset();
 
     void change_format(const struct StreamMsgFormat *fmt);
-    void send_data(const void *data, size_t size, uint32_t mm_time);
+
+    /**
+     * Get a buffer to read a frame of the given size into.
+     * The frame is then queued with send_data(mm_time) and shared by all
+     * the clients without being copied.
+     * Only a frame can be pending, a previous pending frame is discarded.
+     */
+    uint8_t *get_data_buffer(size_t size);
+    /**
+     * Queue the frame read into the buffer returned by get_data_buffer.
+     */
+    void send_data(uint32_t mm_time);
 
     void register_start_cb(stream_channel_start_proc cb, void *opaque);
     void register_queue_stat_cb(stream_channel_queue_stat_proc cb, void *opaque);
@@ -75,6 +92,11 @@ private:
 
     inline void update_queue_stat(int32_t num_diff, int32_t size_diff);
     void request_new_stream(StreamMsgStartStop *start);
+    void release_data_block(StreamDataBlock *block);
+    size_t free_blocks_limit() const;
+    void trim_data_blocks(size_t limit);
+    void free_data_blocks();
+    void discard_pending_data();
 
     /* current video stream id, <0 if not initialized or
      * we are not sending a stream */
@@ -84,6 +106,16 @@ private:
 
     StreamQueueStat queue_stat;
 
+    /* frame being read by the device, see get_data_buffer */
+    StreamDataItem *pending_data = nullptr;
+    /* released frame buffers kept for reuse, by size class */
+    std::array<StreamDataBlock *, STREAM_DATA_NUM_SIZE_CLASSES> free_blocks {};
+    std::array<uint8_t, STREAM_DATA_NUM_SIZE_CLASSES> num_free_blocks {};
+    /* bytes kept in free_blocks */
+    size_t free_blocks_size = 0;
+    /* buffer size of the last frame, used to limit free_blocks */
+    size_t frame_block_size = 0;
+
     /* callback to notify when a stream should be started or stopped */
     stream_channel_start_proc start_cb;
     void *start_opaque;
@@ -322,6 +322,8 @@ int main(int argc, char **argv)
     gint streaming = SPICE_STREAM_VIDEO_FILTER;
     gboolean wait = FALSE;
     gint tls_port = 0;
+    gint image_cache_mb = -1;
+    gint64 start_time;
     gchar *cacert_file = NULL, *cert_file = NULL, *key_file = NULL;
 
     FILE *fd;
@@ -335,7 +337,8 @@ int main(int argc, char **argv)
         { "wait", 'w', 0, G_OPTION_ARG_NONE, &wait, "Wait for client", NULL },
         { "slow", 's', 0, G_OPTION_ARG_INT, &slow, "Slow down replay. Delays USEC microseconds before each command", "USEC" },
         { "skip", 0, 0, G_OPTION_ARG_INT, &skip, "Skip 'slow' for the first n commands", NULL },
-        { "count", 0, 0, G_OPTION_ARG_NONE, &print_count, "Print the number of commands processed", NULL },
+        { "count", 0, 0, G_OPTION_ARG_NONE, &print_count, "Print the number of commands processed and the replay time", NULL },
+        { "image-cache", 0, 0, G_OPTION_ARG_INT, &image_cache_mb, "Decoded image cache size", "MB" },
         { "tls-port", 0, 0, G_OPTION_ARG_INT, &tls_port, "Secure server port", "PORT" },
         { "cacert-file", 0, 0, G_OPTION_ARG_FILENAME, &cacert_file, "TLS CA certificate", "FILE" },
         { "cert-file", 0, 0, G_OPTION_ARG_FILENAME, &cert_file, "TLS server certificate", "FILE" },
@@ -427,6 +430,9 @@ int main(int argc, char **argv)
     server = spice_server_new();
     spice_server_set_image_compression(server, (SpiceImageCompression) compression);
     spice_server_set_streaming_video(server, streaming);
+    if (image_cache_mb >= 0) {
+        spice_server_set_image_cache_size(server, image_cache_mb);
+    }
 
     if (codecs != NULL) {
         if (spice_server_set_video_codecs(server, codecs) != 0) {
@@ -470,10 +476,12 @@ int main(int argc, char **argv)
     }
 
     loop = g_main_loop_new(basic_event_loop_get_context(), FALSE);
+    start_time = g_get_monotonic_time();
     g_main_loop_run(loop);
 
     if (print_count)
-        g_print("Counted %d commands\n", ncommands);
+        g_print("Counted %d commands in %.3f s\n", ncommands,
+                (g_get_monotonic_time() - start_time) / 1000000.0);
 
     spice_server_destroy(server);
     free_queue(display_queue);
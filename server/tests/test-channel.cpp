@@ -20,6 +20,10 @@
  */
 #include <config.h>
 #include <unistd.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
 #include <spice.h>
 
 #include "test-glib-compat.h"
@@ -31,6 +35,8 @@
 #include "win-alarm.h"
 #include "push-visibility.h"
 
+#define NUM_TEST_MESSAGES 25
+
 /*
  * Declare a RedTestChannel to be used for the test
  */
@@ -66,7 +72,7 @@ RedTestChannel::on_connect(RedClient *client, RedStream *stream,
 
     // send enough messages till we should require an ACK
     // the ACK is waited after 2 * 10, append some other messages
-    for (int i = 0; i < 25; ++i) {
+    for (int i = 0; i < NUM_TEST_MESSAGES; ++i) {
         rcc->pipe_add_empty_msg(SPICE_MSG_MIGRATE_DATA);
     }
 }
@@ -196,7 +202,45 @@ static RedStream *create_dummy_stream(SpiceServer *server, int *p_socket)
     return stream;
 }
 
-static void channel_loop()
+#ifndef _WIN32
+// the send thread is not used for local sockets, connect through TCP
+static RedStream *create_tcp_stream(SpiceServer *server, int *p_socket)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(listen_socket, !=, -1);
+    g_assert_cmpint(bind(listen_socket, reinterpret_cast<struct sockaddr *>(&addr),
+                         sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(listen_socket, 1), ==, 0);
+    g_assert_cmpint(getsockname(listen_socket, reinterpret_cast<struct sockaddr *>(&addr),
+                                &addr_len), ==, 0);
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(client, !=, -1);
+    g_assert_cmpint(connect(client, reinterpret_cast<struct sockaddr *>(&addr),
+                            sizeof(addr)), ==, 0);
+    int server_socket = accept(listen_socket, nullptr, nullptr);
+    g_assert_cmpint(server_socket, !=, -1);
+    close(listen_socket);
+
+    *p_socket = client;
+    red_socket_set_non_blocking(server_socket, true);
+    red_socket_set_non_blocking(client, true);
+
+    RedStream * stream = red_stream_new(server, server_socket);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+#endif
+
+static void channel_loop_common(bool send_thread)
 {
     SpiceCoreInterface *core;
     SpiceServer *server = spice_server_new();
@@ -209,11 +253,16 @@ static void channel_loop()
     g_assert_cmpint(spice_server_init(server, core), ==, 0);
 
     // create a channel and connect to it
+    RedChannel::CreationFlags flags = RedChannel::HandleAcks; // we want to test this
+    if (send_thread) {
+        g_assert_cmpint(spice_server_set_display_send_threads(server, TRUE), ==, 0);
+        flags = flags | RedChannel::SendThread;
+    }
     auto channel =
         red::make_shared<RedTestChannel>(server,
                                          SPICE_CHANNEL_PORT, // any other than main is fine
                                          0,
-                                         RedChannel::HandleAcks); // we want to test this
+                                         flags);
 
     // create dummy RedClient and MainChannelClient
     RedChannelCapabilities caps;
@@ -233,19 +282,29 @@ static void channel_loop()
                             0, FALSE, &caps);
     g_assert_nonnull(mcc);
 
-    // inject a trace into the core interface to count the events
-    SpiceCoreInterfaceInternal *server_core = reds_get_core_interface(server);
-    old_watch_add = server_core->watch_add;
-    server_core->watch_add = watch_add_inject;
-
-    // create our testing RedChannelClient
-    channel->connect(client, create_dummy_stream(server, &client_socket),
-                     FALSE, &caps);
-    red_channel_capabilities_reset(&caps);
-
-    // remove code to inject code during RedChannelClient watch, we set it
-    g_assert_nonnull(old_watch_func);
-    server_core->watch_add = old_watch_add;
+#ifndef _WIN32
+    if (send_thread) {
+        // the socket is written by another thread, don't count the events
+        channel->connect(client, create_tcp_stream(server, &client_socket),
+                         FALSE, &caps);
+        red_channel_capabilities_reset(&caps);
+    } else
+#endif
+    {
+        // inject a trace into the core interface to count the events
+        SpiceCoreInterfaceInternal *server_core = reds_get_core_interface(server);
+        old_watch_add = server_core->watch_add;
+        server_core->watch_add = watch_add_inject;
+
+        // create our testing RedChannelClient
+        channel->connect(client, create_dummy_stream(server, &client_socket),
+                         FALSE, &caps);
+        red_channel_capabilities_reset(&caps);
+
+        // remove code to inject code during RedChannelClient watch, we set it
+        g_assert_nonnull(old_watch_func);
+        server_core->watch_add = old_watch_add;
+    }
 
     send_ack_sync(client_socket, 1);
 
@@ -268,13 +327,346 @@ static void channel_loop()
     spice_server_destroy(server);
 
     basic_event_loop_destroy();
+    socket_close(client_socket);
+    client_socket = -1;
+}
+
+#ifndef _WIN32
+// each write of the server is received as a separate packet
+static RedStream *create_seqpacket_stream(SpiceServer *server, int *p_socket)
+{
+    int sv[2];
+    g_assert_cmpint(socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, sv), ==, 0);
+    *p_socket = sv[1];
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_non_blocking(sv[1], true);
+
+    RedStream * stream = red_stream_new(server, sv[0]);
+    g_assert_nonnull(stream);
+
+    return stream;
+}
+
+struct ReceivedPackets {
+    GByteArray *data;
+    unsigned num_packets;
+};
+
+static void timeout_read_packets(void *opaque)
+{
+    auto received = static_cast<ReceivedPackets *>(opaque);
+    uint8_t buffer[64 * 1024];
+    ssize_t len;
+
+    while ((len = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
+        g_byte_array_append(received->data, buffer, len);
+        received->num_packets++;
+    }
+    basic_event_loop_quit();
+}
+
+/* checks the messages queued by RedTestChannel::on_connect() are all
+ * received, in order, returns the number of writes used to send them */
+static unsigned channel_send_packets(bool coalesce)
+{
+    SpiceCoreInterface *core;
+    SpiceServer *server = spice_server_new();
+
+    g_assert_nonnull(server);
+
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+    g_assert_cmpint(spice_server_set_send_coalescing(server, coalesce), ==, 0);
+
+    auto channel =
+        red::make_shared<RedTestChannel>(server, SPICE_CHANNEL_PORT, 0,
+                                         RedChannel::CoalesceMessages);
+
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = static_cast<uint32_t *>(spice_memdup(&common_caps, sizeof(common_caps)));
+
+    RedClient *client = red_client_new(server, FALSE);
+    g_assert_nonnull(client);
+
+    red::shared_ptr<MainChannel> main_channel(main_channel_new(server));
+    g_assert(main_channel);
+
+    MainChannelClient *mcc;
+    mcc = main_channel_link(main_channel.get(), client, create_dummy_stream(server, nullptr),
+                            0, FALSE, &caps);
+    g_assert_nonnull(mcc);
+
+    channel->connect(client, create_seqpacket_stream(server, &client_socket), FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    // the messages are all queued before the channel client writes them
+    ReceivedPackets received = { g_byte_array_new(), 0 };
+    SpiceTimer *read_timer = core->timer_add(timeout_read_packets, &received);
+    core->timer_start(read_timer, 100);
+
+    alarm(5);
+    basic_event_loop_mainloop();
+    alarm(0);
+
+    // a SET_ACK message then the empty messages, with mini headers
+    const uint8_t *data = received.data->data;
+    size_t left = received.data->len;
+    for (int i = 0; i <= NUM_TEST_MESSAGES; i++) {
+        uint16_t type;
+        uint32_t size;
+
+        g_assert_cmpuint(left, >=, 6);
+        memcpy(&type, data, sizeof(type));
+        memcpy(&size, data + 2, sizeof(size));
+        g_assert_cmpuint(GUINT16_FROM_LE(type), ==,
+                         i == 0 ? SPICE_MSG_SET_ACK : SPICE_MSG_MIGRATE_DATA);
+        g_assert_cmpuint(GUINT32_FROM_LE(size), ==, i == 0 ? sizeof(SpiceMsgSetAck) : 0);
+        data += 6 + GUINT32_FROM_LE(size);
+        left -= 6 + GUINT32_FROM_LE(size);
+    }
+    g_assert_cmpuint(left, ==, 0);
+    unsigned num_packets = received.num_packets;
+    g_byte_array_unref(received.data);
+
+    client->destroy();
+    main_channel.reset();
+    channel.reset();
+
+    core->timer_remove(read_timer);
+
+    spice_server_destroy(server);
+
+    basic_event_loop_destroy();
+    socket_close(client_socket);
+    client_socket = -1;
+
+    return num_packets;
+}
+
+static void channel_coalesce()
+{
+    // a write per message
+    g_assert_cmpuint(channel_send_packets(false), ==, NUM_TEST_MESSAGES + 1);
+    // the small messages of a push are written together
+    g_assert_cmpuint(channel_send_packets(true), ==, 1);
+}
+#endif
+
+#define TEST_CLIENT_WINDOW 10
+
+/* sends messages of @msg_size bytes until the client has to acknowledge
+ * some of them, as RedChannelClient::push() does */
+static unsigned ack_send_until_full(RedAckBytes *bytes, uint32_t *messages_window,
+                                    uint64_t bytes_window, uint32_t msg_size)
+{
+    unsigned sent = 0;
+
+    while (!red_ack_window_is_full(*messages_window, TEST_CLIENT_WINDOW,
+                                   bytes->in_flight, bytes_window)) {
+        (*messages_window)++;
+        bytes->add_msg(msg_size);
+        sent++;
+    }
+    return sent;
+}
+
+/* the client acknowledges TEST_CLIENT_WINDOW messages */
+static uint64_t ack_client_ack(RedAckBytes *bytes, uint32_t *messages_window)
+{
+    *messages_window -= TEST_CLIENT_WINDOW;
+    return bytes->remove_msgs(TEST_CLIENT_WINDOW);
+}
+
+/* without a window in bytes the number of messages is limited */
+static void channel_ack_messages()
+{
+    RedAckBytes bytes;
+    uint32_t messages_window = 0;
+
+    g_assert_cmpuint(ack_send_until_full(&bytes, &messages_window, 0, 1024 * 1024), ==,
+                     2 * TEST_CLIENT_WINDOW + 1);
+    ack_client_ack(&bytes, &messages_window);
+    g_assert_cmpuint(ack_send_until_full(&bytes, &messages_window, 0, 10), ==,
+                     TEST_CLIENT_WINDOW);
+}
+
+/* the window in bytes limits the large messages, lets more small ones go */
+static void channel_ack_bytes()
+{
+    const uint64_t window = 256 * 1024;
+    RedAckBytes bytes;
+    uint32_t messages_window = 0;
+
+    // never stopping before the client is due to send an ack
+    g_assert_cmpuint(ack_send_until_full(&bytes, &messages_window, window, 100 * 1024), ==,
+                     TEST_CLIENT_WINDOW + 1);
+    g_assert_cmpuint(bytes.in_flight, ==, (TEST_CLIENT_WINDOW + 1) * 100 * 1024);
+
+    // the ack releases the size of the oldest messages
+    g_assert_cmpuint(ack_client_ack(&bytes, &messages_window), ==,
+                     TEST_CLIENT_WINDOW * 100 * 1024);
+    g_assert_cmpuint(bytes.in_flight, ==, 100 * 1024);
+    // up to the message reaching the window
+    g_assert_cmpuint(ack_send_until_full(&bytes, &messages_window, window, 8 * 1024), ==, 20);
+    g_assert_cmpuint(bytes.in_flight, ==, 100 * 1024 + 20 * 8 * 1024);
+    g_assert_cmpuint(ack_client_ack(&bytes, &messages_window), ==,
+                     100 * 1024 + (TEST_CLIENT_WINDOW - 1) * 8 * 1024);
+
+    // the number of messages stays bounded
+    bytes.reset();
+    messages_window = 0;
+    g_assert_cmpuint(ack_send_until_full(&bytes, &messages_window, window, 100), ==,
+                     ACK_MAX_MESSAGES);
+}
+
+static void channel_ack_bytes_window()
+{
+    const uint64_t min_bytes = 64 * 1024;
+    const uint64_t max_bytes = 1024 * 1024;
+
+    // twice the bandwidth-delay product, 10MB/s with a 10ms roundtrip
+    g_assert_cmpuint(red_ack_bytes_window(80 * 1000 * 1000, 10000, min_bytes, max_bytes), ==,
+                     200 * 1000);
+    g_assert_cmpuint(red_ack_bytes_window(1000 * 1000, 10000, min_bytes, max_bytes), ==,
+                     min_bytes);
+    g_assert_cmpuint(red_ack_bytes_window(8 * 1000 * 1000, 1000000, min_bytes, max_bytes), ==,
+                     max_bytes);
+    g_assert_cmpuint(red_ack_bytes_window(UINT64_C(10) * 1000 * 1000 * 1000, 10000,
+                                          min_bytes, max_bytes), ==, max_bytes);
+}
+
+/* the estimation follows a new roundtrip, a single sample changes it little */
+static void channel_net_estimate_roundtrip()
+{
+    RedNetEstimate estimate;
+
+    estimate.add_roundtrip(8 * NSEC_PER_MILLISEC);
+    g_assert_cmpint(estimate.roundtrip, ==, 8 * NSEC_PER_MILLISEC);
+    estimate.add_roundtrip(16 * NSEC_PER_MILLISEC);
+    g_assert_cmpint(estimate.roundtrip, ==, 9 * NSEC_PER_MILLISEC);
+
+    for (int i = 0; i < 50; i++) {
+        estimate.add_roundtrip(2 * NSEC_PER_MILLISEC);
+    }
+    g_assert_cmpint(estimate.roundtrip, >=, 2 * NSEC_PER_MILLISEC);
+    g_assert_cmpint(estimate.roundtrip, <, 2 * NSEC_PER_MILLISEC + 50 * NSEC_PER_MICROSEC);
+}
+
+static void channel_net_estimate_bitrate()
+{
+    RedNetEstimate estimate;
+
+    estimate.add_bitrate(100 * 1000 * 1000);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 100 * 1000 * 1000);
+    estimate.add_bitrate(20 * 1000 * 1000);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 80 * 1000 * 1000);
+
+    for (int i = 0; i < 20; i++) {
+        estimate.add_bitrate(20 * 1000 * 1000);
+    }
+    g_assert_cmpuint(estimate.bitrate_per_sec, >=, 20 * 1000 * 1000);
+    g_assert_cmpuint(estimate.bitrate_per_sec, <, 21 * 1000 * 1000);
+}
+
+/* only the acks sending was waiting for tell the bandwidth */
+static void channel_net_estimate_ack()
+{
+    RedNetEstimate estimate;
+    uint64_t time = NSEC_PER_SEC;
+
+    estimate.add_ack(64 * 1024, time, true);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 0);
+
+    // 125000 bytes in 100ms
+    time += 100 * NSEC_PER_MILLISEC;
+    estimate.add_ack(125000, time, true);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 10 * 1000 * 1000);
+
+    // the client was faster than the data sent
+    time += NSEC_PER_MILLISEC;
+    estimate.add_ack(1024 * 1024, time, false);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 10 * 1000 * 1000);
+    estimate.add_ack(1024 * 1024, time, true);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 10 * 1000 * 1000);
+    g_assert_cmpuint(estimate.last_ack_time, ==, time);
+}
+
+/* a connection the server sends little to does not look slow */
+static void channel_net_estimate_tcp_info()
+{
+    RedNetEstimate estimate;
+
+    // 10 segments of 1448 bytes per 10ms roundtrip
+    estimate.add_tcp_info(10000, 14480, false);
+    g_assert_cmpint(estimate.roundtrip, ==, 10 * NSEC_PER_MILLISEC);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 0);
+
+    estimate.add_tcp_info(10000, 1000 * 1000, true);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 800 * 1000 * 1000);
+    estimate.add_tcp_info(10000, 14480, false);
+    g_assert_cmpuint(estimate.bitrate_per_sec, ==, 800 * 1000 * 1000);
+
+    // no sample without roundtrip yet
+    estimate.add_tcp_info(0, 1000, true);
+    g_assert_cmpint(estimate.roundtrip, ==, 10 * NSEC_PER_MILLISEC);
+}
+
+/* the channel client is told when the bitrate changes by more than a quarter */
+static void channel_net_estimate_report()
+{
+    RedNetEstimate estimate;
+
+    g_assert_false(estimate.report_bitrate());
+    estimate.add_bitrate(100 * 1000 * 1000);
+    g_assert_true(estimate.report_bitrate());
+    g_assert_false(estimate.report_bitrate());
+
+    estimate.bitrate_per_sec = 125 * 1000 * 1000;
+    g_assert_false(estimate.report_bitrate());
+    estimate.bitrate_per_sec = 126 * 1000 * 1000;
+    g_assert_true(estimate.report_bitrate());
+    g_assert_cmpuint(estimate.reported_bitrate, ==, 126 * 1000 * 1000);
+
+    estimate.bitrate_per_sec = 94500 * 1000;
+    g_assert_false(estimate.report_bitrate());
+    estimate.bitrate_per_sec = 94 * 1000 * 1000;
+    g_assert_true(estimate.report_bitrate());
+}
+
+static void channel_loop()
+{
+    channel_loop_common(false);
+}
+
+#ifndef _WIN32
+static void channel_loop_send_thread()
+{
+    channel_loop_common(true);
 }
+#endif
 
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_func("/server/channel", channel_loop);
+    g_test_add_func("/server/channel-ack-messages", channel_ack_messages);
+    g_test_add_func("/server/channel-ack-bytes", channel_ack_bytes);
+    g_test_add_func("/server/channel-ack-bytes-window", channel_ack_bytes_window);
+    g_test_add_func("/server/channel-net-estimate-roundtrip", channel_net_estimate_roundtrip);
+    g_test_add_func("/server/channel-net-estimate-bitrate", channel_net_estimate_bitrate);
+    g_test_add_func("/server/channel-net-estimate-ack", channel_net_estimate_ack);
+    g_test_add_func("/server/channel-net-estimate-tcp-info", channel_net_estimate_tcp_info);
+    g_test_add_func("/server/channel-net-estimate-report", channel_net_estimate_report);
+#ifndef _WIN32
+    g_test_add_func("/server/channel-send-thread", channel_loop_send_thread);
+    g_test_add_func("/server/channel-coalesce", channel_coalesce);
+#endif
 
     return g_test_run();
 }
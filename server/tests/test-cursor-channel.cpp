@@ -0,0 +1,254 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test how the cursor channel queues the cursor commands for its clients and
+ * recognises the shapes sent again.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "cursor-channel-client.h"
+
+static red::shared_ptr<RedCursorPipeItem> cursor_item_new(uint8_t type, int16_t x = 0)
+{
+    auto cmd = red::make_shared<RedCursorCmd>();
+
+    cmd->type = type;
+    if (type == QXL_CURSOR_MOVE) {
+        cmd->u.position.x = x;
+    }
+    return red::make_shared<RedCursorPipeItem>(cmd);
+}
+
+/* as CursorChannel::pipes_add_move() does */
+static void pipe_add_move(RedChannelClient::Pipe &pipe, int16_t x)
+{
+    auto move = cursor_item_new(QXL_CURSOR_MOVE, x);
+
+    if (!cursor_pipe_coalesce_move(pipe, move)) {
+        pipe.push_front(move);
+    }
+}
+
+static void pipe_add_cursor(RedChannelClient::Pipe &pipe, uint8_t type)
+{
+    pipe.push_front(cursor_item_new(type));
+}
+
+static const RedCursorCmd *pipe_cursor_at(RedChannelClient::Pipe &pipe, size_t pos)
+{
+    auto it = pipe.begin();
+
+    std::advance(it, pos);
+    g_assert_cmpint((*it)->type, ==, RED_PIPE_ITEM_TYPE_CURSOR);
+    return static_cast<RedCursorPipeItem*>(it->get())->red_cursor.get();
+}
+
+/* a burst of moves not sent yet ends up as the last one */
+static void test_cursor_coalesce_burst(void)
+{
+    RedChannelClient::Pipe pipe;
+
+    for (int16_t x = 1; x <= 10; x++) {
+        pipe_add_move(pipe, x);
+    }
+    g_assert_cmpuint(pipe.size(), ==, 1);
+    g_assert_cmpint(pipe_cursor_at(pipe, 0)->u.position.x, ==, 10);
+}
+
+/* moves are not merged across other cursor commands */
+static void test_cursor_coalesce_order(void)
+{
+    RedChannelClient::Pipe pipe;
+
+    pipe_add_move(pipe, 1);
+    pipe_add_cursor(pipe, QXL_CURSOR_SET);
+    pipe_add_move(pipe, 2);
+    pipe_add_move(pipe, 3);
+    pipe_add_cursor(pipe, QXL_CURSOR_HIDE);
+    pipe_add_move(pipe, 4);
+
+    // the front of the pipe is the last item added
+    g_assert_cmpuint(pipe.size(), ==, 5);
+    g_assert_cmpint(pipe_cursor_at(pipe, 0)->u.position.x, ==, 4);
+    g_assert_cmpint(pipe_cursor_at(pipe, 1)->type, ==, QXL_CURSOR_HIDE);
+    g_assert_cmpint(pipe_cursor_at(pipe, 2)->u.position.x, ==, 3);
+    g_assert_cmpint(pipe_cursor_at(pipe, 3)->type, ==, QXL_CURSOR_SET);
+    g_assert_cmpint(pipe_cursor_at(pipe, 4)->u.position.x, ==, 1);
+}
+
+/* any other item queued after the move stops the coalescing */
+static void test_cursor_coalesce_other_item(void)
+{
+    RedChannelClient::Pipe pipe;
+
+    pipe_add_move(pipe, 1);
+    pipe.push_front(red::make_shared<RedPipeItem>(RED_PIPE_ITEM_TYPE_SET_ACK));
+    pipe_add_move(pipe, 2);
+
+    g_assert_cmpuint(pipe.size(), ==, 3);
+    g_assert_cmpint(pipe_cursor_at(pipe, 0)->u.position.x, ==, 2);
+    g_assert_cmpint(pipe_cursor_at(pipe, 2)->u.position.x, ==, 1);
+}
+
+static void test_cursor_hash(void)
+{
+#if G_BYTE_ORDER != G_LITTLE_ENDIAN
+    g_test_skip("the values read depend on the host endianness");
+#else
+    static const char spam[] = "Nobody inspects the spammish repetition";
+    uint8_t data[100];
+
+    for (unsigned i = 0; i < G_N_ELEMENTS(data); i++) {
+        data[i] = i;
+    }
+
+    // the XXH64 reference values, one for each path of the hash
+    g_assert_cmphex(cursor_hash(data, 0, 0), ==, 0xef46db3751d8e999ULL);
+    g_assert_cmphex(cursor_hash((const uint8_t *) "a", 1, 0), ==, 0xd24ec4f1a98c6e5bULL);
+    g_assert_cmphex(cursor_hash((const uint8_t *) "abcd", 4, 0), ==, 0xde0327b0d25d92ccULL);
+    g_assert_cmphex(cursor_hash((const uint8_t *) "abcdefgh", 8, 0), ==, 0x3ad351775b4634b7ULL);
+    g_assert_cmphex(cursor_hash((const uint8_t *) spam, strlen(spam), 0), ==,
+                    0xfbcea83c8a378bf1ULL);
+    g_assert_cmphex(cursor_hash(data, 64, 0), ==, 0xf7c67301db6713f0ULL);
+    g_assert_cmphex(cursor_hash(data, 100, 0x123456789abcdef0ULL), ==, 0x31da36536b451675ULL);
+#endif
+}
+
+#define SHAPE_SIZE (32 * 32 * 4)
+
+struct TestShape {
+    SpiceCursor cursor;
+    uint8_t data[SHAPE_SIZE];
+};
+
+/* a shape without unique id, different for each @n */
+static void shape_init(TestShape *shape, uint32_t n)
+{
+    memset(shape, 0, sizeof(*shape));
+    shape->cursor.header.type = SPICE_CURSOR_TYPE_ALPHA;
+    shape->cursor.header.width = 32;
+    shape->cursor.header.height = 32;
+    shape->cursor.data_size = SHAPE_SIZE;
+    shape->cursor.data = shape->data;
+    memcpy(shape->data, &n, sizeof(n));
+}
+
+static uint64_t cache_get_id(CursorShapeCache *cache, const TestShape *shape,
+                             CursorShapeLookup expected)
+{
+    CursorShapeLookup lookup;
+    uint64_t id = cache->get_id(&shape->cursor, &lookup);
+
+    g_assert_cmpint(lookup, ==, expected);
+    return id;
+}
+
+/* the same shape gets the same id, until the cache is cleared */
+static void test_cursor_shape_hit(void)
+{
+    CursorShapeCache cache;
+    TestShape shape, other;
+
+    shape_init(&shape, 1);
+    shape_init(&other, 2);
+    uint64_t id = cache_get_id(&cache, &shape, CURSOR_SHAPE_NEW);
+    g_assert_cmphex(id, !=, 0);
+    uint64_t other_id = cache_get_id(&cache, &other, CURSOR_SHAPE_NEW);
+    g_assert_cmphex(other_id, !=, id);
+    g_assert_cmphex(cache_get_id(&cache, &shape, CURSOR_SHAPE_HIT), ==, id);
+    g_assert_cmphex(cache_get_id(&cache, &other, CURSOR_SHAPE_HIT), ==, other_id);
+
+    // the same data with another hot spot is another shape
+    shape.cursor.header.hot_spot_x = 5;
+    g_assert_cmphex(cache_get_id(&cache, &shape, CURSOR_SHAPE_NEW), !=, id);
+
+    // the ids are never reused, the clients may still have the old shapes
+    cache.clear();
+    shape.cursor.header.hot_spot_x = 0;
+    uint64_t new_id = cache_get_id(&cache, &shape, CURSOR_SHAPE_NEW);
+    g_assert_cmphex(new_id, !=, id);
+    g_assert_cmphex(new_id, !=, other_id);
+}
+
+/* a shape with the hash of a cached shape is not cached, nor sent with its id */
+static void test_cursor_shape_collision(void)
+{
+    CursorShapeCache cache;
+    TestShape shape;
+
+    shape_init(&shape, 1);
+    uint64_t id = cache_get_id(&cache, &shape, CURSOR_SHAPE_NEW);
+
+    // the cached copy differs now from the shape with the same hash
+    CursorShapeCacheEntry *entry = nullptr;
+    for (auto &e : cache.entries) {
+        if (e.id == id) {
+            entry = &e;
+        }
+    }
+    g_assert_nonnull(entry);
+    entry->data[SHAPE_SIZE - 1] ^= 0xff;
+
+    g_assert_cmphex(cache_get_id(&cache, &shape, CURSOR_SHAPE_COLLISION), ==, 0);
+    g_assert_cmphex(cache_get_id(&cache, &shape, CURSOR_SHAPE_COLLISION), ==, 0);
+    g_assert_cmphex(entry->id, ==, id);
+}
+
+/* a new shape replaces the least recently used one when the cache is full */
+static void test_cursor_shape_eviction(void)
+{
+    CursorShapeCache cache;
+    TestShape shapes[CURSOR_SHAPE_CACHE_SIZE + 1];
+    uint64_t ids[CURSOR_SHAPE_CACHE_SIZE + 1];
+
+    for (uint32_t i = 0; i < G_N_ELEMENTS(shapes); i++) {
+        shape_init(&shapes[i], i);
+    }
+    for (uint32_t i = 0; i < CURSOR_SHAPE_CACHE_SIZE; i++) {
+        ids[i] = cache_get_id(&cache, &shapes[i], CURSOR_SHAPE_NEW);
+    }
+    // the first shape was used again, the second is the oldest one now
+    g_assert_cmphex(cache_get_id(&cache, &shapes[0], CURSOR_SHAPE_HIT), ==, ids[0]);
+    ids[CURSOR_SHAPE_CACHE_SIZE] = cache_get_id(&cache, &shapes[CURSOR_SHAPE_CACHE_SIZE],
+                                                CURSOR_SHAPE_NEW);
+
+    for (uint32_t i = 0; i < G_N_ELEMENTS(shapes); i++) {
+        if (i == 1) {
+            continue;
+        }
+        g_assert_cmphex(cache_get_id(&cache, &shapes[i], CURSOR_SHAPE_HIT), ==, ids[i]);
+    }
+    uint64_t id = cache_get_id(&cache, &shapes[1], CURSOR_SHAPE_NEW);
+    g_assert_cmphex(id, !=, ids[1]);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/cursor-coalesce-burst", test_cursor_coalesce_burst);
+    g_test_add_func("/server/cursor-coalesce-order", test_cursor_coalesce_order);
+    g_test_add_func("/server/cursor-coalesce-other-item", test_cursor_coalesce_other_item);
+    g_test_add_func("/server/cursor-hash", test_cursor_hash);
+    g_test_add_func("/server/cursor-shape-hit", test_cursor_shape_hit);
+    g_test_add_func("/server/cursor-shape-collision", test_cursor_shape_collision);
+    g_test_add_func("/server/cursor-shape-eviction", test_cursor_shape_eviction);
+
+    return g_test_run();
+}
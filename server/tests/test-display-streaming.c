@@ -16,6 +16,15 @@
    License along with this library; if not, see <http://www.gnu.org/licenses/>.
 */
 /* Do repeated updates to the same rectangle to trigger stream creation.
+ *
+ * Benchmark mode:
+ *   test-display-streaming bench [MAX_FPS]
+ * streams a moving pattern at 30, 60 and 120 fps for BENCH_SECONDS each,
+ * with the stream frame rate limited to MAX_FPS (120 by default), and prints
+ * the source frame rate and the CPU time used by the process for each of
+ * them. Connect a client to get the frames encoded and sent; the delivered
+ * frame rate of each stream (out-avg-fps) is logged by the server when built
+ * with STREAM_STATS.
  *
  * TODO: check that stream actually starts programatically (maybe stap?)
  * TODO: stop updating same rect, check (prog) that stream stops
@@ -177,6 +186,99 @@ static void create_frame2(Test *test, Command *command)
 
 typedef void (*create_frame_cb)(Test *test, Command *command);
 
+#define BENCH_SECONDS 10
+/* longer than RED_STREAM_TIMEOUT, so each rate starts a new stream */
+#define BENCH_PAUSE_SECONDS 2
+
+static const int bench_rates[] = {30, 60, 120};
+static unsigned bench_phase;
+static int bench_frame;
+static gint64 bench_start;
+static clock_t bench_start_cpu;
+
+static void bench_print_phase(void)
+{
+    double elapsed = (g_get_monotonic_time() - bench_start) / (double) G_USEC_PER_SEC;
+    double cpu = (double) (clock() - bench_start_cpu) / CLOCKS_PER_SEC;
+
+    printf("source %3d fps: %d frames in %.2f s, %.1f fps, %.2f s CPU (%.0f%%)\n",
+           bench_rates[bench_phase], bench_frame, elapsed, bench_frame / elapsed,
+           cpu, cpu * 100 / elapsed);
+}
+
+/* full screen frames with a bar moving from the top to the bottom, produced
+ * at the rate of the current phase */
+static void create_bench_frame(Test *test, Command *command)
+{
+    CommandDrawBitmap *cmd = &command->bitmap;
+    int fps = bench_rates[bench_phase];
+    int width = test->primary_width;
+    int height = test->primary_height;
+    int bar_height = height / 16;
+    int bar_top;
+    uint32_t *dst;
+
+    if (bench_frame == 0) {
+        bench_start = g_get_monotonic_time();
+        bench_start_cpu = clock();
+    } else if (bench_frame == fps * BENCH_SECONDS) {
+        bench_print_phase();
+        if (++bench_phase == G_N_ELEMENTS(bench_rates)) {
+            exit(0);
+        }
+        bench_frame = 0;
+        sleep(BENCH_PAUSE_SECONDS);
+        bench_start = g_get_monotonic_time();
+        bench_start_cpu = clock();
+        fps = bench_rates[bench_phase];
+    }
+
+    gint64 frame_time = bench_start + (gint64) bench_frame * G_USEC_PER_SEC / fps;
+    gint64 now = g_get_monotonic_time();
+    if (frame_time > now) {
+        g_usleep(frame_time - now);
+    }
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = 0;
+    cmd->bbox.top = 0;
+    cmd->bbox.right = width;
+    cmd->bbox.bottom = height;
+    cmd->num_clip_rects = 0;
+
+    cmd->bitmap = (uint8_t*) g_malloc(width * height * 4);
+    memset(cmd->bitmap, 0xff, width * height * 4);
+    bar_top = (bench_frame * 4) % (height - bar_height);
+    dst = SPICE_ALIGNED_CAST(uint32_t *, cmd->bitmap + bar_top * width * 4);
+    for (int i = 0; i < bar_height * width; i++, dst++) {
+        *dst = 0x00FF00;
+    }
+    bench_frame++;
+}
+
+static int benchmark(int argc, char **argv)
+{
+    static Command bench_commands[] = {
+        {SIMPLE_DRAW_BITMAP, create_bench_frame, .cb_opaque = NULL},
+    };
+    int max_fps = argc > 2 ? atoi(argv[2]) : 120;
+    SpiceCoreInterface *core;
+    Test *test;
+
+    core = basic_event_loop_init();
+    test = test_new(core);
+    spice_server_set_streaming_video(test->server, SPICE_STREAM_VIDEO_ALL);
+    if (spice_server_set_video_max_fps(test->server, max_fps, max_fps) != 0) {
+        fprintf(stderr, "invalid maximum frame rate %d\n", max_fps);
+        return 1;
+    }
+    test_add_display_interface(test);
+    test_set_command_list(test, bench_commands, G_N_ELEMENTS(bench_commands));
+    basic_event_loop_mainloop();
+    test_destroy(test);
+    return 0;
+}
+
 
 /*
  * The test contains two types of streams. The first stream doesn't
@@ -230,6 +332,10 @@ int main(int argc, char **argv)
     int i;
     Test *test;
 
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return benchmark(argc, argv);
+    }
+
     spice_test_config_parse_args(argc, argv);
     sized = 0;
     for (i = 1 ; i < argc; ++i) {
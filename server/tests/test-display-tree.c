@@ -0,0 +1,99 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Benchmark the drawing tree with a terminal like workload: many small
+ * opaque draws (glyphs) at random positions, sometimes clearing a line.
+ * Most drawables stay in the tree, every new one has to be checked against
+ * the ones already there.
+ *
+ *   test-display-tree [DRAWS]
+ *
+ * Prints the CPU time used by the process once DRAWS drawables have been
+ * produced. Producing the commands costs the same whatever the tree does,
+ * so differences come from the server side.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "test-display-base.h"
+
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+
+static int num_draws = 20000;
+static int draw_count;
+static clock_t start_time;
+
+static void set_glyph(Test *test, Command *command)
+{
+    CommandDrawSolid *solid = &command->solid;
+    int columns = test->primary_width / GLYPH_WIDTH;
+    int lines = test->primary_height / GLYPH_HEIGHT;
+    int line = rand() % lines;
+
+    if (draw_count == 0) {
+        start_time = clock();
+    } else if (draw_count == num_draws) {
+        double elapsed = (double) (clock() - start_time) / CLOCKS_PER_SEC;
+
+        printf("%d draws on %dx%d: %.3f s CPU, %.1f us per draw\n",
+               num_draws, test->primary_width, test->primary_height,
+               elapsed, elapsed * 1000000 / num_draws);
+        exit(0);
+    }
+    draw_count++;
+
+    solid->surface_id = 0;
+    solid->color = rand() | 0xff000000;
+    solid->bbox.top = line * GLYPH_HEIGHT;
+    solid->bbox.bottom = solid->bbox.top + GLYPH_HEIGHT;
+    if (rand() % 32 == 0) {
+        /* clear the whole line */
+        solid->bbox.left = 0;
+        solid->bbox.right = columns * GLYPH_WIDTH;
+    } else {
+        solid->bbox.left = (rand() % columns) * GLYPH_WIDTH;
+        solid->bbox.right = solid->bbox.left + GLYPH_WIDTH;
+    }
+}
+
+static Command commands[] = {
+    {SIMPLE_DRAW_SOLID, set_glyph, .cb_opaque = NULL},
+};
+
+int main(int argc, char **argv)
+{
+    SpiceCoreInterface *core;
+    Test *test;
+
+    if (argc > 1) {
+        num_draws = MAX(atoi(argv[1]), 1);
+    }
+    srand(1);
+
+    core = basic_event_loop_init();
+    test = test_new(core);
+    test_add_display_interface(test);
+    test_set_command_list(test, commands, G_N_ELEMENTS(commands));
+    basic_event_loop_mainloop();
+    test_destroy(test);
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the pool of drawables of a display channel: it grows on demand up
+ * to its limit, then drawables are released to make room for new ones.
+ */
+#include <config.h>
+
+#include <vector>
+
+#include "test-glib-compat.h"
+#include "display-channel-private.h"
+
+/* drawables allocated by the test, oldest first */
+struct TestDrawables {
+    DrawablesPool pool;
+    std::vector<void *> drawables;
+    unsigned releases;
+};
+
+static bool release_not_expected(void *opaque)
+{
+    g_assert_not_reached();
+    return false;
+}
+
+/* releases the oldest drawable, like rendering it would do */
+static bool release_oldest(void *opaque)
+{
+    auto test = static_cast<TestDrawables *>(opaque);
+
+    test->releases++;
+    drawables_pool_free(&test->pool, test->drawables.front());
+    test->drawables.erase(test->drawables.begin());
+    return true;
+}
+
+/* a display with nothing left to render */
+static bool release_none(void *opaque)
+{
+    static_cast<TestDrawables *>(opaque)->releases++;
+    return false;
+}
+
+static void alloc_drawables(TestDrawables *test, unsigned count,
+                            drawables_pool_release_proc release)
+{
+    for (unsigned i = 0; i < count; i++) {
+        void *drawable = drawables_pool_alloc(&test->pool, release, test);
+        g_assert_nonnull(drawable);
+        test->drawables.push_back(drawable);
+    }
+}
+
+static void free_drawables(TestDrawables *test)
+{
+    for (auto drawable : test->drawables) {
+        drawables_pool_free(&test->pool, drawable);
+    }
+    test->drawables.clear();
+}
+
+static void test_drawables_pool_grow(void)
+{
+    TestDrawables test = {};
+
+    drawables_pool_init(&test.pool, DRAWABLES_CHUNK_SIZE, DRAWABLES_CHUNK_SIZE * 4);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE);
+    g_assert_cmpuint(test.pool.max_drawables, ==, DRAWABLES_CHUNK_SIZE * 4);
+
+    // the initial drawables don't need to grow the pool
+    alloc_drawables(&test, DRAWABLES_CHUNK_SIZE, release_not_expected);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE);
+
+    // past the initial size the pool grows a chunk at a time
+    alloc_drawables(&test, 1, release_not_expected);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE * 2);
+    alloc_drawables(&test, DRAWABLES_CHUNK_SIZE * 2 - 1, release_not_expected);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE * 3);
+
+    // freed drawables are reused before growing again
+    free_drawables(&test);
+    alloc_drawables(&test, DRAWABLES_CHUNK_SIZE * 3, release_not_expected);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE * 3);
+
+    free_drawables(&test);
+    drawables_pool_destroy(&test.pool);
+}
+
+static void test_drawables_pool_limit(void)
+{
+    TestDrawables test = {};
+
+    // limits are rounded up to whole chunks
+    drawables_pool_init(&test.pool, 1, DRAWABLES_CHUNK_SIZE + 1);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE);
+    g_assert_cmpuint(test.pool.max_drawables, ==, DRAWABLES_CHUNK_SIZE * 2);
+
+    alloc_drawables(&test, DRAWABLES_CHUNK_SIZE * 2, release_not_expected);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE * 2);
+
+    // at the limit the oldest drawables are released instead of growing
+    void *oldest = test.drawables.front();
+    alloc_drawables(&test, 1, release_oldest);
+    g_assert_cmpuint(test.releases, ==, 1);
+    g_assert_true(test.drawables.back() == oldest);
+    alloc_drawables(&test, 10, release_oldest);
+    g_assert_cmpuint(test.releases, ==, 11);
+    g_assert_cmpuint(test.pool.allocated, ==, DRAWABLES_CHUNK_SIZE * 2);
+    g_assert_cmpuint(test.drawables.size(), ==, DRAWABLES_CHUNK_SIZE * 2);
+
+    // nothing can be released, allocation fails
+    g_assert_null(drawables_pool_alloc(&test.pool, release_none, &test));
+    g_assert_cmpuint(test.releases, ==, 12);
+
+    free_drawables(&test);
+    drawables_pool_destroy(&test.pool);
+}
+
+static void test_drawables_pool_clamp(void)
+{
+    DrawablesPool pool = {};
+
+    // soft limit above the hard one is reduced to it
+    drawables_pool_init(&pool, DRAWABLES_CHUNK_SIZE * 8, DRAWABLES_CHUNK_SIZE * 2);
+    g_assert_cmpuint(pool.allocated, ==, DRAWABLES_CHUNK_SIZE * 2);
+    g_assert_cmpuint(pool.max_drawables, ==, DRAWABLES_CHUNK_SIZE * 2);
+    drawables_pool_destroy(&pool);
+    g_assert_cmpuint(pool.allocated, ==, 0);
+
+    // at least a chunk is allocated
+    drawables_pool_init(&pool, 0, 0);
+    g_assert_cmpuint(pool.allocated, ==, DRAWABLES_CHUNK_SIZE);
+    g_assert_cmpuint(pool.max_drawables, ==, DRAWABLES_CHUNK_SIZE);
+    drawables_pool_destroy(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/drawables-pool-grow", test_drawables_pool_grow);
+    g_test_add_func("/server/drawables-pool-limit", test_drawables_pool_limit);
+    g_test_add_func("/server/drawables-pool-clamp", test_drawables_pool_clamp);
+
+    return g_test_run();
+}
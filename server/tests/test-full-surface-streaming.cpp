@@ -0,0 +1,122 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test when the full surface video mode is entered and left depending on
+ * the drawing activity of the primary surface.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "video-stream.h"
+
+#define SURFACE_AREA (1024 * 768)
+
+/* draws @draws drawables covering @screens times the surface during a
+ * window, then closes it */
+static void draw_window(FullSurfaceStreaming *state, red_time_t *now,
+                        double screens, uint32_t draws)
+{
+    state->window_area = static_cast<uint64_t>(screens * SURFACE_AREA);
+    state->window_draws = draws;
+    *now += RED_FULL_SURFACE_WINDOW;
+    video_stream_full_surface_update_window(state, SURFACE_AREA, *now);
+    g_assert_cmpuint(state->window_start, ==, *now);
+}
+
+/* a window of sustained full screen redraws, with a lot of drawables */
+static void draw_busy_window(FullSurfaceStreaming *state, red_time_t *now)
+{
+    draw_window(state, now, 3, 100);
+}
+
+static void test_full_surface_enter(void)
+{
+    FullSurfaceStreaming state = {};
+    red_time_t now = 0;
+
+    state.enabled = true;
+    for (int i = 1; i < RED_FULL_SURFACE_START_WINDOWS; i++) {
+        draw_busy_window(&state, &now);
+        g_assert_false(state.active);
+    }
+    draw_busy_window(&state, &now);
+    g_assert_true(state.active);
+
+    // the window is not over yet
+    state.window_area = 0;
+    video_stream_full_surface_update_window(&state, SURFACE_AREA, now + 1);
+    g_assert_cmpuint(state.window_start, ==, now);
+    g_assert_true(state.active);
+}
+
+/* the windows must be busy in a row, with many drawables */
+static void test_full_surface_not_busy(void)
+{
+    FullSurfaceStreaming state = {};
+    red_time_t now = 0;
+
+    state.enabled = true;
+    for (int i = 0; i < 10; i++) {
+        draw_busy_window(&state, &now);
+        // a video played in a window
+        draw_window(&state, &now, 0.5, 100);
+        g_assert_false(state.active);
+    }
+
+    // large drawables, a slide show
+    for (int i = 0; i < 10; i++) {
+        draw_window(&state, &now, 3, 10);
+        g_assert_false(state.active);
+    }
+}
+
+static void test_full_surface_leave(void)
+{
+    FullSurfaceStreaming state = {};
+    red_time_t now = 0;
+
+    state.enabled = true;
+    for (int i = 0; i < RED_FULL_SURFACE_START_WINDOWS; i++) {
+        draw_busy_window(&state, &now);
+    }
+    g_assert_true(state.active);
+
+    // a busy window restarts the count
+    for (int i = 1; i < RED_FULL_SURFACE_STOP_WINDOWS; i++) {
+        draw_window(&state, &now, 0.1, 5);
+        g_assert_true(state.active);
+    }
+    draw_busy_window(&state, &now);
+    for (int i = 1; i < RED_FULL_SURFACE_STOP_WINDOWS; i++) {
+        draw_window(&state, &now, 0.1, 5);
+        g_assert_true(state.active);
+    }
+    draw_window(&state, &now, 0.1, 5);
+    g_assert_false(state.active);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/full-surface-enter", test_full_surface_enter);
+    g_test_add_func("/server/full-surface-not-busy", test_full_surface_not_busy);
+    g_test_add_func("/server/full-surface-leave", test_full_surface_leave);
+
+    return g_test_run();
+}
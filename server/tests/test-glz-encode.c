@@ -0,0 +1,441 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Replay bitmaps through the GLZ encoder.
+ *
+ * Without arguments, checks that encoding the same images with two new
+ * dictionaries gives the same output, the same as the scalar version of
+ * the encoder.
+ * With arguments, acts as a benchmark:
+ *   test-glz-encode [-n ITERATIONS] [--hugepages] [IMAGE.ppm...]
+ * Images are binary PPM (P6) files, encoded as 32 bit RGB.
+ */
+#include <config.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "glz-encoder.h"
+
+/* the encoder without the SIMD match extension, as a reference */
+GlzEncoderContext *scalar_glz_encoder_create(uint8_t id, GlzEncDictContext *dictionary,
+                                             GlzEncoderUsrContext *usr);
+void scalar_glz_encoder_destroy(GlzEncoderContext *opaque_encoder);
+int scalar_glz_encode(GlzEncoderContext *opaque_encoder, LzImageType type, int width, int height,
+                      int top_down, uint8_t *lines, unsigned int num_lines, int stride,
+                      uint8_t *io_ptr, unsigned int num_io_bytes,
+                      GlzUsrImageContext *usr_context,
+                      GlzEncDictImageContext **o_enc_dict_context);
+
+#define GLZ_ENCODER_NO_SIMD
+#define glz_encoder_create scalar_glz_encoder_create
+#define glz_encoder_destroy scalar_glz_encoder_destroy
+#define glz_encode scalar_glz_encode
+#include "glz-encoder.c"
+#undef glz_encoder_create
+#undef glz_encoder_destroy
+#undef glz_encode
+
+#define GLZ_DICT_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+    int width;
+    int height;
+    uint8_t *data; // 32 bit pixels, stride = width * 4
+} TestImage;
+
+static SPICE_GNUC_PRINTF(2, 3) void
+usr_error(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    g_logv(G_LOG_DOMAIN, G_LOG_LEVEL_ERROR, fmt, ap);
+    va_end(ap);
+}
+
+static SPICE_GNUC_PRINTF(2, 3) void
+usr_message(GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    g_logv(G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, fmt, ap);
+    va_end(ap);
+}
+
+static void *usr_malloc(GlzEncoderUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void usr_free(GlzEncoderUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int usr_more_lines(GlzEncoderUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static int usr_more_space(GlzEncoderUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static void usr_free_image(GlzEncoderUsrContext *usr, GlzUsrImageContext *image)
+{
+}
+
+static GlzEncoderUsrContext usr = {
+    usr_error,
+    usr_message,
+    usr_message,
+    usr_malloc,
+    usr_free,
+    usr_more_lines,
+    usr_more_space,
+    usr_free_image,
+};
+
+/* draw "text": small glyphs picked from a limited set, like a terminal */
+static void image_init_text(TestImage *image, int width, int height, guint32 seed)
+{
+    enum { GLYPH_W = 8, GLYPH_H = 16, NUM_GLYPHS = 64 };
+    GRand *rand = g_rand_new_with_seed(seed);
+    uint8_t glyphs[NUM_GLYPHS][GLYPH_H];
+    uint32_t *pixels;
+
+    for (int i = 0; i < NUM_GLYPHS; i++) {
+        for (int y = 0; y < GLYPH_H; y++) {
+            glyphs[i][y] = g_rand_int_range(rand, 0, 256);
+        }
+    }
+
+    image->width = width;
+    image->height = height;
+    image->data = g_malloc(width * height * 4);
+    pixels = (uint32_t *) image->data;
+
+    for (int row = 0; row + GLYPH_H <= height; row += GLYPH_H) {
+        for (int col = 0; col + GLYPH_W <= width; col += GLYPH_W) {
+            const uint8_t *glyph = glyphs[g_rand_int_range(rand, 0, NUM_GLYPHS)];
+            for (int y = 0; y < GLYPH_H; y++) {
+                for (int x = 0; x < GLYPH_W; x++) {
+                    pixels[(row + y) * width + col + x] =
+                        (glyph[y] >> x) & 1 ? 0x00202020 : 0x00f0f0f0;
+                }
+            }
+        }
+    }
+    g_rand_free(rand);
+}
+
+static bool image_load_ppm(TestImage *image, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    int max_val;
+    bool ok = false;
+
+    if (!f) {
+        return false;
+    }
+    if (fscanf(f, "P6 %d %d %d", &image->width, &image->height, &max_val) == 3 &&
+        fgetc(f) != EOF && max_val == 255 &&
+        image->width > 0 && image->height > 0) {
+        size_t n_pixels = (size_t) image->width * image->height;
+        uint8_t *rgb = g_malloc(n_pixels * 3);
+
+        if (fread(rgb, 3, n_pixels, f) == n_pixels) {
+            image->data = g_malloc(n_pixels * 4);
+            for (size_t i = 0; i < n_pixels; i++) {
+                image->data[i * 4 + 0] = rgb[i * 3 + 2];
+                image->data[i * 4 + 1] = rgb[i * 3 + 1];
+                image->data[i * 4 + 2] = rgb[i * 3 + 0];
+                image->data[i * 4 + 3] = 0;
+            }
+            ok = true;
+        }
+        g_free(rgb);
+    }
+    fclose(f);
+    return ok;
+}
+
+/* Converts the image to @type, with the bits the encoder ignores (the
+ * padding byte of RGB32, the top bit of RGB16) set to varying values so
+ * matches have to skip them */
+static uint8_t *image_convert(const TestImage *image, LzImageType type)
+{
+    const int n_pixels = image->width * image->height;
+    uint8_t *data;
+
+    switch (type) {
+    case LZ_IMAGE_TYPE_RGB32:
+        data = g_malloc(n_pixels * 4);
+        memcpy(data, image->data, n_pixels * 4);
+        for (int i = 0; i < n_pixels; i++) {
+            data[i * 4 + 3] = (i * 7) & 0xff;
+        }
+        break;
+    case LZ_IMAGE_TYPE_RGB24:
+        data = g_malloc(n_pixels * 3);
+        for (int i = 0; i < n_pixels; i++) {
+            memcpy(&data[i * 3], &image->data[i * 4], 3);
+        }
+        break;
+    case LZ_IMAGE_TYPE_RGB16:
+        data = g_malloc(n_pixels * 2);
+        for (int i = 0; i < n_pixels; i++) {
+            const uint8_t *pixel = &image->data[i * 4];
+            uint16_t rgb16 = ((pixel[2] >> 3) << 10) | ((pixel[1] >> 3) << 5) | (pixel[0] >> 3);
+
+            rgb16 |= (i % 3 == 0) << 15;
+            memcpy(&data[i * 2], &rgb16, 2);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return data;
+}
+
+/* encode all the images with a new dictionary, returns the compressed sizes */
+static GArray *encode_images(GPtrArray *images, LzImageType type, unsigned iterations,
+                             uint32_t alloc_flags, bool scalar, GByteArray *output)
+{
+    GlzEncDictContext *dict = glz_enc_dictionary_create(GLZ_DICT_SIZE, 1, alloc_flags, &usr);
+    GlzEncoderContext *encoder = scalar ? scalar_glz_encoder_create(0, dict, &usr) :
+                                          glz_encoder_create(0, dict, &usr);
+    GArray *sizes = g_array_new(FALSE, FALSE, sizeof(int));
+    GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+    const int bytes_per_pixel = type == LZ_IMAGE_TYPE_RGB32 ? 4 :
+                                type == LZ_IMAGE_TYPE_RGB24 ? 3 : 2;
+
+    g_assert_nonnull(dict);
+    g_assert_nonnull(encoder);
+
+    for (guint i = 0; i < images->len; i++) {
+        g_ptr_array_add(lines, image_convert(g_ptr_array_index(images, i), type));
+    }
+
+    for (unsigned iter = 0; iter < iterations; iter++) {
+        for (guint i = 0; i < images->len; i++) {
+            TestImage *image = g_ptr_array_index(images, i);
+            unsigned int out_size = image->width * image->height * 4 * 2 + 1024;
+            uint8_t *out = g_malloc(out_size);
+            uint8_t *data = g_ptr_array_index(lines, i);
+            const int stride = image->width * bytes_per_pixel;
+            GlzEncDictImageContext *dict_image;
+            int size;
+
+            if (scalar) {
+                size = scalar_glz_encode(encoder, type, image->width, image->height,
+                                         TRUE, data, image->height, stride,
+                                         out, out_size, NULL, &dict_image);
+            } else {
+                size = glz_encode(encoder, type, image->width, image->height,
+                                  TRUE, data, image->height, stride,
+                                  out, out_size, NULL, &dict_image);
+            }
+            g_assert_cmpint(size, >, 0);
+            g_array_append_val(sizes, size);
+            if (output) {
+                g_byte_array_append(output, out, size);
+            }
+            g_free(out);
+        }
+    }
+
+    if (scalar) {
+        scalar_glz_encoder_destroy(encoder);
+    } else {
+        glz_encoder_destroy(encoder);
+    }
+    glz_enc_dictionary_destroy(dict, &usr);
+    g_ptr_array_unref(lines);
+    return sizes;
+}
+
+static void test_image_free(gpointer data)
+{
+    TestImage *image = data;
+
+    g_free(image->data);
+    g_free(image);
+}
+
+static GPtrArray *default_images(void)
+{
+    GPtrArray *images = g_ptr_array_new_with_free_func(test_image_free);
+    TestImage *image;
+
+    image = g_new0(TestImage, 1);
+    if (image_load_ppm(image, SPICE_TOP_SRCDIR "/server/tests/base_test.ppm")) {
+        g_ptr_array_add(images, image);
+    } else {
+        g_free(image);
+    }
+
+    for (guint32 seed = 1; seed <= 3; seed++) {
+        image = g_new0(TestImage, 1);
+        image_init_text(image, 800, 480, seed);
+        g_ptr_array_add(images, image);
+    }
+    return images;
+}
+
+/* the output must not depend on the dictionary allocation nor on the
+ * match extension being vectorized */
+static void check_encode(LzImageType type)
+{
+    GPtrArray *images = default_images();
+    GByteArray *output1 = g_byte_array_new();
+    GByteArray *output2 = g_byte_array_new();
+    GByteArray *scalar_output = g_byte_array_new();
+    GArray *sizes1, *sizes2;
+
+    /* the second iteration references the images of the first one */
+    sizes1 = encode_images(images, type, 2, 0, false, output1);
+    sizes2 = encode_images(images, type, 2, 0, false, output2);
+    g_array_unref(encode_images(images, type, 2, 0, true, scalar_output));
+
+    g_assert_cmpuint(sizes1->len, ==, sizes2->len);
+    g_assert_cmpmem(output1->data, output1->len, output2->data, output2->len);
+    g_assert_cmpmem(output1->data, output1->len, scalar_output->data, scalar_output->len);
+
+    /* images already in the dictionary compress very well */
+    for (guint i = 0; i < images->len; i++) {
+        TestImage *image = g_ptr_array_index(images, i);
+        int first = g_array_index(sizes1, int, i);
+        int second = g_array_index(sizes1, int, i + images->len);
+
+        g_assert_cmpint(first, <, image->width * image->height * 4);
+        g_assert_cmpint(second, <, first);
+    }
+
+    g_array_unref(sizes1);
+    g_array_unref(sizes2);
+    g_byte_array_unref(output1);
+    g_byte_array_unref(output2);
+    g_byte_array_unref(scalar_output);
+    g_ptr_array_unref(images);
+}
+
+static void test_glz_encode_rgb32(void)
+{
+    check_encode(LZ_IMAGE_TYPE_RGB32);
+}
+
+static void test_glz_encode_rgb24(void)
+{
+    check_encode(LZ_IMAGE_TYPE_RGB24);
+}
+
+static void test_glz_encode_rgb16(void)
+{
+    check_encode(LZ_IMAGE_TYPE_RGB16);
+}
+
+/* hugepages are best effort, the output must not depend on them */
+static void test_glz_encode_hugepages(void)
+{
+    GPtrArray *images = default_images();
+    GByteArray *output1 = g_byte_array_new();
+    GByteArray *output2 = g_byte_array_new();
+
+    g_array_unref(encode_images(images, LZ_IMAGE_TYPE_RGB32, 2, 0, false, output1));
+    g_array_unref(encode_images(images, LZ_IMAGE_TYPE_RGB32, 2, GLZ_DICT_ALLOC_HUGEPAGES,
+                                false, output2));
+
+    g_assert_cmpmem(output1->data, output1->len, output2->data, output2->len);
+
+    g_byte_array_unref(output1);
+    g_byte_array_unref(output2);
+    g_ptr_array_unref(images);
+}
+
+static int benchmark(int argc, char *argv[])
+{
+    GPtrArray *images = g_ptr_array_new_with_free_func(test_image_free);
+    unsigned iterations = 10;
+    uint32_t alloc_flags = 0;
+    uint64_t raw_size = 0, compressed_size = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = MAX(atoi(argv[++i]), 1);
+            continue;
+        }
+        if (strcmp(argv[i], "--hugepages") == 0) {
+            alloc_flags |= GLZ_DICT_ALLOC_HUGEPAGES;
+            continue;
+        }
+        TestImage *image = g_new0(TestImage, 1);
+        if (!image_load_ppm(image, argv[i])) {
+            fprintf(stderr, "failed to load %s\n", argv[i]);
+            g_free(image);
+            g_ptr_array_unref(images);
+            return 1;
+        }
+        g_ptr_array_add(images, image);
+    }
+    if (images->len == 0) {
+        g_ptr_array_unref(images);
+        images = default_images();
+    }
+
+    gint64 start = g_get_monotonic_time();
+    GArray *sizes = encode_images(images, LZ_IMAGE_TYPE_RGB32, iterations, alloc_flags,
+                                  false, NULL);
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    for (guint i = 0; i < sizes->len; i++) {
+        TestImage *image = g_ptr_array_index(images, i % images->len);
+        raw_size += image->width * image->height * 4;
+        compressed_size += g_array_index(sizes, int, i);
+    }
+    printf("%u images, %" G_GUINT64_FORMAT " bytes -> %" G_GUINT64_FORMAT " bytes "
+           "(%.1f%%) in %.3f s, %.1f MB/s\n",
+           sizes->len, raw_size, compressed_size, compressed_size * 100.0 / raw_size,
+           elapsed / 1000000.0, raw_size / (double) elapsed);
+
+    g_array_unref(sizes);
+    g_ptr_array_unref(images);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && (argv[1][0] != '-' || strcmp(argv[1], "-n") == 0 ||
+                     strcmp(argv[1], "--hugepages") == 0)) {
+        return benchmark(argc, argv);
+    }
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/glz-encode-rgb32", test_glz_encode_rgb32);
+    g_test_add_func("/server/glz-encode-rgb24", test_glz_encode_rgb24);
+    g_test_add_func("/server/glz-encode-rgb16", test_glz_encode_rgb16);
+    g_test_add_func("/server/glz-encode-hugepages", test_glz_encode_hugepages);
+
+    return g_test_run();
+}
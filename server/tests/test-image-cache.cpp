@@ -0,0 +1,278 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the decoded image cache used for rendering on the server.
+ *
+ * Without arguments, checks the size budget and the eviction order.
+ * With arguments, acts as a benchmark:
+ *   test-image-cache [-n DRAWS] [-i IMAGES] CACHE_MB
+ * Replays a synthetic desktop workload, a set of icons and sprites reused
+ * with a skewed distribution, and prints the hit rate and the time spent.
+ * To measure the hit rate on a recorded session use
+ * spice-server-replay --count --image-cache MB.
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "image-cache.h"
+#include "display-limits.h"
+
+#define IMAGE_SIZE 64
+#define IMAGE_BYTES (IMAGE_SIZE * IMAGE_SIZE * 4)
+
+static void cache_init(ImageCache *cache, size_t size_limit)
+{
+    memset(cache, 0, sizeof(*cache));
+    image_cache_init(cache, size_limit);
+}
+
+/* what the canvas does when rendering the image: decode it, then store it
+   in the cache if asked to. Returns whether it was found in the cache */
+static bool cache_render(ImageCache *cache, uint64_t id,
+                         int width = IMAGE_SIZE, int height = IMAGE_SIZE)
+{
+    SpiceImage image = {}, store = {};
+    SpiceImage *image_ptr = &image;
+
+    image.descriptor.id = id;
+    image.descriptor.type = SPICE_IMAGE_TYPE_QUIC;
+    image.descriptor.width = width;
+    image.descriptor.height = height;
+    image_cache_localize(cache, &image_ptr, &store, nullptr);
+    g_assert_true(image_ptr == &store);
+
+    if (store.descriptor.type == SPICE_IMAGE_TYPE_FROM_CACHE) {
+        pixman_image_t *cached = cache->base.ops->get(&cache->base, id);
+        g_assert_cmpint(pixman_image_get_width(cached), ==, width);
+        pixman_image_unref(cached);
+        return true;
+    }
+    if (store.descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) {
+        pixman_image_t *decoded =
+            pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, nullptr, 0);
+        cache->base.ops->put(&cache->base, id, decoded);
+        pixman_image_unref(decoded);
+    }
+    return false;
+}
+
+static bool cache_has(ImageCache *cache, uint64_t id)
+{
+    SpiceImage image = {}, store = {};
+    SpiceImage *image_ptr = &image;
+
+    image.descriptor.id = id;
+    image.descriptor.type = SPICE_IMAGE_TYPE_QUIC;
+    image.descriptor.width = IMAGE_SIZE;
+    image.descriptor.height = IMAGE_SIZE;
+    image_cache_localize(cache, &image_ptr, &store, nullptr);
+    return store.descriptor.type == SPICE_IMAGE_TYPE_FROM_CACHE;
+}
+
+static void test_image_cache_budget(void)
+{
+    ImageCache cache;
+
+    cache_init(&cache, 4 * IMAGE_BYTES);
+
+    for (uint64_t id = 1; id <= 4; id++) {
+        image_cache_aging(&cache);
+        cache_render(&cache, id);
+    }
+    g_assert_cmpuint(cache.num_items, ==, 4);
+    g_assert_cmpuint(cache.size, ==, 4 * IMAGE_BYTES);
+
+    // use 1 so 2 becomes the least recently used
+    image_cache_aging(&cache);
+    g_assert_true(cache_has(&cache, 1));
+
+    image_cache_aging(&cache);
+    cache_render(&cache, 5);
+    g_assert_cmpuint(cache.num_items, ==, 4);
+    g_assert_true(cache_has(&cache, 1));
+    g_assert_false(cache_has(&cache, 2));
+    g_assert_true(cache_has(&cache, 3));
+    g_assert_true(cache_has(&cache, 5));
+
+    // too big for the budget, not cached and nothing evicted
+    image_cache_aging(&cache);
+    cache_render(&cache, 6, IMAGE_SIZE * 5, IMAGE_SIZE);
+    g_assert_false(cache_has(&cache, 6));
+    g_assert_cmpuint(cache.num_items, ==, 4);
+
+    // fits in the whole budget
+    image_cache_aging(&cache);
+    cache_render(&cache, 7, IMAGE_SIZE * 2, IMAGE_SIZE * 2);
+    g_assert_cmpuint(cache.num_items, ==, 1);
+    g_assert_cmpuint(cache.size, ==, 4 * IMAGE_BYTES);
+
+    image_cache_reset(&cache);
+    g_assert_cmpuint(cache.num_items, ==, 0);
+    g_assert_cmpuint(cache.size, ==, 0);
+
+    image_cache_destroy(&cache);
+}
+
+/* images used by the drawing in progress must stay until rendered */
+static void test_image_cache_generation(void)
+{
+    ImageCache cache;
+
+    cache_init(&cache, 4 * IMAGE_BYTES);
+
+    image_cache_aging(&cache);
+    for (uint64_t id = 1; id <= 4; id++) {
+        cache_render(&cache, id);
+    }
+    cache_render(&cache, 5);
+    g_assert_false(cache_has(&cache, 5));
+    for (uint64_t id = 1; id <= 4; id++) {
+        g_assert_true(cache_has(&cache, id));
+    }
+
+    // unused images are released after a while
+    for (int i = 0; i < 5000; i++) {
+        image_cache_aging(&cache);
+    }
+    g_assert_cmpuint(cache.num_items, ==, 0);
+
+    image_cache_destroy(&cache);
+}
+
+/* full screen images are cached with the default budget, along with the
+ * small images used around them */
+static void test_image_cache_full_hd(void)
+{
+    ImageCache cache;
+
+    cache_init(&cache, IMAGE_CACHE_DEFAULT_SIZE);
+
+    image_cache_aging(&cache);
+    g_assert_false(cache_render(&cache, 1, 1920, 1080));
+    for (uint64_t id = 2; id <= 40; id++) {
+        cache_render(&cache, id);
+    }
+    g_assert_cmpuint(cache.num_items, ==, 40);
+
+    image_cache_aging(&cache);
+    g_assert_true(cache_render(&cache, 1, 1920, 1080));
+
+    // a second frame evicts the least recently used images
+    image_cache_aging(&cache);
+    cache_render(&cache, 41, 1920, 1080);
+    g_assert_true(cache_has(&cache, 41));
+    g_assert_true(cache_has(&cache, 1));
+    g_assert_false(cache_has(&cache, 2));
+    g_assert_true(cache_has(&cache, 40));
+
+    image_cache_destroy(&cache);
+}
+
+/* many items, grows and removes from the hash table */
+static void test_image_cache_many(void)
+{
+    const uint64_t n_images = 3000;
+    ImageCache cache;
+
+    cache_init(&cache, 2000 * IMAGE_BYTES);
+
+    for (uint64_t id = 0; id < n_images; id++) {
+        image_cache_aging(&cache);
+        cache_render(&cache, id * 1024);
+    }
+    g_assert_cmpuint(cache.num_items, ==, 2000);
+    g_assert_cmpuint(cache.hash_size, >=, 4000);
+    for (uint64_t id = 0; id < n_images; id++) {
+        image_cache_aging(&cache);
+        g_assert_cmpint(cache_has(&cache, id * 1024), ==, id >= n_images - 2000);
+    }
+
+    image_cache_destroy(&cache);
+}
+
+static int benchmark(int argc, char *argv[])
+{
+    unsigned n_draws = 200000;
+    unsigned n_images = 500;
+    int cache_mb = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n_draws = MAX(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            n_images = MAX(atoi(argv[++i]), 1);
+        } else if (cache_mb < 0 && argv[i][0] != '-') {
+            cache_mb = atoi(argv[i]);
+        } else {
+            cache_mb = -1;
+            break;
+        }
+    }
+    if (cache_mb < 0) {
+        fprintf(stderr, "usage: %s [-n DRAWS] [-i IMAGES] CACHE_MB\n", argv[0]);
+        return 1;
+    }
+
+    GRand *rand = g_rand_new_with_seed(1);
+    ImageCache cache;
+    uint64_t hits = 0;
+
+    cache_init(&cache, (size_t) cache_mb * 1024 * 1024);
+
+    gint64 start = g_get_monotonic_time();
+    for (unsigned i = 0; i < n_draws; i++) {
+        // a few images are used very often, most rarely (power law)
+        double r = g_rand_double(rand);
+        uint64_t id = (uint64_t) (n_images * r * r * r);
+        int size = 16 << (id % 4);
+
+        image_cache_aging(&cache);
+        if (cache_render(&cache, id, size, size)) {
+            hits++;
+        }
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    printf("%u draws, %u images, %d MB: %.1f%% hits, %u cached, %.3f s\n",
+           n_draws, n_images, cache_mb, hits * 100.0 / n_draws, cache.num_items,
+           elapsed / 1000000.0);
+
+    image_cache_destroy(&cache);
+    g_rand_free(rand);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && (argv[1][0] != '-' || strcmp(argv[1], "-n") == 0 ||
+                     strcmp(argv[1], "-i") == 0)) {
+        return benchmark(argc, argv);
+    }
+
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/image-cache-budget", test_image_cache_budget);
+    g_test_add_func("/server/image-cache-generation", test_image_cache_generation);
+    g_test_add_func("/server/image-cache-full-hd", test_image_cache_full_hd);
+    g_test_add_func("/server/image-cache-many", test_image_cache_many);
+
+    return g_test_run();
+}
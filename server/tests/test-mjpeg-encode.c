@@ -0,0 +1,420 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the MJPEG encoder splitting frames in slices encoded in parallel.
+ *
+ * Without arguments, checks that the slices are stitched into an image
+ * decoding to the same pixels as the one encoded by a single thread.
+ * With arguments, acts as a benchmark:
+ *   test-mjpeg-encode [-t THREADS] [-n FRAMES] [WIDTHxHEIGHT]
+ * Encodes FRAMES frames with a single thread, then with THREADS threads
+ * (4 by default), and prints the time spent encoding each frame.
+ * The end to end behaviour of the encoders is covered by test-video-encoders.
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jerror.h>
+#include <jpeglib.h>
+
+#include "test-glib-compat.h"
+#include "video-encoder.h"
+
+/* lines per chunk of the bitmaps, so the slices do not start on a chunk */
+#define CHUNK_LINES 40
+#define NUM_BENCH_FRAMES 8
+
+typedef struct {
+    SpiceBitmap bitmap;
+    SpiceRect src;
+} TestFrame;
+
+static uint32_t encoder_threads;
+
+static uint32_t get_encoder_threads(void *opaque)
+{
+    return encoder_threads;
+}
+
+static uint32_t get_max_fps(void *opaque)
+{
+    return VIDEO_ENCODER_MAX_FPS_LIMIT;
+}
+
+static void bitmap_ref(gpointer data)
+{
+}
+
+static void bitmap_unref(gpointer data)
+{
+}
+
+static VideoEncoder *create_encoder(uint32_t threads)
+{
+    VideoEncoderRateControlCbs cbs = {
+        .opaque = NULL,
+        .get_source_fps = get_max_fps,
+        .get_max_fps = get_max_fps,
+        .get_encoder_threads = get_encoder_threads,
+    };
+    VideoEncoder *encoder;
+
+    encoder_threads = threads;
+    encoder = mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, 1000 * 1000 * 1000, &cbs,
+                                bitmap_ref, bitmap_unref);
+    g_assert_nonnull(encoder);
+    return encoder;
+}
+
+/* a gradient with a few boxes moving with seed */
+static void frame_init(TestFrame *frame, SpiceBitmapFmt format, int width, int height,
+                       bool top_down, unsigned seed)
+{
+    const int bytes_per_pixel = format == SPICE_BITMAP_FMT_24BIT ? 3 : 4;
+    const uint32_t stride = (width * bytes_per_pixel + 3) & ~3;
+    const uint32_t num_chunks = (height + CHUNK_LINES - 1) / CHUNK_LINES;
+    SpiceChunks *chunks = g_malloc0(sizeof(SpiceChunks) + sizeof(SpiceChunk) * num_chunks);
+
+    chunks->data_size = stride * height;
+    chunks->num_chunks = num_chunks;
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        uint32_t lines = MIN(CHUNK_LINES, height - i * CHUNK_LINES);
+
+        chunks->chunk[i].len = stride * lines;
+        chunks->chunk[i].data = g_malloc(chunks->chunk[i].len);
+        for (uint32_t line = 0; line < lines; line++) {
+            uint8_t *pixel = chunks->chunk[i].data + line * stride;
+            int y = i * CHUNK_LINES + line;
+
+            for (int x = 0; x < width; x++) {
+                bool box = ((x + seed * 7) / 64 + (y + seed * 3) / 48) % 5 == 0;
+
+                pixel[0] = box ? 0x20 : x * 255 / width;
+                pixel[1] = box ? 0xe0 : y * 255 / height;
+                pixel[2] = box ? 0x40 : (x + y + seed) & 0xff;
+                if (bytes_per_pixel == 4) {
+                    pixel[3] = 0;
+                }
+                pixel += bytes_per_pixel;
+            }
+        }
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->bitmap.format = format;
+    frame->bitmap.flags = top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    frame->bitmap.x = width;
+    frame->bitmap.y = height;
+    frame->bitmap.stride = stride;
+    frame->bitmap.data = chunks;
+    frame->src.right = width;
+    frame->src.bottom = height;
+}
+
+static void frame_clear(TestFrame *frame)
+{
+    SpiceChunks *chunks = frame->bitmap.data;
+
+    for (uint32_t i = 0; i < chunks->num_chunks; i++) {
+        g_free(chunks->chunk[i].data);
+    }
+    g_free(chunks);
+}
+
+static VideoBuffer *encode(VideoEncoder *encoder, TestFrame *frame)
+{
+    VideoBuffer *buffer = NULL;
+    VideoEncodeResults ret;
+
+    ret = encoder->encode_frame(encoder, 0, &frame->bitmap, &frame->src,
+                                frame->bitmap.flags & SPICE_BITMAP_FLAGS_TOP_DOWN,
+                                NULL, &buffer);
+    g_assert_cmpint(ret, ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    g_assert_nonnull(buffer);
+    return buffer;
+}
+
+/* libjpeg 6 does not have jpeg_mem_src() */
+static void init_source(j_decompress_ptr dinfo)
+{
+}
+
+static boolean fill_input_buffer(j_decompress_ptr dinfo)
+{
+    static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+
+    WARNMS(dinfo, JWRN_JPEG_EOF);
+    dinfo->src->next_input_byte = eoi;
+    dinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+    num_bytes = MIN(num_bytes, (long) dinfo->src->bytes_in_buffer);
+    dinfo->src->next_input_byte += num_bytes;
+    dinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void term_source(j_decompress_ptr dinfo)
+{
+}
+
+/* Decodes a JPEG image to RGB, checking that it was not corrupted */
+static uint8_t *decode(const VideoBuffer *buffer, int width, int height)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr src = {
+        .next_input_byte = buffer->data,
+        .bytes_in_buffer = buffer->size,
+        .init_source = init_source,
+        .fill_input_buffer = fill_input_buffer,
+        .skip_input_data = skip_input_data,
+        .resync_to_restart = jpeg_resync_to_restart,
+        .term_source = term_source,
+    };
+    uint8_t *pixels;
+
+    dinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dinfo);
+    dinfo.src = &src;
+    g_assert_cmpint(jpeg_read_header(&dinfo, TRUE), ==, JPEG_HEADER_OK);
+    dinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&dinfo);
+    g_assert_cmpint(dinfo.output_width, ==, width);
+    g_assert_cmpint(dinfo.output_height, ==, height);
+
+    pixels = g_malloc(width * height * 3);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW row = pixels + dinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    /* bad restart markers only cause warnings */
+    g_assert_cmpint(jerr.num_warnings, ==, 0);
+    jpeg_destroy_decompress(&dinfo);
+    return pixels;
+}
+
+static unsigned count_restart_markers(const VideoBuffer *buffer)
+{
+    unsigned count = 0;
+
+    /* 0xff is followed by 0 in the entropy-coded data */
+    for (uint32_t i = 0; i + 1 < buffer->size; i++) {
+        if (buffer->data[i] == 0xff &&
+            buffer->data[i + 1] >= JPEG_RST0 && buffer->data[i + 1] <= JPEG_RST0 + 7) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* encodes the frame with a single thread and with 4, the slices are
+ * encoded in the same way the whole frame is so the pixels must match */
+static void check_slices(TestFrame *frame, unsigned expected_markers)
+{
+    const int width = frame->src.right - frame->src.left;
+    const int height = frame->src.bottom - frame->src.top;
+    VideoEncoder *serial_encoder = create_encoder(1);
+    VideoEncoder *slice_encoder = create_encoder(4);
+    VideoBuffer *serial = encode(serial_encoder, frame);
+    VideoBuffer *sliced = encode(slice_encoder, frame);
+    uint8_t *serial_pixels = decode(serial, width, height);
+    uint8_t *sliced_pixels = decode(sliced, width, height);
+
+    g_assert_cmpuint(count_restart_markers(serial), ==, 0);
+    g_assert_cmpuint(count_restart_markers(sliced), ==, expected_markers);
+    g_assert_cmpmem(serial_pixels, width * height * 3, sliced_pixels, width * height * 3);
+    if (!expected_markers) {
+        g_assert_cmpmem(serial->data, serial->size, sliced->data, sliced->size);
+    }
+
+    g_free(serial_pixels);
+    g_free(sliced_pixels);
+    serial->free(serial);
+    sliced->free(sliced);
+    serial_encoder->destroy(serial_encoder);
+    slice_encoder->destroy(slice_encoder);
+}
+
+static void test_mjpeg_encode_slices(void)
+{
+    TestFrame frame;
+
+    /* 45 MCU rows split in 4 slices */
+    frame_init(&frame, SPICE_BITMAP_FMT_32BIT, 1280, 720, TRUE, 1);
+    check_slices(&frame, 3);
+    frame_clear(&frame);
+}
+
+/* the rows of a bottom-up bitmap are encoded from the last one, the last
+ * slice is not made of whole MCU rows */
+static void test_mjpeg_encode_slices_bottom_up(void)
+{
+    TestFrame frame;
+
+    frame_init(&frame, SPICE_BITMAP_FMT_24BIT, 1024, 640, FALSE, 2);
+    frame.src.left = 12;
+    frame.src.top = 20;
+    frame.src.right = 1012;
+    frame.src.bottom = 621;
+    check_slices(&frame, 3);
+    frame_clear(&frame);
+}
+
+/* small frames are not split */
+static void test_mjpeg_encode_small(void)
+{
+    TestFrame frame;
+
+    frame_init(&frame, SPICE_BITMAP_FMT_32BIT, 320, 240, TRUE, 3);
+    check_slices(&frame, 0);
+    frame_clear(&frame);
+}
+
+static GMutex async_mutex;
+static unsigned async_done_calls;
+static unsigned async_encoded;
+
+static void async_frame_done(gpointer opaque, VideoEncodeResults result, VideoBuffer *outbuf)
+{
+    g_mutex_lock(&async_mutex);
+    async_done_calls++;
+    if (result == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        g_assert_nonnull(outbuf);
+        async_encoded++;
+        outbuf->free(outbuf);
+    } else {
+        g_assert_cmpint(result, ==, VIDEO_ENCODER_FRAME_UNSUPPORTED);
+        g_assert_null(outbuf);
+    }
+    g_mutex_unlock(&async_mutex);
+}
+
+/* destroying the encoder with frames in flight notifies all of them */
+static void test_mjpeg_encode_async_destroy(void)
+{
+    VideoEncoder *encoder = create_encoder(1);
+    TestFrame frame;
+    unsigned pending = 0;
+
+    async_done_calls = 0;
+    async_encoded = 0;
+    frame_init(&frame, SPICE_BITMAP_FMT_32BIT, 1920, 1080, TRUE, 4);
+    for (uint32_t i = 0; i < 8; i++) {
+        VideoEncodeResults ret =
+            encoder->encode_frame_async(encoder, i * 10, &frame.bitmap, &frame.src, TRUE,
+                                        NULL, async_frame_done, NULL);
+        if (ret == VIDEO_ENCODER_FRAME_PENDING) {
+            pending++;
+        } else {
+            g_assert_cmpint(ret, ==, VIDEO_ENCODER_FRAME_DROP);
+        }
+    }
+    g_assert_cmpuint(pending, >, 0);
+    encoder->destroy(encoder);
+
+    g_assert_cmpuint(async_done_calls, ==, pending);
+    g_assert_cmpuint(async_encoded, <=, pending);
+    frame_clear(&frame);
+}
+
+static void benchmark_threads(TestFrame *frames, unsigned num_frames, uint32_t threads)
+{
+    VideoEncoder *encoder = create_encoder(threads);
+    gint64 elapsed = 0;
+    uint64_t size = 0;
+
+    for (unsigned i = 0; i < num_frames; ) {
+        TestFrame *frame = &frames[i % NUM_BENCH_FRAMES];
+        VideoBuffer *buffer = NULL;
+
+        gint64 start = g_get_monotonic_time();
+        VideoEncodeResults ret = encoder->encode_frame(encoder, i, &frame->bitmap, &frame->src,
+                                                       TRUE, NULL, &buffer);
+        if (ret == VIDEO_ENCODER_FRAME_DROP) {
+            /* the rate control limits the frame rate, retry later */
+            continue;
+        }
+        g_assert_cmpint(ret, ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+        elapsed += g_get_monotonic_time() - start;
+        size += buffer->size;
+        buffer->free(buffer);
+        i++;
+    }
+    elapsed = MAX(elapsed, 1);
+
+    printf("%ux%u, %u thread(s): %u frames, %.2f ms per frame (%.0f fps), %" G_GUINT64_FORMAT
+           " KiB per frame\n",
+           frames->bitmap.x, frames->bitmap.y, threads, num_frames,
+           elapsed / 1000.0 / num_frames, num_frames * 1000000.0 / elapsed,
+           size / num_frames / 1024);
+    encoder->destroy(encoder);
+}
+
+static int benchmark(int argc, char *argv[])
+{
+    TestFrame frames[NUM_BENCH_FRAMES];
+    unsigned num_frames = 300;
+    uint32_t threads = 4;
+    int width = 1920, height = 1080;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            num_frames = MAX(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = CLAMP(atoi(argv[++i]), 1, VIDEO_ENCODER_MAX_THREADS);
+        } else if (sscanf(argv[i], "%dx%d", &width, &height) != 2 ||
+                   width <= 0 || height <= 0) {
+            fprintf(stderr, "usage: %s [-t THREADS] [-n FRAMES] [WIDTHxHEIGHT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (unsigned i = 0; i < NUM_BENCH_FRAMES; i++) {
+        frame_init(&frames[i], SPICE_BITMAP_FMT_32BIT, width, height, TRUE, i);
+    }
+    benchmark_threads(frames, num_frames, 1);
+    if (threads > 1) {
+        benchmark_threads(frames, num_frames, threads);
+    }
+    for (unsigned i = 0; i < NUM_BENCH_FRAMES; i++) {
+        frame_clear(&frames[i]);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && (argv[1][0] != '-' || strcmp(argv[1], "-n") == 0 ||
+                     strcmp(argv[1], "-t") == 0)) {
+        return benchmark(argc, argv);
+    }
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/mjpeg-encode-slices", test_mjpeg_encode_slices);
+    g_test_add_func("/server/mjpeg-encode-slices-bottom-up", test_mjpeg_encode_slices_bottom_up);
+    g_test_add_func("/server/mjpeg-encode-small", test_mjpeg_encode_small);
+    g_test_add_func("/server/mjpeg-encode-async-destroy", test_mjpeg_encode_async_destroy);
+
+    return g_test_run();
+}
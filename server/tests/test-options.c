@@ -44,6 +44,109 @@ static void agent_options(void)
     spice_server_set_agent_file_xfer(server, 0);
 
     spice_server_destroy(server);
+    basic_event_loop_destroy();
+}
+
+/* a server initialised for the options set after init */
+typedef struct {
+    SpiceCoreInterface *core;
+    SpiceServer *server;
+} TestFixture;
+
+static void server_setup(TestFixture *fixture, gconstpointer user_data)
+{
+    fixture->server = spice_server_new();
+    g_assert_nonnull(fixture->server);
+
+    fixture->core = basic_event_loop_init();
+    g_assert_nonnull(fixture->core);
+
+    g_assert_cmpint(spice_server_init(fixture->server, fixture->core), ==, 0);
+}
+
+static void server_teardown(TestFixture *fixture, gconstpointer user_data)
+{
+    spice_server_destroy(fixture->server);
+    basic_event_loop_destroy();
+}
+
+static void add_server_test(const char *path,
+                            void (*test)(TestFixture *fixture, gconstpointer user_data))
+{
+    g_test_add(path, TestFixture, NULL, server_setup, test, server_teardown);
+}
+
+static void compression_options(TestFixture *fixture, gconstpointer user_data)
+{
+    SpiceServer *server = fixture->server;
+
+#ifdef USE_LZ4
+    g_assert_cmpint(spice_server_set_lz4_level(server, -8), ==, 0);
+    g_assert_cmpint(spice_server_set_lz4_level(server, 9), ==, 0);
+    g_assert_cmpint(spice_server_set_lz4_level(server, 0), ==, 0);
+#else
+    g_assert_cmpint(spice_server_set_lz4_level(server, 9), ==, -1);
+#endif
+
+#ifdef __linux__
+    g_assert_cmpint(spice_server_set_glz_hugepages(server, 1), ==, 0);
+    g_assert_cmpint(spice_server_set_glz_hugepages(server, 0), ==, 0);
+#else
+    g_assert_cmpint(spice_server_set_glz_hugepages(server, 1), ==, -1);
+#endif
+
+#ifndef _WIN32
+    g_assert_cmpint(spice_server_set_display_send_threads(server, 1), ==, 0);
+    g_assert_cmpint(spice_server_set_display_send_threads(server, 0), ==, 0);
+#else
+    g_assert_cmpint(spice_server_set_display_send_threads(server, 1), ==, -1);
+#endif
+}
+
+static void drawables_limits(TestFixture *fixture, gconstpointer user_data)
+{
+    SpiceServer *server = fixture->server;
+
+    g_assert_cmpint(spice_server_set_drawables_limits(server, 0, 1000), ==, -1);
+    g_assert_cmpint(spice_server_set_drawables_limits(server, 2000, 1000), ==, -1);
+    g_assert_cmpint(spice_server_set_drawables_limits(server, 1000, 1000), ==, 0);
+    g_assert_cmpint(spice_server_set_drawables_limits(server, 1000, 8000), ==, 0);
+    g_assert_cmpint(spice_server_set_drawables_limits(server, 1000, G_MAXUINT), ==, -1);
+    g_assert_cmpint(spice_server_set_drawables_limits(server, G_MAXUINT, G_MAXUINT), ==, -1);
+}
+
+static void image_cache_options(TestFixture *fixture, gconstpointer user_data)
+{
+    SpiceServer *server = fixture->server;
+
+    g_assert_cmpint(spice_server_set_image_cache_size(server, 0), ==, 0);
+    g_assert_cmpint(spice_server_set_image_cache_size(server, 64), ==, 0);
+}
+
+static void worker_busy_poll(TestFixture *fixture, gconstpointer user_data)
+{
+    SpiceServer *server = fixture->server;
+
+    g_assert_cmpint(spice_server_set_worker_busy_poll(server, 0), ==, 0);
+    g_assert_cmpint(spice_server_set_worker_busy_poll(server, 200), ==, 0);
+    g_assert_cmpint(spice_server_set_worker_busy_poll(server, 1000000), ==, -1);
+}
+
+static void video_encoder_threads(TestFixture *fixture, gconstpointer user_data)
+{
+    SpiceServer *server = fixture->server;
+
+    g_assert_cmpint(spice_server_set_video_encoder_threads(server, 0), ==, -1);
+    g_assert_cmpint(spice_server_set_video_encoder_threads(server, 4), ==, 0);
+    g_assert_cmpint(spice_server_set_video_encoder_threads(server, 64), ==, -1);
+}
+
+static void pixmap_cache_reuse(TestFixture *fixture, gconstpointer user_data)
+{
+    SpiceServer *server = fixture->server;
+
+    g_assert_cmpint(spice_server_set_pixmap_cache_reuse(server, 1), ==, 0);
+    g_assert_cmpint(spice_server_set_pixmap_cache_reuse(server, 0), ==, 0);
 }
 
 int main(int argc, char *argv[])
@@ -51,6 +154,12 @@ int main(int argc, char *argv[])
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_func("/server/agent options", agent_options);
+    add_server_test("/server/compression options", compression_options);
+    add_server_test("/server/drawables limits", drawables_limits);
+    add_server_test("/server/image cache options", image_cache_options);
+    add_server_test("/server/worker busy poll", worker_busy_poll);
+    add_server_test("/server/video encoder threads", video_encoder_threads);
+    add_server_test("/server/pixmap cache reuse", pixmap_cache_reuse);
 
     return g_test_run();
 }
@@ -0,0 +1,154 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the pixmap cache shared by the display channels of a client: its
+ * hash and the digest kept while the channels reconnect.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "pixmap-cache.h"
+
+#define CACHE_ID 1
+
+// only compared by the cache
+static RedClient *const fake_client = reinterpret_cast<RedClient *>(0x1000);
+
+static PixmapCacheDigest *digest_new(uint32_t num_items)
+{
+    auto digest = static_cast<PixmapCacheDigest *>(
+        g_malloc0(sizeof(PixmapCacheDigest) + num_items * sizeof(PixmapCacheDigestItem)));
+
+    digest->id = CACHE_ID;
+    digest->num_items = num_items;
+    for (uint32_t i = 0; i < num_items; i++) {
+        digest->items[i].id = i + 1;
+        digest->items[i].size = 100;
+        digest->items[i].lossy = (i % 2);
+    }
+    return digest;
+}
+
+/* the most recently used items are adopted when the cache got smaller */
+static void test_pixmap_cache_digest_adopt(void)
+{
+    PixmapCacheDigest *digest = digest_new(3);
+    PixmapCache *cache = pixmap_cache_get(fake_client, CACHE_ID, 250);
+
+    // the least recently used item is dropped
+    g_assert_cmpuint(pixmap_cache_adopt_digest(cache, digest), ==, 1);
+    g_free(digest);
+
+    g_assert_null(pixmap_cache_unlocked_find(cache, 1));
+    g_assert_nonnull(pixmap_cache_unlocked_find(cache, 2));
+    g_assert_nonnull(pixmap_cache_unlocked_find(cache, 3));
+    g_assert_cmpint(cache->available, ==, 50);
+
+    // adopted only by a new cache
+    digest = digest_new(1);
+    digest->items[0].id = 10;
+    g_assert_cmpuint(pixmap_cache_adopt_digest(cache, digest), ==, 0);
+    g_free(digest);
+    g_assert_null(pixmap_cache_unlocked_find(cache, 10));
+
+    // still used by another display channel
+    PixmapCache *other = pixmap_cache_get(fake_client, CACHE_ID, 250);
+    g_assert_true(other == cache);
+    g_assert_null(pixmap_cache_unref_to_digest(other, 0, 0));
+
+    digest = pixmap_cache_unref_to_digest(cache, 0, 0);
+    g_assert_nonnull(digest);
+    g_assert_cmpuint(digest->id, ==, CACHE_ID);
+    g_assert_cmpuint(digest->num_items, ==, 2);
+    g_assert_cmpuint(digest->items[0].id, ==, 2);
+    g_assert_cmpuint(digest->items[0].lossy, ==, 1);
+    g_assert_cmpuint(digest->items[1].id, ==, 3);
+    g_assert_cmpuint(digest->items[1].lossy, ==, 0);
+    g_free(digest);
+}
+
+/* only items the client acknowledged on the channel going away are kept */
+static void test_pixmap_cache_digest_acked(void)
+{
+    PixmapCacheDigest *digest = digest_new(4);
+    PixmapCache *cache = pixmap_cache_get(fake_client, CACHE_ID, 1000);
+
+    g_assert_cmpuint(pixmap_cache_adopt_digest(cache, digest), ==, 0);
+    g_free(digest);
+
+    pixmap_cache_unlocked_find(cache, 1)->sync[0] = 5;
+    pixmap_cache_unlocked_find(cache, 2)->sync[0] = 20;
+    pixmap_cache_unlocked_find(cache, 3)->sync[1] = 3;
+
+    digest = pixmap_cache_unref_to_digest(cache, 0, 10);
+    g_assert_nonnull(digest);
+    g_assert_cmpuint(digest->num_items, ==, 2);
+    g_assert_cmpuint(digest->items[0].id, ==, 1);
+    g_assert_cmpuint(digest->items[1].id, ==, 4);
+    g_free(digest);
+
+    // a cache frozen for migration has no digest
+    cache = pixmap_cache_get(fake_client, CACHE_ID, 1000);
+    g_assert_true(pixmap_cache_freeze(cache));
+    g_assert_null(pixmap_cache_unref_to_digest(cache, 0, 10));
+}
+
+/* the hash grows with the items and stays consistent when they are removed */
+static void test_pixmap_cache_hash(void)
+{
+    const uint32_t n_items = 5000;
+    PixmapCache *cache = pixmap_cache_get(fake_client, CACHE_ID, n_items);
+
+    for (uint64_t id = 0; id < n_items; id++) {
+        auto item = g_new0(NewCacheItem, 1);
+        // sequential and strided ids, as sent by guests
+        item->id = id * 1024 + (id & 1);
+        item->size = 1;
+        pixmap_cache_unlocked_insert(cache, item);
+        ring_item_init(&item->lru_link);
+        ring_add(&cache->lru, &item->lru_link);
+    }
+    g_assert_cmpuint(cache->num_items, ==, n_items);
+    g_assert_cmpuint(cache->hash_size, >=, 2 * n_items);
+
+    for (uint64_t id = 0; id < n_items; id += 2) {
+        NewCacheItem *item = pixmap_cache_unlocked_find(cache, id * 1024);
+        g_assert_nonnull(item);
+        pixmap_cache_unlocked_unhash(cache, item);
+        ring_remove(&item->lru_link);
+        g_free(item);
+    }
+    g_assert_cmpuint(cache->num_items, ==, n_items / 2);
+    for (uint64_t id = 0; id < n_items; id++) {
+        NewCacheItem *item = pixmap_cache_unlocked_find(cache, id * 1024 + (id & 1));
+        g_assert_true((item != nullptr) == (id % 2 == 1));
+    }
+
+    pixmap_cache_unref(cache);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/pixmap-cache-digest-adopt", test_pixmap_cache_digest_adopt);
+    g_test_add_func("/server/pixmap-cache-digest-acked", test_pixmap_cache_digest_acked);
+    g_test_add_func("/server/pixmap-cache-hash", test_pixmap_cache_hash);
+
+    return g_test_run();
+}
@@ -0,0 +1,285 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the compressed images shared between the clients of a display
+ * channel: an image compressed for a client is sent as is to the others.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "image-encoders.h"
+
+#define WIDTH 256
+#define HEIGHT 256
+
+struct TestImage {
+    SpiceBitmap bitmap;
+    SpiceImage image;
+};
+
+/* a gradient, different for each @seed */
+static void image_init(TestImage *image, uint64_t id, unsigned seed)
+{
+    const uint32_t stride = WIDTH * 4;
+    auto chunks = static_cast<SpiceChunks *>(g_malloc0(sizeof(SpiceChunks) + sizeof(SpiceChunk)));
+    auto data = static_cast<uint8_t *>(g_malloc(stride * HEIGHT));
+
+    for (int y = 0; y < HEIGHT; y++) {
+        uint8_t *pixel = data + y * stride;
+        for (int x = 0; x < WIDTH; x++, pixel += 4) {
+            pixel[0] = x + seed;
+            pixel[1] = y;
+            pixel[2] = (x + y) / 2;
+            pixel[3] = 0;
+        }
+    }
+    chunks->data_size = stride * HEIGHT;
+    chunks->num_chunks = 1;
+    chunks->chunk[0].data = data;
+    chunks->chunk[0].len = stride * HEIGHT;
+
+    memset(image, 0, sizeof(*image));
+    image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    image->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    image->bitmap.x = WIDTH;
+    image->bitmap.y = HEIGHT;
+    image->bitmap.stride = stride;
+    image->bitmap.data = chunks;
+    image->image.descriptor.id = id;
+    image->image.descriptor.width = WIDTH;
+    image->image.descriptor.height = HEIGHT;
+}
+
+static void image_clear(TestImage *image)
+{
+    g_free(image->bitmap.data->chunk[0].data);
+    g_free(image->bitmap.data);
+}
+
+static void comp_data_free(compress_send_data_t *comp_data)
+{
+    if (comp_data->shared_image) {
+        return;
+    }
+    for (RedCompressBuf *buf = comp_data->comp_buf, *next; buf; buf = next) {
+        next = buf->send_next;
+        compress_buf_free(buf);
+    }
+}
+
+static bool comp_data_equal(const compress_send_data_t *a, const compress_send_data_t *b)
+{
+    const RedCompressBuf *buf_a = a->comp_buf, *buf_b = b->comp_buf;
+    size_t left = a->comp_buf_size;
+
+    if (a->comp_buf_size != b->comp_buf_size) {
+        return false;
+    }
+    while (left) {
+        size_t now = MIN(left, sizeof(buf_a->buf));
+        if (memcmp(buf_a->buf.bytes, buf_b->buf.bytes, now) != 0) {
+            return false;
+        }
+        left -= now;
+        buf_a = buf_a->send_next;
+        buf_b = buf_b->send_next;
+    }
+    return true;
+}
+
+/* as dcc_compress_image_shared() does, returns whether the image was found */
+static bool compress_shared(ImageEncoders *enc, TestImage *image, int32_t param,
+                            compress_send_data_t *comp_data)
+{
+    const RedSharedImageKey key = { image->image.descriptor.id, SPICE_IMAGE_TYPE_QUIC, param };
+    SpiceImage *dest = &image->image;
+
+    *comp_data = {};
+    if (image_encoder_shared_lookup(enc->shared_data, &key, &image->bitmap, dest, comp_data)) {
+        return true;
+    }
+    g_assert_true(image_encoders_compress_quic(enc, dest, &image->bitmap, comp_data));
+    image_encoder_shared_add(enc->shared_data, &key, &image->bitmap, dest, comp_data);
+    return false;
+}
+
+struct TestClients {
+    ImageEncoderSharedData shared_data;
+    ImageEncoders encoders[2];
+};
+
+static void clients_init(TestClients *clients)
+{
+    memset(clients, 0, sizeof(*clients));
+    image_encoder_shared_init(&clients->shared_data);
+    for (auto &enc : clients->encoders) {
+        image_encoders_init(&enc, &clients->shared_data);
+    }
+}
+
+static void clients_destroy(TestClients *clients)
+{
+    for (auto &enc : clients->encoders) {
+        image_encoders_free(&enc);
+    }
+    image_encoder_shared_destroy(&clients->shared_data);
+}
+
+/* the second client sends the buffers compressed for the first one, they
+ * are the same as the ones it would have compressed itself */
+static void test_shared_images_reuse(void)
+{
+    TestClients clients;
+    TestImage image;
+    compress_send_data_t first, second, own = {};
+
+    clients_init(&clients);
+    image_init(&image, 1, 0);
+
+    g_assert_false(compress_shared(&clients.encoders[0], &image, 0, &first));
+    g_assert_nonnull(first.shared_image);
+    g_assert_cmpuint(clients.shared_data.shared_images_size, >, 0);
+
+    image.image.descriptor.type = 0;
+    g_assert_true(compress_shared(&clients.encoders[1], &image, 0, &second));
+    g_assert_true(second.shared_image == first.shared_image);
+    g_assert_true(second.comp_buf == first.comp_buf);
+    g_assert_cmpint(image.image.descriptor.type, ==, SPICE_IMAGE_TYPE_QUIC);
+    g_assert_cmpuint(image.image.u.quic.data_size, ==, second.comp_buf_size);
+
+    g_assert_true(image_encoders_compress_quic(&clients.encoders[1], &image.image,
+                                               &image.bitmap, &own));
+    g_assert_true(comp_data_equal(&own, &second));
+    comp_data_free(&own);
+
+    image_clear(&image);
+    clients_destroy(&clients);
+}
+
+/* another encoder parameter or another source layout is another image */
+static void test_shared_images_key(void)
+{
+    TestClients clients;
+    TestImage image;
+    compress_send_data_t comp_data;
+
+    clients_init(&clients);
+    image_init(&image, 1, 0);
+
+    g_assert_false(compress_shared(&clients.encoders[0], &image, 0, &comp_data));
+    g_assert_false(compress_shared(&clients.encoders[1], &image, 50, &comp_data));
+    g_assert_true(compress_shared(&clients.encoders[1], &image, 50, &comp_data));
+
+    // the same id for a bitmap of another size, not the same image
+    TestImage other;
+    image_init(&other, 1, 0);
+    other.bitmap.x = WIDTH / 2;
+    g_assert_false(compress_shared(&clients.encoders[1], &other, 0, &comp_data));
+
+    image_clear(&other);
+    image_clear(&image);
+    clients_destroy(&clients);
+}
+
+/* the least recently used images are dropped above the size limit, those
+ * still referenced by a message being sent stay valid */
+static void test_shared_images_eviction(void)
+{
+    TestClients clients;
+    TestImage images[5];
+    compress_send_data_t comp_data;
+
+    clients_init(&clients);
+    for (unsigned i = 0; i < G_N_ELEMENTS(images); i++) {
+        image_init(&images[i], i + 1, i);
+    }
+
+    // room for 4 images, the largest image kept is a quarter of the limit
+    g_assert_false(compress_shared(&clients.encoders[0], &images[0], 0, &comp_data));
+    size_t image_size = clients.shared_data.shared_images_size;
+    clients.shared_data.shared_images_max_size = 4 * image_size;
+    for (unsigned i = 1; i < 4; i++) {
+        g_assert_false(compress_shared(&clients.encoders[0], &images[i], 0, &comp_data));
+    }
+    g_assert_cmpuint(clients.shared_data.shared_images_size, ==, 4 * image_size);
+
+    // the first image is being sent by the second client
+    compress_send_data_t sending;
+    g_assert_true(compress_shared(&clients.encoders[1], &images[0], 0, &sending));
+    red_shared_image_ref(sending.shared_image);
+
+    // the second image is the least recently used one
+    g_assert_false(compress_shared(&clients.encoders[0], &images[4], 0, &comp_data));
+    g_assert_cmpuint(clients.shared_data.shared_images_size, ==, 4 * image_size);
+    for (unsigned i = 0; i < G_N_ELEMENTS(images); i++) {
+        if (i != 1) {
+            g_assert_true(compress_shared(&clients.encoders[1], &images[i], 0, &comp_data));
+        }
+    }
+    // compressed again, it replaces the first image
+    g_assert_false(compress_shared(&clients.encoders[1], &images[1], 0, &comp_data));
+    g_assert_false(compress_shared(&clients.encoders[0], &images[0], 0, &comp_data));
+    g_assert_true(comp_data.shared_image != sending.shared_image);
+
+    // the buffers of the first image are released once sent
+    compress_send_data_t own = {};
+    g_assert_true(image_encoders_compress_quic(&clients.encoders[1], &images[0].image,
+                                               &images[0].bitmap, &own));
+    g_assert_true(comp_data_equal(&own, &sending));
+    comp_data_free(&own);
+    red_shared_image_unref(sending.shared_image);
+
+    for (auto &image : images) {
+        image_clear(&image);
+    }
+    clients_destroy(&clients);
+}
+
+/* images too large for the shared images are not kept */
+static void test_shared_images_too_large(void)
+{
+    TestClients clients;
+    TestImage image;
+    compress_send_data_t comp_data;
+
+    clients_init(&clients);
+    clients.shared_data.shared_images_max_size = 1;
+    image_init(&image, 1, 0);
+
+    g_assert_false(compress_shared(&clients.encoders[0], &image, 0, &comp_data));
+    g_assert_null(comp_data.shared_image);
+    g_assert_cmpuint(clients.shared_data.shared_images_size, ==, 0);
+    comp_data_free(&comp_data);
+    g_assert_false(compress_shared(&clients.encoders[1], &image, 0, &comp_data));
+    comp_data_free(&comp_data);
+
+    image_clear(&image);
+    clients_destroy(&clients);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/shared-images-reuse", test_shared_images_reuse);
+    g_test_add_func("/server/shared-images-key", test_shared_images_key);
+    g_test_add_func("/server/shared-images-eviction", test_shared_images_eviction);
+    g_test_add_func("/server/shared-images-too-large", test_shared_images_too_large);
+
+    return g_test_run();
+}
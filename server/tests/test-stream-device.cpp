@@ -105,6 +105,8 @@ check_vmc_error_message()
 
 static int num_send_data_calls = 0;
 static size_t send_data_bytes = 0;
+static uint8_t *data_buffer = nullptr;
+static size_t data_buffer_size = 0;
 
 StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
     RedChannel(reds, SPICE_CHANNEL_DISPLAY, id, RedChannel::HandleAcks)
@@ -112,16 +114,31 @@ StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
     reds_register_channel(reds, this);
 }
 
+StreamChannel::~StreamChannel()
+{
+    g_free(data_buffer);
+    data_buffer = nullptr;
+    data_buffer_size = 0;
+}
+
 void
 StreamChannel::change_format(const StreamMsgFormat *fmt)
 {
 }
 
+uint8_t *
+StreamChannel::get_data_buffer(size_t size)
+{
+    data_buffer = static_cast<uint8_t *>(g_realloc(data_buffer, size));
+    data_buffer_size = size;
+    return data_buffer;
+}
+
 void
-StreamChannel::send_data(const void *data, size_t size, uint32_t mm_time)
+StreamChannel::send_data(uint32_t mm_time)
 {
     ++num_send_data_calls;
-    send_data_bytes += size;
+    send_data_bytes += data_buffer_size;
 }
 
 void
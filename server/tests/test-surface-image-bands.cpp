@@ -0,0 +1,169 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test how the surface images sent to a new client are split in bands, the
+ * areas shown by the monitors first.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "dcc.h"
+
+#define SURFACE_ID 0
+
+static QXLHead head_new(uint32_t id, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    QXLHead head = {};
+
+    head.id = id;
+    head.surface_id = SURFACE_ID;
+    head.x = x;
+    head.y = y;
+    head.width = width;
+    head.height = height;
+    return head;
+}
+
+static bool rect_contains(const SpiceRect *outer, const SpiceRect *inner)
+{
+    return inner->left >= outer->left && inner->right <= outer->right &&
+           inner->top >= outer->top && inner->bottom <= outer->bottom;
+}
+
+/* the bands cover the whole surface exactly once, none higher than
+ * SURFACE_IMAGE_BAND_HEIGHT */
+static void check_bands_cover(const std::vector<SpiceRect> &bands,
+                              uint32_t width, uint32_t height)
+{
+    SpiceRect area = { 0, 0, (int32_t) height, (int32_t) width };
+    uint64_t bands_area = 0;
+    QRegion covered;
+
+    region_init(&covered);
+    for (const auto &band : bands) {
+        g_assert_false(rect_is_empty(&band));
+        g_assert_true(rect_contains(&area, &band));
+        g_assert_cmpint(band.bottom - band.top, <=, SURFACE_IMAGE_BAND_HEIGHT);
+        bands_area += (uint64_t) (band.right - band.left) * (band.bottom - band.top);
+        region_add(&covered, &band);
+    }
+    g_assert_cmpuint(bands_area, ==, (uint64_t) width * height);
+
+    QRegion expected;
+    region_init(&expected);
+    region_add(&expected, &area);
+    g_assert_true(region_is_equal(&covered, &expected));
+    region_destroy(&expected);
+    region_destroy(&covered);
+}
+
+/* the bands from @first are inside @rect until they cover @area of it,
+ * returns the index of the next band */
+static size_t check_bands_first(const std::vector<SpiceRect> &bands, size_t first,
+                                const SpiceRect *rect, uint64_t area)
+{
+    uint64_t bands_area = 0;
+    size_t i;
+
+    for (i = first; i < bands.size() && bands_area < area; i++) {
+        g_assert_true(rect_contains(rect, &bands[i]));
+        bands_area += (uint64_t) (bands[i].right - bands[i].left) *
+                      (bands[i].bottom - bands[i].top);
+    }
+    g_assert_cmpuint(bands_area, ==, area);
+    return i;
+}
+
+static void test_surface_image_bands_no_head(void)
+{
+    auto bands = surface_image_bands(SURFACE_ID, 1000, 300, nullptr, 0);
+
+    check_bands_cover(bands, 1000, 300);
+    g_assert_cmpuint(bands.size(), ==, 3);
+    // top to bottom, full rows
+    g_assert_cmpint(bands[0].top, ==, 0);
+    g_assert_cmpint(bands[0].bottom, ==, SURFACE_IMAGE_BAND_HEIGHT);
+    g_assert_cmpint(bands[1].top, ==, SURFACE_IMAGE_BAND_HEIGHT);
+    g_assert_cmpint(bands[2].bottom, ==, 300);
+    for (const auto &band : bands) {
+        g_assert_cmpint(band.left, ==, 0);
+        g_assert_cmpint(band.right, ==, 1000);
+    }
+}
+
+/* the area shown by the monitor comes first */
+static void test_surface_image_bands_visible_first(void)
+{
+    QXLHead heads[] = {
+        head_new(0, 1920, 200, 1280, 720),
+    };
+    auto bands = surface_image_bands(SURFACE_ID, 3840, 1080, heads, G_N_ELEMENTS(heads));
+
+    check_bands_cover(bands, 3840, 1080);
+    SpiceRect visible = { 200, 1920, 920, 3200 };
+    size_t next = check_bands_first(bands, 0, &visible, 1280 * 720);
+    g_assert_cmpuint(next, <, bands.size());
+    // starting from the top of the monitor
+    g_assert_cmpint(bands[0].top, ==, 200);
+}
+
+/* overlapping monitors: the area shared is sent once, with the first
+ * monitor. Monitors of other surfaces and the parts outside of the surface
+ * are ignored */
+static void test_surface_image_bands_overlapping_heads(void)
+{
+    QXLHead heads[] = {
+        head_new(0, 0, 0, 1024, 768),
+        head_new(1, 512, 384, 1024, 768),
+        head_new(2, 0, 0, 2048, 2048),
+        head_new(3, 1536, 0, 1024, 768),
+    };
+    heads[2].surface_id = SURFACE_ID + 1;
+    auto bands = surface_image_bands(SURFACE_ID, 2048, 1536, heads, G_N_ELEMENTS(heads));
+
+    check_bands_cover(bands, 2048, 1536);
+
+    SpiceRect head0 = { 0, 0, 768, 1024 };
+    size_t next = check_bands_first(bands, 0, &head0, 1024 * 768);
+
+    // only the part of the second monitor not shown by the first one
+    SpiceRect head1 = { 384, 512, 1152, 1536 };
+    size_t head1_start = next;
+    next = check_bands_first(bands, next, &head1, 1024 * 768 - 512 * 384);
+    for (size_t i = head1_start; i < next; i++) {
+        g_assert_false(rect_intersects(&bands[i], &head0));
+    }
+
+    // the last monitor is clipped by the surface
+    SpiceRect head3 = { 0, 1536, 768, 2048 };
+    next = check_bands_first(bands, next, &head3, 512 * 768);
+    g_assert_cmpuint(next, <, bands.size());
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/surface-image-bands-no-head", test_surface_image_bands_no_head);
+    g_test_add_func("/server/surface-image-bands-visible-first",
+                    test_surface_image_bands_visible_first);
+    g_test_add_func("/server/surface-image-bands-overlapping-heads",
+                    test_surface_image_bands_overlapping_heads);
+
+    return g_test_run();
+}
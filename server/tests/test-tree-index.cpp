@@ -0,0 +1,219 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the spatial index of the tree, the items it returns must be the
+ * same, in the same order, as the ones found walking the ring.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "tree.h"
+
+#define WIDTH 1000
+#define HEIGHT 700
+
+struct TestItem {
+    TreeItem base;
+    /* extents of the item when it was indexed */
+    pixman_box32_t box;
+};
+
+static pixman_box32_t random_box(int32_t max_size)
+{
+    pixman_box32_t box;
+
+    box.x1 = g_test_rand_int_range(-50, WIDTH + 50);
+    box.y1 = g_test_rand_int_range(-50, HEIGHT + 50);
+    box.x2 = box.x1 + g_test_rand_int_range(1, max_size + 1);
+    box.y2 = box.y1 + g_test_rand_int_range(1, max_size + 1);
+    return box;
+}
+
+static SpiceRect box_to_rect(const pixman_box32_t *box)
+{
+    SpiceRect rect;
+
+    rect.left = box->x1;
+    rect.top = box->y1;
+    rect.right = box->x2;
+    rect.bottom = box->y2;
+    return rect;
+}
+
+static TestItem *item_new(void)
+{
+    auto item = g_new0(TestItem, 1);
+
+    item->base.type = TREE_ITEM_TYPE_DRAWABLE;
+    ring_item_init(&item->base.siblings_link);
+    // mostly small items, some covering a good part of the surface
+    item->box = random_box(g_test_rand_int_range(0, 8) ? 100 : WIDTH);
+    SpiceRect rect = box_to_rect(&item->box);
+    region_init(&item->base.rgn);
+    region_add(&item->base.rgn, &rect);
+    return item;
+}
+
+static void item_free(TestItem *item)
+{
+    region_destroy(&item->base.rgn);
+    g_free(item);
+}
+
+static TestItem *ring_item_at(Ring *ring, uint32_t pos)
+{
+    RingItem *link = ring_get_head(ring);
+
+    while (pos--) {
+        link = ring_next(ring, link);
+    }
+    return SPICE_CONTAINEROF(link, TestItem, base.siblings_link);
+}
+
+static bool box_intersects(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+    return a->x1 <= b->x2 && b->x1 <= a->x2 && a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+/* compares the items returned by the index after @from, up to @last, with
+ * the ones found walking the ring */
+static void check_query(TreeIndex *index, Ring *current, const pixman_box32_t *box,
+                        TestItem *from, TestItem *last)
+{
+    RingItem *link = from ? ring_next(current, &from->base.siblings_link) : ring_get_head(current);
+    TreeItem *found = from ? &from->base : nullptr;
+
+    for (; link; link = ring_next(current, link)) {
+        auto item = SPICE_CONTAINEROF(link, TestItem, base.siblings_link);
+
+        if (box_intersects(&item->box, box)) {
+            found = tree_index_next(index, found, box, last ? &last->base : nullptr);
+            g_assert_true(found == &item->base);
+        }
+        if (item == last) {
+            break;
+        }
+    }
+    g_assert_null(tree_index_next(index, found, box, last ? &last->base : nullptr));
+}
+
+static void check_queries(TreeIndex *index, Ring *current, uint32_t num_items)
+{
+    for (int i = 0; i < 20; i++) {
+        pixman_box32_t box = random_box(g_test_rand_int_range(0, 4) ? 128 : WIDTH);
+        TestItem *from = nullptr;
+        TestItem *last = nullptr;
+
+        if (box.x2 - box.x1 <= 128 && box.y2 - box.y1 <= 128) {
+            g_assert_true(tree_index_usable(index, &box));
+        }
+        check_query(index, current, &box, nullptr, nullptr);
+        if (num_items == 0) {
+            continue;
+        }
+        uint32_t from_pos = g_test_rand_int_range(0, num_items);
+        uint32_t last_pos = g_test_rand_int_range(from_pos, num_items);
+        if (g_test_rand_bit()) {
+            from = ring_item_at(current, from_pos);
+        }
+        if (g_test_rand_bit()) {
+            last = ring_item_at(current, last_pos);
+        }
+        if (from == last) {
+            from = nullptr;
+        }
+        check_query(index, current, &box, from, last);
+    }
+}
+
+static void test_tree_index_random(void)
+{
+    TreeIndex index;
+    Ring current;
+    uint32_t num_items = 0;
+
+    tree_index_init(&index, WIDTH, HEIGHT);
+    ring_init(&current);
+
+    for (int i = 0; i < 2000; i++) {
+        uint32_t op = g_test_rand_int_range(0, 10);
+
+        if (op < 5 || num_items == 0) {
+            // a new item at the head
+            TestItem *item = item_new();
+            ring_add(&current, &item->base.siblings_link);
+            tree_index_add(&index, &item->base, nullptr);
+            num_items++;
+        } else if (op < 7) {
+            TestItem *item = ring_item_at(&current, g_test_rand_int_range(0, num_items));
+            tree_index_remove(&item->base);
+            ring_remove(&item->base.siblings_link);
+            item_free(item);
+            num_items--;
+        } else if (op < 8) {
+            // an item taking the place of another one
+            TestItem *old_item = ring_item_at(&current, g_test_rand_int_range(0, num_items));
+            TestItem *item = item_new();
+            ring_add_after(&item->base.siblings_link, &old_item->base.siblings_link);
+            tree_index_replace(&old_item->base, &item->base);
+            ring_remove(&old_item->base.siblings_link);
+            item_free(old_item);
+        } else if (op < 9) {
+            // added after an item which is then removed, as for equal drawables
+            TestItem *old_item = ring_item_at(&current, g_test_rand_int_range(0, num_items));
+            TestItem *item = item_new();
+            ring_add_after(&item->base.siblings_link, &old_item->base.siblings_link);
+            tree_index_add(&index, &item->base, &old_item->base);
+            tree_index_remove(&old_item->base);
+            ring_remove(&old_item->base.siblings_link);
+            item_free(old_item);
+        } else {
+            // covered by other items, the region shrinks but the index keeps
+            // the original box
+            TestItem *item = ring_item_at(&current, g_test_rand_int_range(0, num_items));
+            pixman_box32_t box = random_box(200);
+            SpiceRect rect = box_to_rect(&box);
+            region_remove(&item->base.rgn, &rect);
+        }
+        if (i % 10 == 0) {
+            check_queries(&index, &current, num_items);
+        }
+    }
+    check_queries(&index, &current, num_items);
+
+    while (!ring_is_empty(&current)) {
+        TestItem *item = ring_item_at(&current, 0);
+        tree_index_remove(&item->base);
+        ring_remove(&item->base.siblings_link);
+        item_free(item);
+    }
+    check_queries(&index, &current, 0);
+    g_assert_true(index.large.empty());
+    for (const auto &entries : index.cells) {
+        g_assert_true(entries.empty());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/tree-index-random", test_tree_index_random);
+
+    return g_test_run();
+}
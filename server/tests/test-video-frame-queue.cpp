@@ -0,0 +1,270 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2020 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the queue handing the frames encoded by a video encoder thread back
+ * to the worker thread, see video_stream_agent_encode_frame_async().
+ */
+
+#include <config.h>
+
+#include "basic-event-loop.h"
+#include "test-glib-compat.h"
+#include "reds.h"
+#include "video-stream.h"
+#include "win-alarm.h"
+
+#define NUM_FRAMES 200
+
+static SpiceCoreInterface *core;
+static SpiceCoreInterfaceInternal core_int;
+
+/* Stands for a video encoder: encodes the frames in order in its own thread
+ * and, when destroyed, notifies the frames it did not encode yet */
+struct TestEncoder {
+    GThread *thread;
+    GAsyncQueue *jobs;
+    gint stop;
+};
+
+// marks the end of the frames to encode
+static VideoStreamAsyncFrame stop_frame;
+
+// allocated by the encoder thread, freed by the main one
+static gint buffers_allocated;
+
+static void buffer_free(VideoBuffer *buffer)
+{
+    g_assert_cmpint(g_atomic_int_get(&buffers_allocated), >, 0);
+    g_atomic_int_add(&buffers_allocated, -1);
+    g_free(buffer);
+}
+
+static gpointer encoder_thread(gpointer opaque)
+{
+    auto encoder = static_cast<TestEncoder *>(opaque);
+    VideoStreamAsyncFrame *frame;
+
+    while ((frame = static_cast<VideoStreamAsyncFrame *>(g_async_queue_pop(encoder->jobs))) !=
+           &stop_frame) {
+        if (g_atomic_int_get(&encoder->stop)) {
+            video_stream_frame_done(frame, VIDEO_ENCODER_FRAME_UNSUPPORTED, nullptr);
+            continue;
+        }
+        auto buffer = g_new0(VideoBuffer, 1);
+        buffer->free = buffer_free;
+        g_atomic_int_inc(&buffers_allocated);
+        video_stream_frame_done(frame, VIDEO_ENCODER_FRAME_ENCODE_DONE, buffer);
+    }
+    return nullptr;
+}
+
+static TestEncoder *encoder_new(void)
+{
+    auto encoder = g_new0(TestEncoder, 1);
+
+    encoder->jobs = g_async_queue_new();
+    encoder->thread = g_thread_new("test-encoder", encoder_thread, encoder);
+    return encoder;
+}
+
+static void encoder_encode(TestEncoder *encoder, VideoStreamFrameQueue *queue,
+                           const VideoStreamAgent *agent, uint32_t frame_mm_time)
+{
+    auto frame = g_new0(VideoStreamAsyncFrame, 1);
+
+    frame->queue = queue;
+    frame->generation = agent->generation;
+    frame->frame_mm_time = frame_mm_time;
+    g_async_queue_push(encoder->jobs, frame);
+}
+
+/* the frames not encoded yet are notified, as video encoders do */
+static void encoder_destroy(TestEncoder *encoder)
+{
+    g_atomic_int_set(&encoder->stop, TRUE);
+    g_async_queue_push(encoder->jobs, &stop_frame);
+    g_thread_join(encoder->thread);
+    g_async_queue_unref(encoder->jobs);
+    g_free(encoder);
+}
+
+struct TestState {
+    VideoStreamAgent agent;
+    unsigned ready_calls;
+    unsigned received;
+    unsigned sent;
+    unsigned unsupported;
+    unsigned expected;
+    uint32_t next_mm_time;
+};
+
+static void test_setup(void)
+{
+    g_assert_null(core);
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+    core_int = core_interface_adapter;
+    core_int.public_interface = core;
+    buffers_allocated = 0;
+}
+
+static void test_teardown(void)
+{
+    g_assert_cmpint(g_atomic_int_get(&buffers_allocated), ==, 0);
+    basic_event_loop_destroy();
+    core = nullptr;
+}
+
+/* as the display channel client does: only the frames of the current
+ * encoder are sent, in the order they were submitted */
+static void frames_ready(void *opaque, VideoStreamFrameQueue *queue)
+{
+    auto state = static_cast<TestState *>(opaque);
+    VideoStreamAsyncFrame *frame;
+
+    state->ready_calls++;
+    while ((frame = video_stream_frame_queue_pop(queue))) {
+        g_assert_cmpuint(frame->frame_mm_time, ==, state->next_mm_time);
+        state->next_mm_time++;
+        state->received++;
+        if (frame->result != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+            g_assert_cmpint(frame->result, ==, VIDEO_ENCODER_FRAME_UNSUPPORTED);
+            g_assert_null(frame->outbuf);
+            state->unsupported++;
+        } else {
+            if (video_stream_agent_frame_is_current(&state->agent, frame)) {
+                state->sent++;
+            }
+            frame->outbuf->free(frame->outbuf);
+        }
+        g_free(frame);
+    }
+    if (state->received == state->expected) {
+        basic_event_loop_quit();
+    }
+}
+
+static void wait_frames(TestState *state, unsigned expected)
+{
+    state->expected = expected;
+    if (state->received == expected) {
+        return;
+    }
+    // the queue must wake up the main loop
+    alarm(20);
+    basic_event_loop_mainloop();
+    alarm(0);
+    g_assert_cmpuint(state->received, ==, expected);
+}
+
+/* the frames come back in order, through the main loop */
+static void test_video_frame_queue_order(void)
+{
+    TestState state = {};
+
+    test_setup();
+
+    VideoStreamFrameQueue *queue = video_stream_frame_queue_new(&core_int, frames_ready, &state);
+    g_assert_nonnull(queue);
+    TestEncoder *encoder = encoder_new();
+
+    for (uint32_t i = 0; i < NUM_FRAMES; i++) {
+        encoder_encode(encoder, queue, &state.agent, i);
+    }
+    wait_frames(&state, NUM_FRAMES);
+    g_assert_cmpuint(state.sent, ==, NUM_FRAMES);
+    g_assert_cmpuint(state.unsupported, ==, 0);
+    g_assert_cmpuint(state.ready_calls, >=, 1);
+    g_assert_cmpuint(state.ready_calls, <=, NUM_FRAMES);
+
+    // a single frame wakes up the main loop too
+    for (uint32_t i = 0; i < 3; i++) {
+        encoder_encode(encoder, queue, &state.agent, NUM_FRAMES + i);
+        wait_frames(&state, NUM_FRAMES + i + 1);
+    }
+
+    encoder_destroy(encoder);
+    video_stream_frame_queue_free(queue);
+    test_teardown();
+}
+
+/* the frames still in flight when the stream is destroyed are not sent */
+static void test_video_frame_queue_generation(void)
+{
+    TestState state = {};
+
+    test_setup();
+
+    VideoStreamFrameQueue *queue = video_stream_frame_queue_new(&core_int, frames_ready, &state);
+    g_assert_nonnull(queue);
+    TestEncoder *encoder = encoder_new();
+
+    for (uint32_t i = 0; i < NUM_FRAMES; i++) {
+        encoder_encode(encoder, queue, &state.agent, i);
+    }
+    // as video_stream_agent_stop() does
+    encoder_destroy(encoder);
+    state.agent.generation++;
+    wait_frames(&state, NUM_FRAMES);
+    g_assert_cmpuint(state.sent, ==, 0);
+
+    // the frames of the new encoder are sent
+    encoder = encoder_new();
+    state.agent.generation++;
+    for (uint32_t i = 0; i < NUM_FRAMES; i++) {
+        encoder_encode(encoder, queue, &state.agent, NUM_FRAMES + i);
+    }
+    wait_frames(&state, 2 * NUM_FRAMES);
+    g_assert_cmpuint(state.sent, ==, NUM_FRAMES);
+
+    encoder_destroy(encoder);
+    video_stream_frame_queue_free(queue);
+    test_teardown();
+}
+
+/* the frames not handled yet are released with the queue */
+static void test_video_frame_queue_free(void)
+{
+    TestState state = {};
+
+    test_setup();
+
+    VideoStreamFrameQueue *queue = video_stream_frame_queue_new(&core_int, frames_ready, &state);
+    g_assert_nonnull(queue);
+    TestEncoder *encoder = encoder_new();
+
+    for (uint32_t i = 0; i < NUM_FRAMES; i++) {
+        encoder_encode(encoder, queue, &state.agent, i);
+    }
+    encoder_destroy(encoder);
+    video_stream_frame_queue_free(queue);
+    g_assert_cmpuint(state.received, ==, 0);
+
+    test_teardown();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/video-frame-queue-order", test_video_frame_queue_order);
+    g_test_add_func("/server/video-frame-queue-generation", test_video_frame_queue_generation);
+    g_test_add_func("/server/video-frame-queue-free", test_video_frame_queue_free);
+
+    return g_test_run();
+}
@@ -16,6 +16,7 @@
 */
 #include <config.h>
 
+#include <algorithm>
 #include <spice/qxl_dev.h>
 
 #include "red-parse-qxl.h"
@@ -197,6 +198,7 @@ Shadow* shadow_new(DrawItem *item, const SpicePoint *delta)
 
     shadow->base.type = TREE_ITEM_TYPE_SHADOW;
     shadow->base.container = nullptr;
+    shadow->base.index = nullptr;
     region_clone(&shadow->base.rgn, &item->base.rgn);
     region_offset(&shadow->base.rgn, delta->x, delta->y);
     ring_item_init(&shadow->base.siblings_link);
@@ -217,12 +219,14 @@ Container* container_new(DrawItem *item)
 
     container->base.type = TREE_ITEM_TYPE_CONTAINER;
     container->base.container = item->base.container;
+    container->base.index = nullptr;
     item->base.container = container;
     item->container_root = TRUE;
     region_clone(&container->base.rgn, &item->base.rgn);
     ring_item_init(&container->base.siblings_link);
     ring_add_after(&container->base.siblings_link, &item->base.siblings_link);
     ring_remove(&item->base.siblings_link);
+    tree_index_replace(&item->base, &container->base);
     ring_init(&container->items);
     ring_add(&container->items, &item->base.siblings_link);
 
@@ -233,6 +237,7 @@ void container_free(Container *container)
 {
     spice_return_if_fail(ring_is_empty(&container->items));
 
+    tree_index_remove(&container->base);
     ring_remove(&container->base.siblings_link);
     region_destroy(&container->base.rgn);
     g_free(container);
@@ -251,6 +256,7 @@ void container_cleanup(Container *container)
             ring_remove(&item->siblings_link);
             ring_add_after(&item->siblings_link, &container->base.siblings_link);
             item->container = container->base.container;
+            tree_index_replace(&container->base, item);
         }
         container_free(container);
         container = next;
@@ -303,8 +309,211 @@ void draw_item_remove_shadow(DrawItem *item)
     }
     shadow = item->shadow;
     item->shadow = nullptr;
+    tree_index_remove(&shadow->base);
     ring_remove(&shadow->base.siblings_link);
     region_destroy(&shadow->base.rgn);
     region_destroy(&shadow->on_hold);
     g_free(shadow);
 }
+
+#define TREE_INDEX_CELL_SHIFT 6
+/* items covering more cells are stored in TreeIndex::large */
+#define TREE_INDEX_MAX_ITEM_CELLS 16
+/* for larger areas most of the items are candidates anyway, walking the
+ * ring is cheaper than querying that many cells */
+#define TREE_INDEX_MAX_QUERY_CELLS 64
+
+struct TreeIndexCells {
+    uint32_t x1, y1, x2, y2; // inclusive
+};
+
+static uint32_t tree_index_cell(int32_t coord, uint32_t num_cells)
+{
+    return MIN((uint32_t) MAX(coord, 0) >> TREE_INDEX_CELL_SHIFT, num_cells - 1);
+}
+
+static TreeIndexCells tree_index_cells(const TreeIndex *index, const pixman_box32_t *box)
+{
+    TreeIndexCells cells = {
+        tree_index_cell(box->x1, index->cells_x),
+        tree_index_cell(box->y1, index->cells_y),
+        tree_index_cell(box->x2, index->cells_x),
+        tree_index_cell(box->y2, index->cells_y),
+    };
+    return cells;
+}
+
+static uint32_t tree_index_cells_count(const TreeIndexCells *cells)
+{
+    return (cells->x2 - cells->x1 + 1) * (cells->y2 - cells->y1 + 1);
+}
+
+/* boxes touching each other are considered intersecting, the index must
+ * never miss an item */
+static bool tree_index_box_intersects(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+    return a->x1 <= b->x2 && b->x1 <= a->x2 && a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+/* first entry with an order lower or equal to @order */
+static std::vector<TreeIndexEntry>::iterator
+tree_index_entries_find(std::vector<TreeIndexEntry> &entries, int64_t order)
+{
+    return std::lower_bound(entries.begin(), entries.end(), order,
+                            [](const TreeIndexEntry &entry, int64_t value) {
+                                return entry.order > value;
+                            });
+}
+
+static void tree_index_entries_add(std::vector<TreeIndexEntry> &entries, const TreeIndexEntry &entry)
+{
+    entries.insert(tree_index_entries_find(entries, entry.order), entry);
+}
+
+static void tree_index_entries_remove(std::vector<TreeIndexEntry> &entries, const TreeItem *item)
+{
+    auto it = tree_index_entries_find(entries, item->index_order);
+
+    /* orders are only shared while an item gets replaced */
+    while (it != entries.end() && it->item != item) {
+        ++it;
+    }
+    spice_assert(it != entries.end());
+    entries.erase(it);
+}
+
+/* lowest order in (@from, @last] of the entries intersecting @box */
+static const TreeIndexEntry*
+tree_index_entries_next(std::vector<TreeIndexEntry> &entries, int64_t from, int64_t last,
+                        const pixman_box32_t *box, const TreeIndexEntry *best)
+{
+    auto it = tree_index_entries_find(entries, from);
+
+    while (it != entries.begin()) {
+        --it;
+        if (it->order > last || (best && it->order >= best->order)) {
+            break;
+        }
+        if (tree_index_box_intersects(&it->box, box)) {
+            return &*it;
+        }
+    }
+    return best;
+}
+
+template <typename F>
+static void tree_index_foreach_cell(TreeIndex *index, const TreeIndexCells *cells, F f)
+{
+    for (uint32_t y = cells->y1; y <= cells->y2; y++) {
+        for (uint32_t x = cells->x1; x <= cells->x2; x++) {
+            f(index->cells[y * index->cells_x + x]);
+        }
+    }
+}
+
+static void tree_index_insert(TreeIndex *index, TreeItem *item, int64_t order)
+{
+    const TreeIndexEntry entry = { item, order, item->rgn.extents };
+    TreeIndexCells cells = tree_index_cells(index, &entry.box);
+
+    item->index = index;
+    item->index_order = order;
+    item->index_box = entry.box;
+    if (tree_index_cells_count(&cells) > TREE_INDEX_MAX_ITEM_CELLS) {
+        tree_index_entries_add(index->large, entry);
+        return;
+    }
+    tree_index_foreach_cell(index, &cells, [&](std::vector<TreeIndexEntry> &entries) {
+        tree_index_entries_add(entries, entry);
+    });
+}
+
+void tree_index_init(TreeIndex *index, uint32_t width, uint32_t height)
+{
+    const uint32_t cell_size = 1u << TREE_INDEX_CELL_SHIFT;
+
+    index->head_order = 0;
+    index->cells_x = MAX((width + cell_size - 1) / cell_size, 1);
+    index->cells_y = MAX((height + cell_size - 1) / cell_size, 1);
+    index->cells.assign(index->cells_x * index->cells_y, std::vector<TreeIndexEntry>());
+    index->large.clear();
+}
+
+/* Add @item to @index. @pos is the item it was added after in the ring,
+ * NULL if it was added at the head */
+void tree_index_add(TreeIndex *index, TreeItem *item, TreeItem *pos)
+{
+    spice_assert(item->index == nullptr);
+    if (pos) {
+        spice_assert(pos->index == index);
+        /* this only happens when @item replaces @pos, which is removed right
+         * after, so there is no need for a new order in between */
+        tree_index_insert(index, item, pos->index_order);
+    } else {
+        tree_index_insert(index, item, --index->head_order);
+    }
+}
+
+void tree_index_remove(TreeItem *item)
+{
+    TreeIndex *index = item->index;
+
+    if (!index) {
+        return;
+    }
+    TreeIndexCells cells = tree_index_cells(index, &item->index_box);
+    if (tree_index_cells_count(&cells) > TREE_INDEX_MAX_ITEM_CELLS) {
+        tree_index_entries_remove(index->large, item);
+    } else {
+        tree_index_foreach_cell(index, &cells, [&](std::vector<TreeIndexEntry> &entries) {
+            tree_index_entries_remove(entries, item);
+        });
+    }
+    item->index = nullptr;
+}
+
+/* @new_item takes the place of @old_item in the ring */
+void tree_index_replace(TreeItem *old_item, TreeItem *new_item)
+{
+    TreeIndex *index = old_item->index;
+    int64_t order = old_item->index_order;
+
+    if (!index) {
+        return;
+    }
+    tree_index_remove(old_item);
+    tree_index_insert(index, new_item, order);
+}
+
+/* whether looking for the items intersecting @box is worth using @index */
+bool tree_index_usable(TreeIndex *index, const pixman_box32_t *box)
+{
+    if (index->cells.empty()) {
+        return false;
+    }
+    TreeIndexCells cells = tree_index_cells(index, box);
+    return tree_index_cells_count(&cells) <= TREE_INDEX_MAX_QUERY_CELLS;
+}
+
+/* Returns the first item following @from in the ring (the head if @from is
+ * NULL) that may intersect @box, not going further than @last if @last is
+ * not NULL. Returns NULL if there is no such item.
+ * Items not returned are guaranteed not to intersect @box. */
+TreeItem *tree_index_next(TreeIndex *index, TreeItem *from, const pixman_box32_t *box,
+                          TreeItem *last)
+{
+    int64_t from_order = from ? from->index_order : INT64_MIN;
+    int64_t last_order = last ? last->index_order : INT64_MAX;
+    const TreeIndexEntry *best = nullptr;
+
+    spice_assert(!from || from->index == index);
+    spice_assert(!last || last->index == index);
+
+    TreeIndexCells cells = tree_index_cells(index, box);
+    tree_index_foreach_cell(index, &cells, [&](std::vector<TreeIndexEntry> &entries) {
+        best = tree_index_entries_next(entries, from_order, last_order, box, best);
+    });
+    best = tree_index_entries_next(index->large, from_order, last_order, box, best);
+
+    return best ? best->item : nullptr;
+}
@@ -20,6 +20,7 @@
 #define TREE_H_
 
 #include <stdint.h>
+#include <vector>
 #include <common/region.h>
 #include <common/ring.h>
 
@@ -37,6 +38,7 @@ enum {
 };
 
 struct Container;
+struct TreeIndex;
 
 /* TODO consider GNode instead */
 struct TreeItem {
@@ -47,6 +49,36 @@ struct TreeItem {
      * tree, this region may be modified to exclude the portion of the item
      * that is obscured by other items */
     QRegion rgn;
+    /* the index this item is registered in, NULL if not indexed */
+    TreeIndex *index;
+    int64_t index_order;
+    pixman_box32_t index_box;
+};
+
+struct TreeIndexEntry {
+    TreeItem *item;
+    int64_t order;
+    pixman_box32_t box;
+};
+
+/* Spatial index of the items of a top level ring (RedSurface::current).
+ *
+ * The items are stored in a grid of cells by bounding box, so that the
+ * items intersecting a given area can be found without visiting the whole
+ * ring. Each item has an order matching its position in the ring (lower is
+ * closer to the head), which allows to iterate the candidates in the same
+ * order as the ring itself.
+ * The bounding box is the one of the item when it was added. As the region
+ * of an item can only shrink, it may be larger than the actual extents,
+ * never smaller. */
+struct TreeIndex {
+    int64_t head_order;
+    uint32_t cells_x;
+    uint32_t cells_y;
+    /* entries sorted by descending order, so adding at the head is an append */
+    std::vector<std::vector<TreeIndexEntry>> cells;
+    /* items covering too many cells are kept apart */
+    std::vector<TreeIndexEntry> large;
 };
 
 /* A region "below" a copy, or the src region of the copy */
@@ -96,6 +128,14 @@ Container* container_new                            (DrawItem *item);
 void       container_free                           (Container *container);
 void       container_cleanup                        (Container *container);
 
+void       tree_index_init                          (TreeIndex *index, uint32_t width, uint32_t height);
+void       tree_index_add                           (TreeIndex *index, TreeItem *item, TreeItem *pos);
+void       tree_index_remove                        (TreeItem *item);
+void       tree_index_replace                       (TreeItem *old_item, TreeItem *new_item);
+bool       tree_index_usable                        (TreeIndex *index, const pixman_box32_t *box);
+TreeItem*  tree_index_next                          (TreeIndex *index, TreeItem *from,
+                                                     const pixman_box32_t *box, TreeItem *last);
+
 #include "pop-visibility.h"
 
 #endif /* TREE_H_ */
@@ -28,6 +28,15 @@
 
 SPICE_BEGIN_DECLS
 
+/* The default and highest supported limits of the frame rate of the streams,
+ * see spice_server_set_video_max_fps(). */
+#define VIDEO_ENCODER_DEFAULT_MAX_FPS 30
+#define VIDEO_ENCODER_MAX_FPS_LIMIT 240
+
+/* The highest number of threads an encoder may use for a single stream, see
+ * spice_server_set_video_encoder_threads(). */
+#define VIDEO_ENCODER_MAX_THREADS 16
+
 /* A structure containing the data for a compressed frame. See encode_frame(). */
 typedef struct VideoBuffer VideoBuffer;
 struct VideoBuffer {
@@ -48,8 +57,25 @@ typedef enum {
     VIDEO_ENCODER_FRAME_UNSUPPORTED = -1,
     VIDEO_ENCODER_FRAME_DROP,
     VIDEO_ENCODER_FRAME_ENCODE_DONE,
+    VIDEO_ENCODER_FRAME_PENDING,
 } VideoEncodeResults;
 
+/* Called by the video encoder when a frame submitted with
+ * encode_frame_async() has been processed.
+ *
+ * This may be called from any thread, usually the one doing the encoding,
+ * so it must only hand the result over to the main context and must not
+ * call back into the encoder.
+ *
+ * @opaque:  The done_opaque parameter given to encode_frame_async().
+ * @result:  VIDEO_ENCODER_FRAME_ENCODE_DONE if successful,
+ *           VIDEO_ENCODER_FRAME_UNSUPPORTED otherwise.
+ * @outbuf:  The compressed frame if successful, NULL otherwise. Call the
+ *           buffer's free() method as soon as it is no longer needed.
+ */
+typedef void (*video_encoder_done_t)(gpointer opaque, VideoEncodeResults result,
+                                     VideoBuffer *outbuf);
+
 typedef struct VideoEncoderStats {
     uint64_t starting_bit_rate;
     uint64_t cur_bit_rate;
@@ -58,7 +84,12 @@ typedef struct VideoEncoderStats {
 
 typedef struct VideoEncoder VideoEncoder;
 struct VideoEncoder {
-    /* Releases the video encoder's resources */
+    /* Releases the video encoder's resources.
+     *
+     * Frames still being encoded asynchronously are dropped: their done
+     * callback is called with VIDEO_ENCODER_FRAME_UNSUPPORTED before this
+     * returns, and is never called after that.
+     */
     void (*destroy)(VideoEncoder *encoder);
 
     /* Compresses the specified src image area into the outbuf buffer.
@@ -84,6 +115,32 @@ struct VideoEncoder {
                                        const SpiceRect *src, int top_down,
                                        gpointer bitmap_opaque, VideoBuffer** outbuf);
 
+    /* Submits the specified src image area for compression outside of the
+     * main context. This is optional and NULL if not supported.
+     *
+     * The parameters are the same as for encode_frame(). The encoder keeps a
+     * reference to the bitmap through bitmap_ref() until the frame has been
+     * encoded, and the caller must not mix this with encode_frame() calls.
+     *
+     * @done:          Called with the compressed frame, see
+     *                 video_encoder_done_t.
+     * @done_opaque:   The parameter for the done callback.
+     * @return:
+     *     VIDEO_ENCODER_FRAME_PENDING if the frame was submitted, in which
+     *                                 case done is called exactly once,
+     *                                 at the latest by destroy().
+     *     VIDEO_ENCODER_FRAME_UNSUPPORTED if the frame cannot be encoded.
+     *     VIDEO_ENCODER_FRAME_DROP if the frame was dropped, either by the
+     *                              rate control or because too many frames
+     *                              are still being encoded.
+     */
+    VideoEncodeResults (*encode_frame_async)(VideoEncoder *encoder, uint32_t frame_mm_time,
+                                             const SpiceBitmap *bitmap,
+                                             const SpiceRect *src, int top_down,
+                                             gpointer bitmap_opaque,
+                                             video_encoder_done_t done,
+                                             gpointer done_opaque);
+
     /*
      * Bit rate control methods.
      */
@@ -163,6 +220,21 @@ typedef struct VideoEncoderRateControlCbs {
      */
     uint32_t (*get_source_fps)(void *opaque);
 
+    /* Returns the highest frame rate the stream may be sent at.
+     *
+     * Defaults to VIDEO_ENCODER_DEFAULT_MAX_FPS, see
+     * spice_server_set_video_max_fps().
+     */
+    uint32_t (*get_max_fps)(void *opaque);
+
+    /* Returns how many threads the encoder may use to encode each frame.
+     *
+     * This is only queried when the encoder is created and may be NULL, in
+     * which case a single thread is used. See
+     * spice_server_set_video_encoder_threads().
+     */
+    uint32_t (*get_encoder_threads)(void *opaque);
+
     /* Informs the client of the minimum playback delay.
      *
      * @delay_ms:   The minimum number of milliseconds required for the
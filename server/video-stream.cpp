@@ -20,6 +20,7 @@
 #include "display-channel-private.h"
 #include "main-channel-client.h"
 #include "red-client.h"
+#include "net-utils.h"
 
 #define FPS_TEST_INTERVAL 1
 #define FOREACH_STREAMS(display, item)                  \
@@ -174,9 +175,39 @@ VideoStreamClipItem::VideoStreamClipItem(VideoStreamAgent *agent):
     region_ret_rects(&agent->clip, rects->rects, n_rects);
 }
 
-static int is_stream_start(Drawable *drawable)
+/* Highest frame rate of the streams for any client */
+static uint32_t display_channel_get_stream_max_fps(DisplayChannel *display)
 {
-    return ((drawable->frames_count >= RED_STREAM_FRAMES_START_CONDITION) &&
+    uint32_t max_fps = MAX(display->priv->stream_max_fps,
+                           display->priv->stream_low_bandwidth_max_fps);
+
+    return max_fps ? max_fps : VIDEO_ENCODER_DEFAULT_MAX_FPS;
+}
+
+/* The detection conditions count frames at the default frame rate, scale
+ * them by the rate the frames of @drawable came at so that detecting a
+ * faster source takes the same time. The rate is bounded by the highest
+ * frame rate the stream can be sent at, so the time does not get shorter
+ * than with a source at that rate */
+static int stream_frames_condition(DisplayChannel *display, const Drawable *drawable,
+                                   int frames)
+{
+    uint64_t duration = drawable->creation_time - drawable->first_frame_time;
+    uint32_t max_fps = MAX(display_channel_get_stream_max_fps(display),
+                           VIDEO_ENCODER_DEFAULT_MAX_FPS);
+    uint64_t fps = VIDEO_ENCODER_DEFAULT_MAX_FPS;
+
+    if (drawable->frames_count > 1 && duration > 0) {
+        fps = (drawable->frames_count - 1) * NSEC_PER_SEC / duration;
+        fps = CLAMP(fps, VIDEO_ENCODER_DEFAULT_MAX_FPS, max_fps);
+    }
+    return frames * fps / VIDEO_ENCODER_DEFAULT_MAX_FPS;
+}
+
+static int is_stream_start(DisplayChannel *display, Drawable *drawable)
+{
+    return ((drawable->frames_count >=
+             stream_frames_condition(display, drawable, RED_STREAM_FRAMES_START_CONDITION)) &&
             (drawable->gradual_frames_count >=
              (RED_STREAM_GRADUAL_FRAMES_START_CONDITION * drawable->frames_count)));
 }
@@ -396,10 +427,12 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
      * the nearest integer, for instance 24 for 23.976.
      */
     uint64_t duration = drawable->creation_time - drawable->first_frame_time;
-    if (duration > NSEC_PER_SEC * drawable->frames_count / MAX_FPS) {
+    uint32_t max_fps = MAX(display_channel_get_stream_max_fps(display),
+                           VIDEO_ENCODER_DEFAULT_MAX_FPS);
+    if (duration > NSEC_PER_SEC * drawable->frames_count / max_fps) {
         stream->input_fps = (NSEC_PER_SEC * drawable->frames_count + duration / 2) / duration;
     } else {
-        stream->input_fps = MAX_FPS;
+        stream->input_fps = max_fps;
     }
     stream->num_input_frames = 0;
     stream->input_fps_start_time = drawable->creation_time;
@@ -430,7 +463,8 @@ static bool video_stream_add_frame(DisplayChannel *display,
 
     if (frame_drawable->copy_bitmap_graduality != BITMAP_GRADUAL_LOW) {
         if ((frame_drawable->frames_count - last_gradual_frame) >
-            RED_STREAM_FRAMES_RESET_CONDITION) {
+            stream_frames_condition(display, frame_drawable,
+                                    RED_STREAM_FRAMES_RESET_CONDITION)) {
             frame_drawable->frames_count = 1;
             frame_drawable->gradual_frames_count = 1;
         } else {
@@ -442,7 +476,7 @@ static bool video_stream_add_frame(DisplayChannel *display,
         frame_drawable->last_gradual_frame = last_gradual_frame;
     }
 
-    if (is_stream_start(frame_drawable)) {
+    if (is_stream_start(display, frame_drawable)) {
         display_channel_create_stream(display, frame_drawable);
         return TRUE;
     }
@@ -615,9 +649,11 @@ static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, VideoStream *str
         uint64_t net_test_bit_rate;
 
         mcc = dcc->get_client()->get_main();
-        net_test_bit_rate = mcc->is_network_info_initialized() ?
-                                mcc->get_bitrate_per_sec() :
-                                0;
+        /* prefer the current estimation of the connection of the client */
+        net_test_bit_rate = dcc->get_bitrate_estimate();
+        if (!net_test_bit_rate && mcc->is_network_info_initialized()) {
+            net_test_bit_rate = mcc->get_bitrate_per_sec();
+        }
         bit_rate = MAX(dcc_get_max_stream_bit_rate(dcc), net_test_bit_rate);
         if (bit_rate == 0) {
             /*
@@ -646,6 +682,9 @@ static uint32_t get_roundtrip_ms(void *opaque)
     RedChannelClient *rcc = agent->dcc;
 
     roundtrip = rcc->get_roundtrip_ms();
+    if (roundtrip < 0 && rcc->get_roundtrip_estimate_ms()) {
+        roundtrip = rcc->get_roundtrip_estimate_ms();
+    }
     if (roundtrip < 0) {
         MainChannelClient *mcc = rcc->get_client()->get_main();
 
@@ -660,11 +699,60 @@ static uint32_t get_roundtrip_ms(void *opaque)
     return roundtrip;
 }
 
+/* The frame rate limit set for the client, 0 if none was set */
+static uint32_t get_fps_limit(VideoStreamAgent *agent)
+{
+    DisplayChannel *display = DCC_TO_DC(agent->dcc);
+
+    return dcc_is_low_bandwidth(agent->dcc) ? display->priv->stream_low_bandwidth_max_fps :
+                                              display->priv->stream_max_fps;
+}
+
+static uint32_t get_max_fps(void *opaque)
+{
+    auto agent = static_cast<VideoStreamAgent *>(opaque);
+    uint32_t fps_limit = get_fps_limit(agent);
+
+    return fps_limit ? fps_limit : VIDEO_ENCODER_DEFAULT_MAX_FPS;
+}
+
+static uint32_t get_encoder_threads(void *opaque)
+{
+    auto agent = static_cast<VideoStreamAgent *>(opaque);
+
+    return DCC_TO_DC(agent->dcc)->priv->stream_encoder_threads;
+}
+
+/* The frames above the frame rate limit of the client are dropped, see
+ * video_stream_agent_skip_frame() */
 static uint32_t get_source_fps(void *opaque)
 {
     auto agent = static_cast<VideoStreamAgent *>(opaque);
+    uint32_t fps_limit = get_fps_limit(agent);
 
-    return agent->stream->input_fps;
+    return fps_limit ? MIN(agent->stream->input_fps, fps_limit) : agent->stream->input_fps;
+}
+
+/* Returns whether the frame comes too early for the frame rate limit of the
+ * client and should be dropped. A quarter of the frame period is tolerated
+ * to absorb the jitter of the source. Without a limit set, the encoders
+ * keep their own limits. */
+bool video_stream_agent_skip_frame(VideoStreamAgent *agent, Drawable *drawable)
+{
+    uint32_t fps_limit = get_fps_limit(agent);
+
+    if (!fps_limit) {
+        return false;
+    }
+
+    red_time_t period = NSEC_PER_SEC / fps_limit;
+    red_time_t now = drawable->creation_time;
+
+    if (now + period / 4 < agent->next_frame_time) {
+        return true;
+    }
+    agent->next_frame_time = MAX(agent->next_frame_time, now) + period;
+    return false;
 }
 
 static void update_client_playback_delay(void *opaque, uint32_t delay_ms)
@@ -746,15 +834,19 @@ void dcc_create_stream(DisplayChannelClient *dcc, VideoStream *stream)
         region_clone(&agent->clip, &agent->vis_region);
     }
     agent->dcc = dcc;
+    agent->next_frame_time = 0;
 
     VideoEncoderRateControlCbs video_cbs;
     video_cbs.opaque = agent;
     video_cbs.get_roundtrip_ms = get_roundtrip_ms;
     video_cbs.get_source_fps = get_source_fps;
+    video_cbs.get_max_fps = get_max_fps;
+    video_cbs.get_encoder_threads = get_encoder_threads;
     video_cbs.update_client_playback_delay = update_client_playback_delay;
 
     uint64_t initial_bit_rate = get_initial_bit_rate(dcc, stream);
     agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);
+    agent->generation++;
     dcc->pipe_add(video_stream_create_item_new(agent));
 
     if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -782,6 +874,220 @@ void video_stream_agent_stop(VideoStreamAgent *agent)
         agent->video_encoder->destroy(agent->video_encoder);
         agent->video_encoder = nullptr;
     }
+    agent->generation++;
+}
+
+struct VideoStreamFrameQueue {
+    GAsyncQueue *frames;
+    int wakeup_fds[2];
+    SpiceWatch *wakeup_watch;
+    VideoStreamFramesReady ready;
+    void *ready_opaque;
+};
+
+VideoStreamDataItem::VideoStreamDataItem(VideoStreamAgent *agent):
+    RedPipeItem(RED_PIPE_ITEM_TYPE_STREAM_DATA),
+    stream_agent(agent),
+    outbuf(nullptr)
+{
+    agent->stream->refs++;
+}
+
+VideoStreamDataItem::~VideoStreamDataItem()
+{
+    DisplayChannel *display = DCC_TO_DC(stream_agent->dcc);
+
+    if (outbuf) {
+        outbuf->free(outbuf);
+    }
+    video_stream_agent_unref(display, stream_agent);
+}
+
+/* whether @frame was submitted to the current video encoder of @agent, the
+ * frames of a destroyed encoder must not be sent */
+bool video_stream_agent_frame_is_current(const VideoStreamAgent *agent,
+                                         const VideoStreamAsyncFrame *frame)
+{
+    return agent->generation == frame->generation;
+}
+
+static void dcc_queue_video_frame(DisplayChannelClient *dcc, VideoStreamAsyncFrame *frame)
+{
+    VideoStreamAgent *agent = dcc_get_video_stream_agent(dcc, frame->stream_id);
+
+    if (frame->result != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        /* the stream area is refreshed by the next frames, or losslessly
+         * once the stream stops */
+        spice_debug("stream %d: failed to encode frame", frame->stream_id);
+        return;
+    }
+    if (!video_stream_agent_frame_is_current(agent, frame)) {
+        frame->outbuf->free(frame->outbuf);
+        return;
+    }
+
+    auto item = red::make_shared<VideoStreamDataItem>(agent);
+    item->generation = frame->generation;
+    item->frame_mm_time = frame->frame_mm_time;
+    item->is_sized = frame->is_sized;
+    item->width = frame->width;
+    item->height = frame->height;
+    item->dest = frame->dest;
+    item->outbuf = frame->outbuf;
+    dcc->pipe_add(item);
+}
+
+/* Called in the worker thread when frames were encoded */
+static void dcc_video_frames_ready(void *opaque, VideoStreamFrameQueue *queue)
+{
+    auto dcc = static_cast<DisplayChannelClient *>(opaque);
+    red::shared_ptr<DisplayChannelClient> hold_dcc(dcc);
+    VideoStreamAsyncFrame *frame;
+
+    while ((frame = video_stream_frame_queue_pop(queue))) {
+        dcc_queue_video_frame(dcc, frame);
+        g_free(frame);
+    }
+    dcc->push();
+}
+
+static void video_stream_frame_queue_wakeup(int fd, int event, VideoStreamFrameQueue *queue)
+{
+    char buf[16];
+
+    for (;;) {
+        ssize_t n = socket_read(fd, buf, sizeof(buf));
+        if (n <= 0 && !(n == -1 && errno == EINTR)) {
+            break;
+        }
+    }
+    queue->ready(queue->ready_opaque, queue);
+}
+
+/* Called by the video encoder, usually from its own thread */
+void video_stream_frame_done(gpointer opaque, VideoEncodeResults result, VideoBuffer *outbuf)
+{
+    auto frame = static_cast<VideoStreamAsyncFrame *>(opaque);
+    VideoStreamFrameQueue *queue = frame->queue;
+    char c = 0;
+
+    frame->result = result;
+    frame->outbuf = outbuf;
+    g_async_queue_push(queue->frames, frame);
+    /* if the socket is full the worker is going to wake up anyway */
+    while (socket_write(queue->wakeup_fds[1], &c, 1) == -1 && errno == EINTR) {
+        continue;
+    }
+}
+
+VideoStreamFrameQueue *video_stream_frame_queue_new(SpiceCoreInterfaceInternal *core,
+                                                    VideoStreamFramesReady ready,
+                                                    void *opaque)
+{
+    auto queue = g_new0(VideoStreamFrameQueue, 1);
+
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, queue->wakeup_fds) == -1) {
+        spice_warning("socketpair failed %s", strerror(errno));
+        g_free(queue);
+        return nullptr;
+    }
+    red_socket_set_non_blocking(queue->wakeup_fds[0], TRUE);
+    red_socket_set_non_blocking(queue->wakeup_fds[1], TRUE);
+    queue->frames = g_async_queue_new();
+    queue->ready = ready;
+    queue->ready_opaque = opaque;
+    queue->wakeup_watch = core->watch_new(queue->wakeup_fds[0], SPICE_WATCH_EVENT_READ,
+                                          video_stream_frame_queue_wakeup, queue);
+    return queue;
+}
+
+/* the frames completed in order, nullptr once there are no more */
+VideoStreamAsyncFrame *video_stream_frame_queue_pop(VideoStreamFrameQueue *queue)
+{
+    return static_cast<VideoStreamAsyncFrame *>(g_async_queue_try_pop(queue->frames));
+}
+
+/* The video encoders submitting to @queue must have been destroyed already */
+void video_stream_frame_queue_free(VideoStreamFrameQueue *queue)
+{
+    VideoStreamAsyncFrame *frame;
+
+    red_watch_remove(queue->wakeup_watch);
+    while ((frame = video_stream_frame_queue_pop(queue))) {
+        if (frame->outbuf) {
+            frame->outbuf->free(frame->outbuf);
+        }
+        g_free(frame);
+    }
+    g_async_queue_unref(queue->frames);
+    socket_close(queue->wakeup_fds[0]);
+    socket_close(queue->wakeup_fds[1]);
+    g_free(queue);
+}
+
+static VideoStreamFrameQueue *dcc_ensure_video_frame_queue(DisplayChannelClient *dcc)
+{
+    VideoStreamFrameQueue *queue = dcc_get_video_frame_queue(dcc);
+
+    if (!queue) {
+        queue = video_stream_frame_queue_new(dcc->get_channel()->get_core_interface(),
+                                             dcc_video_frames_ready, dcc);
+        dcc_set_video_frame_queue(dcc, queue);
+    }
+    return queue;
+}
+
+/* The video encoders must have been destroyed already */
+void dcc_free_video_frames(DisplayChannelClient *dcc)
+{
+    VideoStreamFrameQueue *queue = dcc_get_video_frame_queue(dcc);
+
+    if (!queue) {
+        return;
+    }
+    video_stream_frame_queue_free(queue);
+    dcc_set_video_frame_queue(dcc, nullptr);
+}
+
+/* Submits the drawable to the agent's video encoder, once encoded the frame
+ * is added to the client pipe from the worker thread.
+ * Returns VIDEO_ENCODER_FRAME_UNSUPPORTED if the frame cannot be encoded,
+ * in which case the drawable is sent as a regular image. */
+VideoEncodeResults video_stream_agent_encode_frame_async(VideoStreamAgent *agent,
+                                                        Drawable *drawable,
+                                                        uint32_t frame_mm_time,
+                                                        bool is_sized)
+{
+    DisplayChannelClient *dcc = agent->dcc;
+    VideoEncoder *encoder = agent->video_encoder;
+    SpiceCopy *copy = &drawable->red_drawable->u.copy;
+    VideoStreamFrameQueue *queue;
+
+    if (!encoder || !encoder->encode_frame_async ||
+        !(queue = dcc_ensure_video_frame_queue(dcc))) {
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    auto frame = g_new0(VideoStreamAsyncFrame, 1);
+    frame->queue = queue;
+    frame->stream_id = display_channel_get_video_stream_id(DCC_TO_DC(dcc), agent->stream);
+    frame->generation = agent->generation;
+    frame->frame_mm_time = frame_mm_time;
+    frame->is_sized = is_sized;
+    frame->width = copy->src_area.right - copy->src_area.left;
+    frame->height = copy->src_area.bottom - copy->src_area.top;
+    frame->dest = drawable->red_drawable->bbox;
+
+    VideoEncodeResults ret =
+        encoder->encode_frame_async(encoder, frame_mm_time,
+                                    &copy->src_bitmap->u.bitmap,
+                                    &copy->src_area, agent->stream->top_down,
+                                    drawable->red_drawable.get(),
+                                    video_stream_frame_done, frame);
+    if (ret != VIDEO_ENCODER_FRAME_PENDING) {
+        g_free(frame);
+    }
+    return ret;
 }
 
 RedUpgradeItem::~RedUpgradeItem()
@@ -891,6 +1197,11 @@ void video_stream_detach_behind(DisplayChannel *display,
     DisplayChannelClient *dcc;
     bool is_connected = display->is_connected();
 
+    /* the area is sent by the next frame of the full surface stream */
+    if (drawable && drawable->held_back) {
+        return;
+    }
+
     while (item) {
         VideoStream *stream = SPICE_CONTAINEROF(item, VideoStream, link);
         int detach = 0;
@@ -930,6 +1241,152 @@ void video_stream_detach_and_stop(DisplayChannel *display)
     }
 }
 
+static red_time_t full_surface_frame_period(DisplayChannel *display)
+{
+    return NSEC_PER_SEC / display_channel_get_stream_max_fps(display);
+}
+
+/* Closes the current activity window of a primary surface of
+ * @surface_area pixels once it is over, and enters or leaves the full
+ * surface video mode depending on it */
+void video_stream_full_surface_update_window(FullSurfaceStreaming *state,
+                                             uint64_t surface_area, red_time_t now)
+{
+    red_time_t duration = now - state->window_start;
+
+    if (duration < RED_FULL_SURFACE_WINDOW) {
+        return;
+    }
+
+    double screens_per_sec = surface_area ?
+        (double) state->window_area * NSEC_PER_SEC / surface_area / duration : 0;
+    double draws_per_sec = (double) state->window_draws * NSEC_PER_SEC / duration;
+
+    if (!state->active) {
+        if (screens_per_sec >= RED_FULL_SURFACE_START_SCREENS_PER_SEC &&
+            draws_per_sec >= RED_FULL_SURFACE_START_DRAWS_PER_SEC) {
+            state->busy_windows++;
+        } else {
+            state->busy_windows = 0;
+        }
+        if (state->busy_windows >= RED_FULL_SURFACE_START_WINDOWS) {
+            spice_debug("entering full surface video mode: %.1f screens/s %.0f draws/s",
+                        screens_per_sec, draws_per_sec);
+            state->active = true;
+            state->calm_windows = 0;
+        }
+    } else {
+        if (screens_per_sec < RED_FULL_SURFACE_STOP_SCREENS_PER_SEC) {
+            state->calm_windows++;
+        } else {
+            state->calm_windows = 0;
+        }
+        if (state->calm_windows >= RED_FULL_SURFACE_STOP_WINDOWS) {
+            /* the drawables held back are sent by a last frame */
+            spice_debug("leaving full surface video mode");
+            state->active = false;
+            state->busy_windows = 0;
+        }
+    }
+    state->window_start = now;
+    state->window_area = 0;
+    state->window_draws = 0;
+}
+
+static void full_surface_update_window(DisplayChannel *display, red_time_t now)
+{
+    RedSurface *primary = display->priv->surfaces[0];
+    uint64_t surface_area = primary ?
+        uint64_t{primary->context.width} * primary->context.height : 0;
+
+    video_stream_full_surface_update_window(&display->priv->full_surface, surface_area, now);
+}
+
+/* Called for each drawable added to the primary surface. Returns whether the
+ * drawable must be held back from the clients, its area being sent by the
+ * next frame of the surface instead. */
+bool video_stream_full_surface_add_damage(DisplayChannel *display, Drawable *drawable)
+{
+    FullSurfaceStreaming *state = &display->priv->full_surface;
+
+    if (!state->enabled || display->priv->stream_video == SPICE_STREAM_VIDEO_OFF) {
+        state->active = false;
+        return false;
+    }
+
+    full_surface_update_window(display, drawable->creation_time);
+    state->window_area += rect_get_area(&drawable->red_drawable->bbox);
+    state->window_draws++;
+    if (!state->active) {
+        return false;
+    }
+    state->dirty = true;
+    return true;
+}
+
+/* Streams the frames right away, without waiting for stream detection */
+void video_stream_full_surface_frame_added(DisplayChannel *display, Drawable *drawable)
+{
+    if (drawable->streamable && !drawable->stream) {
+        display_channel_create_stream(display, drawable);
+    }
+}
+
+/* Sends a frame of the primary surface when drawables were held back */
+static void video_stream_full_surface_timeout(DisplayChannel *display)
+{
+    FullSurfaceStreaming *state = &display->priv->full_surface;
+    red_time_t now = spice_get_monotonic_time_ns();
+
+    if (!state->enabled) {
+        return;
+    }
+    if (state->active) {
+        full_surface_update_window(display, now);
+    }
+    if (!state->dirty ||
+        (state->active && now - state->last_frame_time < full_surface_frame_period(display))) {
+        return;
+    }
+    video_stream_full_surface_flush(display);
+}
+
+/* Sends the drawables held back right away, as a frame of the primary
+ * surface. Needed before sending anything which reads the primary surface
+ * on the client */
+void video_stream_full_surface_flush(DisplayChannel *display)
+{
+    FullSurfaceStreaming *state = &display->priv->full_surface;
+
+    if (!state->dirty) {
+        return;
+    }
+    state->dirty = false;
+    state->last_frame_time = spice_get_monotonic_time_ns();
+    display_channel_add_full_surface_frame(display);
+}
+
+/* Returns the time in milliseconds until video_stream_timeout() has to send
+ * a frame of the primary surface or check the activity */
+int video_stream_full_surface_get_timeout(DisplayChannel *display)
+{
+    FullSurfaceStreaming *state = &display->priv->full_surface;
+
+    if (!state->active) {
+        return state->dirty ? 0 : INT_MAX;
+    }
+
+    red_time_t next = state->window_start + RED_FULL_SURFACE_WINDOW;
+    if (state->dirty) {
+        next = MIN(next, state->last_frame_time + full_surface_frame_period(display));
+    }
+    red_time_t now = spice_get_monotonic_time_ns();
+    if (next < now + NSEC_PER_MILLISEC) {
+        return 0;
+    }
+    return (next - now) / NSEC_PER_MILLISEC;
+}
+
 void video_stream_timeout(DisplayChannel *display)
 {
     Ring *ring = &display->priv->streams;
@@ -945,6 +1402,8 @@ void video_stream_timeout(DisplayChannel *display)
             video_stream_stop(display, stream);
         }
     }
+
+    video_stream_full_surface_timeout(display);
 }
 
 void video_stream_trace_add_drawable(DisplayChannel *display,
@@ -43,9 +43,38 @@
 #define RED_STREAM_CLIENT_REPORT_TIMEOUT MSEC_PER_SEC
 #define RED_STREAM_DEFAULT_HIGH_START_BIT_RATE (10 * 1024 * 1024) // 10Mbps
 #define RED_STREAM_DEFAULT_LOW_START_BIT_RATE (2.5 * 1024 * 1024) // 2.5Mbps
-#define MAX_FPS 30
+/* the activity of the primary surface is measured over windows of this
+ * length to enter and leave the full surface video mode */
+#define RED_FULL_SURFACE_WINDOW (NSEC_PER_SEC / 2)
+/* entered when redrawing the equivalent of the whole surface 4 times per
+ * second, with at least 120 drawables per second, for 2 windows */
+#define RED_FULL_SURFACE_START_SCREENS_PER_SEC 4
+#define RED_FULL_SURFACE_START_DRAWS_PER_SEC 120
+#define RED_FULL_SURFACE_START_WINDOWS 2
+/* left when redrawing less than the whole surface per second for 4 windows */
+#define RED_FULL_SURFACE_STOP_SCREENS_PER_SEC 1
+#define RED_FULL_SURFACE_STOP_WINDOWS 4
 
 struct VideoStream;
+struct VideoStreamFrameQueue;
+
+/* Full surface video mode: while the primary surface is redrawn at a high
+ * rate, its drawables are rendered on the server and the surface is sent as
+ * a video stream instead. See video_stream_full_surface_add_damage() */
+struct FullSurfaceStreaming {
+    bool enabled;
+    bool active;
+    /* drawing activity of the primary surface in the current window */
+    red_time_t window_start;
+    uint64_t window_area;
+    uint32_t window_draws;
+    uint32_t busy_windows;
+    uint32_t calm_windows;
+    /* drawables were held back since the last frame */
+    bool dirty;
+    red_time_t last_frame_time;
+    uint32_t frame_count;
+};
 
 #ifdef STREAM_STATS
 struct StreamStats {
@@ -76,6 +105,11 @@ struct VideoStreamAgent {
 
     uint32_t report_id;
     uint32_t client_required_latency;
+    /* changes each time the video encoder is created or destroyed, so the
+     * frames still being encoded for the previous one can be dropped */
+    uint32_t generation;
+    /* earliest time of the next frame within the frame rate limit */
+    red_time_t next_frame_time;
 #ifdef STREAM_STATS
     StreamStats stats;
 #endif
@@ -90,6 +124,42 @@ struct VideoStreamClipItem: public RedPipeItem {
     red::glib_unique_ptr<SpiceClipRects> rects;
 };
 
+/* A frame encoded outside of the worker thread, see
+ * video_stream_agent_encode_frame_async() */
+struct VideoStreamDataItem: public RedPipeItem {
+    VideoStreamDataItem(VideoStreamAgent *agent);
+    ~VideoStreamDataItem();
+
+    VideoStreamAgent *stream_agent;
+    uint32_t generation;
+    uint32_t frame_mm_time;
+    bool is_sized;
+    uint32_t width;
+    uint32_t height;
+    SpiceRect dest;
+    VideoBuffer *outbuf;
+};
+
+/* A frame submitted by video_stream_agent_encode_frame_async() */
+struct VideoStreamAsyncFrame {
+    VideoStreamFrameQueue *queue;
+    int stream_id;
+    uint32_t generation;
+    uint32_t frame_mm_time;
+    bool is_sized;
+    uint32_t width;
+    uint32_t height;
+    SpiceRect dest;
+
+    VideoEncodeResults result;
+    VideoBuffer *outbuf;
+};
+
+/* Hands the frames encoded outside of the worker thread back to it. The
+ * video encoder calls video_stream_frame_done() from its own thread, @ready
+ * is then called from the worker main loop to pop the frames */
+typedef void (*VideoStreamFramesReady)(void *opaque, VideoStreamFrameQueue *queue);
+
 struct StreamCreateDestroyItem: public RedPipeItem {
     StreamCreateDestroyItem(VideoStreamAgent *agent, int type);
     ~StreamCreateDestroyItem();
@@ -136,9 +206,31 @@ void video_stream_detach_behind(DisplayChannel *display, QRegion *region,
 GArray *video_stream_parse_preferred_codecs(SpiceMsgcDisplayPreferredVideoCodecType *msg);
 
 void video_stream_agent_stop(VideoStreamAgent *agent);
+bool video_stream_agent_skip_frame(VideoStreamAgent *agent, Drawable *drawable);
+VideoEncodeResults video_stream_agent_encode_frame_async(VideoStreamAgent *agent,
+                                                        Drawable *drawable,
+                                                        uint32_t frame_mm_time,
+                                                        bool is_sized);
+void dcc_free_video_frames(DisplayChannelClient *dcc);
+bool video_stream_agent_frame_is_current(const VideoStreamAgent *agent,
+                                         const VideoStreamAsyncFrame *frame);
+
+VideoStreamFrameQueue *video_stream_frame_queue_new(SpiceCoreInterfaceInternal *core,
+                                                    VideoStreamFramesReady ready,
+                                                    void *opaque);
+void video_stream_frame_queue_free(VideoStreamFrameQueue *queue);
+VideoStreamAsyncFrame *video_stream_frame_queue_pop(VideoStreamFrameQueue *queue);
+void video_stream_frame_done(gpointer opaque, VideoEncodeResults result, VideoBuffer *outbuf);
 
 void video_stream_detach_drawable(VideoStream *stream);
 
+void video_stream_full_surface_update_window(FullSurfaceStreaming *state,
+                                             uint64_t surface_area, red_time_t now);
+bool video_stream_full_surface_add_damage(DisplayChannel *display, Drawable *drawable);
+void video_stream_full_surface_flush(DisplayChannel *display);
+void video_stream_full_surface_frame_added(DisplayChannel *display, Drawable *drawable);
+int video_stream_full_surface_get_timeout(DisplayChannel *display);
+
 #include "pop-visibility.h"
 
 #endif /* VIDEO_STREAM_H_ */